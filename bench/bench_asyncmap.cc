@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <random>
+
+#include "benchmark/benchmark.h"
+
+#include "asyncmap.hh"
+#include "needle.hh"
+
+namespace {
+
+constexpr uint64_t kKeys = 1 << 20;
+
+// The needle index shared by all the threads of a benchmark.
+AsyncMap<uint64_t, Needle> *needles;
+
+void
+SetUp(const benchmark::State &state)
+{
+    if (state.thread_index() != 0)
+        return;
+    needles = new AsyncMap<uint64_t, Needle>(kKeys);
+    for (uint64_t i = 0; i < kKeys; ++i)
+        needles->Put(i, Needle(i % 8, i * 64, i, 1));
+}
+
+void
+TearDown(const benchmark::State &state)
+{
+    if (state.thread_index() != 0)
+        return;
+    delete needles;
+    needles = nullptr;
+}
+
+void
+BM_AsyncMapGet(benchmark::State &state)
+{
+    SetUp(state);
+    std::minstd_rand rng(state.thread_index());
+    Needle needle;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(needles->Get(rng() % kKeys, needle));
+    state.SetItemsProcessed(state.iterations());
+    TearDown(state);
+}
+BENCHMARK(BM_AsyncMapGet)->ThreadRange(1, 64)->UseRealTime();
+
+// One in every ten operations inserts a new needle, and removes it again.
+void
+BM_AsyncMapMixed(benchmark::State &state)
+{
+    SetUp(state);
+    std::minstd_rand rng(state.thread_index());
+    uint64_t next = kKeys + (uint64_t(state.thread_index()) << 32);
+    Needle needle;
+    for (auto _ : state) {
+        auto key = rng();
+        if (key % 10 == 0) {
+            needles->Put(next, needle);
+            needles->Remove(next++);
+        }
+        else
+            benchmark::DoNotOptimize(needles->Get(key % kKeys, needle));
+    }
+    state.SetItemsProcessed(state.iterations());
+    TearDown(state);
+}
+BENCHMARK(BM_AsyncMapMixed)->ThreadRange(1, 64)->UseRealTime();
+
+} // namespace
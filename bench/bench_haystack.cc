@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "benchmark/benchmark.h"
+
+#include "codec.hh"
+#include "haystack.hh"
+#include "iobackend.hh"
+#include "needle.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+// Big enough that the appends in a benchmark run never fill the haystack.
+constexpr uint64_t kVolumeSize = 1ull << 40;
+
+// The number of bytes written before a read benchmark starts.
+constexpr uint64_t kReadSetSize = 64 << 20;
+
+// The second argument of the I/O benchmarks selects the backend.
+std::shared_ptr<IoBackend>
+Backend(const benchmark::State &state)
+{
+    return MakeIoBackend(state.range(1) ? "uring" : "fstream");
+}
+
+std::unique_ptr<Haystack>
+NewHaystack(unsigned id, std::shared_ptr<IoBackend> io)
+{
+    boost::filesystem::create_directories(PREFIX);
+    return std::unique_ptr<Haystack>(
+        new Haystack(id, PREFIX, kVolumeSize, false, std::move(io)));
+}
+
+// Fills a haystack with enough needles of the given size to make up the read
+// set, and returns them.
+std::vector<Needle>
+Fill(Haystack &hs, size_t size)
+{
+    std::vector<char> buf(size, 'x');
+    std::vector<Needle> needles;
+    auto count = std::max<uint64_t>(kReadSetSize / size, 64);
+    for (uint64_t i = 0; i < count; ++i)
+        needles.push_back(hs.Write(i, buf.data(), buf.size()));
+    return needles;
+}
+
+void
+SizesAndBackends(benchmark::internal::Benchmark *bench)
+{
+    bench->ArgNames({"size", "uring"});
+    for (int uring : {0, 1}) {
+        for (int size : {1 << 10, 16 << 10, 256 << 10, 1 << 20})
+            bench->Args({size, uring});
+    }
+}
+
+void
+BM_HaystackWrite(benchmark::State &state)
+{
+    auto hs = NewHaystack(0, Backend(state));
+    std::vector<char> buf(state.range(0), 'x');
+    uint64_t needleId = 0;
+    for (auto _ : state)
+        hs->Write(needleId++, buf.data(), buf.size());
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_HaystackWrite)->Apply(SizesAndBackends);
+
+void
+BM_HaystackSequentialRead(benchmark::State &state)
+{
+    auto hs = NewHaystack(1, Backend(state));
+    auto needles = Fill(*hs, state.range(0));
+    std::vector<char> buf(state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        hs->Read(needles[i], buf.data());
+        i = (i + 1) % needles.size();
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_HaystackSequentialRead)->Apply(SizesAndBackends);
+
+void
+BM_HaystackRandomRead(benchmark::State &state)
+{
+    auto hs = NewHaystack(2, Backend(state));
+    auto needles = Fill(*hs, state.range(0));
+    std::shuffle(needles.begin(), needles.end(), std::default_random_engine());
+    std::vector<char> buf(state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        hs->Read(needles[i], buf.data());
+        i = (i + 1) % needles.size();
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_HaystackRandomRead)->Apply(SizesAndBackends);
+
+// Appends groups of 4K needles with one write each, against one write per
+// needle for a group of 1.
+void
+BM_HaystackWriteGroup(benchmark::State &state)
+{
+    auto hs = NewHaystack(6, Backend(state));
+    std::vector<char> buf(4 << 10, 'x');
+    std::vector<NeedleWrite> writes(state.range(0));
+    uint64_t needleId = 0;
+    for (auto _ : state) {
+        for (auto &write : writes)
+            write = NeedleWrite{needleId++, buf.data(), buf.size(), 0};
+        hs->WriteGroup(writes);
+    }
+    state.SetItemsProcessed(state.iterations() * writes.size());
+    state.SetBytesProcessed(state.iterations() * writes.size() * buf.size());
+}
+BENCHMARK(BM_HaystackWriteGroup)
+    ->ArgNames({"group", "uring"})
+    ->ArgsProduct({{1, 8, 64, 512}, {0, 1}});
+
+// Deletes 1K random 4K needles in groups, and folds the journaled deletes
+// into the needle headers, which takes one sync for all of them.
+void
+BM_HaystackDeleteGroup(benchmark::State &state)
+{
+    constexpr size_t kDeletes = 1 << 10;
+    auto hs = NewHaystack(7, Backend(state));
+    auto needles = Fill(*hs, 4 << 10);
+    std::default_random_engine gen;
+    std::uniform_int_distribution<size_t> pick(0, needles.size() - 1);
+    std::vector<Needle> group(state.range(0));
+    for (auto _ : state) {
+        for (size_t i = 0; i < kDeletes; i += group.size()) {
+            for (auto &needle : group)
+                needle = needles[pick(gen)];
+            hs->DeleteGroup(group);
+        }
+        hs->FoldTombstones();
+    }
+    state.SetItemsProcessed(state.iterations() * kDeletes);
+}
+BENCHMARK(BM_HaystackDeleteGroup)
+    ->ArgNames({"group", "uring"})
+    ->ArgsProduct({{1, 64, 1024}, {0, 1}});
+
+// Appends from several threads to the same haystack.
+std::unique_ptr<Haystack> concurrentHs;
+
+void
+BM_HaystackConcurrentWrite(benchmark::State &state)
+{
+    if (state.thread_index() == 0)
+        concurrentHs = NewHaystack(3, Backend(state));
+    std::vector<char> buf(state.range(0), 'x');
+    uint64_t needleId = state.thread_index() * (1ull << 32);
+    for (auto _ : state)
+        concurrentHs->Write(needleId++, buf.data(), buf.size());
+    state.SetBytesProcessed(state.iterations() * buf.size());
+    if (state.thread_index() == 0)
+        concurrentHs.reset();
+}
+BENCHMARK(BM_HaystackConcurrentWrite)
+    ->ArgNames({"size", "uring"})
+    ->Args({4 << 10, 0})
+    ->Args({4 << 10, 1})
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Walks the headers of every needle in the haystack file.
+void
+BM_HaystackNeedles(benchmark::State &state)
+{
+    auto hs = NewHaystack(4, MakeFstreamBackend());
+    std::vector<char> buf(100, 'x');
+    for (int64_t i = 0; i < state.range(0); ++i)
+        hs->Write(i, buf.data(), buf.size());
+    for (auto _ : state)
+        benchmark::DoNotOptimize(hs->Needles());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_HaystackNeedles)->Arg(1 << 10)->Arg(1 << 14)->Arg(1 << 17);
+
+// Streams the needles of the haystack file to a function, reading it in
+// chunks of different sizes.
+void
+BM_HaystackScan(benchmark::State &state)
+{
+    auto hs = NewHaystack(4, MakeFstreamBackend());
+    std::vector<char> buf(100, 'x');
+    for (int64_t i = 0; i < 1 << 17; ++i)
+        hs->Write(i, buf.data(), buf.size());
+    for (auto _ : state) {
+        uint64_t count = 0;
+        hs->Scan([&](const Needle &) {
+            ++count;
+            return true;
+        }, state.range(0));
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetItemsProcessed(state.iterations() << 17);
+}
+BENCHMARK(BM_HaystackScan)->ArgName("chunk")->Arg(64 << 10)->Arg(4 << 20);
+
+// Makes contents that compress about as well as typical metadata, i.e., JSON
+// records with repeated keys and random values.
+std::vector<char>
+Records(size_t size)
+{
+    std::default_random_engine rng;
+    std::uniform_int_distribution<uint32_t> value;
+    std::string text;
+    while (text.size() < size) {
+        text += "{\"id\":" + std::to_string(value(rng))
+            + ",\"owner\":\"user" + std::to_string(value(rng) % 1000)
+            + "\",\"tags\":[\"photo\",\"album\"],\"size\":"
+            + std::to_string(value(rng) % (1 << 20)) + "}\n";
+    }
+    return std::vector<char>(text.begin(), text.begin() + size);
+}
+
+// The first argument of the codec benchmarks selects the codec, and the
+// second one the size of the contents.
+void
+CodecsAndSizes(benchmark::internal::Benchmark *bench)
+{
+    bench->ArgNames({"codec", "size"});
+    for (auto codec : {Codec::Lz4, Codec::Zstd}) {
+        for (int size : {1 << 10, 16 << 10, 256 << 10})
+            bench->Args({static_cast<int>(codec), size});
+    }
+}
+
+void
+BM_CodecCompress(benchmark::State &state)
+{
+    auto codec = static_cast<Codec>(state.range(0));
+    if (not IsCodecAvailable(codec)) {
+        state.SkipWithError("codec not available");
+        return;
+    }
+    auto raw = Records(state.range(1));
+    std::vector<char> packed(raw.size());
+    size_t packedSize = 0;
+    for (auto _ : state) {
+        packedSize = Compress(
+            codec, raw.data(), raw.size(), packed.data(), packed.size());
+        benchmark::DoNotOptimize(packedSize);
+    }
+    state.SetBytesProcessed(state.iterations() * raw.size());
+    state.counters["ratio"] = packedSize
+        ? static_cast<double>(raw.size()) / packedSize : 0;
+}
+BENCHMARK(BM_CodecCompress)->Apply(CodecsAndSizes);
+
+void
+BM_CodecDecompress(benchmark::State &state)
+{
+    auto codec = static_cast<Codec>(state.range(0));
+    if (not IsCodecAvailable(codec)) {
+        state.SkipWithError("codec not available");
+        return;
+    }
+    auto raw = Records(state.range(1));
+    std::vector<char> packed(raw.size());
+    auto packedSize = Compress(
+        codec, raw.data(), raw.size(), packed.data(), packed.size());
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(Decompress(
+            codec, packed.data(), packedSize, raw.data(), raw.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * raw.size());
+}
+BENCHMARK(BM_CodecDecompress)->Apply(CodecsAndSizes);
+
+// Reads needles written with a codec, or with none, to weigh the CPU spent
+// decompressing against the bytes saved on disk.
+void
+BM_HaystackCompressedRead(benchmark::State &state)
+{
+    auto codec = static_cast<Codec>(state.range(0));
+    if (not IsCodecAvailable(codec)) {
+        state.SkipWithError("codec not available");
+        return;
+    }
+    auto hs = NewHaystack(5, MakeFstreamBackend());
+    auto raw = Records(state.range(1));
+    std::vector<Needle> needles;
+    uint64_t stored = 0;
+    for (uint64_t i = 0; i < 64; ++i) {
+        needles.push_back(hs->Write(i, raw.data(), raw.size(), 0, codec));
+        stored += needles.back().flags.size;
+    }
+    std::vector<char> buf(raw.size());
+    size_t i = 0;
+    for (auto _ : state) {
+        hs->Read(needles[i], buf.data());
+        i = (i + 1) % needles.size();
+    }
+    state.SetBytesProcessed(state.iterations() * raw.size());
+    state.counters["ratio"] =
+        static_cast<double>(raw.size() * needles.size()) / stored;
+}
+BENCHMARK(BM_HaystackCompressedRead)
+    ->ArgNames({"codec", "size"})
+    ->Args({static_cast<int>(Codec::None), 16 << 10})
+    ->Args({static_cast<int>(Codec::Lz4), 16 << 10})
+    ->Args({static_cast<int>(Codec::Zstd), 16 << 10});
+
+} // namespace
@@ -0,0 +1,124 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "benchmark/benchmark.h"
+
+#include "store.hh"
+#include "storeconfig.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+constexpr unsigned kStorePort = 5020;
+constexpr size_t kPreloaded = 1024;
+const std::string kIpAddr = "127.0.0.1";
+
+std::atomic<uint64_t> nextNeedleId(0);
+
+// Starts a Store the first time it is called. The Store keeps running until
+// the process exits.
+void
+StartStore()
+{
+    static std::once_flag once;
+    std::call_once(once, [] {
+        // Start from empty volumes, as the Store reopens the ones it finds.
+        boost::filesystem::remove_all(PREFIX "/store");
+        std::thread([] {
+            static Store store(kIpAddr, kStorePort, PREFIX "/store");
+            store.Run();
+        }).detach();
+        // Give the Store some time to setup before we request connection.
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+}
+
+// Sends a request to the Store, reads the whole reply, and returns its status.
+std::string
+Request(const std::string &line, const std::vector<char> &body = {})
+{
+    boost::asio::ip::tcp::iostream conn(kIpAddr, std::to_string(kStorePort));
+    conn << line << '\n';
+    conn.write(body.data(), body.size());
+    conn.flush();
+
+    std::string status;
+    size_t size = 0;
+    conn >> status >> size;
+    if (status == "ok" and size) {
+        conn.ignore(1);
+        std::vector<char> reply(size);
+        conn.read(reply.data(), size);
+    }
+    return status;
+}
+
+std::string
+Put(uint64_t needleId, const std::vector<char> &body)
+{
+    auto volumeId = needleId % StoreConfig::kWritableVolumes;
+    return Request(
+        "put " + std::to_string(volumeId) + ' ' + std::to_string(needleId)
+        + ' ' + std::to_string(body.size()),
+        body);
+}
+
+void
+BM_StorePut(benchmark::State &state)
+{
+    StartStore();
+    std::vector<char> body(state.range(0), 'x');
+    for (auto _ : state) {
+        if (Put(nextNeedleId++, body) != "ok") {
+            state.SkipWithError("put failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_StorePut)
+    ->Arg(1 << 10)
+    ->Arg(64 << 10)
+    ->ThreadRange(1, 16)
+    ->UseRealTime();
+
+// Reads random needles out of a fixed set that is written on the first run.
+void
+BM_StoreGet(benchmark::State &state)
+{
+    static std::vector<uint64_t> preloaded;
+    if (state.thread_index() == 0 and preloaded.empty()) {
+        StartStore();
+        std::vector<char> body(4 << 10, 'x');
+        for (size_t i = 0; i < kPreloaded; ++i) {
+            auto needleId = nextNeedleId++;
+            if (Put(needleId, body) == "ok")
+                preloaded.push_back(needleId);
+        }
+    }
+
+    std::minstd_rand rng(state.thread_index());
+    for (auto _ : state) {
+        auto needleId = preloaded[rng() % preloaded.size()];
+        if (Request("get " + std::to_string(needleId)) != "ok") {
+            state.SkipWithError("get failed");
+            break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_StoreGet)->ThreadRange(1, 16)->UseRealTime();
+
+} // namespace
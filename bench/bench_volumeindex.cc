@@ -0,0 +1,54 @@
+#include <cstdint>
+#include <random>
+
+#include "benchmark/benchmark.h"
+
+#include "needle.hh"
+#include "volumeindex.hh"
+
+namespace {
+
+constexpr uint64_t kKeys = 1 << 20;
+
+// The index shared by all the threads of a benchmark, frozen if the argument
+// is 1.
+VolumeIndex *needles;
+
+void
+SetUp(const benchmark::State &state)
+{
+    if (state.thread_index() != 0)
+        return;
+    needles = new VolumeIndex(0);
+    for (uint64_t i = 0; i < kKeys; ++i)
+        needles->Put(Needle(0, i * 64, i, 1));
+    if (state.range(0))
+        needles->Freeze();
+}
+
+void
+TearDown(benchmark::State &state)
+{
+    if (state.thread_index() != 0)
+        return;
+    state.counters["bytes_per_needle"] =
+        static_cast<double>(needles->MemoryUsage()) / needles->Count();
+    delete needles;
+    needles = nullptr;
+}
+
+void
+BM_VolumeIndexGet(benchmark::State &state)
+{
+    SetUp(state);
+    std::minstd_rand rng(state.thread_index());
+    Needle needle;
+    for (auto _ : state)
+        benchmark::DoNotOptimize(needles->Get(rng() % kKeys, needle));
+    state.SetItemsProcessed(state.iterations());
+    TearDown(state);
+}
+BENCHMARK(BM_VolumeIndexGet)->Arg(0)->Arg(1)->ThreadRange(1, 64)
+    ->UseRealTime();
+
+} // namespace
@@ -0,0 +1,25 @@
+find_package(Threads REQUIRED)
+# Enable ExternalProject CMake module
+include(ExternalProject)
+# Download and build Google Benchmark. The release is pinned so that results
+# can be compared across versions of Haystack.
+ExternalProject_Add(
+    benchmark
+    URL https://github.com/google/benchmark/archive/v1.7.1.zip
+    PREFIX ${CMAKE_CURRENT_BINARY_DIR}/benchmark
+    CMAKE_ARGS
+        -DCMAKE_BUILD_TYPE=Release
+        -DBENCHMARK_ENABLE_TESTING=OFF
+        -DBENCHMARK_ENABLE_GTEST_TESTS=OFF
+    # Disable install step
+    INSTALL_COMMAND ""
+)
+ExternalProject_Get_Property(benchmark source_dir binary_dir)
+# Create a libbenchmark target to be used as a dependency by benchmark programs
+add_library(libbenchmark INTERFACE)
+add_dependencies(libbenchmark benchmark)
+target_link_libraries(libbenchmark INTERFACE Threads::Threads
+    "${binary_dir}/src/libbenchmark.a"
+    "${binary_dir}/src/libbenchmark_main.a"
+)
+set(BENCHMARK_INC ${source_dir}/include)
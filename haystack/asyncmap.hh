@@ -7,7 +7,8 @@
  * Simple wrapper around an unordered_map to make it thread safe.
  *
  * The full functionality provided by unordered_map is not needed, so AsyncMap
- * only exposes a Get, Put, and Remove operation.
+ * only exposes a Get, Put, and Remove operation, and a way to visit every
+ * item, e.g., to save them.
  */
 template<typename TKey, typename TValue>
 class AsyncMap
@@ -24,6 +25,8 @@ public:
     bool Get(const TKey &key, TValue &value) const noexcept;
     bool Put(const TKey &key, const TValue &value);
     bool Remove(const TKey &key) noexcept;
+    template<typename Fn>
+    void ForEach(Fn fn) const;
 };
 
 
@@ -83,3 +86,18 @@ AsyncMap<TKey, TValue>::Remove(const TKey &key) noexcept
     LockGuard lck(mtx);
     return static_cast<bool>(hMap.erase(key));
 }
+
+/**
+ * Calls a function with every key and value in the map, while holding the
+ * lock. The function must not call back into the map.
+ * @param fn The function, which takes the key and the value.
+ */
+template<typename TKey, typename TValue>
+template<typename Fn>
+void
+AsyncMap<TKey, TValue>::ForEach(Fn fn) const
+{
+    LockGuard lck(mtx);
+    for (auto &item : hMap)
+        fn(item.first, item.second);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <system_error>
+
+/**
+ * Writes an integer in little endian order, which is the byte order of all
+ * the on-disk formats, whatever the byte order of the host.
+ *
+ * @param buff The buffer, of at least sizeof(T) bytes.
+ * @param value The integer.
+ */
+template<typename T>
+inline void
+PutLe(char *buff, T value) noexcept
+{
+    for (size_t i = 0; i < sizeof(T); ++i)
+        buff[i] = static_cast<char>(value >> (8*i));
+}
+
+/**
+ * Appends an integer to a string in little endian order.
+ *
+ * @param out The string.
+ * @param value The integer.
+ */
+template<typename T>
+inline void
+PutLe(std::string &out, T value)
+{
+    for (size_t i = 0; i < sizeof(T); ++i)
+        out.push_back(static_cast<char>(value >> (8*i)));
+}
+
+/**
+ * @param buff A buffer of at least sizeof(T) bytes.
+ * @return The integer stored in little endian order at the start of it.
+ */
+template<typename T>
+inline T
+GetLe(const char *buff) noexcept
+{
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        value |= static_cast<T>(static_cast<unsigned char>(buff[i])) << (8*i);
+    return value;
+}
+
+/**
+ * Spreads the bits of a 64-bit value (the finalizer of SplitMix64), so that
+ * consecutive needle IDs hash to unrelated values.
+ *
+ * @param x The value.
+ * @return The mixed value.
+ */
+inline uint64_t
+Mix(uint64_t x) noexcept
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+/**
+ * @param err The errno value of a failed system call.
+ * @param what What failed, e.g., the call and the file name.
+ * @return The exception to throw for it.
+ */
+inline std::system_error
+SystemError(int err, const std::string &what)
+{
+    return std::system_error(err, std::generic_category(), what);
+}
+
+/**
+ * @param what What failed, e.g., the call and the file name.
+ * @return The exception to throw for the system call that just failed, with
+ *  the current errno value.
+ */
+inline std::system_error
+SystemError(const std::string &what)
+{
+    return SystemError(errno, what);
+}
@@ -0,0 +1,188 @@
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bufferpool.hh"
+
+namespace {
+using LockGuard = std::lock_guard<std::mutex>;
+}
+
+// Define them here to avoid link errors
+constexpr size_t BufferPool::kMinSize;
+constexpr size_t BufferPool::kMaxSize;
+constexpr unsigned BufferPool::kClasses;
+constexpr size_t BufferPool::kThreadCacheBytes;
+constexpr size_t BufferPool::kSharedCacheBytes;
+
+/**
+ * The buffers cached by one thread. They are handed to the shared free lists
+ * when the thread exits.
+ */
+struct BufferPool::ThreadCache
+{
+    std::vector<char*> freeLists[kClasses];
+
+    ~ThreadCache()
+    {
+        for (unsigned c = 0; c < kClasses; ++c) {
+            for (auto data : freeLists[c])
+                Instance().ReleaseShared(data, c);
+        }
+    }
+};
+
+BufferPool::Buffer::Buffer(Buffer &&buffer) noexcept
+    : data(buffer.data), size(buffer.size), sizeClass(buffer.sizeClass)
+{
+    buffer.data = nullptr;
+}
+
+BufferPool::Buffer&
+BufferPool::Buffer::operator=(Buffer &&buffer) noexcept
+{
+    std::swap(data, buffer.data);
+    std::swap(size, buffer.size);
+    std::swap(sizeClass, buffer.sizeClass);
+    return *this;
+}
+
+/**
+ * Dtor. Returns the buffer to the pool.
+ */
+BufferPool::Buffer::~Buffer()
+{
+    if (data)
+        Instance().Release(data, sizeClass);
+}
+
+/**
+ * Dtor. Frees the buffers in the shared free lists.
+ */
+BufferPool::~BufferPool()
+{
+    for (auto &freeList : freeLists) {
+        for (auto data : freeList)
+            delete[] data;
+    }
+}
+
+/**
+ * @return The pool shared by all the servers in the process.
+ */
+BufferPool&
+BufferPool::Instance()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+/**
+ * @return The cache of the calling thread.
+ */
+BufferPool::ThreadCache&
+BufferPool::LocalCache()
+{
+    // Make sure that the pool outlives the caches of all the threads.
+    Instance();
+    thread_local ThreadCache cache;
+    return cache;
+}
+
+/**
+ * Takes a buffer from the pool, or allocates one if there is none free.
+ *
+ * @param size The number of bytes needed.
+ * @return A buffer of the smallest size class that holds size bytes.
+ * @throw std::length_error if size is larger than kMaxSize.
+ */
+BufferPool::Buffer
+BufferPool::Get(size_t size)
+{
+    if (size > kMaxSize)
+        throw std::length_error("buffer too large: " + std::to_string(size));
+
+    unsigned sizeClass = 0;
+    while (ClassSize(sizeClass) < size)
+        ++sizeClass;
+
+    auto &local = LocalCache().freeLists[sizeClass];
+    if (not local.empty()) {
+        auto data = local.back();
+        local.pop_back();
+        return Buffer(data, size, sizeClass);
+    }
+    {
+        LockGuard lk(mtx);
+        auto &shared = freeLists[sizeClass];
+        if (not shared.empty()) {
+            auto data = shared.back();
+            shared.pop_back();
+            return Buffer(data, size, sizeClass);
+        }
+    }
+    return Buffer(new char[ClassSize(sizeClass)], size, sizeClass);
+}
+
+/**
+ * Returns a buffer to the cache of the calling thread, or to the shared free
+ * lists if the cache is full.
+ *
+ * @param data The buffer.
+ * @param sizeClass Its size class.
+ */
+void
+BufferPool::Release(char *data, unsigned sizeClass) noexcept
+{
+    auto &local = LocalCache().freeLists[sizeClass];
+    if (local.size() * ClassSize(sizeClass) < kThreadCacheBytes) {
+        try {
+            local.push_back(data);
+            return;
+        }
+        catch (std::bad_alloc&) {
+        }
+    }
+    ReleaseShared(data, sizeClass);
+}
+
+/**
+ * Returns a buffer to the shared free lists, or frees it if they are full.
+ *
+ * @param data The buffer.
+ * @param sizeClass Its size class.
+ */
+void
+BufferPool::ReleaseShared(char *data, unsigned sizeClass) noexcept
+{
+    {
+        LockGuard lk(mtx);
+        auto &shared = freeLists[sizeClass];
+        if (shared.size() * ClassSize(sizeClass) < kSharedCacheBytes) {
+            try {
+                shared.push_back(data);
+                return;
+            }
+            catch (std::bad_alloc&) {
+            }
+        }
+    }
+    delete[] data;
+}
+
+/**
+ * @return The number of bytes in the shared free lists.
+ */
+size_t
+BufferPool::SharedBytes() const
+{
+    LockGuard lk(mtx);
+    size_t bytes = 0;
+    for (unsigned c = 0; c < kClasses; ++c)
+        bytes += freeLists[c].size() * ClassSize(c);
+    return bytes;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+/**
+ * A pool of request buffers shared by the servers, so that the memory used
+ * per request follows the size of its payload, rather than the largest size
+ * allowed.
+ *
+ * Buffers come in power of two size classes from kMinSize to kMaxSize. Freed
+ * buffers are first kept in a cache owned by the calling thread, which needs
+ * no locking, and then in free lists shared by all the threads. Both layers
+ * are bounded, and buffers beyond those bounds are returned to the system.
+ */
+class BufferPool
+{
+public:
+    static constexpr size_t kMinSize = 4 << 10;
+    static constexpr size_t kMaxSize = 1 << 20;
+    static constexpr unsigned kClasses = 9;
+
+    // The number of bytes of each size class cached by every thread, and in
+    // the shared free lists. A thread always caches at least one buffer.
+    static constexpr size_t kThreadCacheBytes = 1 << 20;
+    static constexpr size_t kSharedCacheBytes = 16 << 20;
+
+    /**
+     * A buffer taken from the pool. It is returned to the pool when it is
+     * destroyed.
+     */
+    class Buffer
+    {
+        char *data;
+        size_t size;
+        unsigned sizeClass;
+
+        friend class BufferPool;
+        Buffer(char *data, size_t size, unsigned sizeClass) noexcept
+            : data(data), size(size), sizeClass(sizeClass)
+        {}
+
+    public:
+        Buffer() noexcept : data(nullptr), size(0), sizeClass(0) {}
+        Buffer(Buffer &&buffer) noexcept;
+        Buffer& operator=(Buffer &&buffer) noexcept;
+        Buffer(const Buffer &buffer) = delete;
+        Buffer& operator=(const Buffer &buffer) = delete;
+        ~Buffer();
+
+        char *Data() const noexcept { return data; }
+        size_t Size() const noexcept { return size; }
+        size_t Capacity() const noexcept { return ClassSize(sizeClass); }
+    };
+
+private:
+    struct ThreadCache;
+
+    mutable std::mutex mtx;
+    std::vector<char*> freeLists[kClasses];
+
+    BufferPool() = default;
+    static ThreadCache &LocalCache();
+    void Release(char *data, unsigned sizeClass) noexcept;
+    void ReleaseShared(char *data, unsigned sizeClass) noexcept;
+
+public:
+    BufferPool(const BufferPool &pool) = delete;
+    BufferPool& operator=(const BufferPool &pool) = delete;
+    ~BufferPool();
+
+    static BufferPool &Instance();
+    static size_t ClassSize(unsigned c) noexcept { return kMinSize << c; }
+
+    Buffer Get(size_t size);
+    size_t SharedBytes() const;
+};
@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <hiredis.h>
@@ -13,6 +18,31 @@
 
 // Define here to avoid link errors
 constexpr uint64_t Cache::kBuffSize;
+constexpr unsigned Cache::kFilterInterval;
+constexpr unsigned Cache::kMissTtl;
+constexpr size_t Cache::kMaxMisses;
+
+namespace {
+
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+
+/**
+ * @param needleId The handle of a needle, or its ID if it has no cookie.
+ * @return The ID of the needle, or 0 if it cannot be parsed.
+ */
+uint64_t
+ParseNeedleId(const std::string &needleId)
+{
+    NeedleHandle handle;
+    if (NeedleHandle::Parse(needleId, handle))
+        return handle.needleId;
+    uint64_t id = 0;
+    std::istringstream(needleId) >> id;
+    return id;
+}
+
+} // namespace
 
 /**
  * Initializes a Cache with the addresses of the Redis cache and Store.
@@ -21,8 +51,10 @@ constexpr uint64_t Cache::kBuffSize;
  * @param cachePort The port number where the Cache listens for requests.
  * @param redisIpAddr The Redis IP address.
  * @param redisPort The Redis port number.
- * @param storeIpAddr The Store's IP address.
- * @param storePort The Store's port number.
+ * @param storeIpAddr The Store's IP address, a comma separated list of
+ *  |<ipAddr>[:<port>]| of Stores that hold replicas of the same volumes, or
+ *  the name of a store map file.
+ * @param storePort The Stores' port number, unless the list has their port.
  */
 Cache::Cache(
     const std::string &cacheIpAddr,
@@ -31,38 +63,125 @@ Cache::Cache(
     unsigned redisPort,
     const std::string &storeIpAddr,
     const std::string &storePort)
+    : Cache(
+          cacheIpAddr,
+          cachePort,
+          redisIpAddr,
+          redisPort,
+          StoreMap::FromArgs(storeIpAddr, storePort))
+{}
+
+/**
+ * Initializes a Cache with the addresses of the Redis cache and the shards of
+ * Stores.
+ *
+ * @param cacheIpAddr The IP address where the Cache listens for requests.
+ * @param cachePort The port number where the Cache listens for requests.
+ * @param redisIpAddr The Redis IP address.
+ * @param redisPort The Redis port number.
+ * @param storeMap The shards of Stores, which must match the Directory's.
+ */
+Cache::Cache(
+    const std::string &cacheIpAddr,
+    unsigned cachePort,
+    const std::string &redisIpAddr,
+    unsigned redisPort,
+    StoreMap storeMap)
     : cacheIpAddr(cacheIpAddr),
       cachePort(cachePort),
       redisIpAddr(redisIpAddr),
       redisPort(redisPort),
-      storeIpAddr(storeIpAddr),
-      storePort(storePort)
-{}
+      storeMap(std::move(storeMap)),
+      metrics(),
+      commandMetrics(metrics, "haystack_cache", {"get", "stat", "delete"}),
+      hits(metrics.AddCounter(
+          "haystack_cache_hits_total", "Gets served from Redis.")),
+      misses(metrics.AddCounter(
+          "haystack_cache_misses_total", "Gets forwarded to the store.")),
+      redisErrors(metrics.AddCounter(
+          "haystack_cache_redis_errors_total", "Failed Redis commands.")),
+      busy(metrics.AddCounter(
+          "haystack_cache_busy_total",
+          "Connections refused because all the threads were busy.")),
+      rejected(metrics.AddCounter(
+          "haystack_cache_rejected_total",
+          "Requests for missing needles rejected without asking the store.")),
+      metricsPort(0),
+      metricsServer(),
+      tracePath(),
+      traceSampleRate(0),
+      tracer(),
+      filterInterval(kFilterInterval),
+      filterMtx(),
+      filterCv(),
+      isFilterStopped(true),
+      filterThread(),
+      idFilter(),
+      filterMaxId(0),
+      lastMaxId(0),
+      filterBits(NeedleFilter::kMinBits),
+      recentMisses(new MissCache(std::chrono::seconds(kMissTtl), kMaxMisses)),
+      listener(
+          std::chrono::seconds(Listener::kTimeout),
+          busy,
+          [this](std::unique_ptr<TcpStream> conn) {
+              HandleConnection(std::move(conn));
+          })
+{
+    metrics.AddGauge(
+        "haystack_cache_hit_ratio",
+        "Fraction of the gets served from Redis.",
+        [this]() -> std::vector<MetricsRegistry::GaugeSample> {
+            double hit = hits.Value();
+            double total = hit + misses.Value();
+            return {{{}, total > 0 ? hit / total : 0}};
+        });
+}
 
 /**
- * Listens for requests in a loop, and launches a thread to handle each
- * connection.
+ * Sets how requests for needles that do not exist are rejected. It must be
+ * called before Run.
+ *
+ * @param interval How often the filter of needle IDs is fetched from the
+ *  stores, which must be longer than a write takes, or 0 to never fetch it.
+ * @param missTtl How long a miss is remembered, or 0 to not remember them.
+ */
+void
+Cache::FilterMisses(
+    std::chrono::seconds interval, std::chrono::seconds missTtl)
+{
+    filterInterval = interval;
+    recentMisses.reset(
+        new MissCache(missTtl, missTtl.count() ? kMaxMisses : 0));
+}
+
+/**
+ * Listens for requests and serves them on a pool of threads until Stop is
+ * called, and then waits for the requests being served.
  */
 void
 Cache::Run()
 {
-    using namespace boost::asio;
-    io_service io_service;
-    ip::tcp::acceptor acceptor(
-        io_service,
-        ip::tcp::endpoint(ip::address::from_string(cacheIpAddr), cachePort));
+    if (metricsPort) {
+        metricsServer.reset(
+            new MetricsServer(metrics, cacheIpAddr, metricsPort));
+    }
+    if (not tracePath.empty())
+        tracer.reset(new Tracer("cache", tracePath, traceSampleRate));
+    if (filterInterval.count()) {
+        isFilterStopped = false;
+        filterThread = std::thread(&Cache::FilterLoop, this);
+    }
 
-    for (;;) {
-        try {
-            std::unique_ptr<TcpStream> conn(new TcpStream);
-            acceptor.accept(*conn->rdbuf());
-            std::thread thr(
-                &Cache::HandleConnection, this, std::move(conn));
-            thr.detach();
-        }
-        catch (std::exception& err) {
-            std::cerr << "ERROR: " << err.what() << std::endl;
+    listener.Run(cacheIpAddr, cachePort);
+
+    if (filterThread.joinable()) {
+        {
+            LockGuard lk(filterMtx);
+            isFilterStopped = true;
         }
+        filterCv.notify_all();
+        filterThread.join();
     }
 }
 
@@ -70,23 +189,45 @@ Cache::Run()
  * Handles a connection request.
  *
  * @param conn A pointer to a TCP stream.
- * @details Responds to two commands: get, and delete:
- *  - get: |get <needleId>|
- *  - delete: |delete <needleId>|
+ * @details Responds to three commands: get, stat, and delete:
+ *  - get: |get <handle> [<offset> <length>]|
+ *  - stat: |stat <handle>|
+ *  - delete: |delete <handle>|
+ *  where |<handle>| is the NeedleHandle issued by the Directory, or the needle
+ *  ID of a needle that has no cookie. All take an optional |trace=<traceId>|
+ *  at the end of the line, which is forwarded to the store, see Tracer. A get
+ *  or stat for a needle that is known not to exist is answered with
+ *  |err BadNeedle| without asking the stores, see IsMissing.
  */
 void
 Cache::HandleConnection(std::unique_ptr<TcpStream> conn)
 {
+    auto start = CommandMetrics::Clock::now();
+    std::string line, command, needleId;
+    bool isOk = false;
     try {
         conn->exceptions(std::ios::badbit);
-        std::string command, needleId;
 
-        *conn >> command >> needleId;
+        std::getline(*conn, line);
+        std::istringstream iss(line);
+        iss >> command >> needleId;
+        ByteRange range;
+        bool isRange = command == "get" and ByteRange::Read(iss, range);
+        auto traceId = RequestTraceId(iss, tracer.get());
 
-        if (command == "get")
-            Get(std::move(conn), needleId);
-        else if (command == "delete")
-            Remove(std::move(conn), needleId);
+        if (command == "get") {
+            TraceSpan span(tracer.get(), traceId, "cache.get");
+            isOk = Get(
+                std::move(conn), needleId, isRange ? &range : nullptr, traceId);
+        }
+        else if (command == "stat") {
+            TraceSpan span(tracer.get(), traceId, "cache.stat");
+            isOk = Stat(std::move(conn), needleId, traceId);
+        }
+        else if (command == "delete") {
+            TraceSpan span(tracer.get(), traceId, "cache.delete");
+            isOk = Remove(std::move(conn), needleId);
+        }
         else {
             *conn << "err BadCommand\n";
             conn->flush();
@@ -95,105 +236,239 @@ Cache::HandleConnection(std::unique_ptr<TcpStream> conn)
     catch (std::exception) {
         // Prevent exception form terminating thread
     }
+    commandMetrics.Record(command, isOk, start);
 }
 
 /**
  * Gets a neeldeId from the cache if its there. If the needle is not in the
  * cache, then it fetches the needle from the store, puts the needle in the
- * cache, returns the contents of the needle.
+ * cache, returns the contents of the needle. Each read starts with the next
+ * replica of the shard that owns the needle ID, and moves on to the following
+ * one, and then to the other shards, if a store cannot be reached or does not
+ * have the needle.
+ *
+ * A range read is a partial hit when the whole needle is in the cache, and only
+ * the bytes of the range are taken from Redis. Otherwise the range is read
+ * from the store, and it is not cached.
  *
  * @param conn A pointer to a TCP stream for the connection.
- * @param needleId The needle ID.
+ * @param needleId The handle of the needle, or its ID if it has no cookie. It
+ *  is forwarded to the stores as is, and it is the key of the needle in Redis.
+ * @param range The part of the contents to get, or nullptr for all of them.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @return True if the contents of the needle are sent back, false otherwise.
  */
-void
-Cache::Get(std::unique_ptr<TcpStream> conn, const std::string &needleId)
+bool
+Cache::Get(
+    std::unique_ptr<TcpStream> conn,
+    const std::string &needleId,
+    const ByteRange *range,
+    uint64_t traceId)
 {
-    char buf[kBuffSize];
     redisContext *rc = nullptr;
     redisReply *rp = nullptr;
 
     try {
         rc = ConnectToRedis();
 
-        // Try a GET
-        rp = static_cast<redisReply*>(
-            redisCommand(rc,"GET %s", needleId.c_str()));
-        if (not rp) {
+        // Try a GET, or a GETRANGE for a range. Redis replies to the latter
+        // with an empty string both if the needle is not cached and if the
+        // range is past its end, so empty ranges are left to the store.
+        TraceSpan redisGet(tracer.get(), traceId, "cache.redis_get");
+        if (not range) {
+            rp = static_cast<redisReply*>(
+                redisCommand(rc,"GET %s", needleId.c_str()));
+        }
+        else if (range->length) {
+            auto last = range->offset + std::min(range->length, kBuffSize) - 1;
+            rp = static_cast<redisReply*>(
+                redisCommand(rc, "GETRANGE %s %llu %llu", needleId.c_str(),
+                             static_cast<unsigned long long>(range->offset),
+                             static_cast<unsigned long long>(last)));
+        }
+        redisGet.End();
+        bool isAsked = not range or range->length;
+        if (isAsked and not rp) {
             std::cerr << "CONNECTION ERROR: " << rc->errstr << std::endl;
             redisFree(rc);
             rc = nullptr;
+            redisErrors.Inc();
             *conn << "err RedisErr\n";
             conn->flush();
-            return;
+            return false;
         }
-        else if (rp->type == REDIS_REPLY_STRING) {
+        else if (isAsked and rp->type == REDIS_REPLY_STRING
+                 and (rp->len or not range)) {
             *conn << "ok " << rp->len << '\n';
             conn->write(rp->str, rp->len);
             conn->flush();
             freeReplyObject(rp);
             redisFree(rc);
-            return;
+            hits.Inc();
+            return true;
         }
-        freeReplyObject(rp);
+        if (rp)
+            freeReplyObject(rp);
         rp = nullptr;
+        if (IsMissing(needleId)) {
+            redisFree(rc);
+            rc = nullptr;
+            *conn << "err BadNeedle\n";
+            conn->flush();
+            return false;
+        }
+        misses.Inc();
 
-        // Fetch object from store
-        TcpStream storeConn(storeIpAddr, storePort);
-        storeConn << "get " << needleId << '\n';
-        std::string line, status;
-        size_t nBytes;
-        std::getline(storeConn, line);
-        std::istringstream iss(line);
-        iss >> status >> nBytes;
+        // Fetch object from the first replica that has it
+        TraceSpan storeGet(tracer.get(), traceId, "cache.store_get");
+        std::ostringstream request;
+        request << "get " << needleId;
+        if (range)
+            request << ' ' << range->offset << ' ' << range->length;
+        request << TraceToken(traceId);
+        TcpStream storeConn;
+        bool isMissing = false;
+        auto line = AskStores(
+            needleId, request.str(),
+            "stat " + needleId + TraceToken(traceId), storeConn, isMissing);
+        std::string status;
+        size_t nBytes = 0;
+        std::istringstream(line) >> status >> nBytes;
         if (status != "ok") {
             redisFree(rc);
             rc = nullptr;
+            if (isMissing)
+                recentMisses->Add(needleId);
             *conn << line << '\n';
             conn->flush();
-            return;
+            return false;
         }
         else if (nBytes > kBuffSize) {
             redisFree(rc);
             rc = nullptr;
             *conn << "err TooBig\n";
             conn->flush();
-            return;
+            return false;
         }
-        storeConn.read(buf, nBytes);
+        auto buf = BufferPool::Instance().Get(nBytes);
+        storeConn.read(buf.Data(), nBytes);
         storeConn.close();
+        storeGet.End();
         *conn << "ok " << nBytes << '\n';
-        conn->write(buf, nBytes);
+        conn->write(buf.Data(), nBytes);
         conn->flush();
         conn->close();
+        if (range) {
+            redisFree(rc);
+            return true;
+        }
 
         // Cache the object in the Redis cache
+        TraceSpan redisSet(tracer.get(), traceId, "cache.redis_set");
         rp = static_cast<redisReply*>(
-            redisCommand(rc,"SET %s %b", needleId.c_str(), buf, nBytes));
+            redisCommand(rc,"SET %s %b",
+                         needleId.c_str(), buf.Data(), nBytes));
         if (not rp) {
             std::cerr << "ERROR: redis PUT: " << rc->errstr << std::endl;
+            redisErrors.Inc();
             redisFree(rc);
-            return;
+            return true;
         }
         freeReplyObject(rp);
         redisFree(rc);
+        return true;
+    }
+    catch (std::exception &err) {
+        if (rc) redisFree(rc);
+        if (rp) freeReplyObject(rp);
+        std::cerr << "ERROR: " << err.what() << std::endl;
+        if (not *conn) return false;
+        *conn << "err Unknown\n";
+        conn->flush();
+        return false;
+    }
+}
+
+/**
+ * Gets the size of a needle, from the cache if it is there, or from the
+ * stores otherwise, which serve it without reading the needle.
+ *
+ * @param conn A pointer to a TCP stream for the connection.
+ * @param needleId The handle of the needle, or its ID if it has no cookie.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @return True if the size of the needle is sent back, false otherwise.
+ */
+bool
+Cache::Stat(
+    std::unique_ptr<TcpStream> conn,
+    const std::string &needleId,
+    uint64_t traceId)
+{
+    redisContext *rc = nullptr;
+    redisReply *rp = nullptr;
+
+    try {
+        rc = ConnectToRedis();
+        TraceSpan redisGet(tracer.get(), traceId, "cache.redis_strlen");
+        rp = static_cast<redisReply*>(
+            redisCommand(rc, "STRLEN %s", needleId.c_str()));
+        redisGet.End();
+        if (not rp) {
+            std::cerr << "ERROR: redis: " << rc->errstr << std::endl;
+            redisErrors.Inc();
+        }
+        else if (rp->type == REDIS_REPLY_INTEGER and rp->integer > 0) {
+            *conn << "ok " << rp->integer << '\n';
+            conn->flush();
+            freeReplyObject(rp);
+            redisFree(rc);
+            hits.Inc();
+            return true;
+        }
+        if (rp)
+            freeReplyObject(rp);
+        rp = nullptr;
+        redisFree(rc);
+        rc = nullptr;
+        if (IsMissing(needleId)) {
+            *conn << "err BadNeedle\n";
+            conn->flush();
+            return false;
+        }
+        misses.Inc();
+
+        TraceSpan storeStat(tracer.get(), traceId, "cache.store_stat");
+        TcpStream storeConn;
+        bool isMissing = false;
+        auto stat = "stat " + needleId + TraceToken(traceId);
+        auto line = AskStores(needleId, stat, stat, storeConn, isMissing);
+        storeStat.End();
+        if (isMissing)
+            recentMisses->Add(needleId);
+        *conn << line << '\n';
+        conn->flush();
+        return line.compare(0, 3, "ok ") == 0;
     }
     catch (std::exception &err) {
         if (rc) redisFree(rc);
         if (rp) freeReplyObject(rp);
         std::cerr << "ERROR: " << err.what() << std::endl;
-        if (not *conn) return;
+        if (not *conn) return false;
         *conn << "err Unknown\n";
         conn->flush();
+        return false;
     }
 }
 
 /**
- * Deletes a needle from the Redis cache.
+ * Deletes a needle from the Redis cache, and remembers it as missing, so that
+ * the reads that follow the delete do not ask the Stores for it.
  *
  * @param conn A pointer to TCP stream for the connection.
- * @param needleId The needle ID.
+ * @param needleId The handle of the needle, or its ID if it has no cookie.
+ * @return True if the needle is no longer in the cache, false otherwise.
  */
-void
+bool
 Cache::Remove(std::unique_ptr<TcpStream> conn, const std::string &needleId)
 {
     redisContext *rc = nullptr;
@@ -205,25 +480,179 @@ Cache::Remove(std::unique_ptr<TcpStream> conn, const std::string &needleId)
             redisCommand(rc,"DEL %s", needleId.c_str()));
         if (not rp) {
             std::cerr << "ERROR: redis: " << rc->errstr << std::endl;
+            redisErrors.Inc();
             redisFree(rc);
             rc = nullptr;
             *conn << "err RedisErr\n";
             conn->flush();
-            return;
+            return false;
         }
         freeReplyObject(rp);
         rp = nullptr;
+        redisFree(rc);
+        rc = nullptr;
+        recentMisses->Add(needleId);
         *conn << "ok\n";
         conn->flush();
+        return true;
     }
     catch (std::exception &err) {
         if (rc) redisFree(rc);
         if (rp) freeReplyObject(rp);
         std::cerr << "ERROR: " << err.what() << std::endl;
-        if (not *conn) return;
+        if (not *conn) return false;
         *conn << "err Unknown\n";
         conn->flush();
+        return false;
+    }
+}
+
+/**
+ * Tells whether a needle is known not to exist, in which case the request for
+ * it is counted as rejected.
+ *
+ * @param needleId The handle of the needle, or its ID if it has no cookie.
+ * @return True if the needle was found missing less than the TTL ago, or it
+ *  is not in the filter of needle IDs, false if it may exist.
+ */
+bool
+Cache::IsMissing(const std::string &needleId)
+{
+    bool isMissing = recentMisses->Contains(needleId);
+    if (not isMissing) {
+        auto id = ParseNeedleId(needleId);
+        std::shared_ptr<const NeedleFilter> filter;
+        uint64_t maxId = 0;
+        {
+            LockGuard lk(filterMtx);
+            filter = idFilter;
+            maxId = filterMaxId;
+        }
+        isMissing = filter and id <= maxId and not filter->MayContain(id);
+    }
+    if (isMissing)
+        rejected.Inc();
+    return isMissing;
+}
+
+/**
+ * Fetches the filter of needle IDs from the stores every filterInterval,
+ * until Run is done.
+ */
+void
+Cache::FilterLoop()
+{
+    UniqueLock lk(filterMtx);
+    while (not isFilterStopped) {
+        lk.unlock();
+        RefreshFilter();
+        lk.lock();
+        filterCv.wait_for(
+            lk, filterInterval, [this] { return isFilterStopped; });
+    }
+}
+
+/**
+ * Fetches the filter of needle IDs from every store of every shard, and
+ * merges them. A store that cannot be reached turns the filter off until the
+ * next refresh, since the needles that only it has would be rejected.
+ */
+void
+Cache::RefreshFilter()
+{
+    uint64_t bits = 0;
+    {
+        LockGuard lk(filterMtx);
+        bits = filterBits;
+    }
+
+    std::shared_ptr<NeedleFilter> filter;
+    uint64_t count = 0;
+    uint64_t maxId = 0;
+    try {
+        for (auto &shard : storeMap.Shards()) {
+            for (auto &store : shard.replicas->Stores()) {
+                TcpStream conn;
+                conn.expires_after(std::chrono::seconds(ReplicaSet::kTimeout));
+                conn.connect(store.ipAddr, store.port);
+                conn << "idfilter " << bits << '\n';
+                conn.flush();
+
+                std::string line, status;
+                uint64_t storeBits = 0, storeCount = 0, storeMaxId = 0;
+                std::getline(conn, line);
+                std::istringstream(line)
+                    >> status >> storeBits >> storeCount >> storeMaxId;
+                if (status != "ok")
+                    throw std::runtime_error(store.ToString() + ": " + line);
+                std::shared_ptr<NeedleFilter> storeFilter(
+                    new NeedleFilter(storeBits));
+                if (storeFilter->Bits() != storeBits
+                    or not storeFilter->Read(conn))
+                    throw std::runtime_error(store.ToString() + ": BadFilter");
+                if (filter)
+                    filter->Merge(*storeFilter);
+                else
+                    filter = storeFilter;
+                count += storeCount;
+                maxId = std::max(maxId, storeMaxId);
+            }
+        }
+    }
+    catch (std::exception &err) {
+        std::cerr << "ERROR: needle filter: " << err.what() << std::endl;
+        filter.reset();
+    }
+
+    LockGuard lk(filterMtx);
+    idFilter = filter;
+    filterMaxId = filter ? lastMaxId : 0;
+    if (filter) {
+        lastMaxId = std::max(lastMaxId, maxId);
+        filterBits = NeedleFilter::BitsFor(count);
+    }
+}
+
+/**
+ * Sends a request for a needle to the shards that may hold it, one at a time,
+ * starting with the shard that owns the needle ID, until one of them replies
+ * ok. Every shard only replies ok once enough of its replicas agree that they
+ * have the needle, see ReplicaSet::Read, so a replica that missed a delete
+ * does not bring the needle back. Every store has ReplicaSet::kTimeout
+ * seconds to reply, so a store that hangs is skipped like one that is down.
+ *
+ * @param needleId The handle of the needle, or its ID if it has no cookie.
+ * @param request The request line, without the newline.
+ * @param check The request line that the other replicas are asked to confirm
+ *  that they have the needle.
+ * @param storeConn Set to the connection to the store that replied ok,
+ *  positioned after its reply line.
+ * @param isMissing Set to true if every shard replied that the needle does not
+ *  exist, false otherwise.
+ * @return The reply line of the first shard that replied ok, or else the last
+ *  error reply, or |err NoStore| if no store could be reached.
+ */
+std::string
+Cache::AskStores(
+    const std::string &needleId,
+    const std::string &request,
+    const std::string &check,
+    TcpStream &storeConn,
+    bool &isMissing)
+{
+    std::string line = "err NoStore";
+    isMissing = true;
+    for (auto shard : storeMap.ShardOrder(ParseNeedleId(needleId))) {
+        bool isShardMissing = false;
+        auto reply = shard->replicas->Read(
+            request, check, storeConn, isShardMissing);
+        if (reply != "err NoStore")
+            line = reply;
+        isMissing = isMissing and isShardMissing;
+        if (line.compare(0, 2, "ok") == 0)
+            break;
     }
+    return line;
 }
 
 /**
@@ -239,6 +668,7 @@ Cache::ConnectToRedis()
     if (rc == nullptr or rc->err) {
         if (rc) redisFree(rc);
         std::cerr << "ERROR: redis: cannot connect" << std::endl;
+        redisErrors.Inc();
         throw std::exception();
     }
     return rc;
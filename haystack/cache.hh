@@ -1,26 +1,59 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 
 #include <boost/asio.hpp>
 #include <hiredis.h>
 
+#include "bufferpool.hh"
+#include "listener.hh"
+#include "metrics.hh"
+#include "misscache.hh"
+#include "needle.hh"
+#include "needlefilter.hh"
+#include "storemap.hh"
+#include "trace.hh"
+
 /**
  * The cache component.
  *
  * Requests to the store firt hit the cache. If the blob is found in the cache,
  * then the blob in the cache is served, otherwise the cache forwards the
- * request to the store. If the store replies with the blob, then the blob is
- * stored in the cache, and then the cache forwards the blob back to the client.
+ * request to one of the stores that hold replicas of the blob, spreading the
+ * requests across them, and trying the next one if a store fails, see
+ * StoreMap. If a store
+ * replies with the blob, then the blob is stored in the cache, and then the
+ * cache forwards the blob back to the client.
  * Internally, Cache does not cache anything, but instead relies on the Redis
  * for caching.
+ *
+ * Requests for needles that do not exist, e.g., from scrapers or broken links,
+ * are rejected without asking the stores when the needle was found missing
+ * less than kMissTtl seconds ago, or when it is not in the NeedleFilter that
+ * the cache fetches from every store every kFilterInterval seconds. The filter
+ * is only trusted for the needle IDs up to the highest one at the refresh
+ * before, since the needles with higher IDs may have been written after the
+ * stores built it, which assumes that writes take less than an interval.
  */
 class Cache
 {
 public:
     using TcpStream = boost::asio::ip::tcp::iostream;
 
+    // How often the filter of needle IDs is fetched from the stores, and how
+    // long a miss is remembered, in seconds, by default, and the maximum
+    // number of misses remembered.
+    static constexpr unsigned kFilterInterval = 60;
+    static constexpr unsigned kMissTtl = 10;
+    static constexpr size_t kMaxMisses = 1 << 16;
+
 private:
     static constexpr uint64_t kBuffSize = 1 << 20;
 
@@ -32,13 +65,62 @@ private:
     std::string redisIpAddr;
     unsigned redisPort;
 
-    // The IP address and port where the store listens for requests.
-    std::string storeIpAddr;
-    std::string storePort;
+    // The shards of stores holding the volumes.
+    StoreMap storeMap;
+
+    // Runtime metrics, served over HTTP on metricsPort if it is set.
+    MetricsRegistry metrics;
+    CommandMetrics commandMetrics;
+    Counter &hits;
+    Counter &misses;
+    Counter &redisErrors;
+    Counter &busy;
+    Counter &rejected;
+    unsigned metricsPort;
+    std::unique_ptr<MetricsServer> metricsServer;
+
+    // Records the stages of traced requests, if tracePath is set.
+    std::string tracePath;
+    double traceSampleRate;
+    std::unique_ptr<Tracer> tracer;
+
+    // Rejects the requests for needles that do not exist. The filter is
+    // fetched from the stores by filterThread, and it is trusted for the IDs
+    // up to filterMaxId, the highest ID at the refresh before, lastMaxId.
+    std::chrono::seconds filterInterval;
+    std::mutex filterMtx;
+    std::condition_variable filterCv;
+    bool isFilterStopped;
+    std::thread filterThread;
+    std::shared_ptr<const NeedleFilter> idFilter;
+    uint64_t filterMaxId;
+    uint64_t lastMaxId;
+    uint64_t filterBits;  // The size of the next filter.
+    std::unique_ptr<MissCache> recentMisses;
+
+    // Accepts the connections and serves them on a pool of threads.
+    Listener listener;
 
     void HandleConnection(std::unique_ptr<TcpStream> conn);
-    void Get(std::unique_ptr<TcpStream> conn, const std::string &needleId);
-    void Remove(std::unique_ptr<TcpStream> conn, const std::string &needleId);
+    bool Get(
+        std::unique_ptr<TcpStream> conn,
+        const std::string &needleId,
+        const ByteRange *range,
+        uint64_t traceId);
+    bool Stat(
+        std::unique_ptr<TcpStream> conn,
+        const std::string &needleId,
+        uint64_t traceId);
+    bool Remove(std::unique_ptr<TcpStream> conn, const std::string &needleId);
+    bool IsMissing(const std::string &needleId);
+    void FilterLoop();
+    void RefreshFilter();
+    std::string AskStores(
+        const std::string &needleId,
+        const std::string &request,
+        const std::string &check,
+        TcpStream &storeConn,
+        bool &isMissing);
     redisContext* ConnectToRedis();
 
 public:
@@ -49,7 +131,34 @@ public:
         unsigned redisPort,
         const std::string &storeIpAddr,
         const std::string &storePort);
+    Cache(
+        const std::string &cacheIpAddr,
+        unsigned cachePort,
+        const std::string &redisIpAddr,
+        unsigned redisPort,
+        StoreMap storeMap);
 
-    // Listens for requests on a loop.
+    // Sets the port where metrics are served over HTTP, or 0 to disable them.
+    void ServeMetrics(unsigned port) noexcept { metricsPort = port; }
+
+    // Appends the spans of traced requests to a file, and traces the given
+    // fraction of the requests that arrive without a trace ID.
+    void
+    EnableTracing(const std::string &path, double sampleRate)
+    {
+        tracePath = path;
+        traceSampleRate = sampleRate;
+    }
+
+    // Sets how often the filter of needle IDs is fetched from the stores, and
+    // how long misses are remembered, where 0 disables either of them.
+    void FilterMisses(
+        std::chrono::seconds interval, std::chrono::seconds missTtl);
+
+    // Listens for requests until Stop is called.
     void Run();
+
+    // Makes Run stop accepting connections and return. It may be called from
+    // any thread, e.g., a signal handler's.
+    void Stop() { listener.Stop(); }
 };
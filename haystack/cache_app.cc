@@ -3,6 +3,7 @@
 #include <string>
 
 #include "cache.hh"
+#include "listener.hh"
 
 constexpr int kCacheIpAddr = 1;
 constexpr int kCachePort = 2;
@@ -10,17 +11,21 @@ constexpr int kRedisIpAddr = 3;
 constexpr int kRedisPort = 4;
 constexpr int kStoreIpAddr = 5;
 constexpr int kStorePort = 6;
+constexpr int kMetricsPort = 7;
+constexpr int kTraceFile = 8;
+constexpr int kTraceRate = 9;
 constexpr int kArgs = 7;
 
 int
 main(int argc, char *argv[])
 {
-    if (argc != kArgs) {
+    if (argc != kArgs and argc != kArgs+1 and argc != kArgs+3) {
         std::cerr << "Error: unexpected number of arguments\n";
         std::cerr << "Usage: ./" << argv[0]
                   << "<cacheIpAddrr> <cachePort> "
                   << "<redisIpAddr> <redisPort> "
-                  << "<storeIpAddr> <storePort>\n";
+                  << "<storeIpAddr[:port][,...]|storeMapFile> <storePort> "
+                  << "[metricsPort [traceFile traceSampleRate]]\n";
         exit(EXIT_FAILURE);
     }
     Cache cache(
@@ -30,6 +35,14 @@ main(int argc, char *argv[])
         std::stoi(argv[kRedisPort]),
         argv[kStoreIpAddr],
         argv[kStorePort]);
+    if (argc > kMetricsPort)
+        cache.ServeMetrics(std::stoi(argv[kMetricsPort]));
+    if (argc > kTraceRate)
+        cache.EnableTracing(argv[kTraceFile], std::stod(argv[kTraceRate]));
+
+    // Stop accepting requests on SIGINT or SIGTERM, and return once the
+    // requests being served are done, so that the destructors run.
+    SignalHandler signals([&cache] { cache.Stop(); });
     cache.Run();
-    exit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
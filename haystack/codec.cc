@@ -0,0 +1,169 @@
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#ifdef HS_HAVE_LZ4
+ #include <lz4.h>
+#endif
+#ifdef HS_HAVE_ZSTD
+ #include <zstd.h>
+#endif
+
+#include "codec.hh"
+
+namespace {
+
+// The Zstd level, its default one, which is a good balance for small blobs.
+constexpr int kZstdLevel = 3;
+
+} // namespace
+
+/**
+ * @param codec A codec.
+ * @return True if the codec can be used to compress and decompress needles,
+ *  i.e., it is Codec::None, or the Store was built with its library.
+ */
+bool
+IsCodecAvailable(Codec codec) noexcept
+{
+    switch (codec) {
+    case Codec::None:
+        return true;
+#ifdef HS_HAVE_LZ4
+    case Codec::Lz4:
+        return true;
+#endif
+#ifdef HS_HAVE_ZSTD
+    case Codec::Zstd:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+/**
+ * @param codec A codec.
+ * @return The name of the codec, as used in the configuration and the
+ *  protocol.
+ */
+const char*
+CodecName(Codec codec) noexcept
+{
+    switch (codec) {
+    case Codec::None:
+        return "none";
+    case Codec::Lz4:
+        return "lz4";
+    case Codec::Zstd:
+        return "zstd";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * @param name The name of a codec, see CodecName.
+ * @param codec Set to the codec.
+ * @return False if there is no codec with that name, true otherwise.
+ */
+bool
+ParseCodec(const std::string &name, Codec &codec) noexcept
+{
+    for (auto c : {Codec::None, Codec::Lz4, Codec::Zstd}) {
+        if (name == CodecName(c)) {
+            codec = c;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Compresses a buffer, if it pays off.
+ *
+ * @param codec The codec, which must be available.
+ * @param src The buffer with the data.
+ * @param size The number of bytes in the buffer.
+ * @param dst The buffer where the compressed data is written.
+ * @param capacity The size of the destination buffer, which is the largest
+ *  compressed size that is worth it.
+ * @return The size of the compressed data, or 0 if it does not fit in the
+ *  destination buffer, or the codec is not available.
+ */
+size_t
+Compress(
+    Codec codec,
+    const char *src,
+    size_t size,
+    char *dst,
+    size_t capacity) noexcept
+{
+    switch (codec) {
+#ifdef HS_HAVE_LZ4
+    case Codec::Lz4:
+        if (size > LZ4_MAX_INPUT_SIZE)
+            return 0;
+        return LZ4_compress_default(
+            src, dst, static_cast<int>(size), static_cast<int>(capacity));
+#endif
+#ifdef HS_HAVE_ZSTD
+    case Codec::Zstd: {
+        auto n = ZSTD_compress(dst, capacity, src, size, kZstdLevel);
+        return ZSTD_isError(n) ? 0 : n;
+    }
+#endif
+    default:
+        // Without the libraries, the buffers are left untouched.
+        static_cast<void>(src);
+        static_cast<void>(size);
+        static_cast<void>(dst);
+        static_cast<void>(capacity);
+        return 0;
+    }
+}
+
+/**
+ * Decompresses a buffer.
+ *
+ * @param codec The codec the data was compressed with.
+ * @param src The buffer with the compressed data.
+ * @param size The number of bytes in the buffer.
+ * @param dst The buffer where the data is written.
+ * @param rawSize The size of the data before it was compressed, which the
+ *  destination buffer must have room for.
+ * @return False if the data is corrupt, does not decompress to rawSize bytes,
+ *  or the codec is not available, true otherwise.
+ */
+bool
+Decompress(
+    Codec codec,
+    const char *src,
+    size_t size,
+    char *dst,
+    size_t rawSize) noexcept
+{
+    switch (codec) {
+#ifdef HS_HAVE_LZ4
+    case Codec::Lz4: {
+        if (size > LZ4_MAX_INPUT_SIZE or rawSize > LZ4_MAX_INPUT_SIZE)
+            return false;
+        auto n = LZ4_decompress_safe(
+            src, dst, static_cast<int>(size), static_cast<int>(rawSize));
+        return n >= 0 and static_cast<size_t>(n) == rawSize;
+    }
+#endif
+#ifdef HS_HAVE_ZSTD
+    case Codec::Zstd: {
+        auto n = ZSTD_decompress(dst, rawSize, src, size);
+        return not ZSTD_isError(n) and n == rawSize;
+    }
+#endif
+    default:
+        static_cast<void>(src);
+        static_cast<void>(size);
+        static_cast<void>(dst);
+        static_cast<void>(rawSize);
+        return false;
+    }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * The codecs that needle contents may be compressed with. The values are
+ * written to the needle headers, so they must never change.
+ *
+ * A codec is only available if the Store was built with its library, see
+ * HS_HAVE_LZ4 and HS_HAVE_ZSTD. LZ4 is the cheap one, and Zstd trades more CPU
+ * time for smaller needles.
+ */
+enum class Codec : uint8_t
+{
+    None = 0,
+    Lz4 = 1,
+    Zstd = 2
+};
+
+// Contents smaller than this are never compressed, as the savings would be
+// lost to the needle alignment.
+constexpr size_t kMinCompressSize = 256;
+
+// Contents are only stored compressed if that saves at least 1/kMinSavings of
+// their size, as otherwise every read would pay for little disk space.
+constexpr size_t kMinSavings = 8;
+
+bool IsCodecAvailable(Codec codec) noexcept;
+const char* CodecName(Codec codec) noexcept;
+bool ParseCodec(const std::string &name, Codec &codec) noexcept;
+
+size_t
+Compress(
+    Codec codec,
+    const char *src,
+    size_t size,
+    char *dst,
+    size_t capacity) noexcept;
+bool
+Decompress(
+    Codec codec,
+    const char *src,
+    size_t size,
+    char *dst,
+    size_t rawSize) noexcept;
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "bits.hh"
+#include "contenthash.hh"
+#include "crc32c.hh"
+
+// Define them here to avoid link errors
+constexpr size_t ContentHash::kStripeSize;
+
+namespace {
+
+// The XXH64 primes.
+constexpr uint64_t kPrime1 = 0x9e3779b185ebca87ull;
+constexpr uint64_t kPrime2 = 0xc2b2ae3d27d4eb4full;
+constexpr uint64_t kPrime3 = 0x165667b19e3779f9ull;
+constexpr uint64_t kPrime4 = 0x85ebca77c2b2ae63ull;
+constexpr uint64_t kPrime5 = 0x27d4eb2f165667c5ull;
+
+uint64_t
+Rotl(uint64_t x, int r) noexcept
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t
+Round(uint64_t acc, uint64_t input) noexcept
+{
+    acc += input * kPrime2;
+    return Rotl(acc, 31) * kPrime1;
+}
+
+uint64_t
+MergeRound(uint64_t acc, uint64_t lane) noexcept
+{
+    acc ^= Round(0, lane);
+    return acc * kPrime1 + kPrime4;
+}
+
+} // namespace
+
+/**
+ * Initializes the hash of an empty blob.
+ */
+ContentHash::ContentHash() noexcept
+    : lanes{kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1},
+      stripe(),
+      stripeSize(0),
+      size(0),
+      crc(0)
+{}
+
+/**
+ * Adds the next piece of the blob.
+ *
+ * @param data The bytes that follow the ones added so far.
+ * @param n The number of bytes.
+ */
+void
+ContentHash::Update(const char *data, size_t n) noexcept
+{
+    crc = Crc32c(data, n, crc);
+    size += n;
+
+    if (stripeSize) {
+        auto fill = std::min(n, kStripeSize - stripeSize);
+        std::memcpy(stripe + stripeSize, data, fill);
+        stripeSize += fill;
+        data += fill;
+        n -= fill;
+        if (stripeSize < kStripeSize)
+            return;
+        for (int i = 0; i < 4; ++i)
+            lanes[i] = Round(lanes[i], GetLe<uint64_t>(stripe + 8*i));
+        stripeSize = 0;
+    }
+    for (; n >= kStripeSize; data += kStripeSize, n -= kStripeSize) {
+        for (int i = 0; i < 4; ++i)
+            lanes[i] = Round(lanes[i], GetLe<uint64_t>(data + 8*i));
+    }
+    std::memcpy(stripe, data, n);
+    stripeSize = n;
+}
+
+/**
+ * @return The XXH64 hash, with a seed of 0, of the bytes added so far.
+ */
+uint64_t
+ContentHash::Xxh64() const noexcept
+{
+    uint64_t h;
+    if (size >= kStripeSize) {
+        h = Rotl(lanes[0], 1) + Rotl(lanes[1], 7) + Rotl(lanes[2], 12)
+            + Rotl(lanes[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = MergeRound(h, lanes[i]);
+    }
+    else
+        h = kPrime5;
+    h += size;
+
+    const char *p = stripe;
+    auto n = stripeSize;
+    for (; n >= 8; p += 8, n -= 8) {
+        h ^= Round(0, GetLe<uint64_t>(p));
+        h = Rotl(h, 27) * kPrime1 + kPrime4;
+    }
+    if (n >= 4) {
+        h ^= GetLe<uint32_t>(p) * kPrime1;
+        h = Rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+        n -= 4;
+    }
+    for (; n; ++p, --n) {
+        h ^= static_cast<unsigned char>(*p) * kPrime5;
+        h = Rotl(h, 11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * @return The content address as |<size>-<xxh64>-<crc32c>|, with both hashes
+ *  in fixed width hexadecimal.
+ */
+std::string
+ContentHash::ToString() const
+{
+    std::ostringstream oss;
+    oss << size << '-' << std::hex << std::setfill('0') << std::setw(16)
+        << Xxh64() << '-' << std::setw(8) << crc;
+    return oss.str();
+}
+
+/**
+ * @param data The buffer with the data.
+ * @param size The number of bytes in the buffer.
+ * @return The XXH64 hash of the data, with a seed of 0.
+ */
+uint64_t
+Xxh64(const char *data, size_t size) noexcept
+{
+    ContentHash hash;
+    hash.Update(data, size);
+    return hash.Xxh64();
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Computes the content address of a blob, which identifies identical uploads
+ * so that they can share a needle.
+ *
+ * The address combines the size of the blob, its XXH64 hash, and its CRC32C
+ * checksum, which together make an accidental collision between different
+ * blobs vanishingly unlikely. Neither is a cryptographic hash, so the address
+ * is only suitable where clients gain nothing from forging a collision. The
+ * blob can be fed in pieces as it arrives, with the same result as if it was
+ * fed at once.
+ */
+class ContentHash
+{
+public:
+    static constexpr size_t kStripeSize = 32;
+
+private:
+    uint64_t lanes[4];
+    char stripe[kStripeSize];  // The bytes that do not fill a stripe yet.
+    size_t stripeSize;
+    uint64_t size;
+    uint32_t crc;
+
+public:
+    ContentHash() noexcept;
+
+    void Update(const char *data, size_t size) noexcept;
+    uint64_t Xxh64() const noexcept;
+    uint32_t Crc() const noexcept { return crc; }
+    uint64_t Size() const noexcept { return size; }
+    std::string ToString() const;
+};
+
+uint64_t
+Xxh64(const char *data, size_t size) noexcept;
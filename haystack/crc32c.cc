@@ -0,0 +1,90 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.hh"
+
+namespace {
+
+// The reflected CRC32C polynomial.
+constexpr uint32_t kPoly = 0x82f63b78;
+
+// Lookup table for the software implementation, one entry per byte value.
+struct Crc32cTable
+{
+    uint32_t entries[256];
+
+    Crc32cTable() noexcept
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j)
+                crc = (crc >> 1) ^ (kPoly & (0 - (crc & 1)));
+            entries[i] = crc;
+        }
+    }
+};
+
+const Crc32cTable kTable;
+
+uint32_t
+Crc32cSw(const char *data, size_t size, uint32_t crc) noexcept
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    while (size--)
+        crc = kTable.entries[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t
+Crc32cHw(const char *data, size_t size, uint32_t crc) noexcept
+{
+    uint64_t crc64 = crc;
+    while (size >= sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        data += sizeof(word);
+        size -= sizeof(word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (size--)
+        crc = _mm_crc32_u8(crc, static_cast<unsigned char>(*data++));
+    return crc;
+}
+
+bool
+HasSse42() noexcept
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+#else
+uint32_t
+Crc32cHw(const char *data, size_t size, uint32_t crc) noexcept
+{
+    return Crc32cSw(data, size, crc);
+}
+
+bool
+HasSse42() noexcept
+{
+    return false;
+}
+#endif
+
+} // namespace
+
+uint32_t
+Crc32c(const char *data, size_t size, uint32_t crc) noexcept
+{
+    static const bool hasHw = HasSse42();
+    crc = ~crc;
+    crc = hasHw ? Crc32cHw(data, size, crc) : Crc32cSw(data, size, crc);
+    return ~crc;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Computes the CRC32C (Castagnoli) checksum of a buffer.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU supports it, and falls back
+ * to a table driven implementation otherwise. Both produce the same result.
+ *
+ * @param data The buffer with the data.
+ * @param size The number of bytes in the buffer.
+ * @param crc The checksum of any preceding data, which allows the checksum of
+ *  a large blob to be computed incrementally.
+ * @return The checksum of the data.
+ */
+uint32_t
+Crc32c(const char *data, size_t size, uint32_t crc = 0) noexcept;
@@ -3,23 +3,30 @@
 #include <string>
 
 #include "directory.hh"
+#include "listener.hh"
 
 constexpr int kDirIpAddr = 1;
 constexpr int kDirPort = 2;
 constexpr int kMongoUri = 3;
 constexpr int kStoreIpAddr = 4;
 constexpr int kStorePort = 5;
+constexpr int kMetricsPort = 6;
+constexpr int kTraceFile = 7;
+constexpr int kTraceRate = 8;
+constexpr int kDedup = 9;
 constexpr int kArgs = 6;
 
 int
 main(int argc, char *argv[])
 {
-    if (argc != kArgs) {
+    if (argc != kArgs and argc != kArgs+1 and argc != kArgs+3
+        and argc != kArgs+4) {
         std::cerr << "Error: unexpected number of arguments\n";
         std::cerr << "Usage: ./" << argv[0]
                   << "<dirIpAddrr> <dirPort> "
                   << "<mongoUri> "
-                  << "<storeIpAddr> <storePort>\n";
+                  << "<storeIpAddr[:port][,...]|storeMapFile> <storePort> "
+                  << "[metricsPort [traceFile traceSampleRate [dedup]]]\n";
         exit(EXIT_FAILURE);
     }
     Directory dir(
@@ -28,6 +35,16 @@ main(int argc, char *argv[])
         argv[kMongoUri],
         argv[kStoreIpAddr],
         argv[kStorePort]);
+    if (argc > kMetricsPort)
+        dir.ServeMetrics(std::stoi(argv[kMetricsPort]));
+    if (argc > kTraceRate)
+        dir.EnableTracing(argv[kTraceFile], std::stod(argv[kTraceRate]));
+    if (argc > kDedup)
+        dir.EnableDedup(std::string(argv[kDedup]) == "dedup");
+
+    // Stop accepting requests on SIGINT or SIGTERM, and return once the
+    // requests being served are done, so that the destructors run.
+    SignalHandler signals([&dir] { dir.Stop(); });
     dir.Run();
-    exit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
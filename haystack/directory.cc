@@ -1,78 +1,275 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <iostream>
 #include <memory>
+#include <random>
 #include <sstream>
-#include <thread>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
+#include <bsoncxx/oid.hpp>
+#include <bsoncxx/string/to_string.hpp>
+#include <bsoncxx/types.hpp>
 #include <mongocxx/client.hpp>
 #include <mongocxx/exception/exception.hpp>
+#include <mongocxx/options/find.hpp>
+#include <mongocxx/options/find_one_and_update.hpp>
 
+#include "contenthash.hh"
 #include "directory.hh"
 
 // Define here to avoid link errors
 constexpr char const *Directory::kDbName;
 constexpr char const *Directory::kDbCollectionName;
-constexpr unsigned Directory::kVolumes;
+constexpr char const *Directory::kDbBlobCollectionName;
 constexpr uint64_t Directory::kMaxFileSize;
+constexpr size_t Directory::kMaxBulkNeedles;
+constexpr uint64_t Directory::kMaxBulkSize;
+constexpr uint64_t Directory::kRecvChunkSize;
+
+namespace {
+
+/**
+ * @return A random, nonzero cookie for a new needle. Needles with no cookie
+ *  can be read with their bare ID by legacy clients.
+ */
+uint32_t
+NewCookie()
+{
+    thread_local std::mt19937 gen{std::random_device{}()};
+    std::uniform_int_distribution<uint32_t> dist(1, UINT32_MAX);
+    return dist(gen);
+}
+
+/**
+ * Makes the handle of a needle from its database record.
+ *
+ * @param doc The record of the needle.
+ * @param handle Set to the handle of the needle. The cookie is 0 if the needle
+ *  was recorded before cookies were issued.
+ */
+void
+RecordedHandle(const bsoncxx::document::view &doc, NeedleHandle &handle)
+{
+    handle.needleId = doc["needleId"].get_int64().value;
+    handle.volumeId = doc["haystackId"].get_int32().value;
+    auto cookie = doc["cookie"];
+    handle.cookie = cookie and cookie.type() == bsoncxx::type::k_int64
+        ? cookie.get_int64().value : 0;
+}
+
+/**
+ * Parses the needle named in a delete request.
+ *
+ * @param token The handle of the needle, or its ID if it has no cookie.
+ * @param handle Set to the handle, with a zero cookie and volume for an ID.
+ * @return False if the token is neither, true otherwise.
+ */
+bool
+ParseRequestHandle(const std::string &token, NeedleHandle &handle)
+{
+    handle = NeedleHandle{0, 0, 0};
+    if (NeedleHandle::Parse(token, handle))
+        return true;
+    if (token.empty()
+        or token.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+    handle.needleId = std::stoull(token);
+    return true;
+}
+
+/**
+ * Makes the database record of a needle.
+ *
+ * @param handle The handle of the needle.
+ * @param shard The shard of the needle.
+ * @param stores The replicas that stored the needle, see JoinStores.
+ * @param content The content address of the needle, or an empty string if
+ *  uploads are not deduplicated.
+ * @param refs The number of uploads that share the needle, for its record in
+ *  the blob collection, or 0 for the record of an upload.
+ * @return The record.
+ */
+bsoncxx::document::value
+NeedleRecord(
+    const NeedleHandle &handle,
+    const std::string &shard,
+    const std::string &stores,
+    const std::string &content,
+    int64_t refs = 0)
+{
+    bsoncxx::builder::stream::document doc;
+    doc << "needleId" << static_cast<int64_t>(handle.needleId)
+        << "haystackId" << static_cast<int>(handle.volumeId)
+        << "cookie" << static_cast<int64_t>(handle.cookie)
+        << "shard" << shard
+        << "stores" << stores;
+    if (not content.empty())
+        doc << "content" << content;
+    if (refs)
+        doc << "refs" << refs;
+    return doc.extract();
+}
+
+/**
+ * @param stores Store addresses.
+ * @return The addresses as a comma separated list.
+ */
+std::string
+JoinStores(const std::vector<StoreAddress> &stores)
+{
+    std::string list;
+    for (auto &store : stores)
+        list += (list.empty() ? "" : ",") + store.ToString();
+    return list;
+}
+
+/**
+ * @param doc A database record.
+ * @param key The key of a string field.
+ * @return The value of the field, or an empty string if the record does not
+ *  have it.
+ */
+std::string
+RecordedString(const bsoncxx::document::view &doc, const char *key)
+{
+    auto field = doc[key];
+    if (not field or field.type() != bsoncxx::type::k_utf8)
+        return "";
+    return bsoncxx::string::to_string(field.get_utf8().value);
+}
+
+} // namespace
 
 /**
  * Initializes a Directory with the address where it will listen for
  * connections, the address of the MongoDB it uses to store needle information,
- * and the address of the Store where needles are stored.
+ * and the addresses of the Stores where needles are stored.
  *
  * @param dirIpAddr The address where it listens for requests.
  * @param dirPort The port number where it listens for requests.
  * @param mongoUri The URI to connect to the MongoDB.
- * @param storeIpAddr The Store's IP address.
- * @param storePort The Store's port number.
+ * @param storeIpAddr The Store's IP address, a comma separated list of
+ *  |<ipAddr>[:<port>]| of Stores that hold replicas of the same volumes, or
+ *  the name of a store map file.
+ * @param storePort The Stores' port number, unless the list has their port.
+ */
+Directory::Directory(
+    const std::string &dirIpAddr,
+    unsigned dirPort,
+    const std::string &mongoUri,
+    const std::string &storeIpAddr,
+    const std::string &storePort)
+    : Directory(
+          dirIpAddr,
+          dirPort,
+          mongoUri,
+          StoreMap::FromArgs(storeIpAddr, storePort))
+{}
+
+/**
+ * Initializes a Directory with the address where it will listen for
+ * connections, the address of the MongoDB it uses to store needle information,
+ * and the shards of Stores where needles are stored.
+ *
+ * @param dirIpAddr The address where it listens for requests.
+ * @param dirPort The port number where it listens for requests.
+ * @param mongoUri The URI to connect to the MongoDB.
+ * @param storeMap The shards of Stores, which must match the Cache's.
  *
  * @details In additiona to initializing the paremters listed above, the
  *  constructor also initializes two atomic counters used to determine the ID for
  *  a new needle and volume where it should be stored, and a MongoDB instance
- *  that needs to be created before creating MongoDB clients.
+ *  that needs to be created before creating MongoDB clients. The set of volumes
+ *  of a shard is learned from its stores when the first needle is uploaded to
+ *  it.
  */
 Directory::Directory(
     const std::string &dirIpAddr,
     unsigned dirPort,
     const std::string &mongoUri,
-    const std::string &storeIpAddr,
-    const std::string &storePort)
+    StoreMap storeMap)
     : dirIpAddr(dirIpAddr),
       dirPort(dirPort),
       mongoUri(mongoUri),
-      storeIpAddr(storeIpAddr),
-      storePort(storePort),
+      storeMap(std::move(storeMap)),
       volumeCounter(0),
       idCounter(0),
-      mongoInstance()
+      volumeMtx(),
+      volumes(),
+      isDedup(false),
+      mongoInstance(),
+      metrics(),
+      commandMetrics(
+          metrics, "haystack_directory",
+          {"upload", "bulkupload", "list", "delete", "bulkdelete"}),
+      dbErrors(metrics.AddCounter(
+          "haystack_directory_db_errors_total", "Failed MongoDB requests.")),
+      busy(metrics.AddCounter(
+          "haystack_directory_busy_total",
+          "Connections refused because all the threads were busy.")),
+      dedupHits(metrics.AddCounter(
+          "haystack_directory_dedup_hits_total",
+          "Uploads that share the needle of an identical upload.")),
+      metricsPort(0),
+      metricsServer(),
+      tracePath(),
+      traceSampleRate(0),
+      tracer(),
+      listener(
+          std::chrono::seconds(Listener::kTimeout),
+          busy,
+          [this](std::unique_ptr<TcpStream> conn) {
+              HandleConnection(std::move(conn));
+          })
 {}
 
 /**
- * Listens for requests in a loop, and launches a thread to handle each
- * connection.
+ * Listens for requests and serves them on a pool of threads until Stop is
+ * called, and then waits for the requests being served, and for the writes
+ * still being sent to the slowest replicas. Needle IDs continue from the
+ * largest one in the database.
  */
 void
 Directory::Run()
 {
-    using namespace boost::asio;
-    io_service io_service;
-    ip::tcp::acceptor acceptor(
-        io_service,
-        ip::tcp::endpoint(ip::address::from_string(dirIpAddr), dirPort));
+    if (metricsPort) {
+        metricsServer.reset(
+            new MetricsServer(metrics, dirIpAddr, metricsPort));
+    }
+    if (not tracePath.empty())
+        tracer.reset(new Tracer("directory", tracePath, traceSampleRate));
+    LoadIdCounter();
 
-    for (;;) {
-        try {
-            std::unique_ptr<TcpStream> conn(new TcpStream);
-            acceptor.accept(*conn->rdbuf());
-            std::thread thr(
-                &Directory::HandleConnection, this, std::move(conn));
-            thr.detach();
-        }
-        catch (std::exception& err) {
-            std::cerr << "ERROR: " << err.what() << std::endl;
-        }
+    listener.Run(dirIpAddr, dirPort);
+    for (auto &shard : storeMap.Shards())
+        shard.replicas->Wait();
+}
+
+/**
+ * Starts the needle IDs after the largest one in the database, so that a
+ * restarted Directory does not hand out IDs that are already in use.
+ */
+void
+Directory::LoadIdCounter()
+{
+    try {
+        mongocxx::client mongoConn{mongocxx::uri{mongoUri}};
+        auto coll = mongoConn[kDbName][kDbCollectionName];
+        bsoncxx::builder::stream::document sort;
+        sort << "needleId" << -1;
+        mongocxx::options::find opts;
+        opts.sort(sort.view());
+        auto doc = coll.find_one({}, opts);
+        if (doc)
+            idCounter = doc->view()["needleId"].get_int64().value + 1;
+    }
+    catch (mongocxx::exception &err) {
+        std::cerr << "mongoerr " << err.what() << std::endl;
+        dbErrors.Inc();
     }
 }
 
@@ -80,41 +277,81 @@ Directory::Run()
  * Handles a connection request.
  *
  * @param conn A pointer to a TCP stream.
- * @details Responds to two commands: upload, and list:
+ * @details Responds to five commands: upload, bulkupload, list, delete, and
+ *  bulkdelete:
  *  - upload: |upload <size>|
  *    This uploads a new object to the store. <size> specifies the number of
  *    bytes in the object. The command terminates with a new line, and the
  *    message is expected to follow the new line. Directory will obtain an ID
- *    for the object, and will decide in which volume of the Store to save the
- *    needle. If the command success, it replies with ok or err if there is an
- *    error.
+ *    and a cookie for the object, and will decide in which volume of the Store
+ *    to save the needle. If the command success, it replies with
+ *    |ok <handle>|, see NeedleHandle, or err if there is an error. With
+ *    deduplication enabled, identical uploads get the same handle.
+ *  - bulkupload: |bulkupload <count>|
+ *    Uploads many objects at once. The command is followed by count frames of
+ *    |<size><newline><object...>|. It replies with |ok <count>| followed by
+ *    one line per object, in order, with its handle, or with an err message
+ *    if it could not be uploaded.
  *  - list: |list|
- *    Replies with |ok<new line><list of IDs>|, where list of IDs is a JSON
- *    list.
+ *    Replies with |ok<new line><list of handles>|, where the list is newline
+ *    separated. Needles uploaded before handles were issued are listed by ID.
+ *  - delete: |delete <handle>|
+ *    Deletes the needle. A bare needle ID is only accepted for the needles
+ *    that have no cookie.
+ *  - bulkdelete: |bulkdelete <count>|
+ *    Deletes many needles at once. The command is followed by count lines
+ *    with a handle each. It replies with |ok <count>| followed by one line
+ *    per needle, in order, with ok, or with an err message if it could not be
+ *    deleted.
+ *  Every command takes an optional |trace=<traceId>| at the end of the line,
+ *  which is forwarded to the store, see Tracer.
  */
 void
 Directory::HandleConnection(std::unique_ptr<TcpStream> conn)
 {
+    auto start = CommandMetrics::Clock::now();
+    std::string line, command;
+    bool isOk = false;
     try {
         conn->exceptions(std::ios::badbit);
-        std::string line, command;
         std::getline(*conn, line);
         std::istringstream iss(line);
         iss.exceptions(std::ios::badbit);
 
         iss >> command;
 
-        if (command == "list")
-            List(std::move(conn));
+        if (command == "list") {
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "dir.list");
+            isOk = List(std::move(conn));
+        }
         else if (command == "upload") {
             uint64_t size;
             iss >> size;
-            Upload(std::move(conn), size);
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "dir.upload");
+            isOk = Upload(std::move(conn), size, traceId);
+        }
+        else if (command == "bulkupload") {
+            size_t count = 0;
+            iss >> count;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "dir.bulkupload");
+            isOk = BulkUpload(std::move(conn), count, traceId);
         }
         else if (command == "delete") {
-            uint64_t needleId;
-            iss >> needleId;
-            Remove(std::move(conn), needleId);
+            std::string token;
+            iss >> token;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "dir.delete");
+            isOk = Remove(std::move(conn), token, traceId);
+        }
+        else if (command == "bulkdelete") {
+            size_t count = 0;
+            iss >> count;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "dir.bulkdelete");
+            isOk = BulkRemove(std::move(conn), count, traceId);
         }
         else {
             *conn << "err BadCommand\n";
@@ -124,17 +361,19 @@ Directory::HandleConnection(std::unique_ptr<TcpStream> conn)
     catch (std::exception) {
         // Prevent exception form terminating thread
     }
+    commandMetrics.Record(command, isOk, start);
 }
 
 /**
  * Handles a list request.
  *
  * @param conn The pointer to a TCP stream.
- * @details Fetches the list of IDs from the MongoDB and forwards them to the
- *  client on the TCP stream. The list of IDs is sent back is a new line
- *  separated.
+ * @details Fetches the list of needles from the MongoDB and forwards their
+ *  handles to the client on the TCP stream, or their IDs if they have no
+ *  cookie. The list is sent back new line separated.
+ * @return True if the list is sent back, false otherwise.
  */
-void
+bool
 Directory::List(std::unique_ptr<TcpStream> conn)
 {
     try {
@@ -143,30 +382,38 @@ Directory::List(std::unique_ptr<TcpStream> conn)
         auto coll = mongoConn[kDbName][kDbCollectionName];
         auto cursor = coll.find({});
 
-        // Create list of newline separated IDs
+        // Create list of newline separated handles
         std::string msg;
         auto docFirst = cursor.begin();
         auto docLast = cursor.end();
         while (docFirst != docLast) {
-            auto el = (*docFirst)["needleId"];
-            msg += std::to_string(el.get_int64().value) + '\n';
+            NeedleHandle handle;
+            RecordedHandle(*docFirst, handle);
+            if (handle.cookie)
+                msg += handle.ToString() + '\n';
+            else
+                msg += std::to_string(handle.needleId) + '\n';
             ++docFirst;
         }
 
         // Respond to the client
         *conn << "ok " << msg.size() << '\n' << msg;
         conn->flush();
+        return true;
     }
     catch (mongocxx::exception &err) {
         std::cerr << "mongoerr " << err.what() << std::endl;
+        dbErrors.Inc();
         *conn << "err DbErr\n";
         conn->flush();
+        return false;
     }
     catch (std::exception &err) {
         std::cerr << "Error: " << err.what() << std::endl;
-        if (not *conn) return;
+        if (not *conn) return false;
         *conn << "err Unknown\n";
         conn->flush();
+        return false;
     }
 }
 
@@ -175,103 +422,730 @@ Directory::List(std::unique_ptr<TcpStream> conn)
  *
  * @param conn A pointer to TCP stream for the connection.
  * @param size The size of the object to store in the Store.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
  * @details Does the following:
- *  - Creates an ID for the needle
- *  - Selects the volume for the needle
- *  - Stores the object in the Store.
- *  - Saves the needle ID and volume info in the database.
+ *  - Creates an ID and a random cookie for the needle
+ *  - Selects a volume for the needle in the shard that owns the ID
+ *  - Stores the object in the replicas of the volume. If the volume is full,
+ *    or the stores do not know about it, then the list of volumes is refreshed
+ *    and the upload is retried once with another needle ID, as some replicas
+ *    may already have the first one, and another volume.
+ *  - Saves the needle ID, the volume, the cookie, the shard, and the replicas
+ *    that stored the needle in the database, and replies with the handle.
+ *  With deduplication enabled, the object is hashed while it is received, and
+ *  if a needle with the same contents is recorded, its reference count is
+ *  incremented, and its handle is recorded and sent back instead, without
+ *  writing to the stores. The reference is dropped again if the handle cannot
+ *  be recorded. Otherwise the new needle is recorded with one
+ *  reference. Concurrent uploads of the same contents may still write one
+ *  needle each, which only costs space.
+ * @return True if the needle is uploaded, false otherwise.
  */
-void
-Directory::Upload(std::unique_ptr<TcpStream> conn, uint64_t size)
+bool
+Directory::Upload(
+    std::unique_ptr<TcpStream> conn, uint64_t size, uint64_t traceId)
 {
-    char buf[size];
+    if (size > kMaxFileSize) {
+        *conn << "err TooManyBytes\n";
+        conn->flush();
+        return false;
+    }
 
     try {
-        conn->read(buf, size);
+        TraceSpan recv(tracer.get(), traceId, "dir.recv");
+        BufferPool::Buffer buf;
+        std::string content;
+        Receive(*conn, size, buf, content);
+        recv.End();
+
+        NeedleHandle handle{0, 0, NewCookie()};
+        mongocxx::client mongoConn{mongocxx::uri{mongoUri}};
+        auto db = mongoConn[kDbName];
+        auto coll = db[kDbCollectionName];
+        if (isDedup) {
+            TraceSpan lookup(tracer.get(), traceId, "dir.mongo_dedup");
+            std::string shardName, stores;
+            if (ShareBlob(db, content, handle, shardName, stores)) {
+                lookup.End();
+                auto record = NeedleRecord(handle, shardName, stores, content);
+                try {
+                    coll.insert_one(record.view());
+                }
+                catch (mongocxx::exception&) {
+                    // The upload is not recorded, so give back the reference
+                    // it took to the needle it shares.
+                    ReleaseBlob(db, content, handle.needleId);
+                    throw;
+                }
+                dedupHits.Inc();
+                *conn << "ok " << handle.ToString() << '\n';
+                conn->flush();
+                return true;
+            }
+        }
 
-        // Get IDs
-        auto haystackId = volumeCounter++ % kVolumes;
-        auto needleId = idCounter++;
+        const StoreMap::Shard *shard = nullptr;
+        std::vector<StoreAddress> acked;
 
-        // Save object in store
-        TcpStream storeConn(storeIpAddr, storePort);
-        storeConn << "put " << haystackId << ' '
-                  << needleId << ' ' << size << '\n';
-        storeConn.write(buf, size);
+        // Save object in the stores
+        TraceSpan put(tracer.get(), traceId, "dir.store_put");
         std::string storeResponse;
-        std::getline(storeConn, storeResponse);
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            // The next ID may belong to a shard that still has room.
+            handle.needleId = idCounter++;
+            shard = &storeMap.Owner(handle.needleId);
+            if (not PickVolume(*shard, handle.volumeId)) {
+                storeResponse = "err NoVolume";
+                continue;
+            }
+            storeResponse = shard->replicas->Put(
+                handle, buf.Data(), size, traceId, acked);
+            if (storeResponse != "err NoFit"
+                and storeResponse != "err BadHaystackId")
+                break;
+            RefreshVolumes(*shard);
+        }
+        put.End();
         if (storeResponse.find("err") != std::string::npos) {
             *conn << storeResponse << '\n';
             conn->flush();
-            return;
+            return false;
+        }
+
+        // Save the handle, the shard and the replicas in MongoDB
+        TraceSpan insert(tracer.get(), traceId, "dir.mongo_insert");
+        auto stores = JoinStores(acked);
+        if (isDedup) {
+            db[kDbBlobCollectionName].insert_one(
+                NeedleRecord(handle, shard->name, stores, content, 1).view());
+        }
+        coll.insert_one(
+            NeedleRecord(handle, shard->name, stores, content).view());
+        insert.End();
+
+        // Respond to client
+        *conn << "ok " << handle.ToString() << '\n';
+        conn->flush();
+        return true;
+    }
+    catch (mongocxx::exception &err) {
+        std::cerr << "ERR MONGO: " << err.what() << std::endl;
+        dbErrors.Inc();
+        *conn << "err DbErr\n";
+        conn->flush();
+        return false;
+    }
+    catch (std::exception &err) {
+        std::cerr << "ERR: " << err.what() << std::endl;
+        if (not *conn) return false;
+        *conn << "err Unknown\n";
+        conn->flush();
+        return false;
+    }
+}
+
+/**
+ * Uploads many objects to the Stores at once.
+ *
+ * @param conn A pointer to TCP stream for the connection.
+ * @param count The number of objects that follow.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @details Does what Upload does for every object, but in bulk:
+ *  - The IDs of the objects are allocated in one block, and the objects are
+ *    grouped by the shard that owns their ID.
+ *  - Every group is written to a single volume of its shard with one multiput
+ *    to each replica, which the Stores append together. A group that fails is
+ *    retried once with new IDs and another volume, like an upload.
+ *  - The records of all the objects that were stored are saved in the database
+ *    with a single insert.
+ *  With deduplication enabled, the objects that match a recorded needle share
+ *  it, as uploads do, and identical objects in the request share the needle
+ *  of the first one. If the records cannot be saved, the references taken to
+ *  shared needles are dropped again.
+ * @return True if the objects are received, false otherwise. Objects that
+ *  cannot be stored are reported in the reply.
+ */
+bool
+Directory::BulkUpload(
+    std::unique_ptr<TcpStream> conn, size_t count, uint64_t traceId)
+{
+    if (count > kMaxBulkNeedles) {
+        *conn << "err TooManyNeedles\n";
+        conn->flush();
+        return false;
+    }
+
+    try {
+        TraceSpan recv(tracer.get(), traceId, "dir.recv");
+        std::vector<BufferPool::Buffer> bufs(count);
+        std::vector<std::string> contents(count);
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            std::string line;
+            uint64_t size = 0;
+            std::getline(*conn, line);
+            if (not (std::istringstream(line) >> size)) {
+                *conn << "err BadFrame\n";
+                conn->flush();
+                return false;
+            }
+            if (size > kMaxFileSize or (total += size) > kMaxBulkSize) {
+                *conn << "err TooManyBytes\n";
+                conn->flush();
+                return false;
+            }
+            Receive(*conn, size, bufs[i], contents[i]);
+        }
+        recv.End();
+
+        // Identical objects are stored once, by the first of them, which takes
+        // a reference to the needle for every copy
+        std::vector<size_t> leaders(count);
+        std::vector<int64_t> copies(count, 0);
+        std::map<std::string, size_t> firsts;
+        for (size_t i = 0; i < count; ++i) {
+            leaders[i] = i;
+            if (isDedup)
+                leaders[i] = firsts.emplace(contents[i], i).first->second;
+            ++copies[leaders[i]];
         }
 
-        // Save needleId and haystackId in MongoDB
         mongocxx::client mongoConn{mongocxx::uri{mongoUri}};
-        bsoncxx::builder::stream::document doc;
-        doc << "needleId" << static_cast<int64_t>(needleId)
-            << "haystackId" << static_cast<int>(haystackId);
-        auto coll = mongoConn[kDbName][kDbCollectionName];
-        coll.insert_one(doc.view());
+        auto db = mongoConn[kDbName];
+        std::vector<NeedleHandle> handles(count);
+        std::vector<std::string> shards(count), stores(count), replies(count);
+        std::vector<bool> isShared(count);
+        if (isDedup) {
+            TraceSpan lookup(tracer.get(), traceId, "dir.mongo_dedup");
+            for (size_t i = 0; i < count; ++i) {
+                if (leaders[i] != i)
+                    continue;
+                isShared[i] = ShareBlob(
+                    db, contents[i], handles[i], shards[i], stores[i],
+                    copies[i]);
+                dedupHits.Inc(isShared[i] ? copies[i] : copies[i] - 1);
+            }
+        }
+
+        // Allocate the IDs of the new needles in one block, and group them by
+        // the shard that owns them
+        std::map<const StoreMap::Shard*, std::vector<size_t>> groups;
+        uint64_t fresh = 0;
+        for (size_t i = 0; i < count; ++i)
+            fresh += leaders[i] == i and not isShared[i];
+        uint64_t needleId = idCounter.fetch_add(fresh);
+        for (size_t i = 0; i < count; ++i) {
+            if (leaders[i] != i or isShared[i])
+                continue;
+            handles[i] = NeedleHandle{0, needleId++, NewCookie()};
+            groups[&storeMap.Owner(handles[i].needleId)].push_back(i);
+        }
+
+        // Save every group in a volume of its shard
+        TraceSpan put(tracer.get(), traceId, "dir.store_put");
+        for (auto &group : groups) {
+            auto &shard = *group.first;
+            auto &members = group.second;
+            std::string storeResponse;
+            std::vector<StoreAddress> acked;
+            for (int attempt = 0; attempt < 2; ++attempt) {
+                if (attempt) {
+                    // Some replicas may already have the first IDs.
+                    needleId = idCounter.fetch_add(members.size());
+                    for (auto i : members)
+                        handles[i].needleId = needleId++;
+                }
+                uint64_t volumeId;
+                if (not PickVolume(shard, volumeId)) {
+                    storeResponse = "err NoVolume";
+                    continue;
+                }
+                std::vector<NeedleUpload> uploads;
+                for (auto i : members) {
+                    handles[i].volumeId = volumeId;
+                    uploads.push_back(
+                        {handles[i], bufs[i].Data(), bufs[i].Size()});
+                }
+                storeResponse = shard.replicas->PutGroup(
+                    uploads, traceId, acked);
+                if (storeResponse != "err NoFit"
+                    and storeResponse != "err BadHaystackId")
+                    break;
+                RefreshVolumes(shard);
+            }
+            auto isStored = storeResponse.find("err") == std::string::npos;
+            for (auto i : members) {
+                shards[i] = shard.name;
+                stores[i] = JoinStores(acked);
+                if (not isStored)
+                    replies[i] = storeResponse;
+            }
+        }
+        put.End();
+        for (size_t i = 0; i < count; ++i) {
+            auto first = leaders[i];
+            if (first == i)
+                continue;
+            handles[i] = handles[first];
+            shards[i] = shards[first];
+            stores[i] = stores[first];
+            replies[i] = replies[first];
+        }
+
+        // Save the records of the stored objects in MongoDB
+        TraceSpan insert(tracer.get(), traceId, "dir.mongo_insert");
+        std::vector<bsoncxx::document::value> records, blobs;
+        for (size_t i = 0; i < count; ++i) {
+            if (not replies[i].empty())
+                continue;
+            records.push_back(
+                NeedleRecord(handles[i], shards[i], stores[i], contents[i]));
+            if (isDedup and leaders[i] == i and not isShared[i]) {
+                blobs.push_back(NeedleRecord(
+                    handles[i], shards[i], stores[i], contents[i],
+                    copies[i]));
+            }
+        }
+        try {
+            if (not blobs.empty())
+                db[kDbBlobCollectionName].insert_many(blobs);
+            if (not records.empty())
+                db[kDbCollectionName].insert_many(records);
+        }
+        catch (mongocxx::exception&) {
+            // The uploads are not recorded, so give back the references they
+            // took to the needles they share, or that they stored.
+            for (size_t i = 0; i < count; ++i) {
+                if (isDedup and leaders[i] == i and replies[i].empty()) {
+                    ReleaseBlob(
+                        db, contents[i], handles[i].needleId, copies[i]);
+                }
+            }
+            throw;
+        }
+        insert.End();
 
         // Respond to client
-        *conn << "ok " << needleId << '\n';
+        std::string msg;
+        for (size_t i = 0; i < count; ++i)
+            msg += (replies[i].empty() ? handles[i].ToString() : replies[i])
+                + '\n';
+        *conn << "ok " << count << '\n' << msg;
         conn->flush();
+        return true;
     }
     catch (mongocxx::exception &err) {
         std::cerr << "ERR MONGO: " << err.what() << std::endl;
+        dbErrors.Inc();
         *conn << "err DbErr\n";
         conn->flush();
+        return false;
     }
     catch (std::exception &err) {
         std::cerr << "ERR: " << err.what() << std::endl;
-        if (not *conn) return;
+        if (not *conn) return false;
         *conn << "err Unknown\n";
         conn->flush();
+        return false;
     }
 }
 
 /**
- * Deletes a needle from the directory and the store.
+ * Deletes a needle from the directory and the replicas.
  *
  * @param conn A pointer to TCP stream for the connection.
- * @param needleId The needle ID.
+ * @param token The handle of the needle, or its ID if it has no cookie.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @return True if the needle is deleted, false otherwise.
+ * @details The needle is deleted from the shard recorded in the database, or
+ *  the shard that owns the ID if none is recorded. A needle that is not in the
+ *  database, or whose handle does not match the recorded one, is rejected with
+ *  |err BadNeedle|. A needle shared by identical uploads is only deleted from
+ *  the stores with its last reference, and only the record of one upload is
+ *  deleted otherwise.
  */
-void
-Directory::Remove(std::unique_ptr<TcpStream> conn, uint64_t needleId)
+bool
+Directory::Remove(
+    std::unique_ptr<TcpStream> conn,
+    const std::string &token,
+    uint64_t traceId)
 {
     try {
-        // Delete needle from store
-        TcpStream storeConn(storeIpAddr, storePort);
-        storeConn << "delete " << needleId << '\n';
-        std::string storeResponse;
-        std::getline(storeConn, storeResponse);
+        NeedleHandle request;
+        if (not ParseRequestHandle(token, request)) {
+            *conn << "err BadNeedle\n";
+            conn->flush();
+            return false;
+        }
+
+        mongocxx::client mongoConn{mongocxx::uri{mongoUri}};
+        bsoncxx::builder::stream::document doc;
+        doc << "needleId" << static_cast<int64_t>(request.needleId);
+        auto db = mongoConn[kDbName];
+        auto coll = db[kDbCollectionName];
+        auto found = coll.find_one(doc.view());
+        NeedleHandle handle;
+        if (found)
+            RecordedHandle(found->view(), handle);
+        if (not found or handle.cookie != request.cookie
+            or (request.cookie and handle.volumeId != request.volumeId)) {
+            *conn << "err BadNeedle\n";
+            conn->flush();
+            return false;
+        }
+
+        // Drop a reference to a shared needle, which stays in the stores
+        // while other uploads refer to it
+        auto content = RecordedString(found->view(), "content");
+        if (not content.empty()
+            and not ReleaseBlob(db, content, handle.needleId)) {
+            auto dbResult = coll.delete_one(doc.view());
+            *conn << (dbResult ? "ok\n" : "err DbErr\n");
+            conn->flush();
+            return bool(dbResult);
+        }
+
+        // Delete needle from the stores
+        TraceSpan del(tracer.get(), traceId, "dir.store_delete");
+        auto shard = &storeMap.Owner(handle.needleId);
+        auto recorded = storeMap.Find(RecordedString(found->view(), "shard"));
+        if (recorded)
+            shard = recorded;
+        auto storeResponse = shard->replicas->Delete(handle, traceId);
+        del.End();
         if (storeResponse.find("ok") == std::string::npos) {
             *conn << storeResponse << '\n';
             conn->flush();
-            return;
+            return false;
         }
 
         // Delete needleId from MongoDB
-        mongocxx::client mongoConn{mongocxx::uri{mongoUri}};
-        bsoncxx::builder::stream::document doc;
-        doc << "needleId" << static_cast<int64_t>(needleId);
-        auto coll = mongoConn[kDbName][kDbCollectionName];
+        TraceSpan remove(tracer.get(), traceId, "dir.mongo_delete");
         auto dbResult = coll.delete_one(doc.view());
 
         // Respond to client
         *conn << (dbResult ? "ok\n" : "err DbErr\n");
         conn->flush();
+        return bool(dbResult);
     }
     catch (mongocxx::exception &err) {
         std::cerr << "MongoErr: " << err.what() << std::endl;
+        dbErrors.Inc();
         *conn << "err DbErr\n";
         conn->flush();
+        return false;
     }
     catch (std::exception &err) {
         std::cerr << "Err: " << err.what() << std::endl;
-        if (not *conn) return;
+        if (not *conn) return false;
         *conn << "err Unknown\n";
         conn->flush();
+        return false;
     }
 }
+
+/**
+ * Deletes many needles from the directory and the replicas at once.
+ *
+ * @param conn A pointer to TCP stream for the connection.
+ * @param count The number of handles that follow.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @details Does what Remove does for every needle, but in bulk:
+ *  - The records of all the needles are found with a single query.
+ *  - The needles are grouped by their shard, and every group is deleted with
+ *    one multidelete to each replica, which the Stores journal together.
+ *  - The records of the deleted needles are removed with a single delete.
+ *  Every handle drops the record of one upload and one reference, so a needle
+ *  shared by identical uploads is only deleted from the stores with its last
+ *  reference, and a handle named more times than it has uploads is rejected.
+ * @return True if the handles are received, false otherwise. Needles that
+ *  cannot be deleted are reported in the reply.
+ */
+bool
+Directory::BulkRemove(
+    std::unique_ptr<TcpStream> conn, size_t count, uint64_t traceId)
+{
+    using namespace bsoncxx::builder::stream;
+    if (count > kMaxBulkNeedles) {
+        *conn << "err TooManyNeedles\n";
+        conn->flush();
+        return false;
+    }
+
+    try {
+        std::vector<NeedleHandle> requests(count);
+        std::vector<std::string> replies(count);
+        for (size_t i = 0; i < count; ++i) {
+            std::string line, token;
+            std::getline(*conn, line);
+            std::istringstream(line) >> token;
+            if (not ParseRequestHandle(token, requests[i]))
+                replies[i] = "err BadNeedle";
+        }
+
+        // Find the records of all the needles
+        TraceSpan find(tracer.get(), traceId, "dir.mongo_find");
+        mongocxx::client mongoConn{mongocxx::uri{mongoUri}};
+        auto db = mongoConn[kDbName];
+        auto coll = db[kDbCollectionName];
+        struct Record
+        {
+            bsoncxx::oid id;
+            NeedleHandle handle;
+            std::string shard;
+            std::string content;
+        };
+        std::multimap<uint64_t, Record> records;
+        document filter;
+        auto ids = filter << "needleId" << open_document << "$in" << open_array;
+        for (size_t i = 0; i < count; ++i) {
+            if (replies[i].empty())
+                ids << static_cast<int64_t>(requests[i].needleId);
+        }
+        ids << close_array << close_document;
+        for (auto &&doc : coll.find(filter.view())) {
+            Record record;
+            record.id = doc["_id"].get_oid().value;
+            RecordedHandle(doc, record.handle);
+            record.shard = RecordedString(doc, "shard");
+            record.content = RecordedString(doc, "content");
+            records.emplace(record.handle.needleId, record);
+        }
+        find.End();
+
+        // Check the handles, take one record for each, and drop the
+        // references to shared needles, which stay in the stores while other
+        // uploads refer to them
+        std::vector<bsoncxx::oid> recordIds(count);
+        std::map<const StoreMap::Shard*, std::vector<size_t>> groups;
+        for (size_t i = 0; i < count; ++i) {
+            if (not replies[i].empty())
+                continue;
+            auto &request = requests[i];
+            auto it = records.find(request.needleId);
+            if (it == records.end()
+                or it->second.handle.cookie != request.cookie
+                or (request.cookie
+                    and it->second.handle.volumeId != request.volumeId)) {
+                replies[i] = "err BadNeedle";
+                continue;
+            }
+            auto record = it->second;
+            records.erase(it);
+            recordIds[i] = record.id;
+            if (not record.content.empty()
+                and not ReleaseBlob(db, record.content, request.needleId))
+                continue;
+            request = record.handle;
+            auto shard = storeMap.Find(record.shard);
+            groups[shard ? shard : &storeMap.Owner(request.needleId)]
+                .push_back(i);
+        }
+
+        // Delete every group from its shard
+        TraceSpan del(tracer.get(), traceId, "dir.store_delete");
+        for (auto &group : groups) {
+            std::vector<NeedleHandle> handles;
+            for (auto i : group.second)
+                handles.push_back(requests[i]);
+            auto storeResponse = group.first->replicas->DeleteGroup(
+                handles, traceId);
+            if (storeResponse.find("ok") != std::string::npos)
+                continue;
+            for (auto i : group.second)
+                replies[i] = storeResponse;
+        }
+        del.End();
+
+        // Delete the records taken by the deleted handles from MongoDB, and
+        // only those, as identical uploads share the needle ID
+        TraceSpan remove(tracer.get(), traceId, "dir.mongo_delete");
+        document deleted;
+        auto deletedIds =
+            deleted << "_id" << open_document << "$in" << open_array;
+        size_t nDeleted = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (replies[i].empty()) {
+                deletedIds << recordIds[i];
+                ++nDeleted;
+            }
+        }
+        deletedIds << close_array << close_document;
+        if (nDeleted and not coll.delete_many(deleted.view())) {
+            for (auto &reply : replies) {
+                if (reply.empty())
+                    reply = "err DbErr";
+            }
+        }
+        remove.End();
+
+        // Respond to client
+        std::string msg;
+        for (auto &reply : replies)
+            msg += (reply.empty() ? "ok" : reply) + '\n';
+        *conn << "ok " << count << '\n' << msg;
+        conn->flush();
+        return true;
+    }
+    catch (mongocxx::exception &err) {
+        std::cerr << "ERR MONGO: " << err.what() << std::endl;
+        dbErrors.Inc();
+        *conn << "err DbErr\n";
+        conn->flush();
+        return false;
+    }
+    catch (std::exception &err) {
+        std::cerr << "ERR: " << err.what() << std::endl;
+        if (not *conn) return false;
+        *conn << "err Unknown\n";
+        conn->flush();
+        return false;
+    }
+}
+
+/**
+ * Receives an object, and hashes it on the way if uploads are deduplicated.
+ *
+ * @param conn The connection, positioned at the start of the object.
+ * @param size The size of the object.
+ * @param buf Set to a buffer from the pool with the object.
+ * @param content Set to the content address of the object if uploads are
+ *  deduplicated, see ContentHash, or to an empty string otherwise.
+ * @details The object is received in chunks, and every chunk is hashed while
+ *  the next one is still on its way.
+ */
+void
+Directory::Receive(
+    TcpStream &conn,
+    uint64_t size,
+    BufferPool::Buffer &buf,
+    std::string &content)
+{
+    buf = BufferPool::Instance().Get(size);
+    ContentHash hash;
+    for (uint64_t pos = 0; pos < size;) {
+        auto n = std::min(size - pos, kRecvChunkSize);
+        conn.read(buf.Data() + pos, n);
+        if (isDedup)
+            hash.Update(buf.Data() + pos, conn.gcount());
+        if (static_cast<uint64_t>(conn.gcount()) != n)
+            break;
+        pos += n;
+    }
+    content = isDedup ? hash.ToString() : "";
+}
+
+/**
+ * Takes a reference to the needle recorded with the given contents, if any.
+ *
+ * @param db The database.
+ * @param content The content address of an upload, see ContentHash.
+ * @param handle Set to the handle of the needle.
+ * @param shard Set to the shard recorded with the needle.
+ * @param stores Set to the replicas recorded with the needle.
+ * @param refs The number of references to take.
+ * @return False if no needle with the contents is recorded, true otherwise.
+ * @details A needle whose last reference is being deleted is not shared, as
+ *  it is about to be deleted from the stores.
+ */
+bool
+Directory::ShareBlob(
+    mongocxx::database &db,
+    const std::string &content,
+    NeedleHandle &handle,
+    std::string &shard,
+    std::string &stores,
+    int64_t refs)
+{
+    using namespace bsoncxx::builder::stream;
+    document filter, update;
+    filter << "content" << content
+           << "refs" << open_document << "$gt" << 0 << close_document;
+    update << "$inc" << open_document << "refs" << refs << close_document;
+    auto blob = db[kDbBlobCollectionName].find_one_and_update(
+        filter.view(), update.view());
+    if (not blob)
+        return false;
+    RecordedHandle(blob->view(), handle);
+    shard = RecordedString(blob->view(), "shard");
+    stores = RecordedString(blob->view(), "stores");
+    return true;
+}
+
+/**
+ * Drops references to a needle shared by identical uploads.
+ *
+ * @param db The database.
+ * @param content The content address recorded with the needle.
+ * @param needleId The ID of the needle.
+ * @param refs The number of references to drop.
+ * @return True if those were the last references, or the needle has no
+ *  reference count, in which case it must be deleted from the stores, false
+ *  otherwise.
+ */
+bool
+Directory::ReleaseBlob(
+    mongocxx::database &db,
+    const std::string &content,
+    uint64_t needleId,
+    int64_t refs)
+{
+    using namespace bsoncxx::builder::stream;
+    document filter, update;
+    filter << "content" << content
+           << "needleId" << static_cast<int64_t>(needleId);
+    update << "$inc" << open_document << "refs" << -refs << close_document;
+    mongocxx::options::find_one_and_update opts;
+    opts.return_document(mongocxx::options::return_document::k_after);
+    auto blobs = db[kDbBlobCollectionName];
+    auto blob = blobs.find_one_and_update(filter.view(), update.view(), opts);
+    if (blob and blob->view()["refs"].get_int64().value > 0)
+        return false;
+    if (blob)
+        blobs.delete_one(filter.view());
+    return true;
+}
+
+/**
+ * Asks the replicas of a shard for their volumes, and keeps the ones that are
+ * writable on all of them.
+ *
+ * @param shard The shard.
+ * @throw std::exception if a quorum of the replicas cannot be reached.
+ */
+void
+Directory::RefreshVolumes(const StoreMap::Shard &shard)
+{
+    auto writable = shard.replicas->WritableVolumes();
+    std::lock_guard<std::mutex> lk(volumeMtx);
+    volumes[shard.name] = std::move(writable);
+}
+
+/**
+ * Selects the volume for a new needle, spreading needles across the writable
+ * volumes of a shard in a round robin fashion.
+ *
+ * @param shard The shard.
+ * @param volumeId The selected volume ID.
+ * @return False if the shard has no writable volumes, true otherwise.
+ */
+bool
+Directory::PickVolume(const StoreMap::Shard &shard, uint64_t &volumeId)
+{
+    {
+        std::lock_guard<std::mutex> lk(volumeMtx);
+        auto &writable = volumes[shard.name];
+        if (not writable.empty()) {
+            volumeId = writable[volumeCounter++ % writable.size()];
+            return true;
+        }
+    }
+
+    RefreshVolumes(shard);
+    std::lock_guard<std::mutex> lk(volumeMtx);
+    auto &writable = volumes[shard.name];
+    if (writable.empty())
+        return false;
+    volumeId = writable[volumeCounter++ % writable.size()];
+    return true;
+}
@@ -1,27 +1,52 @@
 #pragma once
 
 #include <atomic>
+#include <map>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 #include <bsoncxx/builder/stream/document.hpp>
 #include <bsoncxx/json.hpp>
+#include <mongocxx/database.hpp>
 #include <mongocxx/instance.hpp>
 
+#include "bufferpool.hh"
+#include "listener.hh"
+#include "metrics.hh"
+#include "needle.hh"
+#include "storemap.hh"
+#include "trace.hh"
+
 /**
  * The directory component.
  *
  * Maps needle IDs to stores. It can receive commands to upload blobs, list the
- * IDs of the blobs in the stores, and to remove a blob. When it receives an
- * upload request, it allocates a needle ID for the blob, chooses a store where
- * to put the blob, and forwards the upload command to the chosen store. On a
- * list command, it simply responds with all the needle IDs in the stores. On a
- * remove command, the blob is not removed from the store, but the needle ID is
- * no longer included with the other needle IDs when a needle ID list is
- * provided.
+ * handles of the blobs in the stores, and to remove a blob. When it receives an
+ * upload request, it allocates a needle ID and a random cookie for the blob,
+ * chooses a volume of the shard that owns the ID, and writes it to the
+ * replicas of the volume, see StoreMap and ReplicaSet. The shard and the
+ * replicas that acknowledged the write are recorded with the needle ID, and
+ * the client gets a NeedleHandle, which readers present to the Cache. On a
+ * list command, it simply responds with all the needle handles. A bulk upload
+ * does the same for many blobs at once, with one multiput per shard and one
+ * database insert for all of them. On a
+ * remove command, the needle is deleted from the replicas of its shard, and
+ * its ID is no longer included when a needle ID list is provided. A bulk
+ * delete does the same for many needles, with one multidelete per shard and
+ * one database delete for all of them.
+ *
+ * With deduplication enabled, every upload is hashed as it arrives, see
+ * ContentHash, and an upload whose contents were already uploaded gets the
+ * handle of the existing needle instead of a new one. The blobs are counted
+ * by reference, and the needle is only deleted from the stores when the last
+ * upload that shares it is deleted.
  *
- * The directory uses MongoDB to store the IDs.
+ * The directory uses MongoDB to store the IDs, and the content addresses of
+ * the blobs with their reference counts.
  */
 class Directory
 {
@@ -32,11 +57,18 @@ private:
     // The MongoDB database and collection names.
     static constexpr char const *kDbName = "HAYSTACK";
     static constexpr char const *kDbCollectionName = "NEEDLES";
+    static constexpr char const *kDbBlobCollectionName = "BLOBS";
 
-    // The number of volumes in the store.
-    static constexpr unsigned kVolumes = 5;
     static constexpr uint64_t kMaxFileSize = 1 << 20;
 
+    // The maximum number of objects, and of bytes, in a bulk upload. They
+    // match the limits of a multiput to the Stores.
+    static constexpr size_t kMaxBulkNeedles = 1024;
+    static constexpr uint64_t kMaxBulkSize = 16 << 20;
+
+    // The number of bytes of an upload received, and hashed, at a time.
+    static constexpr uint64_t kRecvChunkSize = 64 << 10;
+
     // The IP address and port where Directory listens for requests.
     std::string dirIpAddr;
     unsigned dirPort;
@@ -44,21 +76,73 @@ private:
     // The MongoDB URI.
     std::string mongoUri;
 
-    // The IP address and port where Store listens for requests.
-    std::string storeIpAddr;
-    std::string storePort;
+    // The shards of stores holding the volumes.
+    StoreMap storeMap;
 
     // Numbers to keep track of the volume number and ID for the next needle.
     std::atomic_int volumeCounter;
     std::atomic_llong idCounter;
 
+    // The volumes that are writable on all the replicas of each shard, as they
+    // report, by shard name.
+    std::mutex volumeMtx;
+    std::map<std::string, std::vector<uint64_t>> volumes;
+
+    // Whether uploads with the same contents share a needle.
+    bool isDedup;
+
     // The MongoDB instance.
     mongocxx::instance mongoInstance;
 
+    // Runtime metrics, served over HTTP on metricsPort if it is set.
+    MetricsRegistry metrics;
+    CommandMetrics commandMetrics;
+    Counter &dbErrors;
+    Counter &busy;
+    Counter &dedupHits;
+    unsigned metricsPort;
+    std::unique_ptr<MetricsServer> metricsServer;
+
+    // Records the stages of traced requests, if tracePath is set.
+    std::string tracePath;
+    double traceSampleRate;
+    std::unique_ptr<Tracer> tracer;
+
+    // Accepts the connections and serves them on a pool of threads.
+    Listener listener;
+
+    void LoadIdCounter();
     void HandleConnection(std::unique_ptr<TcpStream> conn);
-    void List(std::unique_ptr<TcpStream> conn);
-    void Upload(std::unique_ptr<TcpStream> conn, uint64_t size);
-    void Remove(std::unique_ptr<TcpStream> conn, uint64_t needleId);
+    bool List(std::unique_ptr<TcpStream> conn);
+    bool Upload(
+        std::unique_ptr<TcpStream> conn, uint64_t size, uint64_t traceId);
+    bool Remove(
+        std::unique_ptr<TcpStream> conn,
+        const std::string &token,
+        uint64_t traceId);
+    bool BulkUpload(
+        std::unique_ptr<TcpStream> conn, size_t count, uint64_t traceId);
+    bool BulkRemove(
+        std::unique_ptr<TcpStream> conn, size_t count, uint64_t traceId);
+    void Receive(
+        TcpStream &conn,
+        uint64_t size,
+        BufferPool::Buffer &buf,
+        std::string &content);
+    bool ShareBlob(
+        mongocxx::database &db,
+        const std::string &content,
+        NeedleHandle &handle,
+        std::string &shard,
+        std::string &stores,
+        int64_t refs = 1);
+    bool ReleaseBlob(
+        mongocxx::database &db,
+        const std::string &content,
+        uint64_t needleId,
+        int64_t refs = 1);
+    void RefreshVolumes(const StoreMap::Shard &shard);
+    bool PickVolume(const StoreMap::Shard &shard, uint64_t &volumeId);
 
 public:
     Directory(
@@ -67,7 +151,31 @@ public:
         const std::string &mongoUri,
         const std::string &storeIpAddr,
         const std::string &storePort);
+    Directory(
+        const std::string &dirIpAddr,
+        unsigned dirPort,
+        const std::string &mongoUri,
+        StoreMap storeMap);
 
-    // Listens for requests on a loop.
+    // Sets the port where metrics are served over HTTP, or 0 to disable them.
+    void ServeMetrics(unsigned port) noexcept { metricsPort = port; }
+
+    // Enables or disables the sharing of needles by identical uploads.
+    void EnableDedup(bool enable) noexcept { isDedup = enable; }
+
+    // Appends the spans of traced requests to a file, and traces the given
+    // fraction of the requests that arrive without a trace ID.
+    void
+    EnableTracing(const std::string &path, double sampleRate)
+    {
+        tracePath = path;
+        traceSampleRate = sampleRate;
+    }
+
+    // Listens for requests until Stop is called.
     void Run();
+
+    // Makes Run stop accepting connections and return. It may be called from
+    // any thread, e.g., a signal handler's.
+    void Stop() { listener.Stop(); }
 };
@@ -1,7 +1,15 @@
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <climits>
 #include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <vector>
@@ -9,11 +17,174 @@
 
 #include <boost/filesystem.hpp>
 
+#include "bufferpool.hh"
+#include "crc32c.hh"
 #include "haystack.hh"
 
+// Define them here to avoid link errors
+constexpr size_t Haystack::kMaxTombstones;
+constexpr uint64_t Haystack::kScanChunk;
+constexpr size_t VolumeStats::kSizeBuckets;
+constexpr uint64_t VolumeStats::kFirstBucketSize;
+
 namespace {
 namespace fs = boost::filesystem;
 using LockGuard = std::lock_guard<std::mutex>;
+
+// Zeros used to pad needles to the header alignment.
+char kPadding[NeedleHeader::kAlignment] = {};
+
+// The most buffers a single vectored write takes, see writev(2).
+constexpr size_t kMaxIovecs = IOV_MAX;
+
+/**
+ * Reads a volume file front to back in large chunks, and reads the next chunk
+ * in the background while the current one is parsed. Chunks that are skipped
+ * over, e.g., by a large blob, are not read.
+ */
+class ChunkReader
+{
+    VolumeFile &file;
+    uint64_t end;  // Where the reads stop.
+    uint64_t chunkSize;
+    std::vector<char> chunk;
+    uint64_t chunkStart;
+    uint64_t chunkBytes;
+    std::vector<char> next;  // The chunk being read ahead.
+    uint64_t nextStart;
+    std::future<void> ahead;
+
+    /**
+     * Makes the chunk that starts at an offset the current one, and starts
+     * reading the one after it.
+     */
+    void
+    Load(uint64_t start)
+    {
+        bool isReady = false;
+        if (ahead.valid()) {
+            ahead.get();
+            isReady = nextStart == start;
+        }
+        chunkStart = start;
+        chunkBytes = std::min(chunkSize, end-start);
+        if (isReady)
+            chunk.swap(next);
+        else {
+            chunk.resize(std::max<uint64_t>(chunk.size(), chunkBytes));
+            file.Read(chunk.data(), chunkBytes, start);
+        }
+
+        nextStart = start + chunkSize;
+        if (nextStart < end) {
+            auto size = std::min(chunkSize, end-nextStart);
+            next.resize(std::max<uint64_t>(next.size(), size));
+            auto offset = nextStart;
+            ahead = std::async(std::launch::async, [this, size, offset] {
+                file.Read(next.data(), size, offset);
+            });
+        }
+    }
+
+public:
+    ChunkReader(VolumeFile &file, uint64_t end, uint64_t chunkSize)
+        : file(file),
+          end(end),
+          chunkSize(std::max<uint64_t>(chunkSize, 1)),
+          chunk(),
+          chunkStart(0),
+          chunkBytes(0),
+          next(),
+          nextStart(UINT64_MAX),
+          ahead()
+    {}
+
+    ~ChunkReader()
+    {
+        if (ahead.valid())
+            ahead.wait();
+    }
+
+    /**
+     * Copies bytes of the file into a buffer. Offsets must not go backwards
+     * from one call to the next.
+     */
+    void
+    Read(char *buff, uint64_t size, uint64_t offset)
+    {
+        while (size) {
+            if (offset < chunkStart or offset >= chunkStart+chunkBytes)
+                Load(offset - offset % chunkSize);
+            auto n = std::min(size, chunkStart+chunkBytes-offset);
+            std::memcpy(buff, chunk.data() + (offset-chunkStart), n);
+            buff += n;
+            size -= n;
+            offset += n;
+        }
+    }
+};
+
+} // namespace
+
+/**
+ * Initializes the statistics of an empty haystack.
+ */
+VolumeStats::VolumeStats()
+    : liveNeedles(0),
+      deletedNeedles(0),
+      liveBytes(0),
+      garbageBytes(0),
+      sizeHistogram(),
+      lastWrite(0)
+{}
+
+/**
+ * @param size The size of a blob.
+ * @return The bucket of the size histogram where the blob is counted.
+ */
+size_t
+VolumeStats::Bucket(uint64_t size) noexcept
+{
+    size_t bucket = 0;
+    while (bucket+1 < kSizeBuckets and size >= kFirstBucketSize << bucket)
+        ++bucket;
+    return bucket;
+}
+
+/**
+ * Counts a needle found in, or written to, the haystack.
+ *
+ * @param size The size of its blob.
+ * @param diskSize The bytes it takes in the file.
+ * @param isDeleted Whether it is deleted.
+ */
+void
+VolumeStats::AddNeedle(uint64_t size, uint64_t diskSize, bool isDeleted)
+    noexcept
+{
+    if (isDeleted) {
+        ++deletedNeedles;
+        garbageBytes += diskSize;
+        return;
+    }
+    ++liveNeedles;
+    liveBytes += diskSize;
+    ++sizeHistogram[Bucket(size)];
+}
+
+/**
+ * Moves a live needle to the deleted ones.
+ *
+ * @param size The size of its blob.
+ * @param diskSize The bytes it takes in the file.
+ */
+void
+VolumeStats::DeleteNeedle(uint64_t size, uint64_t diskSize) noexcept
+{
+    --liveNeedles;
+    liveBytes -= diskSize;
+    --sizeHistogram[Bucket(size)];
+    AddNeedle(size, diskSize, true);
 }
 
 /**
@@ -28,17 +199,29 @@ using LockGuard = std::lock_guard<std::mutex>;
  *  read-only mode.
  * @param fromFile Boolean flag indicating whether a new Haystack is being
  *  created from scratch, or is being associated with a pre-existing haystack
- *  file.
+ *  file. A pre-existing file in the legacy format, or with bytes that cannot
+ *  be parsed other than zeros at its end, is opened in read-only mode, and
+ *  the deletes left in its journal are folded into it.
+ * @param io The I/O backend used to open the file. If none is provided, then
+ *  the file is accessed through a buffered std::fstream.
  */
 Haystack::Haystack(
-    unsigned id, const std::string &path, uint64_t maxSize, bool fromFile)
+    unsigned id,
+    const std::string &path,
+    uint64_t maxSize,
+    bool fromFile,
+    std::shared_ptr<IoBackend> io)
     : mtx(),
       file(),
       fname(),
       maxSize(maxSize),
       currentSize(0),
       id(id),
-      isReadOnly(false)
+      isReadOnly(false),
+      version(NeedleHeader::kVersion),
+      journal(),
+      tombstones(),
+      stats()
 {
     auto name = "haystack_" + std::to_string(id);
     if (path.empty())
@@ -48,35 +231,116 @@ Haystack::Haystack(
     else
         fname = path + '/' + name;
 
-    file.exceptions(std::ios::badbit);
-
+    if (not io)
+        io = MakeFstreamBackend();
 
     if (not fromFile) {
         // Since we are creating the file from scratch, we assume that the
         // directory may not exist.
-        if (not fs::exists(path))
-            fs::create_directory(path);
-        constexpr auto mode = std::ios::in | std::ios::out
-                        | std::ios::trunc | std::ios::binary;
-        file.open(fname, mode);
+        if (not path.empty() and not fs::exists(path))
+            fs::create_directories(path);
+        file = io->Open(fname, true);
     }
     else {
-        constexpr auto mode = std::ios::in | std::ios::out
-                            | std::ios::binary;
         // We assume file already exists, and will throw error if it doesn't.
-        file.open(fname, mode);
+        file = io->Open(fname, false);
         currentSize = fs::file_size(fname);
-        isReadOnly = currentSize >= maxSize;
+
+        // Files that do not start with a versioned header were written in the
+        // legacy format, which we only know how to read.
+        char magic[sizeof(NeedleHeader::kMagic)];
+        if (currentSize >= sizeof(magic)) {
+            file->Read(magic, sizeof(magic), 0);
+            if (not NeedleHeader::HasMagic(magic))
+                version = 0;
+        }
+
+        // Find where the last needle ends, and count the needles on the way,
+        // including those after a header that cannot be decoded.
+        uint64_t pos = 0;
+        uint64_t last = 0;
+        bool isDamaged = false;
+        auto count = [this, &last](uint64_t offset, const NeedleFlags &nf) {
+            auto next = NeedleEnd(offset, nf);
+            if (next > currentSize)
+                return false;
+            stats.AddNeedle(nf.size, next - offset, nf.isDeleted);
+            last = next;
+            return true;
+        };
+        while (Walk(pos, currentSize, kScanChunk, count)
+               == WalkEnd::BadHeader) {
+            auto next = Resync(pos, currentSize, kScanChunk);
+            if (next == currentSize)
+                break;
+            std::cerr << "ERROR: " << fname << ": bad needle header at offset "
+                      << pos << ", resuming at offset " << next << std::endl;
+            isDamaged = true;
+            pos = next;
+        }
+
+        // Backends that write whole blocks may leave zeros past the last
+        // needle if the file was not closed cleanly, and those are trimmed.
+        // Any other bytes that cannot be parsed, e.g., a torn needle, are
+        // kept, and the haystack is opened in read-only mode, so that they
+        // are never truncated or written over.
+        if (version and last < currentSize) {
+            if (IsZeroed(last, currentSize))
+                currentSize = last;
+            else {
+                std::cerr << "ERROR: " << fname << ": no needle in the "
+                          << currentSize - last << " bytes after offset "
+                          << last << std::endl;
+                isDamaged = true;
+            }
+        }
+        if (isDamaged) {
+            std::cerr << "ERROR: " << fname << ": damaged, opened in "
+                      << "read-only mode" << std::endl;
+        }
+        stats.lastWrite = fs::last_write_time(fname);
+
+        isReadOnly = not version or isDamaged or currentSize >= maxSize;
+    }
+
+    journal.reset(new TombstoneJournal(fname + ".tomb", not fromFile));
+    if (fromFile) {
+        // A tombstone that does not match the header at its offset, e.g.,
+        // from a torn journal write, would overwrite the flags of another
+        // needle, so it is dropped.
+        NeedleFlags nf;
+        for (auto &tombstone : journal->Load()) {
+            auto offset = tombstone.offset;
+            if (offset+HeaderSize() > currentSize or not ReadHeader(offset, nf)
+                or nf.id != tombstone.needleId) {
+                std::cerr << "ERROR: " << fname << ": dropping the tombstone "
+                          << "of needle " << tombstone.needleId
+                          << " at offset " << offset << std::endl;
+                continue;
+            }
+            if (not tombstones.emplace(offset, tombstone).second)
+                continue;
+            if (not nf.isDeleted)
+                stats.DeleteNeedle(nf.size, NeedleEnd(offset, nf) - offset);
+        }
+        Fold();
+        journal->Clear();
     }
 }
 
 /**
- * Dtor. Flushes and closes the file.
+ * Dtor. Folds the journaled deletes, and flushes and closes the file.
  */
 Haystack::~Haystack()
 {
-    file.flush();
-    file.close();
+    try {
+        Fold();
+        file->Sync();
+        file->Truncate(currentSize);
+    }
+    catch (std::exception &err) {
+        std::cerr << "ERROR: " << fname << ": " << err.what() << std::endl;
+    }
 }
 
 /**
@@ -90,34 +354,211 @@ Haystack::FreeCount() const noexcept
 }
 
 /**
- * Reads the contents of a Needle.
+ * @return The number of bytes used by the needles in the file.
+ */
+uint64_t
+Haystack::Size() const noexcept
+{
+    LockGuard lk(mtx);
+    return currentSize;
+}
+
+/**
+ * @return True if the haystack is sealed, i.e., it no longer accepts writes.
+ */
+bool
+Haystack::IsReadOnly() const noexcept
+{
+    LockGuard lk(mtx);
+    return isReadOnly;
+}
+
+/**
+ * Puts the haystack in read-only mode, e.g., when it is too full to take more
+ * needles. A sealed haystack can still have needles deleted.
+ */
+void
+Haystack::Seal() noexcept
+{
+    LockGuard lk(mtx);
+    isReadOnly = true;
+}
+
+/**
+ * Flushes the needles written so far to the device, and folds the journaled
+ * deletes into their headers.
+ */
+void
+Haystack::Sync()
+{
+    LockGuard lk(mtx);
+    Fold();
+    file->Sync();
+}
+
+/**
+ * @return The size of a needle header in the format of the file.
+ */
+uint64_t
+Haystack::HeaderSize() const noexcept
+{
+    return version ? NeedleHeader::kSize : NeedleHeader::kLegacySize;
+}
+
+/**
+ * @param offset The offset of a needle.
+ * @param nf The flags of the needle.
+ * @return The offset where the next needle starts.
+ */
+uint64_t
+Haystack::NeedleEnd(uint64_t offset, const NeedleFlags &nf) const noexcept
+{
+    return version
+        ? offset + NeedleDiskSize(nf.size)
+        : offset + NeedleHeader::kLegacySize + nf.size;
+}
+
+/**
+ * Reads and decodes a needle header. The caller must check that the header is
+ * within the file.
+ *
+ * @param offset The offset of the needle.
+ * @param nf The needle flags where the header is decoded into.
+ * @return False if there is no valid header at the offset, true otherwise.
+ */
+bool
+Haystack::ReadHeader(uint64_t offset, NeedleFlags &nf) const
+{
+    char header[NeedleHeader::kSize];
+    file->Read(header, HeaderSize(), offset);
+    if (version)
+        return NeedleHeader::Decode(header, nf);
+    NeedleHeader::DecodeLegacy(header, nf);
+    return true;
+}
+
+/**
+ * Reads the contents of a Needle, and decompresses them if they are stored
+ * compressed.
  *
  * @param needle The Needle which tells Haystack how to find the data.
  * @param buff The buffer where the data is copied. It is assumed that the
  *  buffer is allocated and big enough to accomodate the data associated with
- *  the needle.
+ *  the needle, i.e., needle.flags.DataSize() bytes.
+ * @param verify If true, the checksum of the data is verified against the
+ *  checksum stored with the needle. Passing false skips the check for callers
+ *  that would rather trade integrity checking for speed. Needles in legacy
+ *  files have no checksum and are never verified.
  * @throw A HaystackErr if the needle is not for this Haystack, the offset is
- *  larger than the file, or the ID, size, or delete status extracted from the
- *  file do not match the Needle.
+ *  larger than the file, the ID, size, cookie, or delete status extracted from
+ *  the file do not match the Needle, or the checksum does not match the data
+ *  or it cannot be decompressed.
  */
 void
-Haystack::Read(const Needle &needle, char *buff) const
+Haystack::Read(const Needle &needle, char *buff, bool verify) const
 {
-    LockGuard lk(mtx);
-    constexpr auto kFlagsSize = sizeof(NeedleFlags);
+    if (not needle.flags.codec) {
+        ReadStored(needle, buff, verify);
+        return;
+    }
 
-    if (needle.haystackId != id or needle.offset >= currentSize-kFlagsSize)
+    auto blob = BufferPool::Instance().Get(needle.flags.size);
+    ReadStored(needle, blob.Data(), verify);
+    if (not Decompress(
+            static_cast<Codec>(needle.flags.codec), blob.Data(),
+            needle.flags.size, buff, needle.flags.rawSize))
+        throw HaystackErr(HsErr::BadChecksum);
+}
+
+/**
+ * Reads the blob of a Needle as it is stored, i.e., compressed if the needle
+ * is compressed, e.g., to pass it on to clients that decompress it.
+ *
+ * @param needle The Needle which tells Haystack how to find the data.
+ * @param buff The buffer where the blob is copied, of needle.flags.size bytes.
+ * @param verify If true, the checksum of the blob is verified.
+ * @throw A HaystackErr as Read does, except that the blob is not decompressed.
+ */
+void
+Haystack::ReadStored(const Needle &needle, char *buff, bool verify) const
+{
+    const auto headerSize = HeaderSize();
+    uint64_t size;
+    {
+        // A journaled delete is not in the header yet.
+        LockGuard lk(mtx);
+        if (needle.flags.isDeleted or tombstones.count(needle.offset))
+            throw HaystackErr(HsErr::BadNeedle);
+        size = currentSize;
+    }
+
+    if (needle.haystackId != id
+        or needle.offset+headerSize+needle.flags.size > size)
         throw HaystackErr(HsErr::BadNeedle);
 
+    // Read the header and the blob with a single request. Reads do not take
+    // the lock, because the file only grows and needles are never moved.
+    char header[NeedleHeader::kSize];
+    iovec iov[] = {{header, headerSize}, {buff, needle.flags.size}};
+    file->Read(iov, 2, needle.offset);
+
     NeedleFlags nf;
-    file.seekg(needle.offset);
-    file.read(reinterpret_cast<char*>(&nf), kFlagsSize);
+    bool isValid = true;
+    if (version)
+        isValid = NeedleHeader::Decode(header, nf);
+    else
+        NeedleHeader::DecodeLegacy(header, nf);
+    if (not isValid or nf.isDeleted or nf.id != needle.flags.id
+        or nf.size != needle.flags.size or nf.cookie != needle.flags.cookie
+        or nf.codec != needle.flags.codec or nf.rawSize != needle.flags.rawSize)
+        throw HaystackErr(HsErr::BadNeedle);
 
-    if (nf.isDeleted or nf.id != needle.flags.id
-        or nf.size != needle.flags.size)
+    if (verify and version and Crc32c(buff, nf.size) != nf.checksum)
+        throw HaystackErr(HsErr::BadChecksum);
+}
+
+/**
+ * Reads part of the contents of a Needle with a single positional read of
+ * just that part.
+ *
+ * @param needle The Needle which tells Haystack how to find the data.
+ * @param range The part of the contents to read, which must be within them.
+ * @param buff The buffer where the data is copied, of at least range.length
+ *  bytes.
+ * @throw A HaystackErr if the needle is not for this Haystack, or it has a
+ *  journaled delete, or the range is not within the needle or the file, or as
+ *  Read does for compressed needles.
+ * @details The header is not read, so the needle is trusted to be the one in
+ *  the index, and the checksum cannot be verified. A compressed needle is read
+ *  and decompressed whole, as its blob cannot be split.
+ */
+void
+Haystack::ReadRange(
+    const Needle &needle, const ByteRange &range, char *buff) const
+{
+    const auto headerSize = HeaderSize();
+    const auto dataSize = needle.flags.DataSize();
+    uint64_t size;
+    {
+        // A journaled delete is not in the header yet.
+        LockGuard lk(mtx);
+        if (needle.flags.isDeleted or tombstones.count(needle.offset))
+            throw HaystackErr(HsErr::BadNeedle);
+        size = currentSize;
+    }
+    if (needle.haystackId != id
+        or needle.offset+headerSize+needle.flags.size > size)
         throw HaystackErr(HsErr::BadNeedle);
+    if (range.offset > dataSize or range.length > dataSize - range.offset)
+        throw HaystackErr(HsErr::BadRange);
 
-    file.read(buff, nf.size);
+    if (needle.flags.codec) {
+        auto data = BufferPool::Instance().Get(dataSize);
+        Read(needle, data.Data());
+        std::memcpy(buff, data.Data() + range.offset, range.length);
+        return;
+    }
+    file->Read(buff, range.length, needle.offset + headerSize + range.offset);
 }
 
 /**
@@ -126,27 +567,114 @@ Haystack::Read(const Needle &needle, char *buff) const
  * @param needleId The ID of the new Needle.
  * @param buff The buffer with the data to be saved in the haystack.
  * @param size The size of the buffer in bytes.
+ * @param cookie The cookie of the new Needle, which readers must present.
+ * @param codec The codec to compress the contents with, if it pays off.
  * @throw A HaystackErr if Haystack is in read-only mode, or the Needle does not
  *  fit in the haystack.
+ * @details See WriteGroup.
  */
 Needle
-Haystack::Write(uint64_t needleId, char *buff, uint64_t size)
+Haystack::Write(
+    uint64_t needleId,
+    char *buff,
+    uint64_t size,
+    uint32_t cookie,
+    Codec codec)
 {
-    LockGuard lk(mtx);
-    constexpr auto kFlagsSize = sizeof(NeedleFlags);
+    return WriteGroup({{needleId, buff, size, cookie}}, codec).front();
+}
 
-    if (isReadOnly or currentSize+kFlagsSize+size > maxSize)
+/**
+ * Saves a group of objects to the haystack with a single append, and creates
+ * their Needles.
+ *
+ * @param writes The IDs, contents, and cookies of the new Needles.
+ * @param codec The codec to compress the contents with, if it pays off.
+ * @return The Needles, in the order of the writes.
+ * @throw A HaystackErr if Haystack is in read-only mode, or the Needles do not
+ *  all fit in the haystack, in which case none is written.
+ * @details Every needle is written with a versioned header, and it is padded
+ *  so that the next needle starts on an aligned offset. The contents are
+ *  stored compressed if the codec is available, they are at least
+ *  kMinCompressSize bytes, and they shrink by at least 1/kMinSavings.
+ *  Compression happens before the haystack is locked, so it does not hold up
+ *  other writers, and the needles are written back to back with as few
+ *  vectored writes as the system allows.
+ */
+std::vector<Needle>
+Haystack::WriteGroup(const std::vector<NeedleWrite> &writes, Codec codec)
+{
+    const bool isCompressed = codec != Codec::None and version
+        and IsCodecAvailable(codec);
+    std::vector<BufferPool::Buffer> packed(writes.size());
+    std::vector<Needle> needles(writes.size());
+    std::vector<char> headers(writes.size() * NeedleHeader::kSize);
+    std::vector<iovec> iov;
+    iov.reserve(3 * writes.size());
+    uint64_t groupSize = 0;
+    bool isTooLarge = false;
+
+    for (size_t i = 0; i < writes.size(); ++i) {
+        auto &write = writes[i];
+        char *blob = write.buff;
+        uint64_t blobSize = write.size;
+        bool isPacked = false;
+        if (isCompressed and write.size >= kMinCompressSize
+            and write.size <= BufferPool::kMaxSize) {
+            packed[i] = BufferPool::Instance().Get(
+                write.size - write.size / kMinSavings);
+            auto packedSize = Compress(codec, write.buff, write.size,
+                                       packed[i].Data(), packed[i].Size());
+            if (packedSize) {
+                blob = packed[i].Data();
+                blobSize = packedSize;
+                isPacked = true;
+            }
+        }
+
+        auto &needle = needles[i];
+        needle = Needle(id, 0, write.id, blobSize, Crc32c(blob, blobSize));
+        needle.flags.cookie = write.cookie;
+        if (isPacked) {
+            needle.flags.codec = static_cast<uint8_t>(codec);
+            needle.flags.rawSize = static_cast<uint32_t>(write.size);
+        }
+        auto header = headers.data() + i * NeedleHeader::kSize;
+        NeedleHeader::Encode(needle.flags, header);
+        auto diskSize = NeedleDiskSize(blobSize);
+        iov.push_back({header, NeedleHeader::kSize});
+        iov.push_back({blob, blobSize});
+        iov.push_back({kPadding, diskSize - NeedleHeader::kSize - blobSize});
+        groupSize += diskSize;
+        isTooLarge = isTooLarge or write.size > NeedleHeader::kMaxBlobSize;
+    }
+
+    LockGuard lk(mtx);
+    if (isReadOnly or isTooLarge or currentSize+groupSize > maxSize)
         throw HaystackErr(HsErr::NoFit);
 
-    Needle needle(id, currentSize, needleId, size);
-    file.seekp(currentSize);
-    file.write(reinterpret_cast<char*>(&needle.flags), kFlagsSize);
-    file.write(buff, size);
+    auto offset = currentSize;
+    for (auto &needle : needles) {
+        needle.offset = offset;
+        offset += NeedleDiskSize(needle.flags.size);
+    }
+    offset = currentSize;
+    for (size_t i = 0; i < iov.size(); i += kMaxIovecs) {
+        auto count = std::min(iov.size() - i, kMaxIovecs);
+        file->Write(iov.data() + i, count, offset);
+        for (size_t j = i; j < i + count; ++j)
+            offset += iov[j].iov_len;
+    }
 
-    currentSize += kFlagsSize + size;
+    currentSize += groupSize;
     isReadOnly = currentSize >= maxSize;
+    for (auto &needle : needles) {
+        stats.AddNeedle(
+            needle.flags.size, NeedleDiskSize(needle.flags.size), false);
+    }
+    stats.lastWrite = std::time(nullptr);
 
-    return needle;
+    return needles;
 }
 
 /**
@@ -154,54 +682,296 @@ Haystack::Write(uint64_t needleId, char *buff, uint64_t size)
  *
  * @param needle The haystack needle. The isDeleted flag is set to 1 after the
  *  needle is deleted.
- * @throw A HaystackErr if the Needle information does not match the haystack or
- *  what is found at the offset provided by the needle.
+ * @throw A HaystackErr if the Needle information does not match the haystack.
+ * @details See DeleteGroup.
  */
 void
 Haystack::Delete(Needle &needle)
+{
+    std::vector<Needle> needles{needle};
+    DeleteGroup(needles);
+    needle = needles.front();
+}
+
+/**
+ * Marks a group of Needles as deleted with a single append to the tombstone
+ * journal.
+ *
+ * @param needles The haystack needles. Their isDeleted flags are set to 1
+ *  after they are deleted.
+ * @throw A HaystackErr if the information of a Needle does not match the
+ *  haystack, in which case none is deleted.
+ * @details The headers are not read or written: the needles are trusted to be
+ *  the ones in the index, and the deletes are folded into their headers later,
+ *  see Fold. Needles that are already deleted are skipped.
+ */
+void
+Haystack::DeleteGroup(std::vector<Needle> &needles)
 {
     LockGuard lk(mtx);
-    constexpr auto kFlagsSize = sizeof(NeedleFlags);
 
-    if (needle.haystackId != id or needle.offset+kFlagsSize > currentSize)
-        throw HaystackErr(HsErr::BadNeedle);
+    for (auto &needle : needles) {
+        if (needle.haystackId != id or needle.offset+HeaderSize() > currentSize)
+            throw HaystackErr(HsErr::BadNeedle);
+    }
 
-    NeedleFlags nf;
-    file.seekg(needle.offset);
-    file.read(reinterpret_cast<char*>(&nf), kFlagsSize);
+    std::vector<Tombstone> added;
+    std::vector<const Needle*> deleted;
+    for (auto &needle : needles) {
+        if (needle.flags.isDeleted or tombstones.count(needle.offset))
+            continue;
+        deleted.push_back(&needle);
+        NeedleFlags nf = needle.flags;
+        nf.isDeleted = 1;
+        added.push_back({
+            needle.offset, nf.id,
+            version ? NeedleHeader::Flags(nf) : NeedleHeader::kDeletedFlag});
+    }
+    journal->Append(added);
+    for (size_t i = 0; i < added.size(); ++i) {
+        auto &needle = *deleted[i];
+        if (tombstones.emplace(added[i].offset, added[i]).second) {
+            stats.DeleteNeedle(
+                needle.flags.size,
+                NeedleEnd(needle.offset, needle.flags) - needle.offset);
+        }
+    }
+    for (auto &needle : needles)
+        needle.flags.isDeleted = 1;
 
-    if (nf.id != needle.flags.id)
-        throw HaystackErr(HsErr::BadNeedle);
+    if (tombstones.size() >= kMaxTombstones)
+        Fold();
+}
+
+/**
+ * Folds the journaled deletes into the needle headers, see Fold.
+ */
+void
+Haystack::FoldTombstones()
+{
+    LockGuard lk(mtx);
+    Fold();
+}
+
+/**
+ * @return The number of journaled deletes that are not folded yet.
+ */
+size_t
+Haystack::TombstoneCount() const noexcept
+{
+    LockGuard lk(mtx);
+    return tombstones.size();
+}
+
+/**
+ * @return The statistics of the needles in the haystack.
+ */
+VolumeStats
+Haystack::Stats() const
+{
+    LockGuard lk(mtx);
+    return stats;
+}
+
+/**
+ * Writes the deleted flags of the journaled deletes into the needle headers,
+ * in file order, syncs them, and empties the journal. The caller must hold
+ * the lock.
+ */
+void
+Haystack::Fold()
+{
+    if (tombstones.empty())
+        return;
 
-    needle.flags.isDeleted = 1;
-    if (not nf.isDeleted) {
-        const auto offset = needle.offset + offsetof(NeedleFlags, isDeleted);
-        file.seekp(offset);
-        file.write(&needle.flags.isDeleted, sizeof(char));
+    for (auto &item : tombstones) {
+        auto &tombstone = item.second;
+        const char flags = static_cast<char>(tombstone.flags);
+        file->Write(&flags, sizeof(char), tombstone.offset + (version
+            ? NeedleHeader::kFlagsOffset : NeedleHeader::kLegacyDeletedOffset));
     }
+    file->Sync();
+    journal->Clear();
+    tombstones.clear();
 }
 
 /**
- * Marks a Needle as deleted.
+ * Checks that the contents of a Needle match its checksum.
  *
  * @param needle The haystack needle.
- * @throw A HaystackErr if the Needle information does not match the haystack or
- *  what is found at the offset provided by the needle.
+ * @return True if the needle is deleted, its contents match the checksum, or
+ *  it is in a legacy file without checksums, false if the needle header cannot
+ *  be found or the data is corrupt.
  */
-std::vector<Needle>
-Haystack::Needles()
+bool
+Haystack::Verify(const Needle &needle) const
 {
-    LockGuard lk(mtx);
-    constexpr auto kFlagsSize = sizeof(NeedleFlags);
+    const auto size = Size();
+
+    if (needle.haystackId != id or needle.offset+HeaderSize() > size)
+        return false;
 
     NeedleFlags nf;
-    std::vector<Needle> needles;
-    for (uint64_t pos = 0; pos < currentSize;) {
-        file.seekg(pos);
-        file.read(reinterpret_cast<char*>(&nf), kFlagsSize);
-        needles.emplace_back(id, pos, nf);
-        pos += kFlagsSize + nf.size;
+    if (not ReadHeader(needle.offset, nf) or nf.id != needle.flags.id
+        or needle.offset+HeaderSize()+nf.size > size)
+        return false;
+    if (nf.isDeleted or not version)
+        return true;
+
+    std::vector<char> buff(nf.size);
+    file->Read(buff.data(), nf.size, needle.offset+HeaderSize());
+    return Crc32c(buff.data(), nf.size) == nf.checksum;
+}
+
+/**
+ * Walks the needle headers of the file, reading it in chunks.
+ *
+ * @param pos The offset of the needle where the walk starts, which is set to
+ *  the offset where it stops.
+ * @param end Where the walk stops.
+ * @param chunkSize The size of the chunks.
+ * @param fn The function called with the offset and the header of every
+ *  needle, which returns false to stop the walk at that needle.
+ * @return Stopped if fn returned false, and pos is the offset of that needle,
+ *  BadHeader if the walk found a header that cannot be decoded, and pos is
+ *  its offset, or else Done, and pos is the offset past the last needle.
+ */
+Haystack::WalkEnd
+Haystack::Walk(
+    uint64_t &pos,
+    uint64_t end,
+    uint64_t chunkSize,
+    const std::function<bool(uint64_t, const NeedleFlags&)> &fn) const
+{
+    ChunkReader reader(*file, end, chunkSize);
+    char header[NeedleHeader::kSize];
+    NeedleFlags nf;
+    while (pos+HeaderSize() <= end) {
+        reader.Read(header, HeaderSize(), pos);
+        if (version and not NeedleHeader::Decode(header, nf))
+            return WalkEnd::BadHeader;
+        if (not version)
+            NeedleHeader::DecodeLegacy(header, nf);
+        if (not fn(pos, nf))
+            return WalkEnd::Stopped;
+        pos = NeedleEnd(pos, nf);
+    }
+    return WalkEnd::Done;
+}
+
+/**
+ * @param start Where the range starts.
+ * @param end Where the range ends.
+ * @return True if all the bytes of the file in the range are zero, false
+ *  otherwise.
+ */
+bool
+Haystack::IsZeroed(uint64_t start, uint64_t end) const
+{
+    ChunkReader reader(*file, end, kScanChunk);
+    char buff[4096];
+    for (auto pos = start; pos < end; pos += sizeof(buff)) {
+        auto size = std::min<uint64_t>(sizeof(buff), end-pos);
+        reader.Read(buff, size, pos);
+        if (std::any_of(buff, buff+size, [](char c) { return c != 0; }))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Looks for the next needle after a header that cannot be decoded, i.e., the
+ * next aligned offset with a valid header of a needle that ends before the
+ * end. The blob of a needle may happen to hold a valid header at an aligned
+ * offset, so the needle found is only a best guess.
+ *
+ * @param offset The offset of the header that cannot be decoded.
+ * @param end Where the search stops.
+ * @param chunkSize The size of the chunks the file is read in.
+ * @return The offset of the next needle, or end if there is none.
+ */
+uint64_t
+Haystack::Resync(uint64_t offset, uint64_t end, uint64_t chunkSize) const
+{
+    if (not version)
+        return end;
+    ChunkReader reader(*file, end, chunkSize);
+    char header[NeedleHeader::kSize];
+    NeedleFlags nf;
+    auto pos = offset - offset % NeedleHeader::kAlignment;
+    for (pos += NeedleHeader::kAlignment; pos+NeedleHeader::kSize <= end;
+         pos += NeedleHeader::kAlignment) {
+        reader.Read(header, NeedleHeader::kSize, pos);
+        if (NeedleHeader::Decode(header, nf) and NeedleEnd(pos, nf) <= end)
+            return pos;
     }
+    return end;
+}
 
+/**
+ * Streams the needles in the haystack to a function, in the order in which
+ * they appear in the file, including the deleted ones.
+ *
+ * @param fn The function, which returns false to stop the scan.
+ * @param chunkSize The size of the chunks the file is read in.
+ * @param damaged A function called with every header that cannot be decoded,
+ *  if any.
+ * @return False if the function stopped the scan, true otherwise.
+ * @details The file is read in large sequential chunks, the next of which is
+ *  read ahead, and the headers are parsed out of them, so that a scan takes a
+ *  few large reads instead of one per needle. The lock is only taken to see
+ *  how far the file goes and which deletes are still journaled, so writes and
+ *  reads go on while the scan runs, and the needles written or deleted after
+ *  it starts may be missed. A header that cannot be decoded, e.g., in a
+ *  corrupt block, is reported to damaged, and the scan resumes at the next
+ *  needle that Resync finds after it, so that one bad header does not hide
+ *  the needles that follow.
+ */
+bool
+Haystack::Scan(
+    const NeedleFn &fn, uint64_t chunkSize, const DamageFn &damaged) const
+{
+    // Deletes are folded by writing the headers before they leave the map,
+    // so a delete is either copied here or found in the header.
+    uint64_t end;
+    std::map<uint64_t, Tombstone> pending;
+    {
+        LockGuard lk(mtx);
+        end = currentSize;
+        pending = tombstones;
+    }
+
+    auto visit = [&](uint64_t offset, const NeedleFlags &nf) {
+        Needle needle(id, offset, nf);
+        if (pending.count(offset))
+            needle.flags.isDeleted = 1;
+        return fn(needle);
+    };
+    uint64_t pos = 0;
+    auto walkEnd = Walk(pos, end, chunkSize, visit);
+    while (walkEnd == WalkEnd::BadHeader) {
+        auto next = Resync(pos, end, chunkSize);
+        if (damaged)
+            damaged(pos, next);
+        pos = next;
+        walkEnd = Walk(pos, end, chunkSize, visit);
+    }
+    return walkEnd != WalkEnd::Stopped;
+}
+
+/**
+ * Reconstructs the needles in the haystack by traversing the file, see Scan.
+ *
+ * @return The list of needles, including the deleted ones, in the order in
+ *  which they appear in the file.
+ */
+std::vector<Needle>
+Haystack::Needles() const
+{
+    std::vector<Needle> needles;
+    Scan([&](const Needle &needle) {
+        needles.push_back(needle);
+        return true;
+    });
     return needles;
 }
@@ -1,18 +1,28 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <exception>
-#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
+#include "codec.hh"
+#include "iobackend.hh"
 #include "needle.hh"
+#include "tombstone.hh"
 
 // Haystack errors.
 enum class HsErr
 {
     BadNeedle,
-    NoFit
+    NoFit,
+    BadChecksum,
+    BadRange
 };
 
 // Haystack exception, which will contain an HsErr code.
@@ -30,6 +40,10 @@ public:
             return "HaystackErr(BadNeedle)";
         case HsErr::NoFit:
             return "HaystackErr(NoFit)";
+        case HsErr::BadChecksum:
+            return "HaystackErr(BadChecksum)";
+        case HsErr::BadRange:
+            return "HaystackErr(BadRange)";
         default:
             return "HaystackErr(Unknown)";
         }
@@ -41,32 +55,128 @@ public:
     }
 };
 
+/**
+ * The contents of a needle to be written as part of a group, see
+ * Haystack::WriteGroup.
+ */
+struct NeedleWrite
+{
+    uint64_t id;
+    char *buff;
+    uint64_t size;
+    uint32_t cookie;
+};
+
+/**
+ * Statistics of the needles in a haystack, which it keeps up to date on every
+ * write and delete, so that they are read without scanning the file.
+ */
+struct VolumeStats
+{
+    // The live needles are counted by the size of their blobs in buckets of
+    // powers of two: below 1KB, below 2KB, and so on, and the last bucket has
+    // the needles of 16MB and more.
+    static constexpr size_t kSizeBuckets = 16;
+    static constexpr uint64_t kFirstBucketSize = 1 << 10;
+
+    uint64_t liveNeedles;
+    uint64_t deletedNeedles;
+    uint64_t liveBytes;  // On disk, including the headers and padding.
+    uint64_t garbageBytes;  // On disk, taken by the deleted needles.
+    std::array<uint64_t, kSizeBuckets> sizeHistogram;
+    int64_t lastWrite;  // The Unix time of the last write, or 0 if none.
+
+    VolumeStats();
+
+    static size_t Bucket(uint64_t size) noexcept;
+    void AddNeedle(uint64_t size, uint64_t diskSize, bool isDeleted) noexcept;
+    void DeleteNeedle(uint64_t size, uint64_t diskSize) noexcept;
+};
+
 /**
  * The Haystack component.
  *
  * It organizes multiple needles in a single file. The file is organized as an
- * array of needles. Each needle has an ID, a size attribute, a deleted status
- * flag attribute, and a binary blob attribute. The first three are fixed size,
- * the blob is variable, and the size attribute indicates the size of the blob
- * in terms of bytes. Thus, the information in each Haystack file is self
- * contained because everything, such as the number of needles, which are
- * deleted, and so on, can be reconstructed by simply traversing the file.
+ * array of needles. Each needle has a header with an ID, a size attribute, a
+ * deleted status flag attribute, a cookie, and a CRC32C checksum of the blob,
+ * followed by the binary blob attribute. The header is fixed size, the blob is
+ * variable, and the size attribute indicates the size of the blob in terms of
+ * bytes. Thus, the information in each Haystack file is self contained because
+ * everything, such as the number of needles, which are deleted, and so on, can
+ * be reconstructed by simply traversing the file. See NeedleHeader for the
+ * on-disk format.
+ *
+ * Deleted needles are recorded in an append-only TombstoneJournal next to the
+ * file, and they are folded into the deleted flags of their headers in file
+ * order once kMaxTombstones of them pile up, when the haystack is synced or
+ * closed, or when it is opened after a crash. Until then the journaled needles
+ * are reported as deleted and cannot be read.
+ *
+ * The haystack counts its live and deleted needles and their bytes in
+ * VolumeStats, which it finds while it opens the file and updates on every
+ * write and delete, so that they are read without scanning the file.
+ *
+ * Files written in the legacy, unversioned format are opened in read-only mode
+ * and can still be read and have needles deleted, but their needles carry no
+ * checksum.
  */
 class Haystack
 {
-    mutable std::mutex mtx;  // To protect writing/reading to the file.
-    mutable std::fstream file;  // The file object.
+public:
+    // The number of journaled deletes that makes the haystack fold them into
+    // the needle headers.
+    static constexpr size_t kMaxTombstones = 4096;
+
+    // The size of the chunks read by Scan.
+    static constexpr uint64_t kScanChunk = 4 << 20;
+
+    // Called by Scan for every needle, until it returns false.
+    using NeedleFn = std::function<bool(const Needle&)>;
+
+    // Called by Scan with the offset of every header it cannot decode, and
+    // the offset where it resumes, which is the end of the file if no needle
+    // follows.
+    using DamageFn = std::function<void(uint64_t, uint64_t)>;
+
+private:
+    // How a walk of the needle headers ends, see Walk.
+    enum class WalkEnd
+    {
+        Done,  // Past the last needle.
+        Stopped,  // At the needle the function returned false for.
+        BadHeader  // At a header that cannot be decoded.
+    };
+
+    mutable std::mutex mtx;  // To protect writing to the file.
+    std::unique_ptr<VolumeFile> file;  // The file object.
     std::string fname;  // The name of the file.
     uint64_t maxSize;  // The maximum size of the file.
     uint64_t currentSize;  // The current size of the file.
     unsigned id;  // The id of the object.
     bool isReadOnly;  // Read-only status flag.
+    uint8_t version;  // The on-disk format version of the needle headers.
+    std::unique_ptr<TombstoneJournal> journal;  // The journal of deletes.
+    std::map<uint64_t, Tombstone> tombstones;  // Unfolded deletes by offset.
+    VolumeStats stats;  // The needles in the file.
+
+    uint64_t HeaderSize() const noexcept;
+    uint64_t NeedleEnd(uint64_t offset, const NeedleFlags &nf) const noexcept;
+    bool ReadHeader(uint64_t offset, NeedleFlags &nf) const;
+    WalkEnd Walk(
+        uint64_t &pos,
+        uint64_t end,
+        uint64_t chunkSize,
+        const std::function<bool(uint64_t, const NeedleFlags&)> &fn) const;
+    uint64_t Resync(uint64_t offset, uint64_t end, uint64_t chunkSize) const;
+    bool IsZeroed(uint64_t start, uint64_t end) const;
+    void Fold();
 
 public:
     Haystack(unsigned id,
              const std::string &path,
              uint64_t maxSize,
-             bool fromFile = false);
+             bool fromFile = false,
+             std::shared_ptr<IoBackend> io = nullptr);
     Haystack(const Haystack &hs) = delete;
     Haystack(Haystack&& hs) = delete;
     Haystack& operator=(const Haystack &hs) = delete;
@@ -75,8 +185,33 @@ public:
 
     uint64_t Id() const noexcept { return id; }
     uint64_t FreeCount() const noexcept;
-    void Read(const Needle &needle, char *buff) const;
-    Needle Write(uint64_t id, char *buff, uint64_t size);
+    uint64_t Size() const noexcept;
+    bool IsReadOnly() const noexcept;
+    void Seal() noexcept;
+    void Sync();
+    uint8_t Version() const noexcept { return version; }
+    void Read(const Needle &needle, char *buff, bool verify = true) const;
+    void ReadStored(
+        const Needle &needle, char *buff, bool verify = true) const;
+    void ReadRange(
+        const Needle &needle, const ByteRange &range, char *buff) const;
+    Needle Write(
+        uint64_t id,
+        char *buff,
+        uint64_t size,
+        uint32_t cookie = 0,
+        Codec codec = Codec::None);
+    std::vector<Needle> WriteGroup(
+        const std::vector<NeedleWrite> &writes, Codec codec = Codec::None);
     void Delete(Needle &needle);
-    std::vector<Needle> Needles();
+    void DeleteGroup(std::vector<Needle> &needles);
+    void FoldTombstones();
+    size_t TombstoneCount() const noexcept;
+    VolumeStats Stats() const;
+    bool Verify(const Needle &needle) const;
+    bool Scan(
+        const NeedleFn &fn,
+        uint64_t chunkSize = kScanChunk,
+        const DamageFn &damaged = nullptr) const;
+    std::vector<Needle> Needles() const;
 };
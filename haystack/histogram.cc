@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+#include "histogram.hh"
+
+// Define them here to avoid link errors
+constexpr unsigned Histogram::kSubBucketBits;
+constexpr uint64_t Histogram::kSubBuckets;
+constexpr size_t Histogram::kBuckets;
+
+/**
+ * Initializes an empty histogram.
+ */
+Histogram::Histogram()
+    : counts(kBuckets),
+      totalCount(0),
+      minValue(UINT64_MAX),
+      maxValue(0),
+      sum(0)
+{}
+
+/**
+ * @param value A value.
+ * @return The index of the bucket where the value is counted. Values below
+ *  kSubBuckets get a bucket of their own, and every power of two range above
+ *  that is split into kSubBuckets buckets.
+ */
+size_t
+Histogram::Index(uint64_t value) noexcept
+{
+    if (value < kSubBuckets)
+        return value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - kSubBucketBits;
+    return (shift + 1) * kSubBuckets + (value >> shift) - kSubBuckets;
+}
+
+/**
+ * @param index A bucket index.
+ * @return The smallest value counted in the bucket.
+ */
+uint64_t
+Histogram::LowestEquivalent(size_t index) noexcept
+{
+    if (index < kSubBuckets)
+        return index;
+    unsigned shift = index / kSubBuckets - 1;
+    return (kSubBuckets + index % kSubBuckets) << shift;
+}
+
+/**
+ * @param index A bucket index.
+ * @return The largest value counted in the bucket.
+ */
+uint64_t
+Histogram::HighestEquivalent(size_t index) noexcept
+{
+    if (index < kSubBuckets)
+        return index;
+    unsigned shift = index / kSubBuckets - 1;
+    return LowestEquivalent(index) + ((uint64_t(1) << shift) - 1);
+}
+
+/**
+ * Records a value.
+ *
+ * @param value The value.
+ */
+void
+Histogram::Record(uint64_t value) noexcept
+{
+    Record(value, 1);
+}
+
+/**
+ * Records several occurrences of a value.
+ *
+ * @param value The value.
+ * @param count The number of occurrences.
+ */
+void
+Histogram::Record(uint64_t value, uint64_t count) noexcept
+{
+    if (not count)
+        return;
+    counts[Index(value)] += count;
+    totalCount += count;
+    minValue = std::min(minValue, value);
+    maxValue = std::max(maxValue, value);
+    sum += static_cast<long double>(value) * count;
+}
+
+/**
+ * Adds the values recorded in another histogram to this one.
+ *
+ * @param other The other histogram.
+ */
+void
+Histogram::Merge(const Histogram &other) noexcept
+{
+    for (size_t i = 0; i < kBuckets; ++i)
+        counts[i] += other.counts[i];
+    totalCount += other.totalCount;
+    minValue = std::min(minValue, other.minValue);
+    maxValue = std::max(maxValue, other.maxValue);
+    sum += other.sum;
+}
+
+/**
+ * Discards all the recorded values.
+ */
+void
+Histogram::Reset() noexcept
+{
+    std::fill(counts.begin(), counts.end(), 0);
+    totalCount = 0;
+    minValue = UINT64_MAX;
+    maxValue = 0;
+    sum = 0;
+}
+
+/**
+ * @return The mean of the recorded values, or 0 if there are none.
+ */
+double
+Histogram::Mean() const noexcept
+{
+    return totalCount ? static_cast<double>(sum / totalCount) : 0;
+}
+
+/**
+ * @param percentile A percentile between 0 and 100.
+ * @return The smallest value such that the given percentage of the recorded
+ *  values are less than or equal to it, up to the histogram's precision. The
+ *  result never exceeds the largest recorded value.
+ */
+uint64_t
+Histogram::Percentile(double percentile) const noexcept
+{
+    if (not totalCount)
+        return 0;
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    auto target = static_cast<uint64_t>(
+        std::ceil(percentile / 100 * totalCount));
+    target = std::max<uint64_t>(target, 1);
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBuckets; ++i) {
+        seen += counts[i];
+        if (seen >= target)
+            return std::min(HighestEquivalent(i), maxValue);
+    }
+    return maxValue;
+}
+
+/**
+ * Prints the percentile distribution in the text format produced by the HDR
+ * histogram tools, which can be plotted with the HdrHistogram plotter.
+ *
+ * @param os The output stream.
+ * @param scale The values are divided by scale before they are printed, e.g.,
+ *  1000 to print nanoseconds as microseconds.
+ * @param ticksPerHalf The number of lines printed every time the distance to
+ *  the 100th percentile is halved.
+ */
+void
+Histogram::PrintPercentiles(
+    std::ostream &os, double scale, unsigned ticksPerHalf) const
+{
+    auto flags = os.flags();
+    os << std::setw(12) << "Value" << ' ' << std::setw(14) << "Percentile"
+       << ' ' << std::setw(10) << "TotalCount" << ' ' << std::setw(16)
+       << "1/(1-Percentile)" << "\n\n" << std::fixed;
+
+    auto line = [&](double percentile) {
+        auto value = Percentile(percentile);
+        uint64_t upTo = 0;
+        for (size_t i = 0; i <= Index(value); ++i)
+            upTo += counts[i];
+        os << std::setprecision(3) << std::setw(12) << value / scale << ' '
+           << std::setprecision(12) << std::setw(14) << percentile / 100
+           << ' ' << std::setw(10) << upTo;
+        if (percentile < 100) {
+            os << ' ' << std::setprecision(2) << std::setw(16)
+               << 100 / (100 - percentile);
+        }
+        os << '\n';
+        return value;
+    };
+
+    bool isDone = not totalCount;
+    for (int half = 0; not isDone and half < 64; ++half) {
+        double low = 100 - std::ldexp(100.0, -half);
+        double width = std::ldexp(50.0, -half);
+        for (unsigned tick = 0; not isDone and tick < ticksPerHalf; ++tick)
+            isDone = line(low + width * tick / ticksPerHalf) >= maxValue;
+    }
+    if (totalCount)
+        line(100);
+
+    os << std::setprecision(3) << "#[Mean    = " << Mean() / scale
+       << ", Max = " << Max() / scale << "]\n"
+       << "#[Total count    = " << totalCount << "]\n";
+    os.flags(flags);
+}
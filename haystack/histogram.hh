@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+/**
+ * A histogram of non-negative integer values, e.g., latencies in nanoseconds,
+ * with the same bucketing scheme as an HDR histogram.
+ *
+ * Every power of two range is split into kSubBuckets linear sub-buckets, so
+ * values are recorded with a relative error below 1/kSubBuckets over the whole
+ * 64 bit range, using a fixed amount of memory. Recording is a few shifts and
+ * an increment. A Histogram is not thread safe; threads should record into
+ * their own histograms and Merge them.
+ */
+class Histogram
+{
+public:
+    static constexpr unsigned kSubBucketBits = 7;
+    static constexpr uint64_t kSubBuckets = 1 << kSubBucketBits;
+
+private:
+    static constexpr size_t kBuckets = kSubBuckets * (65 - kSubBucketBits);
+
+    std::vector<uint64_t> counts;
+    uint64_t totalCount;
+    uint64_t minValue;
+    uint64_t maxValue;
+    long double sum;
+
+    static size_t Index(uint64_t value) noexcept;
+    static uint64_t LowestEquivalent(size_t index) noexcept;
+    static uint64_t HighestEquivalent(size_t index) noexcept;
+
+public:
+    Histogram();
+
+    void Record(uint64_t value) noexcept;
+    void Record(uint64_t value, uint64_t count) noexcept;
+    void Merge(const Histogram &other) noexcept;
+    void Reset() noexcept;
+
+    uint64_t Count() const noexcept { return totalCount; }
+    uint64_t Min() const noexcept { return totalCount ? minValue : 0; }
+    uint64_t Max() const noexcept { return maxValue; }
+    double Mean() const noexcept;
+    uint64_t Percentile(double percentile) const noexcept;
+
+    void PrintPercentiles(
+        std::ostream &os, double scale = 1, unsigned ticksPerHalf = 5) const;
+};
@@ -0,0 +1,173 @@
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <boost/filesystem.hpp>
+
+#include "iobackend.hh"
+#include "uring.hh"
+
+namespace {
+namespace fs = boost::filesystem;
+using LockGuard = std::lock_guard<std::mutex>;
+
+/**
+ * A volume file backed by a buffered std::fstream.
+ *
+ * The stream has a single position, so every request takes a lock to seek
+ * and transfer the data.
+ */
+class FstreamFile : public VolumeFile
+{
+    std::mutex mtx;
+    std::fstream file;
+    std::string fname;
+
+public:
+    FstreamFile(const std::string &fname, bool create)
+        : mtx(), file(), fname(fname)
+    {
+        auto mode = std::ios::in | std::ios::out | std::ios::binary;
+        if (create)
+            mode |= std::ios::trunc;
+        file.exceptions(std::ios::badbit);
+        file.open(fname, mode);
+        if (not file.is_open())
+            throw std::ios::failure("cannot open " + fname);
+    }
+
+    ~FstreamFile() override
+    {
+        try {
+            file.flush();
+            file.close();
+        }
+        catch (std::exception &err) {
+            std::cerr << "ERROR: " << fname << ": " << err.what() << std::endl;
+        }
+    }
+
+    void
+    Read(const iovec *iov, size_t count, uint64_t offset) override
+    {
+        LockGuard lk(mtx);
+        file.clear();
+        file.seekg(offset);
+        for (size_t i = 0; i < count; ++i) {
+            auto buff = static_cast<char*>(iov[i].iov_base);
+            file.read(buff, iov[i].iov_len);
+            auto nRead = static_cast<size_t>(file.gcount());
+            if (nRead < iov[i].iov_len) {
+                // Past the end of the file.
+                std::memset(buff+nRead, 0, iov[i].iov_len-nRead);
+                file.clear();
+            }
+        }
+    }
+
+    void
+    Write(const iovec *iov, size_t count, uint64_t offset) override
+    {
+        LockGuard lk(mtx);
+        file.clear();
+        file.seekp(offset);
+        for (size_t i = 0; i < count; ++i)
+            file.write(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+    }
+
+    void
+    Sync() override
+    {
+        LockGuard lk(mtx);
+        file.flush();
+
+        // The stream does not expose its descriptor, so the data is synced
+        // through another one.
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0 or ::fdatasync(fd)) {
+            auto err = errno;
+            if (fd >= 0)
+                ::close(fd);
+            throw std::system_error(
+                err, std::generic_category(), "fdatasync " + fname);
+        }
+        ::close(fd);
+    }
+
+    void
+    Truncate(uint64_t size) override
+    {
+        LockGuard lk(mtx);
+        file.flush();
+        if (fs::file_size(fname) != size)
+            fs::resize_file(fname, size);
+    }
+};
+
+class FstreamBackend : public IoBackend
+{
+public:
+    std::unique_ptr<VolumeFile>
+    Open(const std::string &fname, bool create) override
+    {
+        return std::unique_ptr<VolumeFile>(new FstreamFile(fname, create));
+    }
+
+    const char*
+    Name() const noexcept override
+    {
+        return "fstream";
+    }
+};
+
+} // namespace
+
+/**
+ * @return The default I/O backend, which does buffered I/O through
+ *  std::fstream.
+ */
+std::shared_ptr<IoBackend>
+MakeFstreamBackend()
+{
+    return std::make_shared<FstreamBackend>();
+}
+
+/**
+ * Creates an I/O backend by name.
+ *
+ * @param name Either "fstream" or "uring". The latter does direct I/O through
+ *  a single io_uring shared by all the volumes.
+ * @return The backend. If the io_uring backend cannot be set up, e.g., the
+ *  kernel does not support it, then the fstream backend is returned instead.
+ * @throw std::invalid_argument if the name is not recognized.
+ */
+std::shared_ptr<IoBackend>
+MakeIoBackend(const std::string &name)
+{
+    if (name == "fstream")
+        return MakeFstreamBackend();
+    if (name != "uring")
+        throw std::invalid_argument("unknown I/O backend: " + name);
+
+    try {
+        return std::make_shared<UringBackend>();
+    }
+    catch (std::exception &err) {
+        std::cerr << "WARNING: io_uring unavailable, using fstream: "
+                  << err.what() << std::endl;
+        return MakeFstreamBackend();
+    }
+}
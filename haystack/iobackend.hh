@@ -0,0 +1,75 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * A file that holds a haystack volume.
+ *
+ * All reads and writes are positional and gather/scatter a list of buffers,
+ * so a needle header and its blob can be transferred with a single request.
+ * Implementations must allow concurrent reads, and concurrent writes to
+ * ranges that do not overlap. Errors are reported with exceptions derived from
+ * std::exception.
+ */
+class VolumeFile
+{
+public:
+    virtual ~VolumeFile() = default;
+
+    // Reads into the buffers starting at the offset. Bytes past the end of the
+    // file are read as zeros.
+    virtual void Read(const iovec *iov, size_t count, uint64_t offset) = 0;
+
+    // Writes the buffers starting at the offset.
+    virtual void Write(const iovec *iov, size_t count, uint64_t offset) = 0;
+
+    // Flushes any written data to the device.
+    virtual void Sync() = 0;
+
+    // Sets the size of the file.
+    virtual void Truncate(uint64_t size) = 0;
+
+    void
+    Read(char *buff, uint64_t size, uint64_t offset)
+    {
+        iovec iov{buff, size};
+        Read(&iov, 1, offset);
+    }
+
+    void
+    Write(const char *buff, uint64_t size, uint64_t offset)
+    {
+        iovec iov{const_cast<char*>(buff), size};
+        Write(&iov, 1, offset);
+    }
+};
+
+/**
+ * The I/O backend used by haystacks to open their files.
+ *
+ * A single backend is usually shared by all the haystacks of a Store, which
+ * lets backends share resources, e.g., a submission queue, across volumes.
+ */
+class IoBackend
+{
+public:
+    virtual ~IoBackend() = default;
+
+    // Opens a volume file, creating or truncating it if create is true.
+    virtual std::unique_ptr<VolumeFile>
+    Open(const std::string &fname, bool create) = 0;
+
+    // The name of the backend, e.g., for logging.
+    virtual const char* Name() const noexcept = 0;
+};
+
+std::shared_ptr<IoBackend>
+MakeFstreamBackend();
+
+std::shared_ptr<IoBackend>
+MakeIoBackend(const std::string &name);
@@ -0,0 +1,104 @@
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "ioqueue.hh"
+
+namespace {
+using UniqueLock = std::unique_lock<std::mutex>;
+}
+
+/**
+ * Initializes an IoQueue and starts its workers.
+ *
+ * @param name The name of the device, used to report metrics.
+ * @param workers The number of worker threads. At least one is started.
+ * @param capacity The maximum number of requests waiting to be served.
+ */
+IoQueue::IoQueue(std::string name, unsigned workers, size_t capacity)
+    : name(std::move(name)),
+      capacity(capacity ? capacity : 1),
+      mtx(),
+      notEmpty(),
+      notFull(),
+      tasks(),
+      active(0),
+      maxDepth(0),
+      completed(0),
+      isStopped(false),
+      workers()
+{
+    for (unsigned i = 0; i < (workers ? workers : 1); ++i)
+        this->workers.emplace_back(&IoQueue::Work, this);
+}
+
+/**
+ * Dtor. Serves the requests already in the queue, and then stops the workers.
+ */
+IoQueue::~IoQueue()
+{
+    {
+        UniqueLock lk(mtx);
+        isStopped = true;
+    }
+    notEmpty.notify_all();
+    for (auto &thr : workers)
+        thr.join();
+}
+
+/**
+ * Adds a request to the queue, waiting for room if the queue is full.
+ *
+ * @param task The request.
+ */
+void
+IoQueue::Submit(std::function<void()> task)
+{
+    UniqueLock lk(mtx);
+    notFull.wait(lk, [this] { return tasks.size() < capacity; });
+    tasks.push_back(std::move(task));
+    if (tasks.size() + active > maxDepth)
+        maxDepth = tasks.size() + active;
+    lk.unlock();
+    notEmpty.notify_one();
+}
+
+/**
+ * Serves requests until the queue is stopped and empty.
+ */
+void
+IoQueue::Work()
+{
+    UniqueLock lk(mtx);
+    for (;;) {
+        notEmpty.wait(lk, [this] { return isStopped or not tasks.empty(); });
+        if (tasks.empty())
+            return;
+
+        auto task = std::move(tasks.front());
+        tasks.pop_front();
+        ++active;
+        lk.unlock();
+        notFull.notify_one();
+
+        // Exceptions are delivered to the caller through the task's future.
+        task();
+
+        lk.lock();
+        --active;
+        ++completed;
+    }
+}
+
+/**
+ * @return The queue depth metrics.
+ */
+IoQueue::Stats
+IoQueue::GetStats() const
+{
+    UniqueLock lk(mtx);
+    return Stats{tasks.size() + active, maxDepth, completed};
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * A bounded queue of I/O requests for one device, served by a dedicated set of
+ * worker threads.
+ *
+ * Every device gets its own queue so that a slow or busy disk only delays the
+ * requests for the haystacks on that disk. Callers block while the queue is
+ * full, which keeps the number of outstanding requests per device bounded.
+ */
+class IoQueue
+{
+public:
+    // Queue depth metrics for the device.
+    struct Stats
+    {
+        size_t depth;  // Requests waiting or being served right now.
+        size_t maxDepth;  // The largest depth seen so far.
+        uint64_t completed;  // Requests served so far.
+    };
+
+private:
+    std::string name;
+    size_t capacity;
+
+    mutable std::mutex mtx;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<std::function<void()>> tasks;
+    size_t active;
+    size_t maxDepth;
+    uint64_t completed;
+    bool isStopped;
+    std::vector<std::thread> workers;
+
+    void Submit(std::function<void()> task);
+    void Work();
+
+public:
+    IoQueue(std::string name, unsigned workers, size_t capacity);
+    IoQueue(const IoQueue &queue) = delete;
+    IoQueue& operator=(const IoQueue &queue) = delete;
+    ~IoQueue();
+
+    // Runs fn on one of the workers and waits for its result. Exceptions
+    // thrown by fn are rethrown to the caller.
+    template <typename Fn>
+    auto Run(Fn fn) -> decltype(fn());
+
+    const std::string &Name() const noexcept { return name; }
+    size_t Workers() const noexcept { return workers.size(); }
+    Stats GetStats() const;
+};
+
+template <typename Fn>
+auto
+IoQueue::Run(Fn fn) -> decltype(fn())
+{
+    using Result = decltype(fn());
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+    auto result = task->get_future();
+    Submit([task] { (*task)(); });
+    return result.get();
+}
@@ -0,0 +1,148 @@
+#include <signal.h>
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+#include "listener.hh"
+
+// Define them here to avoid link errors
+constexpr unsigned Listener::kTimeout;
+
+/**
+ * Initializes a Listener. It does not open a listening socket until Run is
+ * executed.
+ *
+ * @param timeout How long a connection may stay open.
+ * @param busy The counter of connections refused because the pool is full.
+ * @param handler The function that serves a connection.
+ */
+Listener::Listener(
+    std::chrono::seconds timeout, Counter &busy, Handler handler)
+    : ioService(),
+      acceptor(ioService),
+      timeout(timeout),
+      busy(busy),
+      handler(std::move(handler)),
+      pool(nullptr)
+{}
+
+/**
+ * Listens for connections and serves them until Stop is called, and then
+ * waits for the connections being served.
+ *
+ * @param ipAddr The IP address where it listens for connections.
+ * @param port The port number where it listens for connections.
+ * @param threads The number of threads serving connections, or 0 for one per
+ *  core.
+ * @param backlog The maximum number of connections waiting for a thread.
+ * @throw boost::system::system_error if it cannot listen on the port.
+ */
+void
+Listener::Run(
+    const std::string &ipAddr, unsigned port, unsigned threads, size_t backlog)
+{
+    using namespace boost::asio;
+    ip::tcp::endpoint endpoint(ip::address::from_string(ipAddr), port);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(ip::tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+
+    // The pool is destroyed when Run returns, which drains it.
+    ThreadPool threadPool(threads, backlog);
+    pool = &threadPool;
+    Accept();
+    ioService.run();
+    pool = nullptr;
+}
+
+/**
+ * Stops accepting connections, which makes Run return once the connections
+ * already accepted are served. It may be called from any thread, and before
+ * Run.
+ */
+void
+Listener::Stop()
+{
+    ioService.post([this] {
+        boost::system::error_code err;
+        acceptor.close(err);
+    });
+}
+
+/**
+ * Waits for the next connection.
+ */
+void
+Listener::Accept()
+{
+    std::unique_ptr<TcpStream> conn(new TcpStream);
+    auto raw = conn.get();
+    acceptor.async_accept(
+        *raw->rdbuf(), [this, raw](const boost::system::error_code &err) {
+            std::unique_ptr<TcpStream> conn(raw);
+            if (err == boost::asio::error::operation_aborted)
+                return;
+            if (err)
+                std::cerr << "ERROR: " << err.message() << std::endl;
+            else
+                Serve(std::move(conn));
+            Accept();
+        });
+    conn.release();
+}
+
+/**
+ * Hands a connection to the pool, or refuses it if the pool is full.
+ *
+ * @param conn The connection.
+ */
+void
+Listener::Serve(std::unique_ptr<TcpStream> conn)
+{
+    conn->expires_after(timeout);
+    auto raw = conn.get();
+    auto task = [this, raw] { handler(std::unique_ptr<TcpStream>(raw)); };
+    if (pool->TrySubmit(task))
+        conn.release();
+    else {
+        busy.Inc();
+        *conn << "err Busy\n";
+        conn->flush();
+    }
+}
+
+/**
+ * Starts waiting for SIGINT and SIGTERM.
+ *
+ * @param fn The function called on the first of them.
+ */
+SignalHandler::SignalHandler(std::function<void()> fn)
+    : ioService(),
+      signals(ioService, SIGINT, SIGTERM),
+      thr()
+{
+    signals.async_wait(
+        [fn](const boost::system::error_code &err, int) {
+            if (not err)
+                fn();
+        });
+    thr = std::thread([this] { ioService.run(); });
+}
+
+/**
+ * Dtor. Stops waiting for signals.
+ */
+SignalHandler::~SignalHandler()
+{
+    ioService.stop();
+    thr.join();
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <boost/asio.hpp>
+
+#include "metrics.hh"
+#include "threadpool.hh"
+
+/**
+ * Accepts the connections of a server and serves them on a ThreadPool until it
+ * is stopped.
+ *
+ * Every connection has a deadline, after which reads and writes on it fail.
+ * Stop closes the listening socket, and Run then waits for the connections
+ * that were already accepted, so draining a server takes at most the timeout.
+ * Connections that arrive while the backlog of the pool is full are refused
+ * with |err Busy|.
+ */
+class Listener
+{
+public:
+    using TcpStream = boost::asio::ip::tcp::iostream;
+    using Handler = std::function<void(std::unique_ptr<TcpStream>)>;
+
+    // The default number of seconds a connection may stay open.
+    static constexpr unsigned kTimeout = 30;
+
+private:
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::chrono::seconds timeout;
+    Counter &busy;
+    Handler handler;
+    ThreadPool *pool;
+
+    void Accept();
+    void Serve(std::unique_ptr<TcpStream> conn);
+
+public:
+    Listener(std::chrono::seconds timeout, Counter &busy, Handler handler);
+    Listener(const Listener &listener) = delete;
+    Listener& operator=(const Listener &listener) = delete;
+
+    void Run(
+        const std::string &ipAddr,
+        unsigned port,
+        unsigned threads = 0,
+        size_t backlog = ThreadPool::kBacklog);
+    void Stop();
+};
+
+/**
+ * Calls a function, e.g., a server's Stop, from a thread of its own when the
+ * process receives SIGINT or SIGTERM.
+ */
+class SignalHandler
+{
+    boost::asio::io_service ioService;
+    boost::asio::signal_set signals;
+    std::thread thr;
+
+public:
+    explicit SignalHandler(std::function<void()> fn);
+    SignalHandler(const SignalHandler &handler) = delete;
+    SignalHandler& operator=(const SignalHandler &handler) = delete;
+    ~SignalHandler();
+};
@@ -0,0 +1,510 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "loadgen.hh"
+#include "storeconfig.hh"
+
+namespace {
+using TcpStream = boost::asio::ip::tcp::iostream;
+using LockGuard = std::lock_guard<std::mutex>;
+
+/**
+ * Reads a reply of the form |ok <size><newline><bytes...>|.
+ *
+ * @param conn The connection.
+ * @return True if the reply is ok and all the bytes are received.
+ */
+bool
+ReadBlob(TcpStream &conn)
+{
+    std::string line, status;
+    uint64_t size = 0;
+    std::getline(conn, line);
+    std::istringstream(line) >> status >> size;
+    if (status != "ok")
+        return false;
+    std::vector<char> buf(size);
+    conn.read(buf.data(), size);
+    return static_cast<uint64_t>(conn.gcount()) == size;
+}
+
+/**
+ * @param conn The connection.
+ * @return The first word of the reply.
+ */
+std::string
+ReadStatus(TcpStream &conn)
+{
+    std::string line, status;
+    std::getline(conn, line);
+    std::istringstream(line) >> status;
+    return status == "ok" ? status : line;
+}
+}
+
+// Define them here to avoid link errors
+constexpr uint64_t SizeDistribution::kMaxSize;
+
+/**
+ * Parses a size distribution.
+ *
+ * @param spec The distribution, e.g., uniform:1K:64K.
+ * @throw std::invalid_argument if the distribution cannot be parsed.
+ */
+SizeDistribution::SizeDistribution(const std::string &spec)
+    : kind(Kind::Fixed), a(0), b(0), sigma(0)
+{
+    std::vector<std::string> parts;
+    std::istringstream iss(spec);
+    for (std::string part; std::getline(iss, part, ':');)
+        parts.push_back(part);
+
+    auto bad = std::invalid_argument("bad size distribution: " + spec);
+    if (parts.size() == 2 and parts[0] == "fixed")
+        a = ParseSize(parts[1]);
+    else if (parts.size() == 3 and parts[0] == "uniform") {
+        kind = Kind::Uniform;
+        a = ParseSize(parts[1]);
+        b = ParseSize(parts[2]);
+        if (a > b)
+            throw bad;
+    }
+    else if (parts.size() == 3 and parts[0] == "lognormal") {
+        kind = Kind::LogNormal;
+        a = ParseSize(parts[1]);
+        try {
+            sigma = std::stod(parts[2]);
+        }
+        catch (std::exception&) {
+            throw bad;
+        }
+        if (not a or sigma < 0)
+            throw bad;
+    }
+    else
+        throw bad;
+}
+
+/**
+ * @param rng The random number generator.
+ * @return An object size.
+ */
+uint64_t
+SizeDistribution::operator()(std::mt19937_64 &rng) const
+{
+    double size = a;
+    switch (kind) {
+    case Kind::Fixed:
+        break;
+    case Kind::Uniform:
+        size = std::uniform_int_distribution<uint64_t>(a, b)(rng);
+        break;
+    case Kind::LogNormal:
+        size = std::lognormal_distribution<double>(std::log(a), sigma)(rng);
+        break;
+    }
+    return std::min<uint64_t>(std::max(size, 1.0), kMaxSize);
+}
+
+/**
+ * Initializes a Zipf distribution. The cumulative probabilities are computed
+ * up front, so every draw is a binary search.
+ *
+ * @param n The number of ranks.
+ * @param s The exponent.
+ */
+ZipfDistribution::ZipfDistribution(size_t n, double s)
+    : cdf(n)
+{
+    double sum = 0;
+    for (size_t k = 0; k < n; ++k) {
+        sum += 1 / std::pow(k + 1, s);
+        cdf[k] = sum;
+    }
+    for (auto &p : cdf)
+        p /= sum;
+}
+
+/**
+ * @param rng The random number generator.
+ * @return A rank in [0, n), or 0 if n is 0.
+ */
+size_t
+ZipfDistribution::operator()(std::mt19937_64 &rng) const
+{
+    auto p = std::uniform_real_distribution<double>()(rng);
+    auto it = std::lower_bound(cdf.begin(), cdf.end(), p);
+    if (it == cdf.end())
+        return cdf.empty() ? 0 : cdf.size() - 1;
+    return it - cdf.begin();
+}
+
+/**
+ * @param op A request type.
+ * @return The name of the request type.
+ */
+const char *
+OpName(LoadGen::Op op)
+{
+    switch (op) {
+    case LoadGen::kRead:
+        return "read";
+    case LoadGen::kWrite:
+        return "write";
+    case LoadGen::kDelete:
+        return "delete";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * Prints the throughput and latency of every request type. Latencies are in
+ * microseconds.
+ *
+ * @param os The output stream.
+ */
+void
+LoadGen::Report::Print(std::ostream &os) const
+{
+    auto flags = os.flags();
+    auto seconds = elapsed.count();
+    os << std::left << std::setw(8) << "op" << std::right
+       << std::setw(10) << "count" << std::setw(8) << "errors"
+       << std::setw(10) << "ops/s" << std::setw(10) << "mean"
+       << std::setw(10) << "p50" << std::setw(10) << "p99"
+       << std::setw(10) << "p999" << std::setw(10) << "max" << '\n'
+       << std::fixed << std::setprecision(1);
+    for (int op = 0; op < kOps; ++op) {
+        auto &hist = latency[op];
+        os << std::left << std::setw(8) << OpName(static_cast<Op>(op))
+           << std::right << std::setw(10) << hist.Count()
+           << std::setw(8) << errors[op]
+           << std::setw(10) << (seconds > 0 ? hist.Count() / seconds : 0)
+           << std::setw(10) << hist.Mean() / 1000
+           << std::setw(10) << hist.Percentile(50) / 1000.0
+           << std::setw(10) << hist.Percentile(99) / 1000.0
+           << std::setw(10) << hist.Percentile(99.9) / 1000.0
+           << std::setw(10) << hist.Max() / 1000.0 << '\n';
+    }
+    os.flags(flags);
+}
+
+/**
+ * Initializes a LoadGen. No requests are sent until Preload or Run are called.
+ *
+ * @param config The load generator settings.
+ * @throw std::invalid_argument if the settings are not valid.
+ */
+LoadGen::LoadGen(const LoadGenConfig &config)
+    : config(config),
+      sizes(config.sizes),
+      payload(SizeDistribution::kMaxSize),
+      readIds(),
+      writtenMtx(),
+      writtenIds(),
+      nextNeedleId(config.firstNeedleId),
+      volumeCounter(0),
+      volumeMtx(),
+      volumes()
+{
+    if (config.readPct + config.writePct + config.deletePct != 100)
+        throw std::invalid_argument("the request mix must add up to 100");
+    if (not config.threads)
+        throw std::invalid_argument("at least one thread is needed");
+    if (config.storeIpAddr.empty()
+        and (config.dirIpAddr.empty() or config.cacheIpAddr.empty()))
+        throw std::invalid_argument("no Directory and Cache, or Store");
+
+    std::mt19937_64 rng;
+    for (auto &c : payload)
+        c = static_cast<char>(rng());
+}
+
+/**
+ * Writes the objects that are read during the run.
+ *
+ * @throw std::runtime_error if any of the objects cannot be written.
+ */
+void
+LoadGen::Preload()
+{
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> failed(0);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < config.threads; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937_64 rng(t);
+            uint64_t id;
+            while (next++ < config.preload) {
+                if (not Write(rng, id)) {
+                    ++failed;
+                    continue;
+                }
+                LockGuard lk(writtenMtx);
+                readIds.push_back(id);
+            }
+        });
+    }
+    for (auto &thr : threads)
+        thr.join();
+    if (failed)
+        throw std::runtime_error(
+            "preload: " + std::to_string(failed) + " writes failed");
+
+    // Spread the popular objects over the whole ID space.
+    std::shuffle(readIds.begin(), readIds.end(), std::mt19937_64());
+}
+
+/**
+ * Runs the load for the configured duration.
+ *
+ * @return The latency and throughput of the requests.
+ */
+LoadGen::Report
+LoadGen::Run()
+{
+    ZipfDistribution popularity(readIds.size(), config.zipf);
+    std::vector<Report> reports(config.threads);
+    std::vector<std::thread> threads;
+
+    auto start = Clock::now();
+    auto end = start + config.duration;
+    for (unsigned t = 0; t < config.threads; ++t) {
+        threads.emplace_back(
+            &LoadGen::Worker, this, t, end, std::cref(popularity),
+            std::ref(reports[t]));
+    }
+    for (auto &thr : threads)
+        thr.join();
+
+    Report report = Report();
+    report.elapsed = Clock::now() - start;
+    for (auto &r : reports) {
+        for (int op = 0; op < kOps; ++op) {
+            report.latency[op].Merge(r.latency[op]);
+            report.errors[op] += r.errors[op];
+        }
+    }
+    return report;
+}
+
+/**
+ * Sends requests until the end of the run.
+ *
+ * @param thread The thread number, used to seed its random numbers.
+ * @param end The end of the run.
+ * @param popularity The popularity of the preloaded objects.
+ * @param report Where the latencies and errors are recorded.
+ */
+void
+LoadGen::Worker(
+    unsigned thread,
+    Clock::time_point end,
+    const ZipfDistribution &popularity,
+    Report &report)
+{
+    std::mt19937_64 rng(config.preload + thread);
+    std::uniform_int_distribution<unsigned> mix(0, 99);
+    std::exponential_distribution<double> arrivals(
+        config.qps > 0 ? config.qps / config.threads : 1);
+
+    auto due = Clock::now();
+    for (;;) {
+        if (config.qps > 0) {
+            due += std::chrono::duration_cast<Clock::duration>(
+                std::chrono::duration<double>(arrivals(rng)));
+            std::this_thread::sleep_until(due);
+        }
+        else
+            due = Clock::now();
+        if (due >= end)
+            break;
+
+        // Pick a request, and fall back to a write when there is nothing to
+        // read or delete.
+        auto pick = mix(rng);
+        auto op = pick < config.readPct ? kRead
+            : pick < config.readPct + config.writePct ? kWrite : kDelete;
+        uint64_t id = 0;
+        if (op == kRead) {
+            if (readIds.empty())
+                op = kWrite;
+            else
+                id = readIds[popularity(rng)];
+        }
+        else if (op == kDelete) {
+            LockGuard lk(writtenMtx);
+            if (writtenIds.empty())
+                op = kWrite;
+            else {
+                auto i = rng() % writtenIds.size();
+                id = writtenIds[i];
+                writtenIds[i] = writtenIds.back();
+                writtenIds.pop_back();
+            }
+        }
+
+        bool isOk = false;
+        switch (op) {
+        case kRead:
+            isOk = Read(id);
+            break;
+        case kWrite:
+            isOk = Write(rng, id);
+            if (isOk) {
+                LockGuard lk(writtenMtx);
+                writtenIds.push_back(id);
+            }
+            break;
+        default:
+            isOk = Delete(id);
+            break;
+        }
+
+        auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - due);
+        if (isOk)
+            report.latency[op].Record(latency.count());
+        else
+            ++report.errors[op];
+    }
+}
+
+/**
+ * Writes a new object with a random size.
+ *
+ * @param rng The random number generator.
+ * @param id The ID of the new object.
+ * @return True on success.
+ */
+bool
+LoadGen::Write(std::mt19937_64 &rng, uint64_t &id)
+{
+    auto size = sizes(rng);
+    if (not config.storeIpAddr.empty()) {
+        id = nextNeedleId++;
+        return StorePut(id, size);
+    }
+
+    TcpStream conn(config.dirIpAddr, config.dirPort);
+    conn << "upload " << size << '\n';
+    conn.write(payload.data(), size);
+    conn.flush();
+    std::string line, status;
+    std::getline(conn, line);
+    std::istringstream(line) >> status >> id;
+    return status == "ok";
+}
+
+/**
+ * Reads an object, from the Cache or the Store.
+ *
+ * @param id The object ID.
+ * @return True on success.
+ */
+bool
+LoadGen::Read(uint64_t id)
+{
+    auto direct = not config.storeIpAddr.empty();
+    TcpStream conn(
+        direct ? config.storeIpAddr : config.cacheIpAddr,
+        direct ? config.storePort : config.cachePort);
+    conn << "get " << id << '\n';
+    conn.flush();
+    return ReadBlob(conn);
+}
+
+/**
+ * Deletes an object, through the Directory or from the Store.
+ *
+ * @param id The object ID.
+ * @return True on success.
+ */
+bool
+LoadGen::Delete(uint64_t id)
+{
+    auto direct = not config.storeIpAddr.empty();
+    TcpStream conn(
+        direct ? config.storeIpAddr : config.dirIpAddr,
+        direct ? config.storePort : config.dirPort);
+    conn << "delete " << id << '\n';
+    conn.flush();
+    return ReadStatus(conn) == "ok";
+}
+
+/**
+ * Puts a needle in one of the Store's writable volumes. If the volume is full
+ * or unknown, then the volumes are refreshed and the put is retried once.
+ *
+ * @param id The needle ID.
+ * @param size The size of the needle.
+ * @return True on success.
+ */
+bool
+LoadGen::StorePut(uint64_t id, uint64_t size)
+{
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        uint64_t volumeId;
+        {
+            LockGuard lk(volumeMtx);
+            if (volumes.empty())
+                RefreshVolumes();
+            if (volumes.empty())
+                return false;
+            volumeId = volumes[volumeCounter++ % volumes.size()];
+        }
+
+        TcpStream conn(config.storeIpAddr, config.storePort);
+        conn << "put " << volumeId << ' ' << id << ' ' << size << '\n';
+        conn.write(payload.data(), size);
+        conn.flush();
+        auto status = ReadStatus(conn);
+        if (status == "ok")
+            return true;
+        if (status != "err NoFit" and status != "err BadHaystackId")
+            return false;
+
+        LockGuard lk(volumeMtx);
+        volumes.clear();
+    }
+    return false;
+}
+
+/**
+ * Asks the Store for its writable volumes. The caller must hold the volume
+ * lock.
+ */
+void
+LoadGen::RefreshVolumes()
+{
+    TcpStream conn(config.storeIpAddr, config.storePort);
+    conn << "volumes\n";
+    conn.flush();
+
+    std::string line, status, mode;
+    size_t count = 0;
+    std::getline(conn, line);
+    std::istringstream(line) >> status >> count;
+    if (status != "ok")
+        return;
+    for (size_t i = 0; i < count and std::getline(conn, line); ++i) {
+        uint64_t volumeId, freeBytes;
+        std::istringstream iss(line);
+        if (iss >> volumeId >> freeBytes >> mode and mode == "rw")
+            volumes.push_back(volumeId);
+    }
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "histogram.hh"
+
+/**
+ * A distribution of object sizes, parsed from one of the following:
+ *  - fixed:<size>
+ *  - uniform:<min>:<max>
+ *  - lognormal:<median>:<sigma>
+ * Sizes take an optional K, M, or G suffix, and the generated sizes are
+ * clamped to [1, kMaxSize].
+ */
+class SizeDistribution
+{
+public:
+    static constexpr uint64_t kMaxSize = 1 << 20;
+
+private:
+    enum class Kind { Fixed, Uniform, LogNormal };
+    Kind kind;
+    uint64_t a;
+    uint64_t b;
+    double sigma;
+
+public:
+    explicit SizeDistribution(const std::string &spec);
+    uint64_t operator()(std::mt19937_64 &rng) const;
+};
+
+/**
+ * Generates ranks in [0, n) with Zipfian popularity, i.e., rank k is drawn
+ * with probability proportional to 1/(k+1)^s. An exponent of 0 gives a uniform
+ * distribution.
+ */
+class ZipfDistribution
+{
+    std::vector<double> cdf;
+
+public:
+    ZipfDistribution(size_t n, double s);
+    size_t operator()(std::mt19937_64 &rng) const;
+};
+
+/**
+ * The load generator settings.
+ */
+struct LoadGenConfig
+{
+    // When storeIpAddr is set, requests go straight to a Store, so no Redis or
+    // MongoDB is needed. Otherwise writes and deletes go to the Directory and
+    // reads go to the Cache, as with the front end.
+    std::string dirIpAddr, dirPort;
+    std::string cacheIpAddr, cachePort;
+    std::string storeIpAddr, storePort;
+
+    unsigned threads = 8;
+    std::chrono::milliseconds duration{10000};
+    double qps = 0;  // The target rate of the open loop, or 0 for closed loop.
+    std::string sizes = "fixed:4096";
+    unsigned readPct = 90, writePct = 9, deletePct = 1;
+    double zipf = 0.99;  // The Zipf exponent of the read popularity.
+    size_t preload = 1000;  // The number of objects read during the run.
+    uint64_t firstNeedleId = 1ull << 40;  // Only used with a Store.
+};
+
+/**
+ * Drives the Haystack servers with a mix of reads, writes, and deletes, and
+ * records the latency of every request.
+ *
+ * Before the measured run, preload objects are written, and reads during the
+ * run pick among them with Zipfian popularity. Deletes remove objects written
+ * during the run, so that the set of objects read stays fixed.
+ *
+ * In closed loop, every thread issues requests back to back. In open loop,
+ * requests arrive as a Poisson process with the target rate, and latencies
+ * are measured from the time each request was due to be sent rather than from
+ * when it was actually sent, which keeps a stalled server from hiding the
+ * queueing delay it causes.
+ */
+class LoadGen
+{
+public:
+    enum Op { kRead, kWrite, kDelete, kOps };
+
+    struct Report
+    {
+        std::chrono::duration<double> elapsed;
+        Histogram latency[kOps];  // Nanoseconds.
+        uint64_t errors[kOps];
+
+        void Print(std::ostream &os) const;
+    };
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    LoadGenConfig config;
+    SizeDistribution sizes;
+    std::vector<char> payload;
+
+    std::vector<uint64_t> readIds;
+    std::mutex writtenMtx;
+    std::vector<uint64_t> writtenIds;
+
+    std::atomic<uint64_t> nextNeedleId;
+    std::atomic<uint64_t> volumeCounter;
+    std::mutex volumeMtx;
+    std::vector<uint64_t> volumes;
+
+    void Worker(
+        unsigned thread,
+        Clock::time_point end,
+        const ZipfDistribution &popularity,
+        Report &report);
+    bool Write(std::mt19937_64 &rng, uint64_t &id);
+    bool Read(uint64_t id);
+    bool Delete(uint64_t id);
+    bool StorePut(uint64_t id, uint64_t size);
+    void RefreshVolumes();
+
+public:
+    explicit LoadGen(const LoadGenConfig &config);
+
+    void Preload();
+    Report Run();
+};
+
+const char *
+OpName(LoadGen::Op op);
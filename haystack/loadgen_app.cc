@@ -0,0 +1,111 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "loadgen.hh"
+
+namespace {
+
+void
+Usage(const char *prog)
+{
+    std::cerr
+        << "Usage: " << prog << " [options]\n"
+        << "  --dir <ip>:<port>      Directory, used for writes and deletes\n"
+        << "  --cache <ip>:<port>    Cache, used for reads\n"
+        << "  --store <ip>:<port>    Send every request to a Store instead\n"
+        << "  --threads <n>          Concurrent clients (8)\n"
+        << "  --duration <seconds>   Length of the measured run (10)\n"
+        << "  --qps <rate>           Open loop target rate, 0 for closed loop\n"
+        << "  --sizes <dist>         fixed:<s>, uniform:<min>:<max>, or\n"
+        << "                         lognormal:<median>:<sigma> (fixed:4K)\n"
+        << "  --mix <r>:<w>:<d>      Percentage of reads, writes, and deletes"
+        << " (90:9:1)\n"
+        << "  --zipf <s>             Zipf exponent of read popularity (0.99)\n"
+        << "  --preload <n>          Objects written before the run (1000)\n"
+        << "  --hdr <prefix>         Write <prefix>.<op>.hgrm percentile files\n";
+    exit(EXIT_FAILURE);
+}
+
+std::pair<std::string, std::string>
+SplitAddr(const std::string &addr)
+{
+    auto colon = addr.rfind(':');
+    if (colon == std::string::npos)
+        throw std::invalid_argument("bad address: " + addr);
+    return {addr.substr(0, colon), addr.substr(colon + 1)};
+}
+
+} // namespace
+
+int
+main(int argc, char *argv[])
+{
+    LoadGenConfig config;
+    std::string hdrPrefix;
+    try {
+        for (int i = 1; i < argc; i += 2) {
+            std::string opt = argv[i];
+            if (i + 1 >= argc)
+                Usage(argv[0]);
+            std::string value = argv[i + 1];
+            if (opt == "--dir")
+                std::tie(config.dirIpAddr, config.dirPort) = SplitAddr(value);
+            else if (opt == "--cache")
+                std::tie(config.cacheIpAddr, config.cachePort) =
+                    SplitAddr(value);
+            else if (opt == "--store")
+                std::tie(config.storeIpAddr, config.storePort) =
+                    SplitAddr(value);
+            else if (opt == "--threads")
+                config.threads = std::stoul(value);
+            else if (opt == "--duration")
+                config.duration = std::chrono::milliseconds(
+                    static_cast<long>(std::stod(value) * 1000));
+            else if (opt == "--qps")
+                config.qps = std::stod(value);
+            else if (opt == "--sizes")
+                config.sizes = value;
+            else if (opt == "--mix") {
+                char colon1, colon2;
+                std::istringstream iss(value);
+                if (not (iss >> config.readPct >> colon1 >> config.writePct
+                         >> colon2 >> config.deletePct))
+                    throw std::invalid_argument("bad mix: " + value);
+            }
+            else if (opt == "--zipf")
+                config.zipf = std::stod(value);
+            else if (opt == "--preload")
+                config.preload = std::stoul(value);
+            else if (opt == "--hdr")
+                hdrPrefix = value;
+            else
+                Usage(argv[0]);
+        }
+
+        LoadGen loadGen(config);
+        std::cout << "Preloading " << config.preload << " objects\n";
+        loadGen.Preload();
+        std::cout << "Running for " << config.duration.count() / 1000.0
+                  << " s, latencies in us\n";
+        auto report = loadGen.Run();
+        report.Print(std::cout);
+
+        for (int op = 0; op < LoadGen::kOps and not hdrPrefix.empty(); ++op) {
+            auto name = OpName(static_cast<LoadGen::Op>(op));
+            std::ofstream file(hdrPrefix + '.' + name + ".hgrm");
+            report.latency[op].PrintPercentiles(file, 1000);
+        }
+    }
+    catch (std::exception &err) {
+        std::cerr << "Error: " << err.what() << '\n';
+        exit(EXIT_FAILURE);
+    }
+    exit(EXIT_SUCCESS);
+}
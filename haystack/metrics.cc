@@ -0,0 +1,443 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <boost/asio.hpp>
+
+#include "metrics.hh"
+
+namespace {
+using LockGuard = std::lock_guard<std::mutex>;
+
+// The upper bound of the first latency bucket, in nanoseconds.
+constexpr uint64_t kFirstBound = 10000;
+
+/**
+ * Writes a set of labels in the exposition format, e.g., {a="1",b="2"}.
+ *
+ * @param os The output stream.
+ * @param labels The labels.
+ * @param le The upper bound of a histogram bucket, or nullptr.
+ */
+void
+RenderLabels(std::ostream &os, const MetricLabels &labels, const char *le)
+{
+    if (labels.empty() and not le)
+        return;
+    char sep = '{';
+    for (auto &label : labels) {
+        os << sep << label.first << "=\"";
+        for (auto c : label.second) {
+            if (c == '\\' or c == '"')
+                os << '\\' << c;
+            else if (c == '\n')
+                os << "\\n";
+            else
+                os << c;
+        }
+        os << '"';
+        sep = ',';
+    }
+    if (le)
+        os << sep << "le=\"" << le << '"';
+    os << '}';
+}
+}
+
+// Define them here to avoid link errors
+constexpr size_t LatencyHistogram::kBuckets;
+
+/**
+ * @return The metric shard of the calling thread. Threads are assigned shards
+ *  in a round robin fashion the first time they update a metric.
+ */
+size_t
+MetricShard() noexcept
+{
+    static std::atomic<size_t> nextShard(0);
+    thread_local size_t shard = nextShard++ % kMetricShards;
+    return shard;
+}
+
+/**
+ * Initializes a counter to zero.
+ */
+Counter::Counter() noexcept
+{
+    for (auto &shard : shards)
+        shard.value.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * @return The value of the counter.
+ */
+uint64_t
+Counter::Value() const noexcept
+{
+    uint64_t value = 0;
+    for (auto &shard : shards)
+        value += shard.value.load(std::memory_order_relaxed);
+    return value;
+}
+
+/**
+ * Initializes an empty histogram.
+ */
+LatencyHistogram::LatencyHistogram() noexcept
+{
+    for (auto &shard : shards) {
+        for (auto &bucket : shard.buckets)
+            bucket.store(0, std::memory_order_relaxed);
+        shard.count.store(0, std::memory_order_relaxed);
+        shard.sumNanos.store(0, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * @param bucket A bucket index, below kBuckets.
+ * @return The upper bound of the bucket, in seconds.
+ */
+double
+LatencyHistogram::UpperBound(size_t bucket) noexcept
+{
+    return (kFirstBound << bucket) / 1e9;
+}
+
+/**
+ * Records a latency.
+ *
+ * @param latency The latency.
+ */
+void
+LatencyHistogram::Observe(std::chrono::nanoseconds latency) noexcept
+{
+    uint64_t nanos = latency.count() > 0 ? latency.count() : 0;
+    uint64_t quotient = nanos ? (nanos - 1) / kFirstBound : 0;
+    size_t bucket = quotient ? 64 - __builtin_clzll(quotient) : 0;
+    if (bucket > kBuckets)
+        bucket = kBuckets;
+
+    auto &shard = shards[MetricShard()];
+    shard.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    shard.count.fetch_add(1, std::memory_order_relaxed);
+    shard.sumNanos.fetch_add(nanos, std::memory_order_relaxed);
+}
+
+/**
+ * @return The cumulative bucket counts, the count, and the sum of the recorded
+ *  latencies. Latencies recorded while the snapshot is taken may or may not be
+ *  included.
+ */
+LatencyHistogram::Snapshot
+LatencyHistogram::Collect() const
+{
+    Snapshot snapshot{std::vector<uint64_t>(kBuckets + 1), 0, 0};
+    uint64_t sumNanos = 0;
+    for (auto &shard : shards) {
+        for (size_t i = 0; i <= kBuckets; ++i)
+            snapshot.cumulative[i] +=
+                shard.buckets[i].load(std::memory_order_relaxed);
+        snapshot.count += shard.count.load(std::memory_order_relaxed);
+        sumNanos += shard.sumNanos.load(std::memory_order_relaxed);
+    }
+    for (size_t i = 1; i <= kBuckets; ++i)
+        snapshot.cumulative[i] += snapshot.cumulative[i - 1];
+    snapshot.sum = sumNanos / 1e9;
+    return snapshot;
+}
+
+/**
+ * Finds or creates a family of metrics. The caller must hold the lock.
+ *
+ * @param name The name of the family.
+ * @param help The description of the family.
+ * @param type The Prometheus type of the family.
+ * @return The family.
+ * @throw std::invalid_argument if a family with the same name and a different
+ *  type exists.
+ */
+MetricsRegistry::Family &
+MetricsRegistry::GetFamily(
+    const std::string &name,
+    const std::string &help,
+    const std::string &type)
+{
+    auto &family = families[name];
+    if (family.type.empty()) {
+        family.help = help;
+        family.type = type;
+    }
+    else if (family.type != type)
+        throw std::invalid_argument("metric " + name + " is a " + family.type);
+    return family;
+}
+
+/**
+ * Adds a counter, or finds the counter with the same name and labels.
+ *
+ * @param name The metric name.
+ * @param help The description of the metric.
+ * @param labels The labels of the counter.
+ * @return The counter.
+ */
+Counter &
+MetricsRegistry::AddCounter(
+    const std::string &name,
+    const std::string &help,
+    const MetricLabels &labels)
+{
+    LockGuard lk(mtx);
+    auto &family = GetFamily(name, help, "counter");
+    for (auto &item : family.counters) {
+        if (item.first == labels)
+            return *item.second;
+    }
+    family.counters.emplace_back(labels, std::unique_ptr<Counter>(new Counter));
+    return *family.counters.back().second;
+}
+
+/**
+ * Adds a latency histogram, or finds the histogram with the same name and
+ * labels.
+ *
+ * @param name The metric name.
+ * @param help The description of the metric.
+ * @param labels The labels of the histogram.
+ * @return The histogram.
+ */
+LatencyHistogram &
+MetricsRegistry::AddHistogram(
+    const std::string &name,
+    const std::string &help,
+    const MetricLabels &labels)
+{
+    LockGuard lk(mtx);
+    auto &family = GetFamily(name, help, "histogram");
+    for (auto &item : family.histograms) {
+        if (item.first == labels)
+            return *item.second;
+    }
+    family.histograms.emplace_back(
+        labels, std::unique_ptr<LatencyHistogram>(new LatencyHistogram));
+    return *family.histograms.back().second;
+}
+
+/**
+ * Adds a gauge, which can have a different set of samples every time it is
+ * rendered, e.g., one per volume.
+ *
+ * @param name The metric name.
+ * @param help The description of the metric.
+ * @param fn The function returning the samples. It is called without holding
+ *  the registry lock.
+ */
+void
+MetricsRegistry::AddGauge(
+    const std::string &name, const std::string &help, GaugeFn fn)
+{
+    LockGuard lk(mtx);
+    GetFamily(name, help, "gauge").gauge = std::move(fn);
+}
+
+/**
+ * Writes all the metrics in the Prometheus text exposition format.
+ *
+ * @param os The output stream.
+ */
+void
+MetricsRegistry::Render(std::ostream &os) const
+{
+    std::vector<std::pair<std::string, GaugeFn>> gauges;
+    {
+        LockGuard lk(mtx);
+        for (auto &item : families) {
+            auto &name = item.first;
+            auto &family = item.second;
+            if (family.gauge) {
+                gauges.emplace_back(name, family.gauge);
+                continue;
+            }
+
+            os << "# HELP " << name << ' ' << family.help << '\n'
+               << "# TYPE " << name << ' ' << family.type << '\n';
+            for (auto &counter : family.counters) {
+                os << name;
+                RenderLabels(os, counter.first, nullptr);
+                os << ' ' << counter.second->Value() << '\n';
+            }
+            for (auto &hist : family.histograms) {
+                auto snapshot = hist.second->Collect();
+                for (size_t i = 0; i <= LatencyHistogram::kBuckets; ++i) {
+                    std::ostringstream le;
+                    if (i < LatencyHistogram::kBuckets)
+                        le << LatencyHistogram::UpperBound(i);
+                    else
+                        le << "+Inf";
+                    os << name << "_bucket";
+                    RenderLabels(os, hist.first, le.str().c_str());
+                    os << ' ' << snapshot.cumulative[i] << '\n';
+                }
+                os << name << "_sum";
+                RenderLabels(os, hist.first, nullptr);
+                os << ' ' << snapshot.sum << '\n' << name << "_count";
+                RenderLabels(os, hist.first, nullptr);
+                os << ' ' << snapshot.count << '\n';
+            }
+        }
+    }
+
+    // Gauges may take other locks, so they are evaluated without the lock.
+    for (auto &gauge : gauges) {
+        auto samples = gauge.second();
+        LockGuard lk(mtx);
+        os << "# HELP " << gauge.first << ' '
+           << families.at(gauge.first).help << '\n'
+           << "# TYPE " << gauge.first << " gauge\n";
+        for (auto &sample : samples) {
+            os << gauge.first;
+            RenderLabels(os, sample.labels, nullptr);
+            os << ' ' << sample.value << '\n';
+        }
+    }
+}
+
+/**
+ * Adds the request metrics of a server to a registry.
+ *
+ * @param registry The registry.
+ * @param prefix The prefix of the metric names, e.g., haystack_store.
+ * @param names The commands of the server.
+ */
+CommandMetrics::CommandMetrics(
+    MetricsRegistry &registry,
+    const std::string &prefix,
+    std::initializer_list<const char*> names)
+    : commands()
+{
+    auto requests = prefix + "_requests_total";
+    auto duration = prefix + "_request_duration_seconds";
+    std::vector<std::string> all(names.begin(), names.end());
+    all.push_back("other");
+    for (auto &name : all) {
+        commands[name] = Command{
+            &registry.AddCounter(
+                requests, "Requests handled.",
+                {{"command", name}, {"result", "ok"}}),
+            &registry.AddCounter(
+                requests, "Requests handled.",
+                {{"command", name}, {"result", "err"}}),
+            &registry.AddHistogram(
+                duration, "Time to handle a request.", {{"command", name}})};
+    }
+}
+
+/**
+ * Records a request.
+ *
+ * @param command The command.
+ * @param isOk Whether the request succeeded.
+ * @param start When the request started.
+ */
+void
+CommandMetrics::Record(
+    const std::string &command, bool isOk, Clock::time_point start) const
+{
+    auto it = commands.find(command);
+    if (it == commands.end())
+        it = commands.find("other");
+    auto &metrics = it->second;
+    (isOk ? metrics.ok : metrics.err)->Inc();
+    metrics.latency->Observe(Clock::now() - start);
+}
+
+/**
+ * Starts serving the metrics of a registry.
+ *
+ * @param registry The registry, which must outlive the server.
+ * @param ipAddr The IP address where the server listens for requests.
+ * @param port The port number where the server listens for requests.
+ * @throw boost::system::system_error if the server cannot listen on the port.
+ */
+MetricsServer::MetricsServer(
+    const MetricsRegistry &registry,
+    const std::string &ipAddr,
+    unsigned port)
+    : registry(registry),
+      ioService(),
+      acceptor(
+          ioService,
+          boost::asio::ip::tcp::endpoint(
+              boost::asio::ip::address::from_string(ipAddr), port)),
+      thr()
+{
+    Accept();
+    thr = std::thread([this] { ioService.run(); });
+}
+
+/**
+ * Dtor. Stops the server and waits for its thread.
+ */
+MetricsServer::~MetricsServer()
+{
+    ioService.stop();
+    thr.join();
+}
+
+/**
+ * Waits for the next connection.
+ */
+void
+MetricsServer::Accept()
+{
+    auto sock = std::make_shared<boost::asio::ip::tcp::socket>(ioService);
+    acceptor.async_accept(
+        *sock, [this, sock](const boost::system::error_code &err) {
+            if (err)
+                return;
+            Serve(*sock);
+            Accept();
+        });
+}
+
+/**
+ * Answers an HTTP request with the metrics.
+ *
+ * @param sock The connection.
+ */
+void
+MetricsServer::Serve(boost::asio::ip::tcp::socket &sock)
+{
+    using namespace boost::asio;
+    boost::system::error_code err;
+    streambuf request;
+    read_until(sock, request, "\r\n\r\n", err);
+    std::istream is(&request);
+    std::string method, path;
+    is >> method >> path;
+
+    std::ostringstream body;
+    std::string status = "200 OK";
+    if (method != "GET")
+        status = "405 Method Not Allowed";
+    else if (path != "/metrics" and path != "/")
+        status = "404 Not Found";
+    else
+        registry.Render(body);
+
+    std::ostringstream response;
+    response << "HTTP/1.0 " << status << "\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << body.str().size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << body.str();
+    write(sock, buffer(response.str()), err);
+    sock.shutdown(ip::tcp::socket::shutdown_both, err);
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+// The label names and values of a metric, e.g., {{"command", "get"}}.
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// The number of shards of every metric. Threads are spread over the shards, so
+// that threads incrementing the same metric rarely touch the same cache line.
+constexpr size_t kMetricShards = 16;
+
+size_t
+MetricShard() noexcept;
+
+/**
+ * A monotonically increasing counter. Incrementing it is a relaxed atomic add
+ * on the calling thread's shard, and reading it adds up the shards.
+ */
+class Counter
+{
+    struct Shard
+    {
+        std::atomic<uint64_t> value;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+    Shard shards[kMetricShards];
+
+public:
+    Counter() noexcept;
+    Counter(const Counter &counter) = delete;
+    Counter& operator=(const Counter &counter) = delete;
+
+    void
+    Inc(uint64_t n = 1) noexcept
+    {
+        shards[MetricShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t Value() const noexcept;
+};
+
+/**
+ * A histogram of latencies with fixed, exponentially growing buckets from 10
+ * microseconds to about 5 seconds, in the form expected by Prometheus.
+ * Observing a latency is a few relaxed atomic adds on the calling thread's
+ * shard.
+ */
+class LatencyHistogram
+{
+public:
+    static constexpr size_t kBuckets = 20;
+
+    struct Snapshot
+    {
+        std::vector<uint64_t> cumulative;  // Per bucket, then +Inf.
+        uint64_t count;
+        double sum;  // Seconds.
+    };
+
+private:
+    struct Shard
+    {
+        std::atomic<uint64_t> buckets[kBuckets + 1];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sumNanos;
+        char padding[64];
+    };
+    Shard shards[kMetricShards];
+
+public:
+    LatencyHistogram() noexcept;
+    LatencyHistogram(const LatencyHistogram &hist) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram &hist) = delete;
+
+    static double UpperBound(size_t bucket) noexcept;
+
+    void Observe(std::chrono::nanoseconds latency) noexcept;
+    Snapshot Collect() const;
+};
+
+/**
+ * A named set of metrics, rendered in the Prometheus text exposition format.
+ *
+ * Adding metrics takes a lock, so servers add their metrics up front and keep
+ * references to them. The references stay valid for the lifetime of the
+ * registry. Gauges are functions evaluated when the metrics are rendered.
+ */
+class MetricsRegistry
+{
+public:
+    struct GaugeSample
+    {
+        MetricLabels labels;
+        double value;
+    };
+    using GaugeFn = std::function<std::vector<GaugeSample>()>;
+
+private:
+    struct Family
+    {
+        std::string help;
+        std::string type;
+        std::vector<std::pair<MetricLabels, std::unique_ptr<Counter>>>
+            counters;
+        std::vector<std::pair<MetricLabels, std::unique_ptr<LatencyHistogram>>>
+            histograms;
+        GaugeFn gauge;
+    };
+
+    mutable std::mutex mtx;
+    std::map<std::string, Family> families;
+
+    Family &GetFamily(
+        const std::string &name,
+        const std::string &help,
+        const std::string &type);
+
+public:
+    Counter &AddCounter(
+        const std::string &name,
+        const std::string &help,
+        const MetricLabels &labels = {});
+    LatencyHistogram &AddHistogram(
+        const std::string &name,
+        const std::string &help,
+        const MetricLabels &labels = {});
+    void AddGauge(const std::string &name, const std::string &help, GaugeFn fn);
+
+    void Render(std::ostream &os) const;
+};
+
+/**
+ * The request count and latency of every command of a server, as
+ * <prefix>_requests_total{command,result} and
+ * <prefix>_request_duration_seconds{command}. Unknown commands are counted as
+ * "other".
+ */
+class CommandMetrics
+{
+    struct Command
+    {
+        Counter *ok;
+        Counter *err;
+        LatencyHistogram *latency;
+    };
+    std::map<std::string, Command> commands;
+
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CommandMetrics(
+        MetricsRegistry &registry,
+        const std::string &prefix,
+        std::initializer_list<const char*> names);
+
+    void Record(
+        const std::string &command, bool isOk, Clock::time_point start) const;
+};
+
+/**
+ * Serves the metrics of a registry over HTTP, on a thread of its own. Every
+ * GET request is answered with the rendered metrics.
+ */
+class MetricsServer
+{
+    const MetricsRegistry &registry;
+    boost::asio::io_service ioService;
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::thread thr;
+
+    void Accept();
+    void Serve(boost::asio::ip::tcp::socket &sock);
+
+public:
+    MetricsServer(
+        const MetricsRegistry &registry,
+        const std::string &ipAddr,
+        unsigned port);
+    MetricsServer(const MetricsServer &server) = delete;
+    MetricsServer& operator=(const MetricsServer &server) = delete;
+    ~MetricsServer();
+};
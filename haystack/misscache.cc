@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <string>
+
+#include "misscache.hh"
+
+/**
+ * Initializes an empty cache.
+ *
+ * @param ttl How long a miss is remembered.
+ * @param capacity The maximum number of misses remembered.
+ */
+MissCache::MissCache(std::chrono::milliseconds ttl, size_t capacity)
+    : mtx(),
+      ttl(ttl),
+      capacity(capacity),
+      order(),
+      keys()
+{}
+
+/**
+ * Remembers a miss, or makes it last longer if it is remembered already.
+ *
+ * @param key The needle handle, or ID, that was found missing.
+ */
+void
+MissCache::Add(const std::string &key)
+{
+    if (not capacity)
+        return;
+    LockGuard lk(mtx);
+    auto now = Clock::now();
+    Expire(now);
+    auto it = keys.find(key);
+    if (it != keys.end()) {
+        it->second->first = now + ttl;
+        order.splice(order.end(), order, it->second);
+        return;
+    }
+    if (keys.size() == capacity) {
+        keys.erase(order.front().second);
+        order.pop_front();
+    }
+    order.emplace_back(now + ttl, key);
+    keys.emplace(key, std::prev(order.end()));
+}
+
+/**
+ * @param key A needle handle, or ID.
+ * @return True if it was found missing less than the TTL ago, false
+ *  otherwise.
+ */
+bool
+MissCache::Contains(const std::string &key)
+{
+    LockGuard lk(mtx);
+    Expire(Clock::now());
+    return keys.count(key) != 0;
+}
+
+/**
+ * @return The number of misses remembered, some of which may have expired.
+ */
+size_t
+MissCache::Size() const
+{
+    LockGuard lk(mtx);
+    return keys.size();
+}
+
+/**
+ * Forgets the misses that are due. They are in order, since they all last
+ * the same time.
+ *
+ * @param now The current time.
+ */
+void
+MissCache::Expire(Clock::time_point now)
+{
+    while (not order.empty() and order.front().first <= now) {
+        keys.erase(order.front().second);
+        order.pop_front();
+    }
+}
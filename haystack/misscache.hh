@@ -0,0 +1,41 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Remembers the needles that were recently found missing, so that repeated
+ * requests for them, e.g., by scrapers or from broken links, are rejected
+ * without asking the Stores. Entries expire after a short time, since a
+ * needle may show up later, e.g., once a slow replica catches up, and the
+ * oldest ones are dropped when the cache is full. It is thread safe.
+ */
+class MissCache
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    using LockGuard = std::lock_guard<std::mutex>;
+    using Order = std::list<std::pair<Clock::time_point, std::string>>;
+
+    mutable std::mutex mtx;
+    std::chrono::milliseconds ttl;
+    size_t capacity;
+    Order order;  // The keys by expiry time.
+    std::unordered_map<std::string, Order::iterator> keys;
+
+    void Expire(Clock::time_point now);
+
+public:
+    MissCache(std::chrono::milliseconds ttl, size_t capacity);
+
+    void Add(const std::string &key);
+    bool Contains(const std::string &key);
+    size_t Size() const;
+};
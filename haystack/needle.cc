@@ -1,7 +1,42 @@
+#include <cstdint>
+#include <cstring>
+#include <istream>
 #include <ostream>
+#include <sstream>
+#include <string>
 
+#include "bits.hh"
 #include "needle.hh"
 
+// Define them here to avoid link errors
+constexpr char NeedleHeader::kMagic[4];
+constexpr uint8_t NeedleHeader::kVersion;
+constexpr size_t NeedleHeader::kSize;
+constexpr uint64_t NeedleHeader::kAlignment;
+constexpr uint64_t NeedleHeader::kMaxBlobSize;
+constexpr size_t NeedleHeader::kFlagsOffset;
+constexpr uint8_t NeedleHeader::kDeletedFlag;
+constexpr uint8_t NeedleHeader::kCompressedFlag;
+constexpr size_t NeedleHeader::kLegacySize;
+constexpr size_t NeedleHeader::kLegacyDeletedOffset;
+
+namespace {
+
+// Offsets of the fields in the version 1 header.
+constexpr size_t kVersionOffset = 4;
+constexpr size_t kCodecOffset = 6;
+constexpr size_t kCookieOffset = 8;
+constexpr size_t kChecksumOffset = 12;
+constexpr size_t kIdOffset = 16;
+constexpr size_t kSizeOffset = 24;
+constexpr size_t kRawSizeOffset = 28;
+
+// Offsets of the fields in the legacy header.
+constexpr size_t kLegacyIdOffset = 0;
+constexpr size_t kLegacySizeOffset = 8;
+
+} // namespace
+
 
 Needle::Needle()
     : haystackId(0), offset(0), flags()
@@ -11,10 +46,11 @@ Needle::Needle(
     uint64_t haystackId,
     uint64_t offset,
     uint64_t needleId,
-    uint64_t size)
+    uint64_t size,
+    uint32_t checksum)
     : haystackId(haystackId),
       offset(offset),
-      flags(needleId, size)
+      flags(needleId, size, checksum)
 {}
 
 Needle::Needle(
@@ -26,6 +62,195 @@ Needle::Needle(
       flags(nf)
 {}
 
+/**
+ * Encodes a needle header in the current on-disk format.
+ *
+ * @param nf The needle flags to encode.
+ * @param buff The buffer where the header is written. It must have room for
+ *  NeedleHeader::kSize bytes.
+ */
+void
+NeedleHeader::Encode(const NeedleFlags &nf, char *buff) noexcept
+{
+    std::memset(buff, 0, kSize);
+    std::memcpy(buff, kMagic, sizeof(kMagic));
+    buff[kVersionOffset] = static_cast<char>(kVersion);
+    buff[kFlagsOffset] = static_cast<char>(Flags(nf));
+    PutLe<uint32_t>(buff+kCookieOffset, nf.cookie);
+    PutLe<uint32_t>(buff+kChecksumOffset, nf.checksum);
+    PutLe<uint64_t>(buff+kIdOffset, nf.id);
+    PutLe<uint32_t>(buff+kSizeOffset, static_cast<uint32_t>(nf.size));
+    if (nf.codec) {
+        buff[kCodecOffset] = static_cast<char>(nf.codec);
+        PutLe<uint32_t>(buff+kRawSizeOffset, nf.rawSize);
+    }
+}
+
+/**
+ * Decodes a needle header in the current on-disk format.
+ *
+ * @param buff The buffer with the NeedleHeader::kSize bytes of the header.
+ * @param nf The needle flags where the header is decoded into.
+ * @return False if the buffer does not contain a header, i.e., the magic bytes
+ *  or the version do not match, true otherwise.
+ */
+bool
+NeedleHeader::Decode(const char *buff, NeedleFlags &nf) noexcept
+{
+    if (not HasMagic(buff)
+        or static_cast<uint8_t>(buff[kVersionOffset]) != kVersion)
+        return false;
+
+    auto flags = static_cast<uint8_t>(buff[kFlagsOffset]);
+    nf.isDeleted = (flags & kDeletedFlag) ? 1 : 0;
+    nf.cookie = GetLe<uint32_t>(buff+kCookieOffset);
+    nf.checksum = GetLe<uint32_t>(buff+kChecksumOffset);
+    nf.id = GetLe<uint64_t>(buff+kIdOffset);
+    nf.size = GetLe<uint32_t>(buff+kSizeOffset);
+    if (flags & kCompressedFlag) {
+        nf.codec = static_cast<uint8_t>(buff[kCodecOffset]);
+        nf.rawSize = GetLe<uint32_t>(buff+kRawSizeOffset);
+    }
+    else {
+        nf.codec = 0;
+        nf.rawSize = 0;
+    }
+    return true;
+}
+
+/**
+ * Decodes a needle header written before the header format was versioned.
+ * Legacy headers carry no checksum or cookie, so both are set to zero, and
+ * their needles are never compressed.
+ *
+ * @param buff The buffer with the NeedleHeader::kLegacySize bytes of the
+ *  header.
+ * @param nf The needle flags where the header is decoded into.
+ */
+void
+NeedleHeader::DecodeLegacy(const char *buff, NeedleFlags &nf) noexcept
+{
+    nf.id = GetLe<uint64_t>(buff+kLegacyIdOffset);
+    nf.size = GetLe<uint64_t>(buff+kLegacySizeOffset);
+    nf.isDeleted = buff[kLegacyDeletedOffset] ? 1 : 0;
+    nf.checksum = 0;
+    nf.cookie = 0;
+    nf.codec = 0;
+    nf.rawSize = 0;
+}
+
+/**
+ * @param nf The needle flags.
+ * @return The flags byte of the on-disk header for the needle.
+ */
+uint8_t
+NeedleHeader::Flags(const NeedleFlags &nf) noexcept
+{
+    return (nf.isDeleted ? kDeletedFlag : 0) | (nf.codec ? kCompressedFlag : 0);
+}
+
+/**
+ * @param buff A buffer with at least four bytes.
+ * @return True if the buffer starts with the magic bytes of a needle header.
+ */
+bool
+NeedleHeader::HasMagic(const char *buff) noexcept
+{
+    return std::memcmp(buff, kMagic, sizeof(kMagic)) == 0;
+}
+
+/**
+ * Parses a needle handle.
+ *
+ * @param s The handle, |<volumeId>,<needleId>,<cookie in hex>|.
+ * @param handle Set to the parsed handle.
+ * @return False if the string is not a handle, true otherwise.
+ */
+bool
+NeedleHandle::Parse(const std::string &s, NeedleHandle &handle) noexcept
+{
+    uint64_t fields[3] = {0, 0, 0};
+    const uint64_t limits[3] = {UINT64_MAX, UINT64_MAX, UINT32_MAX};
+    const unsigned bases[3] = {10, 10, 16};
+    size_t pos = 0;
+    for (int i = 0; i < 3; ++i) {
+        if (i and (pos >= s.size() or s[pos++] != ','))
+            return false;
+        auto start = pos;
+        for (; pos < s.size() and s[pos] != ','; ++pos) {
+            auto c = s[pos];
+            unsigned digit;
+            if (c >= '0' and c <= '9')
+                digit = c - '0';
+            else if (bases[i] == 16 and c >= 'a' and c <= 'f')
+                digit = c - 'a' + 10;
+            else
+                return false;
+            if (fields[i] > (limits[i] - digit) / bases[i])
+                return false;
+            fields[i] = fields[i] * bases[i] + digit;
+        }
+        if (pos == start)
+            return false;
+    }
+    if (pos != s.size())
+        return false;
+
+    handle.volumeId = fields[0];
+    handle.needleId = fields[1];
+    handle.cookie = static_cast<uint32_t>(fields[2]);
+    return true;
+}
+
+/**
+ * @return The handle as a string, |<volumeId>,<needleId>,<cookie in hex>|.
+ */
+std::string
+NeedleHandle::ToString() const
+{
+    std::ostringstream oss;
+    oss << volumeId << ',' << needleId << ',' << std::hex << cookie;
+    return oss.str();
+}
+
+/**
+ * Reads the optional byte range of a request.
+ *
+ * @param is The stream with the rest of the request line.
+ * @param range Set to the range, if there is one, or left as it is.
+ * @return True if the stream has an offset and a length next. Otherwise the
+ *  stream is left where it was, e.g., at a trace token, and false is returned.
+ */
+bool
+ByteRange::Read(std::istream &is, ByteRange &range)
+{
+    auto pos = is.tellg();
+    uint64_t offset, length;
+    if (is >> offset >> length) {
+        range = ByteRange{offset, length};
+        return true;
+    }
+    is.clear();
+    is.seekg(pos);
+    return false;
+}
+
+/**
+ * Trims the range so that it does not go past the end of a needle.
+ *
+ * @param size The size of the needle.
+ * @return False if the range starts past the end of the needle, true
+ *  otherwise.
+ */
+bool
+ByteRange::Clamp(uint64_t size) noexcept
+{
+    if (offset > size)
+        return false;
+    if (length > size - offset)
+        length = size - offset;
+    return true;
+}
 
 std::ostream&
 operator<<(std::ostream &os, const Needle &needle)
@@ -35,6 +260,7 @@ operator<<(std::ostream &os, const Needle &needle)
        << ", id=" << needle.flags.id
        << ", size=" << needle.flags.size
        << ", isDeleted=" << bool(needle.flags.isDeleted)
+       << ", checksum=" << needle.flags.checksum
        << ")";
     return os;
 }
@@ -43,7 +269,11 @@ bool
 operator==(const NeedleFlags &nf1, const NeedleFlags &nf2) noexcept{
     return nf1.id == nf2.id
        and nf1.size == nf2.size
-       and nf1.isDeleted == nf2.isDeleted;
+       and nf1.isDeleted == nf2.isDeleted
+       and nf1.checksum == nf2.checksum
+       and nf1.cookie == nf2.cookie
+       and nf1.codec == nf2.codec
+       and nf1.rawSize == nf2.rawSize;
 }
 
 bool
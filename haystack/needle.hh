@@ -1,24 +1,107 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <istream>
 #include <ostream>
+#include <string>
 
+/**
+ * The in-memory representation of a needle header. It is never written to
+ * disk as is; NeedleHeader takes care of the on-disk encoding.
+ */
 struct NeedleFlags
 {
     uint64_t id;
     uint64_t size;
     char isDeleted;
+    uint32_t checksum;  // CRC32C of the blob.
+    uint32_t cookie;  // Random value used to validate requests for the needle.
+    uint8_t codec;  // The Codec the blob is compressed with, 0 if it is not.
+    uint32_t rawSize;  // The size of the contents, if the blob is compressed.
 
     NeedleFlags() = default;
-    NeedleFlags(uint64_t id, uint64_t size)
-        : id(id), size(size), isDeleted(0) {}
+    NeedleFlags(
+        uint64_t id, uint64_t size, uint32_t checksum = 0, uint32_t cookie = 0)
+        : id(id), size(size), isDeleted(0), checksum(checksum), cookie(cookie),
+          codec(0), rawSize(0)
+    {}
     NeedleFlags(const NeedleFlags &needleFlags) = default;
     NeedleFlags(NeedleFlags &&needleFlags) = default;
     NeedleFlags& operator=(const NeedleFlags &needleFlags) = default;
     NeedleFlags& operator=(NeedleFlags &&needleFlags) = default;
     ~NeedleFlags() = default;
+
+    // The size of the contents as clients see them, whereas size is the size
+    // of the blob on disk.
+    uint64_t DataSize() const noexcept { return codec ? rawSize : size; }
 };
 
+/**
+ * The on-disk needle header.
+ *
+ * The current format (version 1) is a packed, little-endian, 32 byte header
+ * with the following layout:
+ *
+ *  | offset | size | field                              |
+ *  |--------|------|------------------------------------|
+ *  |      0 |    4 | magic bytes, "HSND"                |
+ *  |      4 |    1 | version                            |
+ *  |      5 |    1 | flags, bit 0 is the deleted flag   |
+ *  |      |      | and bit 1 the compressed flag      |
+ *  |      6 |    1 | codec, if compressed, else 0       |
+ *  |      7 |    1 | reserved                           |
+ *  |      8 |    4 | cookie                             |
+ *  |     12 |    4 | CRC32C of the blob                 |
+ *  |     16 |    8 | needle ID                          |
+ *  |     24 |    4 | size of the blob in bytes          |
+ *  |     28 |    4 | size of the contents, if           |
+ *  |      |      | compressed, else 0                 |
+ *
+ * The blob follows the header, and it is padded with zeros so that every
+ * needle, and thus every header and blob, starts on a kAlignment boundary. A
+ * compressed blob holds the contents compressed with the codec, see Codec, and
+ * its checksum covers the compressed bytes, so it can be verified without
+ * decompressing it.
+ *
+ * Volumes written before the header was versioned (version 0) contain the raw
+ * NeedleFlags struct as laid out by the compiler: the ID at offset 0, the size
+ * at offset 8, and the deleted flag at offset 16, in a 24 byte header with no
+ * padding between needles. They can still be decoded with DecodeLegacy.
+ */
+struct NeedleHeader
+{
+    static constexpr char kMagic[4] = {'H', 'S', 'N', 'D'};
+    static constexpr uint8_t kVersion = 1;
+    static constexpr size_t kSize = 32;
+    static constexpr uint64_t kAlignment = 8;
+    static constexpr uint64_t kMaxBlobSize = UINT32_MAX;
+    static constexpr size_t kFlagsOffset = 5;
+    static constexpr uint8_t kDeletedFlag = 1;
+    static constexpr uint8_t kCompressedFlag = 2;
+
+    static constexpr size_t kLegacySize = 24;
+    static constexpr size_t kLegacyDeletedOffset = 16;
+
+    static void Encode(const NeedleFlags &nf, char *buff) noexcept;
+    static bool Decode(const char *buff, NeedleFlags &nf) noexcept;
+    static void DecodeLegacy(const char *buff, NeedleFlags &nf) noexcept;
+    static uint8_t Flags(const NeedleFlags &nf) noexcept;
+    static bool HasMagic(const char *buff) noexcept;
+};
+
+/**
+ * @param size The size of a blob.
+ * @return The number of bytes taken by a needle with a blob of the given size,
+ *  including the header and padding.
+ */
+constexpr uint64_t
+NeedleDiskSize(uint64_t size) noexcept
+{
+    return (NeedleHeader::kSize + size + NeedleHeader::kAlignment - 1)
+        & ~(NeedleHeader::kAlignment - 1);
+}
+
 struct Needle
 {
     uint64_t haystackId;
@@ -30,7 +113,8 @@ struct Needle
         uint64_t haystackId,
         uint64_t offset,
         uint64_t needleId,
-        uint64_t size);
+        uint64_t size,
+        uint32_t checksum = 0);
     Needle(uint64_t haystackId, uint64_t offset, const NeedleFlags &nf);
     Needle(const Needle &needle) = default;
     Needle(Needle &&needle) = default;
@@ -39,6 +123,38 @@ struct Needle
     ~Needle() = default;
 };
 
+/**
+ * A self-locating reference to a needle, as issued by the Directory: the
+ * volume that holds the needle, the needle ID, and the needle's cookie. It is
+ * written as |<volumeId>,<needleId>,<cookie in hex>|, e.g., |3,1024,9f3a2b1c|.
+ *
+ * The Store goes straight to the volume's index with it, and serves the needle
+ * only if the cookie matches the one in the needle's header, so that needles
+ * cannot be fetched by guessing their IDs.
+ */
+struct NeedleHandle
+{
+    uint64_t volumeId;
+    uint64_t needleId;
+    uint32_t cookie;
+
+    static bool Parse(const std::string &s, NeedleHandle &handle) noexcept;
+    std::string ToString() const;
+};
+
+/**
+ * A range of the contents of a needle, as requested with
+ * |get <handle> <offset> <length>|.
+ */
+struct ByteRange
+{
+    uint64_t offset;
+    uint64_t length;
+
+    static bool Read(std::istream &is, ByteRange &range);
+    bool Clamp(uint64_t size) noexcept;
+};
+
 std::ostream&
 operator<<(std::ostream &os, const Needle &n);
 
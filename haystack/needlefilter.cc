@@ -0,0 +1,117 @@
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+#include "bits.hh"
+#include "needlefilter.hh"
+
+// Define them here to avoid link errors
+constexpr unsigned NeedleFilter::kHashes;
+constexpr uint64_t NeedleFilter::kBitsPerNeedle;
+constexpr uint64_t NeedleFilter::kMinBits;
+constexpr uint64_t NeedleFilter::kMaxBits;
+
+/**
+ * Initializes an empty filter.
+ *
+ * @param bits The number of bits, which is rounded up to a power of two, and
+ *  kept between kMinBits and kMaxBits.
+ */
+NeedleFilter::NeedleFilter(uint64_t bits)
+    : bytes(),
+      mask(0)
+{
+    uint64_t size = kMinBits;
+    while (size < bits and size < kMaxBits)
+        size *= 2;
+    bytes.assign(size / 8, '\0');
+    mask = size - 1;
+}
+
+/**
+ * @param needles The number of needles to put in a filter.
+ * @return The number of bits for a filter with them.
+ */
+uint64_t
+NeedleFilter::BitsFor(uint64_t needles) noexcept
+{
+    return needles > kMaxBits / kBitsPerNeedle
+        ? kMaxBits : needles * kBitsPerNeedle;
+}
+
+/**
+ * Adds a needle ID to the filter.
+ *
+ * @param needleId The ID.
+ */
+void
+NeedleFilter::Add(uint64_t needleId) noexcept
+{
+    auto hash = Mix(needleId);
+    auto step = hash >> 32 | 1;
+    for (unsigned i = 0; i < kHashes; ++i, hash += step) {
+        auto bit = hash & mask;
+        bytes[bit / 8] |= static_cast<char>(1 << (bit % 8));
+    }
+}
+
+/**
+ * @param needleId A needle ID.
+ * @return False if the ID was never added to the filter, true if it may have
+ *  been.
+ */
+bool
+NeedleFilter::MayContain(uint64_t needleId) const noexcept
+{
+    auto hash = Mix(needleId);
+    auto step = hash >> 32 | 1;
+    for (unsigned i = 0; i < kHashes; ++i, hash += step) {
+        auto bit = hash & mask;
+        if (not (bytes[bit / 8] & (1 << (bit % 8))))
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Adds the IDs of another filter to this one.
+ *
+ * @param filter The other filter.
+ * @throw std::invalid_argument if the filters are not the same size.
+ */
+void
+NeedleFilter::Merge(const NeedleFilter &filter)
+{
+    if (filter.mask != mask)
+        throw std::invalid_argument("filters of different sizes");
+    for (size_t i = 0; i < bytes.size(); ++i)
+        bytes[i] |= filter.bytes[i];
+}
+
+/**
+ * Writes the bits of the filter to a stream.
+ *
+ * @param os The output stream.
+ */
+void
+NeedleFilter::Write(std::ostream &os) const
+{
+    os.write(bytes.data(), bytes.size());
+}
+
+/**
+ * Reads the bits of the filter from a stream, as written by a filter of the
+ * same size.
+ *
+ * @param is The input stream.
+ * @return True if all the bits are read, false otherwise.
+ */
+bool
+NeedleFilter::Read(std::istream &is)
+{
+    is.read(&bytes[0], bytes.size());
+    return static_cast<size_t>(is.gcount()) == bytes.size();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+/**
+ * A Bloom filter of needle IDs, which tells for sure that a needle is not in
+ * a set, and may be wrong about one that is, at a rate of about 1% with the
+ * recommended number of bits.
+ *
+ * Stores build one with the IDs of all their needles, and the Cache merges the
+ * filters of all the Stores to reject requests for needles that do not exist
+ * without asking the Stores. Filters of the same size set the same bits for
+ * the same ID, so that they are merged by OR-ing them. The bits are sent as a
+ * byte array, where bit i is the bit i % 8 of byte i / 8.
+ */
+class NeedleFilter
+{
+public:
+    static constexpr unsigned kHashes = 7;
+    static constexpr uint64_t kBitsPerNeedle = 10;
+    static constexpr uint64_t kMinBits = 1 << 10;
+    static constexpr uint64_t kMaxBits = uint64_t(1) << 32;
+
+private:
+    std::string bytes;
+    uint64_t mask;  // The number of bits minus 1.
+
+public:
+    explicit NeedleFilter(uint64_t bits);
+
+    static uint64_t BitsFor(uint64_t needles) noexcept;
+
+    uint64_t Bits() const noexcept { return mask + 1; }
+    void Add(uint64_t needleId) noexcept;
+    bool MayContain(uint64_t needleId) const noexcept;
+    void Merge(const NeedleFilter &filter);
+    void Write(std::ostream &os) const;
+    bool Read(std::istream &is);
+};
@@ -0,0 +1,146 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "bits.hh"
+#include "crc32c.hh"
+#include "needleindex.hh"
+
+// Define them here to avoid link errors
+constexpr char NeedleIndex::kMagic[4];
+constexpr uint32_t NeedleIndex::kVersion;
+
+namespace {
+
+constexpr size_t kVolumeSize = 16;
+constexpr size_t kNeedleSize = 48;
+
+} // namespace
+
+/**
+ * Writes the index to a file, replacing it atomically. The data is synced
+ * before the file is renamed, so a crash leaves either the old or the new file.
+ *
+ * @param fname The name of the file.
+ * @throw std::system_error if the file cannot be written.
+ */
+void
+NeedleIndex::Save(const std::string &fname) const
+{
+    std::string out(kMagic, sizeof(kMagic));
+    PutLe<uint32_t>(out, kVersion);
+    PutLe<uint64_t>(out, volumeSizes.size());
+    for (auto &item : volumeSizes) {
+        PutLe<uint64_t>(out, item.first);
+        PutLe<uint64_t>(out, item.second);
+    }
+    PutLe<uint64_t>(out, needles.size());
+    for (auto &needle : needles) {
+        PutLe<uint64_t>(out, needle.flags.id);
+        PutLe<uint64_t>(out, needle.haystackId);
+        PutLe<uint64_t>(out, needle.offset);
+        PutLe<uint64_t>(out, needle.flags.size);
+        PutLe<uint32_t>(out, needle.flags.checksum);
+        PutLe<uint32_t>(out, needle.flags.cookie);
+        PutLe<uint32_t>(out, needle.flags.codec);
+        PutLe<uint32_t>(out, needle.flags.rawSize);
+    }
+    PutLe<uint32_t>(out, Crc32c(out.data(), out.size()));
+
+    auto tmpName = fname + ".tmp";
+    int fd = ::open(tmpName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw SystemError("open " + tmpName);
+    for (size_t pos = 0; pos < out.size();) {
+        auto n = ::write(fd, out.data() + pos, out.size() - pos);
+        if (n < 0 and errno == EINTR)
+            continue;
+        if (n < 0) {
+            auto err = SystemError("write " + tmpName);
+            ::close(fd);
+            throw err;
+        }
+        pos += n;
+    }
+    if (::fsync(fd)) {
+        auto err = SystemError("fsync " + tmpName);
+        ::close(fd);
+        throw err;
+    }
+    ::close(fd);
+    if (std::rename(tmpName.c_str(), fname.c_str()))
+        throw SystemError("rename " + tmpName);
+}
+
+/**
+ * Reads an index from a file.
+ *
+ * @param fname The name of the file.
+ * @return False if the file does not exist, or it is not a valid index, true
+ *  otherwise.
+ */
+bool
+NeedleIndex::Load(const std::string &fname)
+{
+    volumeSizes.clear();
+    needles.clear();
+
+    std::ifstream file(fname, std::ios::binary);
+    if (not file)
+        return false;
+    std::vector<char> in{
+        std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+
+    const size_t headerSize = sizeof(kMagic) + 4 + 8;
+    if (in.size() < headerSize + 8 + 4
+        or std::memcmp(in.data(), kMagic, sizeof(kMagic)) != 0
+        or GetLe<uint32_t>(in.data() + 4) != kVersion
+        or GetLe<uint32_t>(in.data() + in.size() - 4)
+            != Crc32c(in.data(), in.size() - 4))
+        return false;
+
+    auto end = in.size() - 4;
+    auto volumeCount = GetLe<uint64_t>(in.data() + 8);
+    if (volumeCount > (end - headerSize) / kVolumeSize)
+        return false;
+    size_t pos = headerSize;
+    for (uint64_t i = 0; i < volumeCount; ++i, pos += kVolumeSize) {
+        volumeSizes[GetLe<uint64_t>(in.data() + pos)] =
+            GetLe<uint64_t>(in.data() + pos + 8);
+    }
+
+    if (pos + 8 > end)
+        return false;
+    auto needleCount = GetLe<uint64_t>(in.data() + pos);
+    pos += 8;
+    if (needleCount != (end - pos) / kNeedleSize
+        or (end - pos) % kNeedleSize) {
+        volumeSizes.clear();
+        return false;
+    }
+    needles.reserve(needleCount);
+    for (; pos < end; pos += kNeedleSize) {
+        auto p = in.data() + pos;
+        needles.emplace_back(
+            GetLe<uint64_t>(p + 8),
+            GetLe<uint64_t>(p + 16),
+            GetLe<uint64_t>(p),
+            GetLe<uint64_t>(p + 24),
+            GetLe<uint32_t>(p + 32));
+        needles.back().flags.cookie = GetLe<uint32_t>(p + 36);
+        needles.back().flags.codec =
+            static_cast<uint8_t>(GetLe<uint32_t>(p + 40));
+        needles.back().flags.rawSize = GetLe<uint32_t>(p + 44);
+    }
+    return true;
+}
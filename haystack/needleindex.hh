@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "needle.hh"
+
+/**
+ * A snapshot of the Store's needle index, saved on shutdown so that the next
+ * start does not have to scan every volume.
+ *
+ * The file is little-endian, and it is only trusted for the volumes whose size
+ * still matches the snapshot:
+ *
+ *  | size | field                                                      |
+ *  |------|------------------------------------------------------------|
+ *  |    4 | magic bytes, "HSIX"                                        |
+ *  |    4 | version                                                    |
+ *  |    8 | number of volumes, followed by their ID and size (8 + 8)   |
+ *  |    8 | number of needles, followed by their ID, volume ID, offset,|
+ *  |      | and size (8 + 8 + 8 + 8), checksum and cookie (4 + 4),     |
+ *  |      | and codec and uncompressed size (4 + 4)                    |
+ *  |    4 | CRC32C of everything before it                             |
+ */
+struct NeedleIndex
+{
+    static constexpr char kMagic[4] = {'H', 'S', 'I', 'X'};
+    static constexpr uint32_t kVersion = 2;
+
+    std::map<uint64_t, uint64_t> volumeSizes;  // By volume ID.
+    std::vector<Needle> needles;
+
+    void Save(const std::string &fname) const;
+    bool Load(const std::string &fname);
+};
@@ -0,0 +1,162 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "readcache.hh"
+
+namespace {
+using LockGuard = std::lock_guard<std::mutex>;
+}
+
+// Define them here to avoid link errors
+constexpr unsigned ReadCache::kShards;
+
+/**
+ * Initializes an empty ReadCache.
+ *
+ * @param capacity The maximum number of bytes of needle contents held, or 0 to
+ *  disable the cache.
+ * @param maxNeedleSize The size of the largest needle that is cached.
+ */
+ReadCache::ReadCache(size_t capacity, size_t maxNeedleSize)
+    : shardCapacity(capacity / kShards),
+      maxNeedleSize(maxNeedleSize),
+      shards(new Shard[kShards])
+{}
+
+/**
+ * @param needleId The needle ID.
+ * @return The generation of the needle's shard, to be passed to Put once the
+ *  needle is read.
+ */
+uint64_t
+ReadCache::Generation(uint64_t needleId) const
+{
+    auto &shard = ShardOf(needleId);
+    LockGuard lk(shard.mtx);
+    return shard.generation;
+}
+
+/**
+ * Copies part of the contents of a cached needle into a buffer, and makes it
+ * the most recently used one of its shard. A range read is served by a cached
+ * needle as well as a whole one.
+ *
+ * @param handle The volume, ID, and cookie of the needle.
+ * @param range The part of the contents to copy. It is trimmed to the end of
+ *  the needle.
+ * @param buf Set to a buffer from the pool with the contents, if the needle is
+ *  cached. Its size is the size of the range.
+ * @return True if the needle is cached and the range starts within it, false
+ *  otherwise.
+ */
+bool
+ReadCache::Get(
+    const NeedleHandle &handle,
+    ByteRange range,
+    BufferPool::Buffer &buf)
+{
+    if (not IsEnabled())
+        return false;
+
+    auto &shard = ShardOf(handle.needleId);
+    LockGuard lk(shard.mtx);
+    auto it = shard.entries.find(handle.needleId);
+    if (it == shard.entries.end()
+        or it->second->handle.volumeId != handle.volumeId
+        or it->second->handle.cookie != handle.cookie
+        or not range.Clamp(it->second->size))
+        return false;
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    auto &entry = *it->second;
+    buf = BufferPool::Instance().Get(range.length);
+    std::memcpy(buf.Data(), entry.data.get() + range.offset, range.length);
+    return true;
+}
+
+/**
+ * Caches the contents of a needle, evicting the least recently used needles of
+ * its shard to make room for it.
+ *
+ * @param handle The volume, ID, and cookie of the needle.
+ * @param data The contents of the needle.
+ * @param size The size of the needle.
+ * @param generation The generation of the shard before the needle was read.
+ * @details Nothing is cached if the needle is too large, or if a needle of the
+ *  shard was removed since the generation was taken, as this one may be it.
+ *  A needle with the same ID in another volume is replaced.
+ */
+void
+ReadCache::Put(
+    const NeedleHandle &handle,
+    const char *data,
+    size_t size,
+    uint64_t generation)
+{
+    if (not Fits(size))
+        return;
+
+    std::unique_ptr<char[]> copy(new char[size]);
+    std::memcpy(copy.get(), data, size);
+
+    auto needleId = handle.needleId;
+    auto &shard = ShardOf(needleId);
+    LockGuard lk(shard.mtx);
+    if (generation != shard.generation)
+        return;
+    auto it = shard.entries.find(needleId);
+    if (it != shard.entries.end()) {
+        if (it->second->handle.volumeId == handle.volumeId)
+            return;
+        shard.bytes -= it->second->size;
+        shard.lru.erase(it->second);
+        shard.entries.erase(it);
+    }
+
+    while (shard.bytes + size > shardCapacity) {
+        auto &victim = shard.lru.back();
+        shard.bytes -= victim.size;
+        shard.entries.erase(victim.handle.needleId);
+        shard.lru.pop_back();
+    }
+    shard.lru.push_front(Entry{handle, std::move(copy), size});
+    shard.entries[needleId] = shard.lru.begin();
+    shard.bytes += size;
+}
+
+/**
+ * Drops a needle from the cache, and makes sure that reads that started before
+ * do not cache it again.
+ *
+ * @param needleId The needle ID. The needle is dropped whatever its volume.
+ */
+void
+ReadCache::Remove(uint64_t needleId)
+{
+    auto &shard = ShardOf(needleId);
+    LockGuard lk(shard.mtx);
+    ++shard.generation;
+    auto it = shard.entries.find(needleId);
+    if (it == shard.entries.end())
+        return;
+    shard.bytes -= it->second->size;
+    shard.lru.erase(it->second);
+    shard.entries.erase(it);
+}
+
+/**
+ * @return The number of bytes of needle contents held.
+ */
+size_t
+ReadCache::Bytes() const
+{
+    size_t bytes = 0;
+    for (unsigned i = 0; i < kShards; ++i) {
+        LockGuard lk(shards[i].mtx);
+        bytes += shards[i].bytes;
+    }
+    return bytes;
+}
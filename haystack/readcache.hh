@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "bufferpool.hh"
+#include "needle.hh"
+
+/**
+ * An in-memory LRU cache of the contents of small needles, which serves the
+ * Store's repeated reads of hot needles without going to disk.
+ *
+ * The cache is split into kShards shards by needle ID, each with its own lock
+ * and an equal share of the capacity. Every shard has a generation, which
+ * Remove increments. A reader takes the generation before it reads a needle
+ * from disk and passes it to Put, so that a needle deleted in the meantime is
+ * never cached. A needle is only served to requests for the volume and cookie
+ * it was read with.
+ */
+class ReadCache
+{
+public:
+    static constexpr unsigned kShards = 16;
+
+private:
+    struct Entry
+    {
+        NeedleHandle handle;
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    struct Shard
+    {
+        std::mutex mtx;
+        std::list<Entry> lru;  // The most recently used first.
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+        size_t bytes = 0;
+        uint64_t generation = 0;
+    };
+
+    size_t shardCapacity;
+    size_t maxNeedleSize;
+    std::unique_ptr<Shard[]> shards;
+
+    Shard &ShardOf(uint64_t needleId) const noexcept
+    {
+        return shards[needleId % kShards];
+    }
+
+public:
+    ReadCache(size_t capacity, size_t maxNeedleSize);
+    ReadCache(const ReadCache &cache) = delete;
+    ReadCache& operator=(const ReadCache &cache) = delete;
+
+    // Whether the cache holds anything at all.
+    bool IsEnabled() const noexcept { return shardCapacity and maxNeedleSize; }
+    // Whether a needle of the given size may be cached.
+    bool Fits(size_t size) const noexcept
+    {
+        return IsEnabled() and size <= maxNeedleSize and size <= shardCapacity;
+    }
+
+    uint64_t Generation(uint64_t needleId) const;
+    bool Get(
+        const NeedleHandle &handle,
+        ByteRange range,
+        BufferPool::Buffer &buf);
+    // Copies the whole needle, see the other Get.
+    bool
+    Get(const NeedleHandle &handle, BufferPool::Buffer &buf)
+    {
+        return Get(handle, ByteRange{0, UINT64_MAX}, buf);
+    }
+    void Put(
+        const NeedleHandle &handle,
+        const char *data,
+        size_t size,
+        uint64_t generation);
+    void Remove(uint64_t needleId);
+    size_t Bytes() const;
+};
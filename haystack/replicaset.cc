@@ -0,0 +1,572 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "replicaset.hh"
+#include "trace.hh"
+
+namespace {
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+
+/**
+ * Sends a request to a Store and reads its reply line.
+ *
+ * @param store The address of the Store.
+ * @param request The request, with its newline and data.
+ * @param conn The connection, positioned after the reply line on return.
+ * @return The reply line, or an empty string if the Store cannot be reached
+ *  or does not reply within ReplicaSet::kTimeout seconds.
+ */
+std::string
+Exchange(
+    const StoreAddress &store,
+    const std::string &request,
+    ReplicaSet::TcpStream &conn)
+{
+    std::string reply;
+    try {
+        conn.expires_after(std::chrono::seconds(ReplicaSet::kTimeout));
+        conn.connect(store.ipAddr, store.port);
+        if (conn) {
+            conn.write(request.data(), request.size());
+            conn.flush();
+            std::getline(conn, reply);
+        }
+    }
+    catch (std::exception&) {
+        reply.clear();
+    }
+    return reply;
+}
+
+/**
+ * @param reply The reply line of a Store.
+ * @return True if it is an ok reply, false otherwise.
+ */
+bool
+IsOk(const std::string &reply)
+{
+    return reply.compare(0, 2, "ok") == 0;
+}
+
+} // namespace
+
+/**
+ * A request sent to every replica, shared with the threads that send it, as
+ * they may outlive the caller.
+ */
+struct ReplicaSet::Round
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::string request;
+    std::vector<std::string> replies;  // Empty until the replica replies.
+    size_t done = 0;
+    size_t oks = 0;
+    bool isRetried = false;  // Sent again to the replicas that missed it.
+};
+
+// Define them here to avoid link errors
+constexpr unsigned ReplicaSet::kTimeout;
+constexpr unsigned ReplicaSet::kSendersPerStore;
+constexpr size_t ReplicaSet::kMaxMissed;
+
+/**
+ * Parses a comma separated list of Store addresses, e.g.,
+ * |10.0.0.1,10.0.0.2:5001|.
+ *
+ * @param list The list of |<ipAddr>[:<port>]|.
+ * @param defaultPort The port of the addresses that do not have one.
+ * @return The addresses.
+ * @throw std::invalid_argument if the list is empty, or has an empty address.
+ */
+std::vector<StoreAddress>
+ParseStoreAddresses(const std::string &list, const std::string &defaultPort)
+{
+    std::vector<StoreAddress> stores;
+    std::istringstream iss(list);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        auto colon = item.find(':');
+        StoreAddress store{item.substr(0, colon), defaultPort};
+        if (colon != std::string::npos)
+            store.port = item.substr(colon + 1);
+        if (store.ipAddr.empty() or store.port.empty())
+            throw std::invalid_argument("bad store address: " + item);
+        stores.push_back(store);
+    }
+    if (stores.empty())
+        throw std::invalid_argument("no store addresses");
+    return stores;
+}
+
+/**
+ * Initializes a ReplicaSet.
+ *
+ * @param stores The addresses of the replicas.
+ * @param quorum The number of replicas that must acknowledge a write, or 0 for
+ *  a majority of them.
+ */
+ReplicaSet::ReplicaSet(std::vector<StoreAddress> stores, size_t quorum)
+    : stores(std::move(stores)),
+      quorum(quorum),
+      nextRead(0),
+      roundMtx(),
+      roundCv(),
+      rounds(0),
+      senders(),
+      missedMtx(),
+      missed(this->stores.size())
+{
+    if (not this->quorum or this->quorum > this->stores.size())
+        this->quorum = this->stores.size() / 2 + 1;
+    auto workers = static_cast<unsigned>(
+        this->stores.size() * kSendersPerStore);
+    senders.reset(new ThreadPool(workers, workers));
+}
+
+/**
+ * Dtor. Waits for the requests still being sent to the replicas.
+ */
+ReplicaSet::~ReplicaSet()
+{
+    Wait();
+}
+
+/**
+ * Waits until the requests of the writes that returned before a quorum of the
+ * replicas replied have been sent to all of them, and answered.
+ */
+void
+ReplicaSet::Wait() const
+{
+    UniqueLock lk(roundMtx);
+    roundCv.wait(lk, [this] { return not rounds; });
+}
+
+/**
+ * Sends a request to every replica in parallel.
+ *
+ * @param line The request line, without the newline.
+ * @param body The data that follows the request line.
+ * @param size The number of bytes of data.
+ * @param isRetried If true, the request is queued for the replicas that
+ *  cannot be reached, and sent to them again, see SendMissed.
+ * @return The reply line of every replica, in the order of the stores. The
+ *  reply of a replica that cannot be reached is empty.
+ * @details Returns as soon as a quorum of the replicas replies ok, or all of
+ *  them reply. The requests to the other replicas are completed in the
+ *  background, and their replies are left empty. A request that finds every
+ *  sender busy is sent by the caller.
+ */
+std::vector<std::string>
+ReplicaSet::Broadcast(
+    const std::string &line,
+    const char *body,
+    size_t size,
+    bool isRetried) const
+{
+    auto round = std::make_shared<Round>();
+    round->request = line + '\n';
+    if (size)
+        round->request.append(body, size);
+    round->replies.resize(stores.size());
+    round->isRetried = isRetried;
+    {
+        LockGuard lk(roundMtx);
+        ++rounds;
+    }
+
+    for (size_t i = 0; i < stores.size(); ++i) {
+        auto send = [this, round, i] { Send(*round, i); };
+        if (not senders->TrySubmit(send))
+            send();
+    }
+
+    UniqueLock lk(round->mtx);
+    round->cv.wait(lk, [&] {
+        return round->oks >= quorum or round->done == stores.size();
+    });
+    return round->replies;
+}
+
+/**
+ * Sends the request of a round to a replica, after the requests it missed,
+ * and records the reply. The last reply of the round releases it, after which
+ * the replica set may be gone.
+ *
+ * @param round The round.
+ * @param i The index of the replica.
+ */
+void
+ReplicaSet::Send(Round &round, size_t i) const
+{
+    SendMissed(i);
+    TcpStream conn;
+    auto reply = Exchange(stores[i], round.request, conn);
+    if (reply.empty() and round.isRetried)
+        AddMissed(i, round.request);
+
+    bool isLast;
+    {
+        LockGuard lk(round.mtx);
+        round.replies[i] = reply;
+        isLast = ++round.done == stores.size();
+        if (reply == "ok")
+            ++round.oks;
+        round.cv.notify_all();
+    }
+    if (isLast) {
+        LockGuard lk(roundMtx);
+        --rounds;
+        roundCv.notify_all();
+    }
+}
+
+/**
+ * Queues a request that a replica missed. The oldest request is dropped once
+ * kMaxMissed are queued.
+ *
+ * @param i The index of the replica.
+ * @param request The request, with its newline and data.
+ */
+void
+ReplicaSet::AddMissed(size_t i, const std::string &request) const
+{
+    LockGuard lk(missedMtx);
+    auto &requests = missed[i];
+    if (requests.size() >= kMaxMissed) {
+        std::cerr << "ERROR: " << stores[i].ToString()
+                  << ": dropping a missed request" << std::endl;
+        requests.pop_front();
+    }
+    requests.push_back(request);
+}
+
+/**
+ * Sends the requests that a replica missed, in order, until one of them
+ * cannot be sent, which is kept for the next time. Any reply counts, e.g.,
+ * |err BadNeedle| for a needle that the replica deleted before the first
+ * attempt timed out.
+ *
+ * @param i The index of the replica.
+ */
+void
+ReplicaSet::SendMissed(size_t i) const
+{
+    for (;;) {
+        std::string request;
+        {
+            LockGuard lk(missedMtx);
+            if (missed[i].empty())
+                return;
+            request = std::move(missed[i].front());
+            missed[i].pop_front();
+        }
+        TcpStream conn;
+        if (Exchange(stores[i], request, conn).empty()) {
+            LockGuard lk(missedMtx);
+            missed[i].push_front(std::move(request));
+            return;
+        }
+    }
+}
+
+/**
+ * @return The number of requests that the replicas missed, which are still
+ *  queued.
+ */
+size_t
+ReplicaSet::Missed() const
+{
+    LockGuard lk(missedMtx);
+    size_t count = 0;
+    for (auto &requests : missed)
+        count += requests.size();
+    return count;
+}
+
+/**
+ * Sends the requests that the replicas missed, without waiting for the next
+ * write.
+ */
+void
+ReplicaSet::Repair() const
+{
+    for (size_t i = 0; i < stores.size(); ++i)
+        SendMissed(i);
+}
+
+/**
+ * Reduces the replies of the replicas to the reply of the replica set.
+ *
+ * @param replies The reply of every replica.
+ * @param acked If not null, set to the replicas that replied ok.
+ * @return |ok| if a quorum of the replicas replied ok. Otherwise the first
+ *  error reply, or |err NoQuorum| if the replicas could not be reached.
+ */
+std::string
+ReplicaSet::Reduce(
+    const std::vector<std::string> &replies,
+    std::vector<StoreAddress> *acked) const
+{
+    size_t oks = 0;
+    std::string err;
+    for (size_t i = 0; i < replies.size(); ++i) {
+        if (replies[i] == "ok") {
+            ++oks;
+            if (acked)
+                acked->push_back(stores[i]);
+        }
+        else if (err.empty())
+            err = replies[i];
+    }
+    if (oks >= quorum)
+        return "ok";
+    return err.empty() ? "err NoQuorum" : err;
+}
+
+/**
+ * Writes a needle to every replica.
+ *
+ * @param handle The volume where the needle is saved, and its ID and cookie.
+ * @param buf The contents of the needle.
+ * @param size The number of bytes in the buffer.
+ * @param traceId The trace ID forwarded to the replicas, or 0.
+ * @param acked Set to the replicas that acknowledged the write.
+ * @return |ok| if a quorum of the replicas stored the needle, or an error
+ *  reply otherwise, e.g., |err NoFit| if the volume is full.
+ */
+std::string
+ReplicaSet::Put(
+    const NeedleHandle &handle,
+    const char *buf,
+    uint64_t size,
+    uint64_t traceId,
+    std::vector<StoreAddress> &acked) const
+{
+    std::ostringstream line;
+    line << "put " << handle.ToString() << ' ' << size << TraceToken(traceId);
+    acked.clear();
+    return Reduce(Broadcast(line.str(), buf, size), &acked);
+}
+
+/**
+ * Writes a group of needles to every replica with a single request.
+ *
+ * @param uploads The handles and contents of the needles.
+ * @param traceId The trace ID forwarded to the replicas, or 0.
+ * @param acked Set to the replicas that acknowledged the write.
+ * @return |ok| if a quorum of the replicas stored all the needles, or an error
+ *  reply otherwise.
+ * @details The replicas append the needles of each volume together, see the
+ *  multiput command of the Store.
+ */
+std::string
+ReplicaSet::PutGroup(
+    const std::vector<NeedleUpload> &uploads,
+    uint64_t traceId,
+    std::vector<StoreAddress> &acked) const
+{
+    std::ostringstream line;
+    line << "multiput " << uploads.size() << TraceToken(traceId);
+    std::string body;
+    for (auto &upload : uploads) {
+        body += upload.handle.ToString() + ' ' + std::to_string(upload.size)
+            + '\n';
+        body.append(upload.buf, upload.size);
+    }
+    acked.clear();
+    return Reduce(Broadcast(line.str(), body.data(), body.size()), &acked);
+}
+
+/**
+ * Deletes a needle from every replica.
+ *
+ * @param handle The volume, ID, and cookie of the needle.
+ * @param traceId The trace ID forwarded to the replicas, or 0.
+ * @return |ok| if a quorum of the replicas deleted the needle, or an error
+ *  reply otherwise.
+ * @details A replica that never got the needle, e.g., because it was down when
+ *  it was written, counts as having deleted it, as long as another replica
+ *  had it. A replica that cannot be reached is sent the delete again later.
+ */
+std::string
+ReplicaSet::Delete(const NeedleHandle &handle, uint64_t traceId) const
+{
+    std::ostringstream line;
+    line << "delete " << handle.ToString() << TraceToken(traceId);
+    auto replies = Broadcast(line.str(), nullptr, 0, true);
+
+    bool isFound = false;
+    for (auto &reply : replies)
+        isFound = isFound or reply == "ok";
+    if (isFound) {
+        for (auto &reply : replies) {
+            if (reply == "err BadNeedle")
+                reply = "ok";
+        }
+    }
+    return Reduce(replies, nullptr);
+}
+
+/**
+ * Deletes a group of needles from every replica with a single request.
+ *
+ * @param handles The volumes, IDs, and cookies of the needles.
+ * @param traceId The trace ID forwarded to the replicas, or 0.
+ * @return |ok| if a quorum of the replicas deleted the needles, or an error
+ *  reply otherwise.
+ * @details The replicas journal the deletes of each volume together, see the
+ *  multidelete command of the Store, and skip the needles they do not have.
+ *  A replica that cannot be reached is sent the deletes again later.
+ */
+std::string
+ReplicaSet::DeleteGroup(
+    const std::vector<NeedleHandle> &handles, uint64_t traceId) const
+{
+    std::ostringstream line;
+    line << "multidelete " << handles.size() << TraceToken(traceId);
+    std::string body;
+    for (auto &handle : handles)
+        body += handle.ToString() + '\n';
+    return Reduce(
+        Broadcast(line.str(), body.data(), body.size(), true), nullptr);
+}
+
+/**
+ * Asks every replica for its volumes.
+ *
+ * @return The volumes that are writable on all the replicas that can be
+ *  reached, in order of volume ID.
+ * @throw std::runtime_error if fewer than a quorum of the replicas can be
+ *  reached.
+ */
+std::vector<uint64_t>
+ReplicaSet::WritableVolumes() const
+{
+    std::map<uint64_t, size_t> writable;
+    size_t reached = 0;
+    for (auto &store : stores) {
+        TcpStream conn;
+        conn.expires_after(std::chrono::seconds(kTimeout));
+        conn.connect(store.ipAddr, store.port);
+        conn << "volumes\n";
+        conn.flush();
+
+        std::string line, status;
+        size_t count = 0;
+        if (not std::getline(conn, line))
+            continue;
+        std::istringstream iss(line);
+        iss >> status >> count;
+        if (status != "ok")
+            continue;
+        ++reached;
+        for (size_t i = 0; i < count and std::getline(conn, line); ++i) {
+            std::istringstream volume(line);
+            uint64_t volumeId, freeBytes;
+            std::string mode;
+            if (volume >> volumeId >> freeBytes >> mode and mode == "rw")
+                ++writable[volumeId];
+        }
+    }
+    if (reached < quorum)
+        throw std::runtime_error("store volumes: no quorum");
+
+    std::vector<uint64_t> volumes;
+    for (auto &item : writable) {
+        if (item.second == reached)
+            volumes.push_back(item.first);
+    }
+    return volumes;
+}
+
+/**
+ * @return The replicas in the order they should be tried for a read. Every
+ *  call starts with the next replica.
+ */
+std::vector<StoreAddress>
+ReplicaSet::ReadOrder() const
+{
+    std::vector<StoreAddress> order;
+    auto first = nextRead++;
+    for (size_t i = 0; i < stores.size(); ++i)
+        order.push_back(stores[(first + i) % stores.size()]);
+    return order;
+}
+
+/**
+ * Reads a needle from the replicas. The request goes to the replicas in read
+ * order until one of them replies ok, and the others are asked the check
+ * request, until enough of them agree that no write quorum can disagree:
+ * N - Q + 1 of the N replicas, with a write quorum of Q. A replica that missed
+ * a delete thus cannot return the needle alone.
+ *
+ * @param request The request line, without the newline, e.g., a get.
+ * @param check The request line that the other replicas are asked to confirm
+ *  that they have the needle, e.g., a stat.
+ * @param conn Set to the connection to the replica that replied ok to the
+ *  request, positioned after its reply line.
+ * @param isMissing Set to true if enough replicas replied |err BadNeedle|,
+ *  so the needle is known not to exist, false otherwise.
+ * @return The ok reply line to the request, or |err BadNeedle| if enough
+ *  replicas do not have the needle. Otherwise the last error reply, or
+ *  |err NoStore| if no replica could be reached. The ok reply is returned
+ *  when the replicas that can be reached do not agree, as the other
+ *  replicas may have the needle.
+ */
+std::string
+ReplicaSet::Read(
+    const std::string &request,
+    const std::string &check,
+    TcpStream &conn,
+    bool &isMissing) const
+{
+    const auto needed = stores.size() - quorum + 1;
+    std::string line = "err NoStore", found;
+    size_t oks = 0, misses = 0;
+    for (auto &store : ReadOrder()) {
+        std::string reply;
+        if (found.empty()) {
+            conn.close();
+            conn.clear();
+            reply = Exchange(store, request + '\n', conn);
+            if (IsOk(reply))
+                found = reply;
+        }
+        else {
+            TcpStream checkConn;
+            reply = Exchange(store, check + '\n', checkConn);
+        }
+
+        if (IsOk(reply))
+            ++oks;
+        else if (reply == "err BadNeedle")
+            ++misses;
+        if (not reply.empty())
+            line = reply;
+        if (oks >= needed or misses >= needed)
+            break;
+    }
+
+    isMissing = misses >= needed;
+    if (isMissing) {
+        conn.close();
+        return "err BadNeedle";
+    }
+    return found.empty() ? line : found;
+}
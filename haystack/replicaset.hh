@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "needle.hh"
+#include "threadpool.hh"
+
+/**
+ * The address of a Store.
+ */
+struct StoreAddress
+{
+    std::string ipAddr;
+    std::string port;
+
+    // Formats the address as |<ipAddr>:<port>|.
+    std::string ToString() const { return ipAddr + ':' + port; }
+};
+
+std::vector<StoreAddress>
+ParseStoreAddresses(const std::string &list, const std::string &defaultPort);
+
+/**
+ * A needle sent to the Stores with others in a single request.
+ */
+struct NeedleUpload
+{
+    NeedleHandle handle;
+    const char *buf;
+    uint64_t size;
+};
+
+/**
+ * A set of Store processes that hold replicas of the same logical volumes.
+ *
+ * Every needle is written to the same volume ID on all the replicas, in
+ * parallel, and a write succeeds once a quorum of them acknowledges it, a
+ * majority by default. A replica that fails or lags behind does not fail the
+ * write, and the replicas that acknowledged it are reported to the caller so
+ * that they can be recorded. A delete that a replica missed because it could
+ * not be reached is queued, and sent again before the next request to that
+ * replica, so that it stops serving the needle. Reads are spread across the
+ * replicas in a round robin fashion, and a needle is only returned once
+ * enough replicas agree on it that no write quorum can disagree.
+ *
+ * The requests are sent by a pool of kSendersPerStore threads per replica.
+ * When the pool is busy, the caller sends the request itself, which bounds the
+ * number of requests, and copies of their data, still being sent once the
+ * writes return. The dtor waits for them.
+ */
+class ReplicaSet
+{
+public:
+    using TcpStream = boost::asio::ip::tcp::iostream;
+
+    // The number of seconds a request to a replica may take.
+    static constexpr unsigned kTimeout = 10;
+
+    // The number of threads per replica that send the requests.
+    static constexpr unsigned kSendersPerStore = 4;
+
+    // The number of missed deletes queued per replica.
+    static constexpr size_t kMaxMissed = 10000;
+
+private:
+    struct Round;
+
+    std::vector<StoreAddress> stores;
+    size_t quorum;
+    mutable std::atomic<unsigned> nextRead;
+
+    // The number of requests still being sent to some of the replicas.
+    mutable std::mutex roundMtx;
+    mutable std::condition_variable roundCv;
+    mutable size_t rounds;
+
+    std::unique_ptr<ThreadPool> senders;
+
+    // The requests that each replica missed, to send again.
+    mutable std::mutex missedMtx;
+    mutable std::vector<std::deque<std::string>> missed;
+
+    void Send(Round &round, size_t i) const;
+    void AddMissed(size_t i, const std::string &request) const;
+    void SendMissed(size_t i) const;
+    std::vector<std::string> Broadcast(
+        const std::string &line,
+        const char *body,
+        size_t size,
+        bool isRetried = false) const;
+    std::string Reduce(
+        const std::vector<std::string> &replies,
+        std::vector<StoreAddress> *acked) const;
+
+public:
+    explicit ReplicaSet(std::vector<StoreAddress> stores, size_t quorum = 0);
+    ReplicaSet(const ReplicaSet &replicas) = delete;
+    ReplicaSet& operator=(const ReplicaSet &replicas) = delete;
+    ~ReplicaSet();
+
+    void Wait() const;
+
+    const std::vector<StoreAddress> &Stores() const noexcept { return stores; }
+    size_t Quorum() const noexcept { return quorum; }
+
+    std::string Put(
+        const NeedleHandle &handle,
+        const char *buf,
+        uint64_t size,
+        uint64_t traceId,
+        std::vector<StoreAddress> &acked) const;
+    std::string PutGroup(
+        const std::vector<NeedleUpload> &uploads,
+        uint64_t traceId,
+        std::vector<StoreAddress> &acked) const;
+    std::string Delete(const NeedleHandle &handle, uint64_t traceId) const;
+    std::string DeleteGroup(
+        const std::vector<NeedleHandle> &handles, uint64_t traceId) const;
+    std::vector<uint64_t> WritableVolumes() const;
+    std::vector<StoreAddress> ReadOrder() const;
+    std::string Read(
+        const std::string &request,
+        const std::string &check,
+        TcpStream &conn,
+        bool &isMissing) const;
+    size_t Missed() const;
+    void Repair() const;
+};
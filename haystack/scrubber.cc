@@ -0,0 +1,204 @@
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "scrubber.hh"
+
+namespace {
+using UniqueLock = std::unique_lock<std::mutex>;
+using Clock = std::chrono::steady_clock;
+}
+
+/**
+ * Initializes a Scrubber. The scrubber thread is not started until Start is
+ * called.
+ *
+ * @param volumes A function returning the haystacks to scrub. It is called at
+ *  the beginning of every pass, and only the sealed haystacks are scrubbed.
+ * @param bytesPerSecond The maximum number of bytes to verify per second.
+ * @param interval The time to wait between passes.
+ * @param report A function called with every corrupt needle. If none is
+ *  provided, then corrupt needles are reported on stderr.
+ */
+Scrubber::Scrubber(
+    VolumeFn volumes,
+    uint64_t bytesPerSecond,
+    std::chrono::seconds interval,
+    ReportFn report)
+    : volumes(std::move(volumes)),
+      report(std::move(report)),
+      bytesPerSecond(bytesPerSecond ? bytesPerSecond : 1),
+      interval(interval),
+      corruptCount(0),
+      scrubbedCount(0),
+      unreadableCount(0),
+      mtx(),
+      cv(),
+      isStopped(true),
+      thr()
+{
+    if (not this->report) {
+        this->report = [](const Needle &needle) {
+            std::cerr << "CORRUPT: " << needle << std::endl;
+        };
+    }
+}
+
+/**
+ * Dtor. Stops the scrubber thread if it is running.
+ */
+Scrubber::~Scrubber()
+{
+    Stop();
+}
+
+/**
+ * Launches the scrubber thread.
+ */
+void
+Scrubber::Start()
+{
+    UniqueLock lk(mtx);
+    if (not isStopped)
+        return;
+    isStopped = false;
+    thr = std::thread(&Scrubber::Loop, this);
+}
+
+/**
+ * Stops the scrubber thread and waits for it to finish. A pass in progress is
+ * abandoned.
+ */
+void
+Scrubber::Stop()
+{
+    {
+        UniqueLock lk(mtx);
+        isStopped = true;
+    }
+    cv.notify_all();
+    if (thr.joinable())
+        thr.join();
+}
+
+/**
+ * Runs passes over the sealed haystacks until the scrubber is stopped.
+ */
+void
+Scrubber::Loop()
+{
+    while (Pass(true)) {
+        UniqueLock lk(mtx);
+        if (cv.wait_for(lk, interval, [this] { return isStopped; }))
+            break;
+    }
+}
+
+/**
+ * Verifies every needle in the sealed haystacks once, without throttling.
+ *
+ * @return True when the pass completes.
+ */
+bool
+Scrubber::ScrubOnce()
+{
+    return Pass(false);
+}
+
+/**
+ * Verifies every needle in the sealed haystacks once. A needle that cannot be
+ * read, e.g., because the device returns EIO, is reported as corrupt, and a
+ * volume that cannot be scanned is logged and skipped, so that a failing disk
+ * does not stop the pass over the other volumes. A needle header that cannot
+ * be decoded is logged and counted as corrupt, and the pass goes on with the
+ * needles after it.
+ *
+ * @param throttled If true, the pass is throttled and it is abandoned when the
+ *  scrubber is stopped.
+ * @return False if the pass was interrupted because the scrubber was stopped,
+ *  true otherwise.
+ */
+bool
+Scrubber::Pass(bool throttled)
+{
+    auto start = Clock::now();
+    uint64_t bytes = 0;
+
+    for (auto &hs : volumes()) {
+        if (not hs->IsReadOnly())
+            continue;
+        bool isDone = true;
+        auto volumeId = hs->Id();
+        try {
+            isDone = hs->Scan(
+                [&](const Needle &needle) {
+                    if (needle.flags.isDeleted)
+                        return true;
+                    if (not Check(*hs, needle)) {
+                        ++corruptCount;
+                        report(needle);
+                    }
+                    ++scrubbedCount;
+                    bytes += NeedleDiskSize(needle.flags.size);
+                    return not throttled or Throttle(start, bytes);
+                },
+                Haystack::kScanChunk,
+                [&](uint64_t offset, uint64_t next) {
+                    ++corruptCount;
+                    std::cerr << "CORRUPT: volume " << volumeId
+                              << ": bad needle header at offset " << offset
+                              << ", resuming at offset " << next << std::endl;
+                });
+        }
+        catch (std::exception &err) {
+            ++unreadableCount;
+            std::cerr << "UNREADABLE: volume " << volumeId << ": "
+                      << err.what() << std::endl;
+        }
+        if (not isDone)
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Verifies a needle, treating a read error as corruption.
+ *
+ * @param hs The haystack of the needle.
+ * @param needle The needle.
+ * @return True if the blob matches its checksum, false otherwise.
+ */
+bool
+Scrubber::Check(const Haystack &hs, const Needle &needle)
+{
+    try {
+        return hs.Verify(needle);
+    }
+    catch (std::exception &err) {
+        ++unreadableCount;
+        std::cerr << "UNREADABLE: " << needle << ": " << err.what()
+                  << std::endl;
+        return false;
+    }
+}
+
+/**
+ * Sleeps long enough to keep the scrub rate under the limit.
+ *
+ * @param start The time when the pass started.
+ * @param bytes The number of bytes scrubbed since the pass started.
+ * @return False if the scrubber has been stopped, true otherwise.
+ */
+bool
+Scrubber::Throttle(Clock::time_point start, uint64_t bytes)
+{
+    auto due = start + std::chrono::microseconds(
+        bytes * 1000000 / bytesPerSecond);
+    UniqueLock lk(mtx);
+    return not cv.wait_until(lk, due, [this] { return isStopped; });
+}
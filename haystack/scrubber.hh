@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "haystack.hh"
+#include "needle.hh"
+
+/**
+ * Background scrubber for sealed haystacks.
+ *
+ * Walks every needle in the sealed (read-only) haystacks, verifies the blob
+ * against the checksum stored with it, and reports any needle whose contents
+ * no longer match, or that cannot be read. Needle headers that cannot be
+ * decoded are counted as corrupt too, and skipped. The scrubber is throttled
+ * to a maximum number of bytes per second so that it does not compete with
+ * foreground reads, and it sleeps for a fixed interval between passes.
+ */
+class Scrubber
+{
+public:
+    using HaystackList = std::vector<std::shared_ptr<Haystack>>;
+
+    // Returns the haystacks to scrub, which may change between passes.
+    using VolumeFn = std::function<HaystackList()>;
+
+    // Called once for every corrupt or unreadable needle that is found.
+    using ReportFn = std::function<void(const Needle&)>;
+
+private:
+    VolumeFn volumes;
+    ReportFn report;
+    uint64_t bytesPerSecond;  // Maximum scrub rate.
+    std::chrono::seconds interval;  // Time to wait between passes.
+
+    std::atomic<uint64_t> corruptCount;  // Needles and headers.
+    std::atomic<uint64_t> scrubbedCount;
+    std::atomic<uint64_t> unreadableCount;  // Needles and volumes.
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool isStopped;
+    std::thread thr;
+
+    void Loop();
+    bool Pass(bool throttled);
+    bool Check(const Haystack &hs, const Needle &needle);
+    bool Throttle(
+        std::chrono::steady_clock::time_point start, uint64_t bytes);
+
+public:
+    Scrubber(
+        VolumeFn volumes,
+        uint64_t bytesPerSecond,
+        std::chrono::seconds interval,
+        ReportFn report = nullptr);
+    Scrubber(const Scrubber &scrubber) = delete;
+    Scrubber& operator=(const Scrubber &scrubber) = delete;
+    ~Scrubber();
+
+    void Start();
+    void Stop();
+    bool ScrubOnce();
+
+    uint64_t Corrupted() const noexcept { return corruptCount; }
+    uint64_t Scrubbed() const noexcept { return scrubbedCount; }
+    uint64_t Unreadable() const noexcept { return unreadableCount; }
+};
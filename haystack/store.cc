@@ -1,16 +1,68 @@
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <cstdint>
 #include <iostream>
+#include <map>
 #include <sstream>
-#include <thread>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
 
+#include "needlefilter.hh"
+#include "needleindex.hh"
 #include "store.hh"
 
+namespace {
+
+using LockGuard = std::lock_guard<std::mutex>;
+
+constexpr char kAcceptPrefix[] = "accept=";
+
+/**
+ * Reads the optional list of codecs a client can decompress itself.
+ *
+ * @param is The stream with the rest of the request line.
+ * @return The codecs in |accept=<codec>[,<codec>...]|, or an empty list if the
+ *  stream has no such token next, in which case it is left where it was.
+ */
+std::vector<Codec>
+ReadAccept(std::istream &is)
+{
+    std::vector<Codec> codecs;
+    auto pos = is.tellg();
+    std::string token;
+    if (not (is >> token) or token.compare(0, sizeof(kAcceptPrefix) - 1,
+                                           kAcceptPrefix) != 0) {
+        is.clear();
+        is.seekg(pos);
+        return codecs;
+    }
+    std::istringstream list(token.substr(sizeof(kAcceptPrefix) - 1));
+    std::string name;
+    Codec codec;
+    while (std::getline(list, name, ',')) {
+        if (ParseCodec(name, codec) and codec != Codec::None)
+            codecs.push_back(codec);
+    }
+    return codecs;
+}
+
+} // namespace
+
 // Define them here to avoid link errors
-constexpr unsigned Store::kVolumes;
 constexpr uint64_t Store::kMaxFileSize;
-constexpr uint64_t Store::kMaxVolumeSize;
+constexpr size_t Store::kMaxGroupNeedles;
+constexpr uint64_t Store::kMaxGroupSize;
+constexpr uint64_t Store::kScrubRate;
+constexpr unsigned Store::kScrubInterval;
 
 /**
  * Initializes a Store with an address to listen for connections, and the
@@ -21,75 +73,236 @@ constexpr uint64_t Store::kMaxVolumeSize;
  * @param port The port number where it will listen for requests.
  * @param hayDir The prefix path were haystack files are located,
  *  or where they will be created.
+ * @param io The I/O backend shared by all the haystacks. If none is provided,
+ *  then the haystacks use buffered I/O through std::fstream.
  *
- * @details The ctor does not open files or open a listening socket until
- *  Run is executed.
+ * @details Uses the default configuration, i.e., five writable volumes of up
+ *  to 1 GiB in hayDir. The ctor does not open files or open a listening socket
+ *  until Run is executed. Checksums are verified on reads by default.
  */
 Store::Store(
     const std::string &ipAddr,
     unsigned port,
-    const std::string &hayDir)
+    const std::string &hayDir,
+    std::shared_ptr<IoBackend> io)
+    : Store(ipAddr, port, StoreConfig::Default(hayDir), std::move(io))
+{}
+
+/**
+ * Initializes a Store with an address to listen for connections, and the
+ * configuration of the directories where the haystack files are created.
+ *
+ * @param ipAddr The IP address where it will listen for requests.
+ * @param port The port number where it will listen for requests.
+ * @param config The Store configuration.
+ * @param io The I/O backend shared by all the haystacks. If none is provided,
+ *  then the backend named in the configuration is used.
+ */
+Store::Store(
+    const std::string &ipAddr,
+    unsigned port,
+    const StoreConfig &config,
+    std::shared_ptr<IoBackend> io)
     : port(port),
       ipAddr(ipAddr),
-      hayDir(hayDir)
- //     ioService(),
- //     acceptor(ioService, boost::asio::ip::tcp::endpoint(
- //              boost::asio::ip::address::from_string(ipAddr), port))
-{}
+      config(config),
+      io(io ? std::move(io) : MakeIoBackend(config.ioBackend)),
+      volumeMtx(),
+      hayStacks(),
+      dirVolumes(config.dirs.size()),
+      nextVolumeId(0),
+      devices(),
+      volumeQueues(),
+      verifyReads(config.verifyReads),
+      readCache(config.readCacheSize, config.readCacheNeedleSize),
+      scrubber(
+          [this] { return Volumes(); },
+          kScrubRate,
+          std::chrono::seconds(kScrubInterval)),
+      metrics(),
+      commandMetrics(
+          metrics, "haystack_store",
+          {"get", "put", "multiput", "delete", "multidelete", "stat",
+           "volumes", "iostat", "idfilter"}),
+      busy(metrics.AddCounter(
+          "haystack_store_busy_total",
+          "Connections refused because all the threads were busy.")),
+      readCacheHits(metrics.AddCounter(
+          "haystack_store_read_cache_hits_total",
+          "Reads served from the read cache.")),
+      readCacheMisses(metrics.AddCounter(
+          "haystack_store_read_cache_misses_total",
+          "Reads of cacheable needles that went to disk.")),
+      metricsPort(config.metricsPort),
+      metricsServer(),
+      tracer(),
+      listener(
+          std::chrono::seconds(config.timeout),
+          busy,
+          [this](std::unique_ptr<Listener::TcpStream> conn) {
+              HandleConnection(conn.release());
+          })
+{
+    metrics.AddGauge(
+        "haystack_store_volume_fill_ratio",
+        "Fraction of the volume that is used.",
+        [this] { return VolumeFill(); });
+    metrics.AddGauge(
+        "haystack_store_io_queue_depth",
+        "I/O requests waiting or being served per device.",
+        [this] { return QueueDepth(); });
+    metrics.AddGauge(
+        "haystack_store_index_bytes",
+        "Bytes of memory taken by the needle index per volume.",
+        [this] { return IndexMemory(false); });
+    metrics.AddGauge(
+        "haystack_store_index_bytes_per_needle",
+        "Bytes of memory taken by the needle index per needle of the volume: "
+        "16 once it is sealed, 27 to 54 while it is writable, and 12 more for "
+        "a compressed needle.",
+        [this] { return IndexMemory(true); });
+    metrics.AddGauge(
+        "haystack_store_scrubbed_needles",
+        "Needles verified by the scrubber since the Store started.",
+        [this] {
+            return std::vector<MetricsRegistry::GaugeSample>{
+                {{}, static_cast<double>(scrubber.Scrubbed())}};
+        });
+    metrics.AddGauge(
+        "haystack_store_scrub_corrupt",
+        "Corrupt needles and needle headers found by the scrubber.",
+        [this] {
+            return std::vector<MetricsRegistry::GaugeSample>{
+                {{}, static_cast<double>(scrubber.Corrupted())}};
+        });
+    metrics.AddGauge(
+        "haystack_store_scrub_unreadable",
+        "Needles and volumes the scrubber could not read.",
+        [this] {
+            return std::vector<MetricsRegistry::GaugeSample>{
+                {{}, static_cast<double>(scrubber.Unreadable())}};
+        });
+    if (readCache.IsEnabled()) {
+        metrics.AddGauge(
+            "haystack_store_read_cache_bytes",
+            "Bytes of needle contents held by the read cache.",
+            [this] {
+                return std::vector<MetricsRegistry::GaugeSample>{
+                    {{}, static_cast<double>(readCache.Bytes())}};
+            });
+    }
+}
 
 /**
- * Sets up the Store to listen for requests to store and fetch files.
+ * Sets up the Store to listen for requests to store and fetch files, and shuts
+ * it down cleanly once it is stopped.
  *
- * @details Initializes the store by creating a set of haystack files, creating
- *  a listening socket, and spinning on a loop as it listens for requests.
+ * @details Initializes the store by opening the haystack files left by the
+ *  previous run and creating new ones, starting the scrubber, the metrics
+ *  server, and the tracer, and listening for requests until Stop is called.
+ *  Then it waits for the requests being served, flushes the haystacks to disk,
+ *  and saves the needle index for a fast restart.
  */
 void
 Store::Run()
 {
     // Create the haystacks
-    for (size_t i = 0; i < kVolumes; ++i) {
-        auto p = std::make_shared<Haystack>(i, hayDir, kMaxVolumeSize);
-        hayStacks.push_back(std::move(p));
+    OpenVolumes();
+    EnsureWritable();
+    scrubber.Start();
+    if (metricsPort)
+        metricsServer.reset(new MetricsServer(metrics, ipAddr, metricsPort));
+    if (not config.tracePath.empty()) {
+        tracer.reset(new Tracer(
+            "store", config.tracePath, config.traceSampleRate));
     }
 
-    using namespace boost::asio;
-    io_service io_service;
-    auto ipaddr = ip::address::from_string(ipAddr);
-    ip::tcp::acceptor acceptor(io_service, ip::tcp::endpoint(ipaddr, port));
+    listener.Run(ipAddr, port, config.threads, config.backlog);
 
-    for (;;) {
+    // No requests are being served anymore, so the haystacks do not change.
+    scrubber.Stop();
+    for (auto &hs : Volumes()) {
         try {
-            auto conn = new ip::tcp::iostream;
-            acceptor.accept(*conn->rdbuf());
-            std::thread thr(&Store::HandleConnection, this, conn);
-            thr.detach();
+            hs->Sync();
         }
-        catch (std::exception& err) {
+        catch (std::exception &err) {
             std::cerr << "ERROR: " << err.what() << std::endl;
         }
     }
+    try {
+        SaveIndex();
+    }
+    catch (std::exception &err) {
+        std::cerr << "ERROR: " << err.what() << std::endl;
+    }
 }
 
 /**
  * Handles a connection request.
  *
  * @param conn A pointer to a connection.
- * @details Responds to three commands: get, put, and delete. In each case, the
- *  handler responds with an ok message on success, or an err message on
- *  failure. If there is a failure, then it also replies with a brief
- *  description of the error message. The requests are expected to have the
- *  following format:
- *  - PUT: |put <needleId> <haystackId> <size><newline><message...>|
- *  - GET: |get <needleId>|
- *  - DELETE: |delete <needleId>|
+ * @details Responds to nine commands: get, put, multiput, delete,
+ *  multidelete, stat, volumes, iostat, and idfilter. In each case, the handler
+ *  responds with an ok message on success, or an err message on failure. If
+ *  there is a failure, then it also replies with a brief description of the
+ *  error message. The requests are expected to have the following format:
+ *  - PUT: |put <handle> <size><newline><message...>|
+ *  - GET: |get <handle> [<offset> <length>] [accept=<codec>[,...]]|
+ *    Replies with |ok <size>| followed by the contents, or by the bytes of the
+ *    range, which is trimmed to the end of the needle. A needle stored
+ *    compressed with one of the accepted codecs, see StoreConfig, is sent as
+ *    it is stored when the whole of it is asked for, with
+ *    |ok <size> <codec> <rawSize>|, so the client decompresses it. Otherwise
+ *    the contents are decompressed by the Store.
+ *  - MULTIPUT: |multiput <count>| followed by count frames of
+ *    |<handle> <size><newline><message...>|
+ *    Writes the needles of each volume with a single append, and replies ok
+ *    once all of them are written. The needles of a volume are written all
+ *    or none, and a bad frame, or a volume that does not exist, fails the
+ *    request before anything is written.
+ *  - DELETE: |delete <handle>|
+ *  - MULTIDELETE: |multidelete <count>| followed by count lines with a
+ *    |<handle>| each
+ *    Deletes the needles of each volume with a single append to its tombstone
+ *    journal, and replies ok once all of them are deleted. Needles that are
+ *    not found are skipped, as they may be gone already, and a bad line fails
+ *    the request before anything is deleted.
+ *  - STAT: |stat <handle>|
+ *    Replies with |ok <size>| and no contents.
+ *  - STAT: |stat|
+ *    Replies with |ok <count>| followed by one line per volume with
+ *    |<haystackId> <rw|ro> <liveNeedles> <deletedNeedles> <liveBytes>
+ *    <garbageBytes> <lastWrite> <bucket>,...|, see VolumeStats, where the
+ *    buckets are the live needles by size.
+ *  where |<handle>| is a NeedleHandle. Legacy clients may still send
+ *  |put <haystackId> <needleId> <size>|, and a bare needle ID instead of a
+ *  handle, which only finds the needles written without a cookie.
+ *  PUT, GET, DELETE, and STAT take an optional |trace=<traceId>| at the end of
+ *  the line, see Tracer.
+ *  - VOLUMES: |volumes|
+ *    Replies with |ok <count>| followed by one line per volume with
+ *    |<haystackId> <freeBytes> <rw|ro>|.
+ *  - IOSTAT: |iostat|
+ *    Replies with |ok <count>| followed by one line per device with
+ *    |<major:minor> <workers> <depth> <maxDepth> <completed>|.
+ *  - IDFILTER: |idfilter <bits>|
+ *    Replies with |ok <bits> <count> <maxId>| followed by the bytes of a
+ *    NeedleFilter of about the given number of bits with the IDs of all the
+ *    needles, their count, and the highest of them.
  */
 void
 Store::HandleConnection(boost::asio::ip::tcp::iostream *conn)
 {
-    char buf[kMaxFileSize];
-    std::string command, line;
-    uint64_t needleId, volumeId, nBytes;
+    std::string command, line, token;
+    NeedleHandle handle;
+    uint64_t nBytes = 0;
+    auto start = CommandMetrics::Clock::now();
+    bool isOk = true;
     conn->exceptions(std::ios::badbit);
+    // Replies are flushed once they are complete, rather than after every
+    // insertion. The flush of a stream with unitbuf happens in a destructor,
+    // where a client that hung up would make it throw.
+    conn->unsetf(std::ios::unitbuf);
 
     try {
         std::getline(*conn, line);
@@ -98,36 +311,170 @@ Store::HandleConnection(boost::asio::ip::tcp::iostream *conn)
 
         iss >> command;
         if (command == "get") {
-            iss >> needleId;
-            auto nBytes = Get(needleId, buf);
-            *conn << "ok " << nBytes << '\n';
-            conn->write(buf, nBytes);
+            ByteRange range;
+            iss >> token;
+            bool isRange = ByteRange::Read(iss, range);
+            auto accept = ReadAccept(iss);
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "store.get");
+            if (not Resolve(token, handle))
+                throw HaystackErr(HsErr::BadNeedle);
+            BufferPool::Buffer buf;
+            NeedleFlags stored;
+            if (not isRange and not accept.empty()
+                and GetStored(handle, accept, buf, stored, traceId)) {
+                *conn << "ok " << stored.size << ' '
+                      << CodecName(static_cast<Codec>(stored.codec)) << ' '
+                      << stored.rawSize << '\n';
+                conn->write(buf.Data(), stored.size);
+            }
+            else {
+                auto nBytes = isRange
+                    ? GetRange(handle, range, buf, traceId)
+                    : Get(handle, buf, traceId);
+                *conn << "ok " << nBytes << '\n';
+                conn->write(buf.Data(), nBytes);
+            }
         }
         else if (command == "put") {
-            iss >> volumeId >> needleId >> nBytes;
-            if (volumeId >= kVolumes)
-                *conn << "err BadHaystackId\n";
-            else if (nBytes > kMaxFileSize)
+            iss >> token;
+            if (not NeedleHandle::Parse(token, handle)) {
+                std::istringstream(token) >> handle.volumeId;
+                iss >> handle.needleId;
+                handle.cookie = 0;
+            }
+            iss >> nBytes;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "store.put");
+            isOk = false;
+            if (nBytes > kMaxFileSize)
                 *conn << "err TooManyBytes\n";
             else {
                 //conn->readsome(buf, nBytes);
-                conn->read(buf, nBytes);
+                TraceSpan recv(tracer.get(), traceId, "store.recv");
+                auto buf = BufferPool::Instance().Get(nBytes);
+                conn->read(buf.Data(), nBytes);
                 nBytes = conn->gcount();
-                // Ignore that we may get less, but store correct number of
-                // bytes.
-                Put(volumeId, needleId, buf, nBytes);
+                recv.End();
+                // Read the data even if the volume is bad, as closing the
+                // connection with unread data resets it, and the client may
+                // lose the reply.
+                if (not Volume(handle.volumeId))
+                    *conn << "err BadHaystackId\n";
+                else {
+                    // Ignore that we may get less, but store correct number
+                    // of bytes.
+                    Put(handle, buf.Data(), nBytes, traceId);
+                    *conn << "ok\n";
+                    isOk = true;
+                }
+            }
+        }
+        else if (command == "multiput") {
+            size_t count = 0;
+            iss >> count;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "store.multiput");
+            isOk = false;
+            TraceSpan recv(tracer.get(), traceId, "store.recv");
+            std::vector<BufferPool::Buffer> bufs;
+            std::map<uint64_t, std::vector<NeedleWrite>> groups;
+            const char *err = count > kMaxGroupNeedles ? "TooManyNeedles" : "";
+            uint64_t total = 0;
+            for (size_t i = 0; i < count and not *err; ++i) {
+                std::getline(*conn, line);
+                std::istringstream frame(line);
+                if (not (frame >> token >> nBytes)
+                    or not NeedleHandle::Parse(token, handle)) {
+                    err = "BadFrame";
+                    break;
+                }
+                total += nBytes;
+                if (nBytes > kMaxFileSize or total > kMaxGroupSize) {
+                    err = "TooManyBytes";
+                    break;
+                }
+                bufs.push_back(BufferPool::Instance().Get(nBytes));
+                conn->read(bufs.back().Data(), nBytes);
+                if (static_cast<uint64_t>(conn->gcount()) != nBytes) {
+                    err = "BadFrame";
+                    break;
+                }
+                groups[handle.volumeId].push_back(
+                    {handle.needleId, bufs.back().Data(), nBytes,
+                     handle.cookie});
+            }
+            recv.End();
+            for (auto &group : groups) {
+                if (not *err and not Volume(group.first))
+                    err = "BadHaystackId";
+            }
+            if (*err)
+                *conn << "err " << err << '\n';
+            else {
+                for (auto &group : groups)
+                    PutGroup(group.first, group.second, traceId);
                 *conn << "ok\n";
+                isOk = true;
             }
         }
         else if (command == "delete") {
-            iss >> needleId;
-            Remove(needleId);
+            iss >> token;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "store.delete");
+            if (not Resolve(token, handle))
+                throw HaystackErr(HsErr::BadNeedle);
+            Remove(handle, traceId);
             *conn << "ok\n";
         }
-        else
+        else if (command == "multidelete") {
+            size_t count = 0;
+            iss >> count;
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "store.multidelete");
+            isOk = false;
+            std::vector<NeedleHandle> handles;
+            const char *err = count > kMaxGroupNeedles ? "TooManyNeedles" : "";
+            for (size_t i = 0; i < count and not *err; ++i) {
+                std::getline(*conn, line);
+                if (not NeedleHandle::Parse(line, handle))
+                    err = "BadFrame";
+                handles.push_back(handle);
+            }
+            if (*err)
+                *conn << "err " << err << '\n';
+            else {
+                RemoveGroup(handles, traceId);
+                *conn << "ok\n";
+                isOk = true;
+            }
+        }
+        else if (command == "stat" and not (iss >> token))
+            ListStats(*conn);
+        else if (command == "stat") {
+            auto traceId = RequestTraceId(iss, tracer.get());
+            TraceSpan span(tracer.get(), traceId, "store.stat");
+            if (not Resolve(token, handle))
+                throw HaystackErr(HsErr::BadNeedle);
+            auto size = Stat(handle);
+            *conn << "ok " << size << '\n';
+        }
+        else if (command == "volumes")
+            ListVolumes(*conn);
+        else if (command == "iostat")
+            ListDevices(*conn);
+        else if (command == "idfilter") {
+            uint64_t bits = 0;
+            iss >> bits;
+            WriteFilter(*conn, bits);
+        }
+        else {
             *conn << "err BadCommand\n";
+            isOk = false;
+        }
         conn->flush();
         delete conn;
+        commandMetrics.Record(command, isOk, start);
     }
     catch (HaystackErr &err) {
         const char *msg;
@@ -138,6 +485,12 @@ Store::HandleConnection(boost::asio::ip::tcp::iostream *conn)
         case HsErr::NoFit:
             msg = "err NoFit";
             break;
+        case HsErr::BadChecksum:
+            msg = "err BadChecksum";
+            break;
+        case HsErr::BadRange:
+            msg = "err BadRange";
+            break;
         default:
             msg = "err Unknown";
             break;
@@ -150,64 +503,744 @@ Store::HandleConnection(boost::asio::ip::tcp::iostream *conn)
             // Nothing to do
         }
         delete conn;
+        commandMetrics.Record(command, false, start);
     }
     catch (std::exception) {
         delete conn;
+        commandMetrics.Record(command, false, start);
     }
 }
 
 /**
  * Creats a new Needle in a Haystack.
  *
- * @param volumeId The Haystack ID.
- * @param needleId The ID to associate with the Needle.
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
  * @param buf The buffer containing the contents to be put in the Haystack.
  * @param size The number of bytes in the buffer.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
  * @throw HaystackErr if there is a problem writing to the Haystack or inserting
  *  the Needle into the map of needles.
+ * @details See PutGroup.
  */
 void
-Store::Put(uint64_t volumeId, uint64_t needleId, char *buf, uint64_t size)
+Store::Put(
+    const NeedleHandle &handle,
+    char *buf,
+    uint64_t size,
+    uint64_t traceId)
 {
-    auto hs = hayStacks[volumeId];
-    auto needle = hs->Write(needleId, buf, size);
-    if (not needles.Put(needleId, needle)) {
-        hs->Delete(needle);
-        throw HaystackErr(HsErr::NoFit);
+    PutGroup(
+        handle.volumeId, {{handle.needleId, buf, size, handle.cookie}},
+        traceId);
+}
+
+/**
+ * Creates a group of Needles in a Haystack with a single append.
+ *
+ * @param volumeId The Haystack ID.
+ * @param writes The IDs, contents, and cookies of the Needles.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @throw HaystackErr if there is a problem writing to the Haystack, in which
+ *  case none of the needles is written, or inserting a Needle into the map of
+ *  needles, e.g., because the ID is taken, in which case that needle is
+ *  deleted and the others are kept.
+ * @details The needles are written by the workers of the haystack's device. A
+ *  haystack that does not have room for the needles is sealed, and new volumes
+ *  are created if needed to keep enough writable volumes around.
+ */
+void
+Store::PutGroup(
+    uint64_t volumeId,
+    const std::vector<NeedleWrite> &writes,
+    uint64_t traceId)
+{
+    VolumeRef volume;
+    if (not Lookup(volumeId, volume))
+        throw HaystackErr(HsErr::BadNeedle);
+    auto &hs = volume.hs;
+
+    std::vector<Needle> needles;
+    try {
+        TraceSpan wait(tracer.get(), traceId, "store.queue_wait");
+        needles = volume.queue->Run([&] {
+            wait.End();
+            TraceSpan write(tracer.get(), traceId, "haystack.write");
+            return hs->WriteGroup(writes, config.compression);
+        });
+    }
+    catch (HaystackErr &err) {
+        if (err.reason() == HsErr::NoFit and not hs->IsReadOnly()) {
+            hs->Seal();
+            volume.needles->Freeze();
+            EnsureWritable();
+        }
+        throw;
+    }
+    if (hs->IsReadOnly())
+        EnsureWritable();
+
+    bool isTaken = false;
+    for (auto &needle : needles) {
+        if (not volume.needles->Put(needle)) {
+            volume.queue->Run([&] { hs->Delete(needle); });
+            isTaken = true;
+        }
     }
+    if (hs->IsReadOnly())
+        volume.needles->Freeze();
+    if (isTaken)
+        throw HaystackErr(HsErr::NoFit);
 }
 
 /**
  * Gets a Needle content from a Haystack.
  *
- * @param needleId The Needle ID.
- * @param buf The buffer where the contents are to be copied.
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
+ * @param buf Set to a buffer from the pool with the contents.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @return The number of bytes copied into the buffer.
+ * @throw HaystackErr if Needle is not found in the volume, the cookie does not
+ *  match the one in its header, or its contents do not match the checksum.
+ * @details Small needles are served from the read cache when they are in it,
+ *  and put in it when they are read from disk. Compressed needles are
+ *  decompressed, and cached decompressed.
+ */
+uint64_t
+Store::Get(
+    const NeedleHandle &handle,
+    BufferPool::Buffer &buf,
+    uint64_t traceId) const
+{
+    if (readCache.Get(handle, buf)) {
+        readCacheHits.Inc();
+        return buf.Size();
+    }
+
+    VolumeRef volume;
+    Needle needle;
+    if (not FindNeedle(handle, volume, needle))
+        throw HaystackErr(HsErr::BadNeedle);
+    const auto size = needle.flags.DataSize();
+    bool isCacheable = readCache.Fits(size);
+    uint64_t generation = 0;
+    if (isCacheable) {
+        readCacheMisses.Inc();
+        generation = readCache.Generation(handle.needleId);
+    }
+    buf = BufferPool::Instance().Get(size);
+    TraceSpan wait(tracer.get(), traceId, "store.queue_wait");
+    volume.queue->Run([&] {
+        wait.End();
+        TraceSpan read(tracer.get(), traceId, "haystack.read");
+        volume.hs->Read(needle, buf.Data(), verifyReads);
+    });
+    if (isCacheable)
+        readCache.Put(handle, buf.Data(), size, generation);
+    return size;
+}
+
+/**
+ * Gets the blob of a compressed Needle as it is stored, for a client that
+ * decompresses it itself.
+ *
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
+ * @param accept The codecs the client can decompress.
+ * @param buf Set to a buffer from the pool with the blob.
+ * @param flags Set to the header of the needle, with the size of the blob, its
+ *  codec, and the size of the contents.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @return False if the needle is not compressed with one of the accepted
+ *  codecs, in which case nothing is read, true otherwise.
+ * @throw HaystackErr as Get does.
+ * @details The read cache is bypassed, as it holds decompressed contents.
+ */
+bool
+Store::GetStored(
+    const NeedleHandle &handle,
+    const std::vector<Codec> &accept,
+    BufferPool::Buffer &buf,
+    NeedleFlags &flags,
+    uint64_t traceId) const
+{
+    VolumeRef volume;
+    Needle needle;
+    if (not FindNeedle(handle, volume, needle))
+        throw HaystackErr(HsErr::BadNeedle);
+    auto codec = static_cast<Codec>(needle.flags.codec);
+    if (codec == Codec::None
+        or std::find(accept.begin(), accept.end(), codec) == accept.end())
+        return false;
+
+    buf = BufferPool::Instance().Get(needle.flags.size);
+    TraceSpan wait(tracer.get(), traceId, "store.queue_wait");
+    volume.queue->Run([&] {
+        wait.End();
+        TraceSpan read(tracer.get(), traceId, "haystack.read");
+        volume.hs->ReadStored(needle, buf.Data(), verifyReads);
+    });
+    flags = needle.flags;
+    return true;
+}
+
+/**
+ * Gets part of a Needle content from a Haystack.
+ *
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
+ * @param range The part of the contents to get. It is trimmed to the end of
+ *  the needle.
+ * @param buf Set to a buffer from the pool with the bytes of the range.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
  * @return The number of bytes copied into the buffer.
- * @throw HaystackErr if Needle is not found.
+ * @throw HaystackErr if Needle is not found in the volume, the cookie does not
+ *  match, or the range starts past the end of the needle.
+ * @details A cached needle serves any range of it. Otherwise only the bytes of
+ *  the range are read from disk, and the checksum is not verified, unless the
+ *  range is the whole needle. A compressed needle is read and decompressed
+ *  whole, see Haystack::ReadRange.
  */
 uint64_t
-Store::Get(uint64_t needleId, char *buf) const
+Store::GetRange(
+    const NeedleHandle &handle,
+    ByteRange range,
+    BufferPool::Buffer &buf,
+    uint64_t traceId) const
 {
+    if (readCache.Get(handle, range, buf)) {
+        readCacheHits.Inc();
+        return buf.Size();
+    }
+
+    VolumeRef volume;
     Needle needle;
-    if (not needles.Get(needleId, needle))
+    if (not FindNeedle(handle, volume, needle))
         throw HaystackErr(HsErr::BadNeedle);
-    auto hs = hayStacks[needle.haystackId];
-    hs->Read(needle, buf);
-    return needle.flags.size;
+    const auto size = needle.flags.DataSize();
+    if (not range.Clamp(size))
+        throw HaystackErr(HsErr::BadRange);
+    if (range.offset == 0 and range.length == size)
+        return Get(handle, buf, traceId);
+
+    if (readCache.Fits(size))
+        readCacheMisses.Inc();
+    buf = BufferPool::Instance().Get(range.length);
+    TraceSpan wait(tracer.get(), traceId, "store.queue_wait");
+    volume.queue->Run([&] {
+        wait.End();
+        TraceSpan read(tracer.get(), traceId, "haystack.read");
+        volume.hs->ReadRange(needle, range, buf.Data());
+    });
+    return range.length;
+}
+
+/**
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
+ * @return The size of the contents of the Needle, before any compression, from
+ *  the index of its volume, which holds a copy of its header.
+ * @throw HaystackErr if Needle is not found in the volume, or the cookie does
+ *  not match.
+ */
+uint64_t
+Store::Stat(const NeedleHandle &handle) const
+{
+    VolumeRef volume;
+    Needle needle;
+    if (not FindNeedle(handle, volume, needle))
+        throw HaystackErr(HsErr::BadNeedle);
+    return needle.flags.DataSize();
 }
 
 /**
  * Removes a needle from a Haystack.
  *
- * @param needleId The ID of the needle to remove.
- * @throw HaystackErr if Needle is not found.
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @throw HaystackErr if Needle is not found in the volume, or the cookie does
+ *  not match.
+ * @details The needle is dropped from the index of its volume and from the
+ *  read cache once it is deleted from its haystack.
  */
 void
-Store::Remove(uint64_t needleId)
+Store::Remove(const NeedleHandle &handle, uint64_t traceId)
 {
+    VolumeRef volume;
     Needle needle;
-    if (not needles.Get(needleId, needle))
+    if (not FindNeedle(handle, volume, needle))
         throw HaystackErr(HsErr::BadNeedle);
-    auto hs = hayStacks[needle.haystackId];
-    hs->Delete(needle);
+    TraceSpan wait(tracer.get(), traceId, "store.queue_wait");
+    volume.queue->Run([&] {
+        wait.End();
+        TraceSpan del(tracer.get(), traceId, "haystack.delete");
+        volume.hs->Delete(needle);
+    });
+    volume.needles->Remove(handle.needleId);
+    readCache.Remove(handle.needleId);
+}
+
+/**
+ * Deletes a group of Needles, with a single append to the tombstone journal
+ * of each of their volumes, see Haystack::DeleteGroup.
+ *
+ * @param handles The Haystack IDs, and the IDs and cookies of the Needles.
+ * @param traceId The trace ID of the request, or 0 if it is not traced.
+ * @return The number of Needles deleted. The ones that are not found, or whose
+ *  cookie does not match, are skipped.
+ * @throw HaystackErr if a Needle does not match its Haystack.
+ */
+size_t
+Store::RemoveGroup(const std::vector<NeedleHandle> &handles, uint64_t traceId)
+{
+    struct Group
+    {
+        VolumeRef volume;
+        std::vector<Needle> needles;
+    };
+    std::map<uint64_t, Group> groups;
+    for (auto &handle : handles) {
+        VolumeRef volume;
+        Needle needle;
+        if (not FindNeedle(handle, volume, needle))
+            continue;
+        auto &group = groups[handle.volumeId];
+        group.volume = volume;
+        group.needles.push_back(needle);
+    }
+
+    size_t count = 0;
+    for (auto &item : groups) {
+        auto &volume = item.second.volume;
+        auto &needles = item.second.needles;
+        TraceSpan wait(tracer.get(), traceId, "store.queue_wait");
+        volume.queue->Run([&] {
+            wait.End();
+            TraceSpan del(tracer.get(), traceId, "haystack.delete");
+            volume.hs->DeleteGroup(needles);
+        });
+        for (auto &needle : needles) {
+            volume.needles->Remove(needle.flags.id);
+            readCache.Remove(needle.flags.id);
+        }
+        count += needles.size();
+    }
+    return count;
+}
+
+/**
+ * Finds a needle in the index of its volume.
+ *
+ * @param handle The Haystack ID, and the ID and cookie of the Needle.
+ * @param volume Set to the volume of the needle.
+ * @param needle Set to the needle.
+ * @return False if there is no such needle, or its cookie does not match the
+ *  one in the handle, true otherwise.
+ */
+bool
+Store::FindNeedle(
+    const NeedleHandle &handle, VolumeRef &volume, Needle &needle) const
+{
+    return Lookup(handle.volumeId, volume)
+        and volume.needles->Get(handle.needleId, needle)
+        and needle.flags.cookie == handle.cookie;
+}
+
+/**
+ * Resolves the needle named in a request.
+ *
+ * @param token A needle handle, or the bare needle ID sent by legacy clients.
+ * @param handle Set to the handle of the needle.
+ * @return False if the token is neither, or no volume has a needle with the
+ *  ID, true otherwise.
+ * @details A bare needle ID is looked up in the index of every volume, and it
+ *  resolves to a handle with no cookie, so it only finds the needles written
+ *  without one.
+ */
+bool
+Store::Resolve(const std::string &token, NeedleHandle &handle) const
+{
+    if (NeedleHandle::Parse(token, handle))
+        return true;
+    if (token.empty()
+        or token.find_first_not_of("0123456789") != std::string::npos)
+        return false;
+
+    std::istringstream(token) >> handle.needleId;
+    handle.cookie = 0;
+    LockGuard lk(volumeMtx);
+    for (auto &item : volumeNeedles) {
+        Needle needle;
+        if (item.second->Get(handle.needleId, needle)) {
+            handle.volumeId = item.first;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes the list of volumes to a stream, in the format of the reply to the
+ * volumes command.
+ *
+ * @param os The output stream.
+ */
+void
+Store::ListVolumes(std::ostream &os) const
+{
+    auto volumes = Volumes();
+    os << "ok " << volumes.size() << '\n';
+    for (auto &hs : volumes) {
+        os << hs->Id() << ' ' << hs->FreeCount() << ' '
+           << (hs->IsReadOnly() ? "ro" : "rw") << '\n';
+    }
+}
+
+/**
+ * Writes the statistics of every volume to a stream, in the format of the
+ * reply to the stat command without a handle. They are kept by the haystacks,
+ * so the volumes are not scanned.
+ *
+ * @param os The output stream.
+ */
+void
+Store::ListStats(std::ostream &os) const
+{
+    auto volumes = Volumes();
+    os << "ok " << volumes.size() << '\n';
+    for (auto &hs : volumes) {
+        auto stats = hs->Stats();
+        os << hs->Id() << ' ' << (hs->IsReadOnly() ? "ro" : "rw") << ' '
+           << stats.liveNeedles << ' ' << stats.deletedNeedles << ' '
+           << stats.liveBytes << ' ' << stats.garbageBytes << ' '
+           << stats.lastWrite << ' ';
+        for (size_t i = 0; i < stats.sizeHistogram.size(); ++i)
+            os << (i ? "," : "") << stats.sizeHistogram[i];
+        os << '\n';
+    }
+}
+
+/**
+ * Writes a filter with the IDs of all the needles to a stream, in the format
+ * of the reply to the idfilter command.
+ *
+ * @param os The output stream.
+ * @param bits The number of bits of the filter, see NeedleFilter.
+ */
+void
+Store::WriteFilter(std::ostream &os, uint64_t bits) const
+{
+    NeedleFilter filter(bits);
+    uint64_t count = 0;
+    uint64_t maxId = 0;
+    VolumeRef volume;
+    for (auto &hs : Volumes()) {
+        if (not Lookup(hs->Id(), volume))
+            continue;
+        volume.needles->ForEach([&](const Needle &needle) {
+            filter.Add(needle.flags.id);
+            maxId = std::max(maxId, needle.flags.id);
+            ++count;
+        });
+    }
+    os << "ok " << filter.Bits() << ' ' << count << ' ' << maxId << '\n';
+    filter.Write(os);
+}
+
+/**
+ * @param volumeId The volume ID.
+ * @return The Haystack for the volume, or nullptr if there is no such volume.
+ */
+std::shared_ptr<Haystack>
+Store::Volume(uint64_t volumeId) const
+{
+    LockGuard lk(volumeMtx);
+    auto it = hayStacks.find(volumeId);
+    return it == hayStacks.end() ? nullptr : it->second;
+}
+
+/**
+ * @param volumeId The volume ID.
+ * @param volume Set to the Haystack, I/O queue, and index of the volume.
+ * @return False if there is no such volume, true otherwise.
+ */
+bool
+Store::Lookup(uint64_t volumeId, VolumeRef &volume) const
+{
+    LockGuard lk(volumeMtx);
+    auto it = hayStacks.find(volumeId);
+    if (it == hayStacks.end())
+        return false;
+    volume.hs = it->second;
+    volume.queue = volumeQueues.at(volumeId);
+    volume.needles = volumeNeedles.at(volumeId);
+    return true;
+}
+
+/**
+ * Writes the queue depth metrics of every device to a stream, in the format of
+ * the reply to the iostat command.
+ *
+ * @param os The output stream.
+ */
+void
+Store::ListDevices(std::ostream &os) const
+{
+    std::vector<std::shared_ptr<IoQueue>> queues;
+    {
+        LockGuard lk(volumeMtx);
+        for (auto &item : devices)
+            queues.push_back(item.second);
+    }
+
+    os << "ok " << queues.size() << '\n';
+    for (auto &queue : queues) {
+        auto stats = queue->GetStats();
+        os << queue->Name() << ' ' << queue->Workers() << ' ' << stats.depth
+           << ' ' << stats.maxDepth << ' ' << stats.completed << '\n';
+    }
+}
+
+/**
+ * Finds the I/O queue of the device holding a directory, and creates it if
+ * this is the first volume on that device. The caller must hold the volume
+ * lock.
+ *
+ * @param path An existing directory.
+ * @return The I/O queue of the device.
+ * @throw std::system_error if the directory cannot be accessed.
+ */
+std::shared_ptr<IoQueue>
+Store::DeviceQueue(const std::string &path)
+{
+    struct stat st;
+    if (::stat(path.empty() ? "." : path.c_str(), &st) != 0)
+        throw std::system_error(errno, std::generic_category(), path);
+
+    auto &queue = devices[st.st_dev];
+    if (not queue) {
+        auto name = std::to_string(major(st.st_dev)) + ':'
+            + std::to_string(minor(st.st_dev));
+        queue = std::make_shared<IoQueue>(
+            name, config.ioWorkers, config.ioQueueDepth);
+    }
+    return queue;
+}
+
+/**
+ * @return The fraction of every volume that is used, labeled with the volume
+ *  ID and whether it is writable.
+ */
+std::vector<MetricsRegistry::GaugeSample>
+Store::VolumeFill() const
+{
+    std::vector<MetricsRegistry::GaugeSample> samples;
+    for (auto &hs : Volumes()) {
+        double used = hs->Size();
+        double capacity = used + hs->FreeCount();
+        samples.push_back({
+            {{"volume", std::to_string(hs->Id())},
+             {"mode", hs->IsReadOnly() ? "ro" : "rw"}},
+            capacity > 0 ? used / capacity : 1});
+    }
+    return samples;
+}
+
+/**
+ * @return The depth of the I/O queue of every device.
+ */
+std::vector<MetricsRegistry::GaugeSample>
+Store::QueueDepth() const
+{
+    std::vector<MetricsRegistry::GaugeSample> samples;
+    LockGuard lk(volumeMtx);
+    for (auto &item : devices) {
+        samples.push_back({
+            {{"device", item.second->Name()}},
+            static_cast<double>(item.second->GetStats().depth)});
+    }
+    return samples;
+}
+
+/**
+ * @param perNeedle If true, the memory is divided by the number of needles.
+ * @return The memory taken by the index of every volume.
+ */
+std::vector<MetricsRegistry::GaugeSample>
+Store::IndexMemory(bool perNeedle) const
+{
+    std::vector<MetricsRegistry::GaugeSample> samples;
+    LockGuard lk(volumeMtx);
+    for (auto &item : volumeNeedles) {
+        double bytes = item.second->MemoryUsage();
+        if (perNeedle)
+            bytes /= std::max<size_t>(item.second->Count(), 1);
+        samples.push_back(
+            {{{"volume", std::to_string(item.first)}}, bytes});
+    }
+    return samples;
+}
+
+/**
+ * @return All the haystacks, in order of volume ID.
+ */
+Scrubber::HaystackList
+Store::Volumes() const
+{
+    LockGuard lk(volumeMtx);
+    Scrubber::HaystackList volumes;
+    for (auto &item : hayStacks)
+        volumes.push_back(item.second);
+    return volumes;
+}
+
+/**
+ * Creates new volumes until the store has the configured number of writable
+ * volumes, or the directories are full.
+ */
+void
+Store::EnsureWritable()
+{
+    LockGuard lk(volumeMtx);
+    unsigned writable = 0;
+    for (auto &item : hayStacks)
+        writable += not item.second->IsReadOnly();
+    while (writable < config.writableVolumes and AddVolume())
+        ++writable;
+}
+
+/**
+ * Creates a new volume in the directory with the fewest volumes, which spreads
+ * the volumes evenly across the directories, and assigns it to the I/O queue of
+ * the directory's device. The caller must hold the volume lock.
+ *
+ * @return False if all the directories are full, true otherwise.
+ */
+bool
+Store::AddVolume()
+{
+    size_t best = dirVolumes.size();
+    for (size_t i = 0; i < dirVolumes.size(); ++i) {
+        if (dirVolumes[i] >= config.dirs[i].maxVolumes)
+            continue;
+        if (best == dirVolumes.size() or dirVolumes[i] < dirVolumes[best])
+            best = i;
+    }
+    if (best == dirVolumes.size())
+        return false;
+
+    auto &dir = config.dirs[best];
+    auto volumeId = nextVolumeId++;
+    hayStacks[volumeId] = std::make_shared<Haystack>(
+        volumeId, dir.path, dir.volumeSize, false, io);
+    volumeQueues[volumeId] = DeviceQueue(dir.path);
+    volumeNeedles[volumeId] = std::make_shared<VolumeIndex>(volumeId);
+    ++dirVolumes[best];
+    return true;
+}
+
+/**
+ * Opens the haystack files found in the configured directories, and fills the
+ * needle index. The index saved by the last clean shutdown is used for the
+ * volumes that have not changed since, and the other volumes are scanned.
+ */
+void
+Store::OpenVolumes()
+{
+    namespace fs = boost::filesystem;
+    const std::string prefix = "haystack_";
+    {
+        LockGuard lk(volumeMtx);
+        for (size_t i = 0; i < config.dirs.size(); ++i) {
+            auto &dir = config.dirs[i];
+            fs::path path(dir.path.empty() ? "." : dir.path);
+            if (not fs::is_directory(path))
+                continue;
+            for (auto &entry : fs::directory_iterator(path)) {
+                auto name = entry.path().filename().string();
+                if (name.size() <= prefix.size()
+                    or name.compare(0, prefix.size(), prefix) != 0
+                    or name.find_first_not_of("0123456789", prefix.size())
+                        != std::string::npos)
+                    continue;
+                unsigned volumeId = std::stoul(name.substr(prefix.size()));
+                if (hayStacks.count(volumeId)) {
+                    std::cerr << "ERROR: duplicate volume " << entry.path()
+                              << std::endl;
+                    continue;
+                }
+                auto hs = std::make_shared<Haystack>(
+                    volumeId, dir.path, dir.volumeSize, true, io);
+                hayStacks[volumeId] = hs;
+                volumeQueues[volumeId] = DeviceQueue(dir.path);
+                // Legacy volumes do not align their needles.
+                volumeNeedles[volumeId] = std::make_shared<VolumeIndex>(
+                    volumeId, hs->Version() ? NeedleHeader::kAlignment : 1);
+                ++dirVolumes[i];
+                if (volumeId >= nextVolumeId)
+                    nextVolumeId = volumeId + 1;
+            }
+        }
+    }
+
+    // The saved index is removed once it is loaded, since it goes stale as
+    // soon as the volumes change.
+    NeedleIndex index;
+    auto indexPath = config.IndexPath();
+    if (index.Load(indexPath)) {
+        boost::system::error_code err;
+        fs::remove(indexPath, err);
+    }
+
+    std::map<uint64_t, bool> isIndexed;
+    for (auto &hs : Volumes()) {
+        auto it = index.volumeSizes.find(hs->Id());
+        isIndexed[hs->Id()] =
+            it != index.volumeSizes.end() and it->second == hs->Size();
+    }
+    VolumeRef volume;
+    for (auto &needle : index.needles) {
+        if (isIndexed[needle.haystackId]
+            and Lookup(needle.haystackId, volume))
+            volume.needles->Put(needle);
+    }
+    for (auto &hs : Volumes()) {
+        if (isIndexed[hs->Id()] or not Lookup(hs->Id(), volume))
+            continue;
+        auto volumeId = hs->Id();
+        hs->Scan(
+            [&](const Needle &needle) {
+                if (not needle.flags.isDeleted)
+                    volume.needles->Put(needle);
+                return true;
+            },
+            Haystack::kScanChunk,
+            [volumeId](uint64_t offset, uint64_t next) {
+                std::cerr << "ERROR: volume " << volumeId << ": bad needle "
+                          << "header at offset " << offset << ", indexing "
+                          << "from offset " << next << std::endl;
+            });
+    }
+    for (auto &hs : Volumes()) {
+        if (hs->IsReadOnly() and Lookup(hs->Id(), volume))
+            volume.needles->Freeze();
+    }
+}
+
+/**
+ * Saves the needle index, together with the size of every volume. Requests
+ * must not be served while it runs, or the saved index may be stale.
+ *
+ * @throw std::system_error if the index cannot be written.
+ */
+void
+Store::SaveIndex() const
+{
+    NeedleIndex index;
+    VolumeRef volume;
+    for (auto &hs : Volumes()) {
+        index.volumeSizes[hs->Id()] = hs->Size();
+        if (not Lookup(hs->Id(), volume))
+            continue;
+        volume.needles->ForEach([&](const Needle &needle) {
+            index.needles.push_back(needle);
+        });
+    }
+    index.Save(config.IndexPath());
 }
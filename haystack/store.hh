@@ -1,52 +1,180 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <ostream>
 #include <string>
 #include <vector>
 
 #include <boost/asio.hpp>
 
-#include "asyncmap.hh"
+#include "bufferpool.hh"
 #include "haystack.hh"
+#include "iobackend.hh"
+#include "ioqueue.hh"
+#include "listener.hh"
+#include "metrics.hh"
+#include "readcache.hh"
+#include "scrubber.hh"
+#include "storeconfig.hh"
+#include "trace.hh"
+#include "volumeindex.hh"
 
 class Store
 {
-    // Total number of files used by store. Ideally, this would be configurable,
-    // but hardcoding to simplify matters.
-    static constexpr unsigned kVolumes = 5;
-
     // The maximum file size allowed per needle (1 MiB).
     static constexpr uint64_t kMaxFileSize = 1<<20;
 
-    // The maximum volume size allowed for the file containing all the needles
-    // for a given volume (1 GiB).
-    static constexpr uint64_t kMaxVolumeSize = kMaxFileSize<<10;
+    // The maximum number of needles, and of bytes, in a multiput, and of
+    // needles in a multidelete. Volumes that do not have room for a group are
+    // sealed, so large groups waste space.
+    static constexpr size_t kMaxGroupNeedles = 1024;
+    static constexpr uint64_t kMaxGroupSize = 16<<20;
+
+    // The maximum number of bytes per second verified by the scrubber, and the
+    // number of seconds to wait between scrubbing passes.
+    static constexpr uint64_t kScrubRate = 8<<20;
+    static constexpr unsigned kScrubInterval = 3600;
 
     // The IP address and port where Store will listen for requests.
     unsigned port;
     std::string ipAddr;
 
-    // A map of IDs to needles.
-    AsyncMap<uint64_t, Needle> needles;
+    // The directories where the haystack files are created, and how many
+    // writable haystacks to keep.
+    StoreConfig config;
+
+    // The I/O backend shared by all the haystacks.
+    std::shared_ptr<IoBackend> io;
+
+    // The Haystack instances by volume ID, and the number of haystacks in each
+    // of the configured directories. Volumes are added on demand, and they are
+    // never removed.
+    mutable std::mutex volumeMtx;
+    std::map<uint64_t, std::shared_ptr<Haystack>> hayStacks;
+    std::vector<unsigned> dirVolumes;
+    unsigned nextVolumeId;
+
+    // The I/O queue of each device by device ID, and the queue serving each
+    // volume. Requests for a haystack are served by the workers of the device
+    // where its file lives.
+    std::map<uint64_t, std::shared_ptr<IoQueue>> devices;
+    std::map<uint64_t, std::shared_ptr<IoQueue>> volumeQueues;
+
+    // The index of each volume, which maps needle IDs to needles. A request
+    // with a needle handle goes straight to the index of its volume.
+    std::map<uint64_t, std::shared_ptr<VolumeIndex>> volumeNeedles;
+
+    // Everything needed to serve a request for a volume, taken under a single
+    // lock.
+    struct VolumeRef
+    {
+        std::shared_ptr<Haystack> hs;
+        std::shared_ptr<IoQueue> queue;
+        std::shared_ptr<VolumeIndex> needles;
+    };
+
+    // Whether needle checksums are verified when serving reads.
+    bool verifyReads;
+
+    // The contents of recently read small needles, if configured. Reads fill
+    // it, so it is mutable.
+    mutable ReadCache readCache;
 
-    // The prefix path where the haystack files are located, or to be created.
-    std::string hayDir;
+    // Verifies the sealed haystacks in the background. Declared after the
+    // haystacks so that it is stopped before they are destroyed.
+    Scrubber scrubber;
 
-    // List of Hastack instances.
-    std::vector<std::shared_ptr<Haystack>> hayStacks;
+    // Runtime metrics, served over HTTP on metricsPort if it is set.
+    MetricsRegistry metrics;
+    CommandMetrics commandMetrics;
+    Counter &busy;
+    Counter &readCacheHits;
+    Counter &readCacheMisses;
+    unsigned metricsPort;
+    std::unique_ptr<MetricsServer> metricsServer;
+
+    // Records the stages of traced requests, if tracing is configured.
+    std::unique_ptr<Tracer> tracer;
+
+    // Accepts the connections and serves them on a pool of threads.
+    Listener listener;
 
     void HandleConnection(boost::asio::ip::tcp::iostream *conn);
-    void Put(uint64_t volumeId, uint64_t needleId, char *buf, uint64_t size);
-    uint64_t Get(uint64_t needleId, char *buf) const;
-    void Remove(uint64_t needleId);
+    void Put(
+        const NeedleHandle &handle,
+        char *buf,
+        uint64_t size,
+        uint64_t traceId = 0);
+    void PutGroup(
+        uint64_t volumeId,
+        const std::vector<NeedleWrite> &writes,
+        uint64_t traceId = 0);
+    uint64_t Get(
+        const NeedleHandle &handle,
+        BufferPool::Buffer &buf,
+        uint64_t traceId = 0) const;
+    bool GetStored(
+        const NeedleHandle &handle,
+        const std::vector<Codec> &accept,
+        BufferPool::Buffer &buf,
+        NeedleFlags &flags,
+        uint64_t traceId = 0) const;
+    uint64_t GetRange(
+        const NeedleHandle &handle,
+        ByteRange range,
+        BufferPool::Buffer &buf,
+        uint64_t traceId = 0) const;
+    uint64_t Stat(const NeedleHandle &handle) const;
+    void Remove(const NeedleHandle &handle, uint64_t traceId = 0);
+    size_t RemoveGroup(
+        const std::vector<NeedleHandle> &handles, uint64_t traceId = 0);
+    bool Resolve(const std::string &token, NeedleHandle &handle) const;
+    bool FindNeedle(
+        const NeedleHandle &handle, VolumeRef &volume, Needle &needle) const;
+    void ListVolumes(std::ostream &os) const;
+    void ListDevices(std::ostream &os) const;
+    void ListStats(std::ostream &os) const;
+    void WriteFilter(std::ostream &os, uint64_t bits) const;
+
+    std::shared_ptr<Haystack> Volume(uint64_t volumeId) const;
+    bool Lookup(uint64_t volumeId, VolumeRef &volume) const;
+    std::shared_ptr<IoQueue> DeviceQueue(const std::string &path);
+    std::vector<MetricsRegistry::GaugeSample> VolumeFill() const;
+    std::vector<MetricsRegistry::GaugeSample> QueueDepth() const;
+    std::vector<MetricsRegistry::GaugeSample> IndexMemory(
+        bool perNeedle) const;
+    Scrubber::HaystackList Volumes() const;
+    void EnsureWritable();
+    bool AddVolume();
+    void OpenVolumes();
+    void SaveIndex() const;
 
 public:
     Store(
         const std::string &ipAddr,
         unsigned port,
-        const std::string &hayDir);
+        const std::string &hayDir,
+        std::shared_ptr<IoBackend> io = nullptr);
+    Store(
+        const std::string &ipAddr,
+        unsigned port,
+        const StoreConfig &config,
+        std::shared_ptr<IoBackend> io = nullptr);
+
+    // Enables or disables checksum verification on reads.
+    void VerifyReads(bool verify) noexcept { verifyReads = verify; }
 
-    // Listens for requests on a loop.
+    // Sets the port where metrics are served over HTTP, or 0 to disable them.
+    void ServeMetrics(unsigned port) noexcept { metricsPort = port; }
+
+    // Listens for requests until Stop is called, and then shuts down cleanly.
     void Run();
+
+    // Makes Run stop accepting connections and return. It may be called from
+    // any thread, e.g., a signal handler's.
+    void Stop() { listener.Stop(); }
 };
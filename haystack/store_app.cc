@@ -2,22 +2,54 @@
 #include <iostream>
 #include <string>
 
+#include <boost/filesystem.hpp>
+
+#include "iobackend.hh"
+#include "listener.hh"
 #include "store.hh"
+#include "storeconfig.hh"
 
 constexpr int kIpAddr = 1;
 constexpr int kPort = 2;
 constexpr int kPrefixDir = 3;
+constexpr int kIoBackend = 4;
+constexpr int kMetricsPort = 5;
 constexpr int kArgs = 4;
 
 int
 main(int argc, char *argv[])
 {
-    if (argc != kArgs) {
+    if (argc < kArgs or argc > kArgs+2) {
         std::cerr << "Error: unexpected number of arguments\n";
-        std::cerr << "Usage: ./" << argv[0] << "<ipAddr> <port> <prefixDir>\n";
+        std::cerr << "Usage: ./" << argv[0]
+                  << "<ipAddr> <port> <prefixDir|configFile> "
+                  << "[fstream|uring [metricsPort]]\n";
         exit(EXIT_FAILURE);
     }
-    Store store(argv[kIpAddr], std::stoi(argv[kPort]), argv[kPrefixDir]);
+
+    // A regular file is read as a configuration, otherwise it is the directory
+    // where the haystack files are created.
+    std::string prefix = argv[kPrefixDir];
+    StoreConfig config;
+    try {
+        config = boost::filesystem::is_regular_file(prefix)
+            ? StoreConfig::FromFile(prefix)
+            : StoreConfig::Default(prefix);
+    }
+    catch (std::exception &err) {
+        std::cerr << "Error: " << err.what() << '\n';
+        exit(EXIT_FAILURE);
+    }
+    if (argc > kIoBackend)
+        config.ioBackend = argv[kIoBackend];
+    if (argc > kMetricsPort)
+        config.metricsPort = std::stoi(argv[kMetricsPort]);
+
+    Store store(argv[kIpAddr], std::stoi(argv[kPort]), config);
+
+    // Stop accepting requests on SIGINT or SIGTERM, and return once the
+    // requests being served are done, so that the destructors run.
+    SignalHandler signals([&store] { store.Stop(); });
     store.Run();
-    exit(EXIT_SUCCESS);
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,184 @@
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "storeconfig.hh"
+
+// Define them here to avoid link errors
+constexpr uint64_t StoreConfig::kVolumeSize;
+constexpr unsigned StoreConfig::kWritableVolumes;
+constexpr unsigned StoreConfig::kMaxVolumes;
+constexpr unsigned StoreConfig::kIoWorkers;
+constexpr unsigned StoreConfig::kIoQueueDepth;
+constexpr unsigned StoreConfig::kBacklog;
+constexpr unsigned StoreConfig::kTimeout;
+constexpr uint64_t StoreConfig::kReadCacheNeedleSize;
+
+/**
+ * Reads a Store configuration from a file.
+ *
+ * @param fname The name of the file.
+ * @return The configuration.
+ * @throw std::invalid_argument if the file cannot be read, or a line cannot be
+ *  parsed.
+ */
+StoreConfig
+StoreConfig::FromFile(const std::string &fname)
+{
+    std::ifstream file(fname);
+    if (not file)
+        throw std::invalid_argument("cannot read " + fname);
+
+    StoreConfig config;
+    std::string line;
+    for (unsigned lineNo = 1; std::getline(file, line); ++lineNo) {
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream iss(line);
+        std::string key, value, extra;
+        if (not (iss >> key))
+            continue;
+
+        auto bad = [&] {
+            return std::invalid_argument(
+                fname + ":" + std::to_string(lineNo) + ": bad line: " + line);
+        };
+
+        if (key == "directory") {
+            VolumeDirConfig dir;
+            std::string size;
+            if (not (iss >> dir.path >> size >> dir.maxVolumes))
+                throw bad();
+            dir.volumeSize = ParseSize(size);
+            config.dirs.push_back(dir);
+        }
+        else if (key == "writable") {
+            if (not (iss >> config.writableVolumes))
+                throw bad();
+        }
+        else if (key == "io") {
+            if (not (iss >> config.ioBackend))
+                throw bad();
+        }
+        else if (key == "workers") {
+            if (not (iss >> config.ioWorkers) or not config.ioWorkers)
+                throw bad();
+        }
+        else if (key == "queue") {
+            if (not (iss >> config.ioQueueDepth) or not config.ioQueueDepth)
+                throw bad();
+        }
+        else if (key == "threads") {
+            if (not (iss >> config.threads))
+                throw bad();
+        }
+        else if (key == "backlog") {
+            if (not (iss >> config.backlog) or not config.backlog)
+                throw bad();
+        }
+        else if (key == "timeout") {
+            if (not (iss >> config.timeout) or not config.timeout)
+                throw bad();
+        }
+        else if (key == "index") {
+            if (not (iss >> config.indexPath))
+                throw bad();
+        }
+        else if (key == "readcache") {
+            if (not (iss >> value))
+                throw bad();
+            config.readCacheSize = ParseSize(value);
+            if (iss >> value)
+                config.readCacheNeedleSize = ParseSize(value);
+        }
+        else if (key == "metrics") {
+            if (not (iss >> config.metricsPort))
+                throw bad();
+        }
+        else if (key == "trace") {
+            if (not (iss >> config.tracePath >> config.traceSampleRate)
+                or config.traceSampleRate < 0 or config.traceSampleRate > 1)
+                throw bad();
+        }
+        else if (key == "verify") {
+            if (not (iss >> value) or (value != "on" and value != "off"))
+                throw bad();
+            config.verifyReads = value == "on";
+        }
+        else if (key == "compression") {
+            if (not (iss >> value) or not ParseCodec(value, config.compression)
+                or not IsCodecAvailable(config.compression))
+                throw bad();
+        }
+        else
+            throw bad();
+
+        if (iss >> extra)
+            throw bad();
+    }
+
+    if (config.dirs.empty())
+        throw std::invalid_argument(fname + ": no directories");
+    return config;
+}
+
+/**
+ * @param hayDir The directory where haystack files are created.
+ * @return The default configuration, with all the haystacks in one directory.
+ */
+StoreConfig
+StoreConfig::Default(const std::string &hayDir)
+{
+    StoreConfig config;
+    config.dirs.push_back({hayDir, kVolumeSize, kMaxVolumes});
+    return config;
+}
+
+/**
+ * @return The file where the needle index is saved.
+ */
+std::string
+StoreConfig::IndexPath() const
+{
+    if (not indexPath.empty() or dirs.empty())
+        return indexPath;
+    auto &path = dirs.front().path;
+    if (path.empty())
+        return "haystack.index";
+    return path + (path.back() == '/' ? "" : "/") + "haystack.index";
+}
+
+/**
+ * Parses a size with an optional K, M, or G suffix, e.g., 512M.
+ *
+ * @param size The size.
+ * @return The number of bytes.
+ * @throw std::invalid_argument if the size cannot be parsed.
+ */
+uint64_t
+ParseSize(const std::string &size)
+{
+    size_t pos = 0;
+    uint64_t value = 0;
+    try {
+        value = std::stoull(size, &pos);
+    }
+    catch (std::exception&) {
+        throw std::invalid_argument("bad size: " + size);
+    }
+
+    auto suffix = size.substr(pos);
+    if (suffix == "K" or suffix == "k")
+        return value << 10;
+    if (suffix == "M" or suffix == "m")
+        return value << 20;
+    if (suffix == "G" or suffix == "g")
+        return value << 30;
+    if (not suffix.empty())
+        throw std::invalid_argument("bad size: " + size);
+    return value;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "codec.hh"
+
+/**
+ * A directory where the Store keeps haystack files, usually one per disk.
+ */
+struct VolumeDirConfig
+{
+    std::string path;  // The directory where the haystack files are created.
+    uint64_t volumeSize;  // The maximum size of each haystack file.
+    unsigned maxVolumes;  // The maximum number of haystack files.
+};
+
+/**
+ * The Store configuration.
+ *
+ * It can be read from a file with one setting per line, where everything
+ * after a '#' is a comment. Sizes take an optional K, M, or G suffix.
+ *
+ *  directory <path> <volumeSize> <maxVolumes>
+ *      Adds a directory for haystack files. It can be repeated to spread the
+ *      volumes across several mount points.
+ *  writable <count>
+ *      The number of writable volumes the Store keeps. Volumes are created at
+ *      startup, and new ones are created whenever volumes are sealed, as long
+ *      as the directories have room for them.
+ *  io <fstream|uring>
+ *      The I/O backend.
+ *  workers <count>
+ *      The number of I/O worker threads for each device.
+ *  queue <depth>
+ *      The maximum number of I/O requests waiting for each device.
+ *  threads <count>
+ *      The number of threads serving connections, or 0 for one per core.
+ *  backlog <count>
+ *      The maximum number of connections waiting for a thread. Connections
+ *      beyond it are refused with |err Busy|.
+ *  timeout <seconds>
+ *      How long a connection may stay open. It also bounds how long Stop waits
+ *      for the connections being served.
+ *  index <file>
+ *      Where the needle index is saved on shutdown, so that the next start
+ *      does not have to scan the volumes. It defaults to haystack.index in the
+ *      first directory.
+ *  readcache <size> [<maxNeedleSize>]
+ *      Caches the contents of needles up to maxNeedleSize (64K by default) in
+ *      memory, up to size bytes in total, to serve repeated reads of hot
+ *      needles without going to disk.
+ *  verify <on|off>
+ *      Whether needle checksums are verified on reads.
+ *  compression <none|lz4|zstd>
+ *      The codec new needles are compressed with, if it shrinks them enough.
+ *      Needles written with any codec can always be read back, as long as the
+ *      Store was built with it.
+ *  metrics <port>
+ *      The port where metrics are served over HTTP.
+ *  trace <file> <sampleRate>
+ *      Appends the spans of traced requests to a file, and traces the given
+ *      fraction of the requests that arrive without a trace ID.
+ */
+struct StoreConfig
+{
+    // Defaults, which match the original hardcoded configuration.
+    static constexpr uint64_t kVolumeSize = 1ull << 30;
+    static constexpr unsigned kWritableVolumes = 5;
+    static constexpr unsigned kMaxVolumes = 1024;
+    static constexpr unsigned kIoWorkers = 4;
+    static constexpr unsigned kIoQueueDepth = 64;
+    static constexpr unsigned kBacklog = 1024;
+    static constexpr unsigned kTimeout = 30;
+    static constexpr uint64_t kReadCacheNeedleSize = 64 << 10;
+
+    std::vector<VolumeDirConfig> dirs;
+    unsigned writableVolumes = kWritableVolumes;
+    std::string ioBackend = "fstream";
+    unsigned ioWorkers = kIoWorkers;
+    unsigned ioQueueDepth = kIoQueueDepth;
+    unsigned threads = 0;  // One per core.
+    unsigned backlog = kBacklog;
+    unsigned timeout = kTimeout;
+    std::string indexPath;  // Empty for the default.
+    uint64_t readCacheSize = 0;  // No read cache by default.
+    uint64_t readCacheNeedleSize = kReadCacheNeedleSize;
+    bool verifyReads = true;
+    Codec compression = Codec::None;
+    unsigned metricsPort = 0;  // No metrics are served by default.
+    std::string tracePath;  // No spans are recorded by default.
+    double traceSampleRate = 0;
+
+    static StoreConfig FromFile(const std::string &fname);
+    static StoreConfig Default(const std::string &hayDir);
+
+    std::string IndexPath() const;
+};
+
+uint64_t
+ParseSize(const std::string &size);
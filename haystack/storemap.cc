@@ -0,0 +1,188 @@
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "bits.hh"
+#include "storemap.hh"
+
+// Define them here to avoid link errors
+constexpr unsigned StoreMap::kVirtualNodes;
+
+namespace {
+
+/**
+ * @return The 64-bit FNV-1a hash of a string.
+ */
+uint64_t
+Fnv1a(const std::string &s) noexcept
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (unsigned char c : s) {
+        hash ^= c;
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+} // namespace
+
+/**
+ * Reads a store map from a file.
+ *
+ * @param fname The name of the file.
+ * @param defaultPort The port of the Stores listed without one.
+ * @return The store map.
+ * @throw std::invalid_argument if the file cannot be read, a line cannot be
+ *  parsed, or it has no shards.
+ */
+StoreMap
+StoreMap::FromFile(const std::string &fname, const std::string &defaultPort)
+{
+    std::ifstream file(fname);
+    if (not file)
+        throw std::invalid_argument("cannot read " + fname);
+
+    StoreMap storeMap;
+    std::string line;
+    for (unsigned lineNo = 1; std::getline(file, line); ++lineNo) {
+        auto comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream iss(line);
+        std::string key, name, stores, quorum, extra;
+        if (not (iss >> key))
+            continue;
+        iss >> name >> stores >> quorum >> extra;
+        if (key != "shard" or stores.empty() or not extra.empty()
+            or quorum.find_first_not_of("0123456789") != std::string::npos
+            or storeMap.Find(name)) {
+            throw std::invalid_argument(
+                fname + ":" + std::to_string(lineNo) + ": bad line: " + line);
+        }
+        storeMap.AddShard(
+            name,
+            ParseStoreAddresses(stores, defaultPort),
+            quorum.empty() ? 0 : std::stoul(quorum));
+    }
+
+    if (storeMap.shards.empty())
+        throw std::invalid_argument(fname + ": no shards");
+    return storeMap;
+}
+
+/**
+ * Makes a store map from the Store arguments of the Directory and the Cache.
+ *
+ * @param stores The name of a store map file, or a comma separated list of
+ *  |<ipAddr>[:<port>]| of Stores that make a single shard.
+ * @param defaultPort The port of the Stores listed without one.
+ * @return The store map.
+ * @throw std::invalid_argument if the file or the list cannot be parsed.
+ */
+StoreMap
+StoreMap::FromArgs(const std::string &stores, const std::string &defaultPort)
+{
+    if (boost::filesystem::is_regular_file(stores))
+        return FromFile(stores, defaultPort);
+    StoreMap storeMap;
+    storeMap.AddShard("0", ParseStoreAddresses(stores, defaultPort));
+    return storeMap;
+}
+
+/**
+ * Adds a shard, and places it on the ring.
+ *
+ * @param name The name of the shard, which is recorded with its needles.
+ * @param stores The Stores holding replicas of the shard's volumes.
+ * @param quorum The number of replicas that must acknowledge a write, or 0 for
+ *  a majority of them.
+ */
+void
+StoreMap::AddShard(
+    const std::string &name, std::vector<StoreAddress> stores, size_t quorum)
+{
+    shards.push_back(
+        {name, std::make_shared<ReplicaSet>(std::move(stores), quorum)});
+    for (unsigned i = 0; i < kVirtualNodes; ++i) {
+        auto point = Mix(Fnv1a(name + '#' + std::to_string(i)));
+        ring.emplace(point, shards.size() - 1);
+    }
+}
+
+/**
+ * @param needleId The needle ID.
+ * @return The index of the shard that owns the needle ID.
+ */
+size_t
+StoreMap::OwnerIndex(uint64_t needleId) const
+{
+    if (ring.empty())
+        throw std::logic_error("empty store map");
+    auto it = ring.lower_bound(Mix(needleId));
+    return it == ring.end() ? ring.begin()->second : it->second;
+}
+
+/**
+ * @param needleId The needle ID.
+ * @return The shard where a new needle with the ID is written.
+ */
+const StoreMap::Shard &
+StoreMap::Owner(uint64_t needleId) const
+{
+    return shards[OwnerIndex(needleId)];
+}
+
+/**
+ * @param name The name of a shard.
+ * @return The shard, or nullptr if there is no shard with that name.
+ */
+const StoreMap::Shard *
+StoreMap::Find(const std::string &name) const noexcept
+{
+    for (auto &shard : shards) {
+        if (shard.name == name)
+            return &shard;
+    }
+    return nullptr;
+}
+
+/**
+ * @param needleId The needle ID.
+ * @return The shards in the order they should be tried for a read: the owner
+ *  of the needle ID, and then the other shards, which may hold it if it was
+ *  written before the owner was added.
+ */
+std::vector<const StoreMap::Shard*>
+StoreMap::ShardOrder(uint64_t needleId) const
+{
+    std::vector<const Shard*> order;
+    auto first = OwnerIndex(needleId);
+    for (size_t i = 0; i < shards.size(); ++i)
+        order.push_back(&shards[(first + i) % shards.size()]);
+    return order;
+}
+
+/**
+ * @param needleId The needle ID.
+ * @return The Stores in the order they should be tried for a read: the
+ *  replicas of the shards in the order of ShardOrder.
+ */
+std::vector<StoreAddress>
+StoreMap::ReadOrder(uint64_t needleId) const
+{
+    std::vector<StoreAddress> order;
+    for (auto shard : ShardOrder(needleId)) {
+        auto stores = shard->replicas->ReadOrder();
+        order.insert(order.end(), stores.begin(), stores.end());
+    }
+    return order;
+}
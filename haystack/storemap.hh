@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "replicaset.hh"
+
+/**
+ * Partitions the needles across shards of Stores, and is shared by the
+ * Directory and the Cache so that both agree on where a needle lives.
+ *
+ * Every shard is a ReplicaSet with its own volumes. Needle IDs are placed on
+ * a consistent hash ring, where every shard owns kVirtualNodes points, and a
+ * needle is written to the shard that owns the first point after its hash.
+ * Adding a shard moves about 1/N of the needle IDs to it, and the needles
+ * already written stay where they are: the Directory records the shard of
+ * every needle, and readers try the other shards after the owner.
+ *
+ * A store map can be read from a file with one shard per line, where
+ * everything after a '#' is a comment:
+ *
+ *  shard <name> <ipAddr>[:<port>][,...] [<quorum>]
+ */
+class StoreMap
+{
+public:
+    static constexpr unsigned kVirtualNodes = 64;
+
+    struct Shard
+    {
+        std::string name;
+        std::shared_ptr<ReplicaSet> replicas;
+    };
+
+private:
+    std::vector<Shard> shards;
+    std::map<uint64_t, size_t> ring;  // Shard index by point.
+
+    size_t OwnerIndex(uint64_t needleId) const;
+
+public:
+    StoreMap() = default;
+
+    static StoreMap FromFile(
+        const std::string &fname, const std::string &defaultPort);
+    static StoreMap FromArgs(
+        const std::string &stores, const std::string &defaultPort);
+
+    void AddShard(
+        const std::string &name,
+        std::vector<StoreAddress> stores,
+        size_t quorum = 0);
+
+    const std::vector<Shard> &Shards() const noexcept { return shards; }
+    const Shard &Owner(uint64_t needleId) const;
+    const Shard *Find(const std::string &name) const noexcept;
+    std::vector<const Shard*> ShardOrder(uint64_t needleId) const;
+    std::vector<StoreAddress> ReadOrder(uint64_t needleId) const;
+};
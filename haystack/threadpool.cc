@@ -0,0 +1,147 @@
+#include <cstddef>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "threadpool.hh"
+
+namespace {
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+}
+
+// Define them here to avoid link errors
+constexpr size_t ThreadPool::kBacklog;
+
+/**
+ * Initializes a ThreadPool and starts its workers.
+ *
+ * @param workers The number of worker threads, or 0 for one per core.
+ * @param capacity The maximum number of tasks waiting for a worker.
+ */
+ThreadPool::ThreadPool(unsigned workers, size_t capacity)
+    : capacity(capacity ? capacity : 1),
+      queues(),
+      pending(0),
+      next(0),
+      mtx(),
+      cv(),
+      isStopped(false),
+      workers()
+{
+    if (not workers)
+        workers = std::thread::hardware_concurrency();
+    if (not workers)
+        workers = 1;
+
+    for (unsigned i = 0; i < workers; ++i)
+        queues.emplace_back(new WorkerQueue);
+    for (unsigned i = 0; i < workers; ++i)
+        this->workers.emplace_back(&ThreadPool::Work, this, i);
+}
+
+/**
+ * Dtor. Runs the tasks already submitted, and then stops the workers.
+ */
+ThreadPool::~ThreadPool()
+{
+    {
+        LockGuard lk(mtx);
+        isStopped = true;
+    }
+    cv.notify_all();
+    for (auto &thr : workers)
+        thr.join();
+}
+
+/**
+ * Queues a task for the workers, unless the backlog is full.
+ *
+ * @param task The task.
+ * @return True if the task is queued, false if it is refused because capacity
+ *  tasks are already waiting, or the pool is being destroyed.
+ */
+bool
+ThreadPool::TrySubmit(std::function<void()> task)
+{
+    auto count = pending.load();
+    do {
+        if (count >= capacity)
+            return false;
+    } while (not pending.compare_exchange_weak(count, count + 1));
+
+    {
+        LockGuard lk(mtx);
+        if (isStopped) {
+            --pending;
+            return false;
+        }
+    }
+
+    auto &queue = *queues[next++ % queues.size()];
+    {
+        LockGuard lk(queue.mtx);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        LockGuard lk(mtx);
+    }
+    cv.notify_one();
+    return true;
+}
+
+/**
+ * Takes the oldest task from the worker's own queue, or steals the oldest task
+ * of another worker.
+ *
+ * @param self The index of the worker.
+ * @param task The task.
+ * @return False if all the queues are empty, true otherwise.
+ */
+bool
+ThreadPool::Pop(size_t self, std::function<void()> &task)
+{
+    for (size_t i = 0; i < queues.size(); ++i) {
+        auto &queue = *queues[(self + i) % queues.size()];
+        LockGuard lk(queue.mtx);
+        if (not queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            --pending;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Serves tasks until the pool is stopped and there are no tasks left.
+ *
+ * @param self The index of the worker.
+ */
+void
+ThreadPool::Work(size_t self)
+{
+    std::function<void()> task;
+    for (;;) {
+        if (Pop(self, task)) {
+            try {
+                task();
+            }
+            catch (std::exception &err) {
+                std::cerr << "ERROR: " << err.what() << std::endl;
+            }
+            task = nullptr;
+            continue;
+        }
+
+        // A task may be counted in pending before it is in a queue, so keep
+        // looking while there are any.
+        UniqueLock lk(mtx);
+        if (isStopped and not pending)
+            return;
+        cv.wait(lk, [this] { return isStopped or pending > 0; });
+    }
+}
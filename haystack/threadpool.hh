@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of worker threads that serve the connections accepted by a
+ * server, with a bounded backlog.
+ *
+ * Every worker has its own queue. Tasks are spread over the queues in round
+ * robin order, and a worker whose queue is empty steals the oldest task from
+ * the others, so that a connection queued behind a slow one is picked up by
+ * the first idle worker. Once capacity tasks are waiting, TrySubmit refuses
+ * new ones, and the server sheds the load instead of creating more threads.
+ */
+class ThreadPool
+{
+public:
+    static constexpr size_t kBacklog = 1024;
+
+private:
+    struct WorkerQueue
+    {
+        std::mutex mtx;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    size_t capacity;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::atomic<size_t> pending;
+    std::atomic<size_t> next;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool isStopped;
+    std::vector<std::thread> workers;
+
+    bool Pop(size_t self, std::function<void()> &task);
+    void Work(size_t self);
+
+public:
+    ThreadPool(unsigned workers = 0, size_t capacity = kBacklog);
+    ThreadPool(const ThreadPool &pool) = delete;
+    ThreadPool& operator=(const ThreadPool &pool) = delete;
+    ~ThreadPool();
+
+    bool TrySubmit(std::function<void()> task);
+
+    size_t Workers() const noexcept { return workers.size(); }
+    size_t Pending() const noexcept { return pending; }
+};
@@ -0,0 +1,142 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "bits.hh"
+#include "crc32c.hh"
+#include "tombstone.hh"
+
+// Define them here to avoid link errors
+constexpr size_t TombstoneJournal::kRecordSize;
+
+namespace {
+
+// Offsets of the fields in a record.
+constexpr size_t kNeedleIdOffset = 8;
+constexpr size_t kFlagsOffset = 16;
+constexpr size_t kChecksumOffset = 20;
+
+} // namespace
+
+/**
+ * Opens the tombstone journal of a haystack.
+ *
+ * @param fname The name of the file.
+ * @param create If true, the journal is created empty, replacing any file
+ *  with the same name. Otherwise the file is created if it does not exist,
+ *  and Load must be called before anything is appended to it.
+ * @throw std::system_error if the file cannot be opened.
+ */
+TombstoneJournal::TombstoneJournal(const std::string &fname, bool create)
+    : fname(fname),
+      fd(-1),
+      size(0)
+{
+    fd = ::open(fname.c_str(), O_RDWR | O_CREAT | (create ? O_TRUNC : 0), 0644);
+    if (fd < 0)
+        throw SystemError("open " + fname);
+}
+
+/**
+ * Dtor. Closes the file.
+ */
+TombstoneJournal::~TombstoneJournal()
+{
+    ::close(fd);
+}
+
+/**
+ * Reads the records in the journal. The next records are appended after the
+ * last valid one.
+ *
+ * @return The tombstones, in the order they were appended.
+ * @throw std::system_error if the file cannot be read.
+ */
+std::vector<Tombstone>
+TombstoneJournal::Load()
+{
+    struct stat st;
+    if (::fstat(fd, &st))
+        throw SystemError("stat " + fname);
+    std::string data(st.st_size, '\0');
+    for (size_t pos = 0; pos < data.size();) {
+        auto n = ::pread(fd, &data[pos], data.size() - pos, pos);
+        if (n < 0 and errno == EINTR)
+            continue;
+        if (n < 0)
+            throw SystemError("read " + fname);
+        if (n == 0) {
+            data.resize(pos);
+            break;
+        }
+        pos += n;
+    }
+
+    std::vector<Tombstone> tombstones;
+    for (size = 0; size+kRecordSize <= data.size(); size += kRecordSize) {
+        auto record = data.data() + size;
+        if (GetLe<uint32_t>(record+kChecksumOffset)
+            != Crc32c(record, kChecksumOffset))
+            break;
+        tombstones.push_back({
+            GetLe<uint64_t>(record),
+            GetLe<uint64_t>(record+kNeedleIdOffset),
+            static_cast<uint8_t>(record[kFlagsOffset])});
+    }
+    return tombstones;
+}
+
+/**
+ * Appends tombstones to the journal with a single write.
+ *
+ * @param tombstones The tombstones.
+ * @throw std::system_error if the records cannot be written, in which case
+ *  none of them counts as appended.
+ */
+void
+TombstoneJournal::Append(const std::vector<Tombstone> &tombstones)
+{
+    if (tombstones.empty())
+        return;
+
+    std::string data(tombstones.size() * kRecordSize, '\0');
+    for (size_t i = 0; i < tombstones.size(); ++i) {
+        auto record = &data[i * kRecordSize];
+        PutLe<uint64_t>(record, tombstones[i].offset);
+        PutLe<uint64_t>(record+kNeedleIdOffset, tombstones[i].needleId);
+        record[kFlagsOffset] = static_cast<char>(tombstones[i].flags);
+        PutLe<uint32_t>(
+            record+kChecksumOffset, Crc32c(record, kChecksumOffset));
+    }
+    for (size_t pos = 0; pos < data.size();) {
+        auto n = ::pwrite(fd, data.data() + pos, data.size() - pos,
+                          size + pos);
+        if (n < 0 and errno == EINTR)
+            continue;
+        if (n < 0)
+            throw SystemError("write " + fname);
+        pos += n;
+    }
+    size += data.size();
+}
+
+/**
+ * Empties the journal, once its tombstones are folded into the needle headers
+ * and those are synced.
+ *
+ * @throw std::system_error if the file cannot be truncated.
+ */
+void
+TombstoneJournal::Clear()
+{
+    if (::ftruncate(fd, 0))
+        throw SystemError("truncate " + fname);
+    size = 0;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * The deletion of a needle, as recorded in a TombstoneJournal.
+ */
+struct Tombstone
+{
+    uint64_t offset;  // The offset of the needle in its haystack.
+    uint64_t needleId;
+    uint8_t flags;  // The flags byte of the needle header once it is deleted.
+};
+
+/**
+ * An append-only journal of the needles deleted from a haystack.
+ *
+ * Marking a needle as deleted in its header takes a random one byte write to
+ * the volume, so the haystack appends its deletions to the journal instead,
+ * and later folds them into the needle headers in file order, see
+ * Haystack::Delete. The journal lives next to the volume, in
+ * |haystack_<id>.tomb|, and it is a little-endian array of records:
+ *
+ *  | size | field                                      |
+ *  |------|--------------------------------------------|
+ *  |    8 | offset of the needle                       |
+ *  |    8 | needle ID                                  |
+ *  |    4 | flags byte of the deleted needle's header  |
+ *  |    4 | CRC32C of the fields before it             |
+ *
+ * Records are handed to the kernel as they are appended, so they survive a
+ * crash of the process, and they are folded into the volume, which is then
+ * synced, when the haystack is synced or closed. A record torn by a crash
+ * fails its checksum, and it is ignored together with anything after it.
+ */
+class TombstoneJournal
+{
+public:
+    static constexpr size_t kRecordSize = 24;
+
+private:
+    std::string fname;  // The name of the file.
+    int fd;  // The file descriptor.
+    uint64_t size;  // The number of bytes in the valid records.
+
+public:
+    TombstoneJournal(const std::string &fname, bool create);
+    TombstoneJournal(const TombstoneJournal &journal) = delete;
+    TombstoneJournal& operator=(const TombstoneJournal &journal) = delete;
+    ~TombstoneJournal();
+
+    const std::string &Name() const noexcept { return fname; }
+    uint64_t Count() const noexcept { return size / kRecordSize; }
+
+    std::vector<Tombstone> Load();
+    void Append(const std::vector<Tombstone> &tombstones);
+    void Clear();
+};
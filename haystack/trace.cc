@@ -0,0 +1,260 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <istream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "trace.hh"
+
+namespace {
+using UniqueLock = std::unique_lock<std::mutex>;
+
+constexpr char kTracePrefix[] = "trace=";
+constexpr size_t kTracePrefixSize = sizeof(kTracePrefix) - 1;
+}
+
+// Define them here to avoid link errors
+constexpr size_t Tracer::kCapacity;
+constexpr unsigned Tracer::kFlushIntervalMs;
+
+/**
+ * Initializes a Tracer and starts the thread that writes spans to the file.
+ *
+ * @param process The name of the process, written with every span.
+ * @param path The file where spans are appended.
+ * @param sampleRate The fraction of the requests without a trace ID that are
+ *  traced, between 0 and 1.
+ * @param capacity The number of spans the buffer holds. It is rounded up to a
+ *  power of two.
+ * @throw std::invalid_argument if the file cannot be opened.
+ */
+Tracer::Tracer(
+    const std::string &process,
+    const std::string &path,
+    double sampleRate,
+    size_t capacity)
+    : process(process),
+      sampleRate(sampleRate),
+      slots(),
+      mask(0),
+      head(0),
+      tail(0),
+      dropped(0),
+      file(path, std::ios::app),
+      mtx(),
+      cv(),
+      isStopped(false),
+      thr()
+{
+    if (not file)
+        throw std::invalid_argument("cannot open " + path);
+
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    slots.reset(new Slot[size]);
+    mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+        slots[i].seq.store(i, std::memory_order_relaxed);
+
+    thr = std::thread(&Tracer::Loop, this);
+}
+
+/**
+ * Dtor. Writes the spans in the buffer, and stops the thread.
+ */
+Tracer::~Tracer()
+{
+    {
+        UniqueLock lk(mtx);
+        isStopped = true;
+    }
+    cv.notify_all();
+    thr.join();
+}
+
+/**
+ * Decides whether to trace a request that arrived without a trace ID.
+ *
+ * @return A new trace ID, or 0 if the request is not traced.
+ */
+uint64_t
+Tracer::Sample() noexcept
+{
+    thread_local std::mt19937_64 rng(std::random_device{}());
+    if (std::uniform_real_distribution<double>()(rng) >= sampleRate)
+        return 0;
+    uint64_t traceId;
+    do {
+        traceId = rng();
+    } while (not traceId);
+    return traceId;
+}
+
+/**
+ * Records a span. It never blocks: if the buffer is full, then the span is
+ * dropped.
+ *
+ * @param traceId The trace ID.
+ * @param name The name of the stage, which must be a string literal.
+ * @param start When the stage started.
+ * @param end When the stage finished.
+ */
+void
+Tracer::Record(
+    uint64_t traceId,
+    const char *name,
+    Clock::time_point start,
+    Clock::time_point end) noexcept
+{
+    auto pos = head.load(std::memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+        slot = &slots[pos & mask];
+        auto seq = slot->seq.load(std::memory_order_acquire);
+        auto diff = static_cast<int64_t>(seq - pos);
+        if (diff == 0) {
+            if (head.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+            pos = head.load(std::memory_order_relaxed);
+    }
+    slot->span = Span{traceId, name, start, end - start};
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+/**
+ * Takes the oldest span out of the buffer. Only the writer thread, or the
+ * caller of Flush while holding the lock, may call it.
+ *
+ * @param span The span.
+ * @return False if the buffer is empty, true otherwise.
+ */
+bool
+Tracer::Pop(Span &span)
+{
+    auto &slot = slots[tail & mask];
+    if (slot.seq.load(std::memory_order_acquire) != tail + 1)
+        return false;
+    span = slot.span;
+    slot.seq.store(tail + mask + 1, std::memory_order_release);
+    ++tail;
+    return true;
+}
+
+/**
+ * Writes the spans in the buffer to the file.
+ */
+void
+Tracer::Flush()
+{
+    UniqueLock lk(mtx);
+    Span span;
+    std::ostringstream oss;
+    while (Pop(span)) {
+        using std::chrono::duration_cast;
+        using std::chrono::nanoseconds;
+        oss << std::hex << span.traceId << std::dec << ' ' << process << ' '
+            << span.name << ' '
+            << duration_cast<nanoseconds>(span.start.time_since_epoch()).count()
+            << ' ' << duration_cast<nanoseconds>(span.duration).count()
+            << '\n';
+    }
+    file << oss.str();
+    file.flush();
+}
+
+/**
+ * Writes the spans to the file periodically, until the tracer is stopped.
+ */
+void
+Tracer::Loop()
+{
+    for (;;) {
+        bool isDone;
+        {
+            UniqueLock lk(mtx);
+            isDone = cv.wait_for(
+                lk, std::chrono::milliseconds(kFlushIntervalMs),
+                [this] { return isStopped; });
+        }
+        Flush();
+        if (isDone)
+            return;
+    }
+}
+
+/**
+ * Parses a |trace=<hex ID>| token.
+ *
+ * @param token The token.
+ * @param traceId The trace ID.
+ * @return True if the token is a trace ID, false otherwise.
+ */
+bool
+ParseTraceId(const std::string &token, uint64_t &traceId) noexcept
+{
+    if (token.compare(0, kTracePrefixSize, kTracePrefix) != 0
+        or token.size() == kTracePrefixSize)
+        return false;
+    try {
+        size_t pos;
+        auto id = std::stoull(token.substr(kTracePrefixSize), &pos, 16);
+        if (pos != token.size() - kTracePrefixSize)
+            return false;
+        traceId = id;
+        return true;
+    }
+    catch (std::exception&) {
+        return false;
+    }
+}
+
+/**
+ * Reads the optional trace ID at the end of a request, and samples requests
+ * that do not have one.
+ *
+ * @param is The rest of the request line.
+ * @param tracer The tracer of the server, or nullptr if it does not record
+ *  spans. Trace IDs in requests are returned even when there is no tracer, so
+ *  that they are forwarded to other servers.
+ * @return The trace ID, or 0 if the request is not traced.
+ */
+uint64_t
+RequestTraceId(std::istream &is, Tracer *tracer)
+{
+    std::string token;
+    uint64_t traceId = 0;
+    if (is >> token and ParseTraceId(token, traceId))
+        return traceId;
+    return tracer ? tracer->Sample() : 0;
+}
+
+/**
+ * @param traceId A trace ID.
+ * @return The token to append to a request to forward the trace ID, including
+ *  the leading space, or an empty string if the trace ID is 0.
+ */
+std::string
+TraceToken(uint64_t traceId)
+{
+    if (not traceId)
+        return "";
+    std::ostringstream oss;
+    oss << ' ' << kTracePrefix << std::hex << traceId;
+    return oss.str();
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Request tracing.
+ *
+ * A traced request carries a trace ID in the text protocol as a trailing
+ * |trace=<hex ID>| token, e.g., |upload 1024 trace=1f2e3d|. Every server that
+ * handles a traced request records the time spent in each stage as a span,
+ * and forwards the trace ID to the servers it calls. Requests without a trace
+ * ID are traced with the sampling rate of the server that receives them.
+ *
+ * Spans are pushed into a bounded lock-free ring buffer, and a background
+ * thread appends them to a local file, one per line:
+ *
+ *  <trace ID> <process> <span> <start, ns since the epoch> <duration, ns>
+ *
+ * When the buffer is full, spans are dropped rather than blocking requests.
+ */
+class Tracer
+{
+public:
+    using Clock = std::chrono::system_clock;
+
+    struct Span
+    {
+        uint64_t traceId;
+        const char *name;  // Must be a string literal.
+        Clock::time_point start;
+        Clock::duration duration;
+    };
+
+    static constexpr size_t kCapacity = 1 << 14;
+    static constexpr unsigned kFlushIntervalMs = 100;
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> seq;
+        Span span;
+    };
+
+    std::string process;
+    double sampleRate;
+
+    // A bounded multi-producer, single-consumer queue. Every slot has a
+    // sequence number, which tells producers whether the slot is free for the
+    // current lap, and the consumer whether it has been filled.
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    std::atomic<uint64_t> head;
+    uint64_t tail;
+    std::atomic<uint64_t> dropped;
+
+    std::ofstream file;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool isStopped;
+    std::thread thr;
+
+    bool Pop(Span &span);
+    void Loop();
+
+public:
+    Tracer(
+        const std::string &process,
+        const std::string &path,
+        double sampleRate,
+        size_t capacity = kCapacity);
+    Tracer(const Tracer &tracer) = delete;
+    Tracer& operator=(const Tracer &tracer) = delete;
+    ~Tracer();
+
+    uint64_t Sample() noexcept;
+    void Record(
+        uint64_t traceId,
+        const char *name,
+        Clock::time_point start,
+        Clock::time_point end = Clock::now()) noexcept;
+    void Flush();
+
+    uint64_t Dropped() const noexcept { return dropped; }
+};
+
+/**
+ * Records a span from its construction to its destruction, or to the call to
+ * End. Nothing is recorded when there is no tracer or the trace ID is 0.
+ */
+class TraceSpan
+{
+    Tracer *tracer;
+    uint64_t traceId;
+    const char *name;
+    Tracer::Clock::time_point start;
+
+public:
+    TraceSpan(Tracer *tracer, uint64_t traceId, const char *name) noexcept
+        : tracer(traceId ? tracer : nullptr),
+          traceId(traceId),
+          name(name),
+          start(this->tracer ? Tracer::Clock::now() : Tracer::Clock::time_point())
+    {}
+    TraceSpan(const TraceSpan &span) = delete;
+    TraceSpan& operator=(const TraceSpan &span) = delete;
+    ~TraceSpan() { End(); }
+
+    void
+    End() noexcept
+    {
+        if (tracer)
+            tracer->Record(traceId, name, start);
+        tracer = nullptr;
+    }
+};
+
+bool
+ParseTraceId(const std::string &token, uint64_t &traceId) noexcept;
+
+uint64_t
+RequestTraceId(std::istream &is, Tracer *tracer);
+
+std::string
+TraceToken(uint64_t traceId);
@@ -0,0 +1,508 @@
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bits.hh"
+#include "uring.hh"
+
+// Define them here to avoid link errors
+constexpr uint64_t UringBackend::kDirectAlignment;
+constexpr unsigned UringBackend::kEntries;
+
+namespace {
+
+using LockGuard = std::lock_guard<std::mutex>;
+using UniqueLock = std::unique_lock<std::mutex>;
+
+int
+IoUringSetup(unsigned entries, io_uring_params *params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int
+IoUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return static_cast<int>(syscall(
+        __NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+template<typename T>
+T*
+RingPtr(void *ring, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(ring) + offset);
+}
+
+uint64_t
+AlignDown(uint64_t value) noexcept
+{
+    return value & ~(UringBackend::kDirectAlignment - 1);
+}
+
+uint64_t
+AlignUp(uint64_t value) noexcept
+{
+    return AlignDown(value + UringBackend::kDirectAlignment - 1);
+}
+
+// A request waiting for its completion.
+struct Completion
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool isDone = false;
+    int result = 0;
+};
+
+// A buffer aligned for direct I/O.
+struct AlignedBuffer
+{
+    char *data;
+
+    explicit AlignedBuffer(uint64_t size)
+        : data(nullptr)
+    {
+        void *p = nullptr;
+        if (posix_memalign(&p, UringBackend::kDirectAlignment, size))
+            throw std::bad_alloc();
+        data = static_cast<char*>(p);
+    }
+    AlignedBuffer(const AlignedBuffer &buffer) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer &buffer) = delete;
+    ~AlignedBuffer() { free(data); }
+};
+
+/**
+ * A volume file whose requests go through the io_uring of an UringBackend.
+ */
+class UringFile : public VolumeFile
+{
+    // The number of locks that guard the partial blocks of unaligned writes.
+    static constexpr size_t kEdgeLocks = 64;
+
+    std::shared_ptr<UringBackend> ring;
+    std::string fname;
+    int fd;
+    bool isDirect;
+
+    // Two writes that do not overlap may still share a block at their edges,
+    // and each one writes back the bytes of the other that it read, so the
+    // read-modify-write of a partial block holds the lock of that block.
+    std::array<std::mutex, kEdgeLocks> edgeMtx;
+
+    std::mutex&
+    EdgeLock(uint64_t block) noexcept
+    {
+        return edgeMtx[block / UringBackend::kDirectAlignment % kEdgeLocks];
+    }
+
+    // Reads the range into the buffers, filling anything past the end of the
+    // file with zeros.
+    void
+    ReadRange(const iovec *iov, size_t count, uint64_t offset)
+    {
+        auto n = ring->Transfer(
+            IORING_OP_READV, fd, iov, static_cast<unsigned>(count), offset);
+        if (n < 0)
+            throw SystemError(-n, "read " + fname);
+
+        // A short read means we hit the end of the file.
+        uint64_t nRead = n;
+        for (size_t i = 0; i < count; ++i) {
+            if (nRead >= iov[i].iov_len) {
+                nRead -= iov[i].iov_len;
+                continue;
+            }
+            std::memset(static_cast<char*>(iov[i].iov_base) + nRead, 0,
+                        iov[i].iov_len - nRead);
+            nRead = 0;
+        }
+    }
+
+    void
+    WriteRange(const iovec *iov, size_t count, uint64_t offset)
+    {
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += iov[i].iov_len;
+
+        auto n = ring->Transfer(
+            IORING_OP_WRITEV, fd, iov, static_cast<unsigned>(count), offset);
+        if (n < 0)
+            throw SystemError(-n, "write " + fname);
+        if (uint64_t(n) != total)
+            throw SystemError(EIO, "short write " + fname);
+    }
+
+public:
+    UringFile(std::shared_ptr<UringBackend> ring,
+              const std::string &fname,
+              bool create)
+        : ring(std::move(ring)),
+          fname(fname),
+          fd(-1),
+          isDirect(true),
+          edgeMtx()
+    {
+        int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0);
+        fd = open(fname.c_str(), flags | O_DIRECT, 0644);
+        if (fd < 0 and errno == EINVAL) {
+            // The filesystem does not support direct I/O.
+            isDirect = false;
+            fd = open(fname.c_str(), flags, 0644);
+        }
+        if (fd < 0)
+            throw SystemError(errno, "open " + fname);
+    }
+
+    ~UringFile() override
+    {
+        close(fd);
+    }
+
+    void
+    Read(const iovec *iov, size_t count, uint64_t offset) override
+    {
+        if (not isDirect) {
+            ReadRange(iov, count, offset);
+            return;
+        }
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += iov[i].iov_len;
+
+        // Read the aligned range that covers the request, and copy out the
+        // bytes that were asked for.
+        auto start = AlignDown(offset);
+        auto end = AlignUp(offset + total);
+        AlignedBuffer bounce(end - start);
+        iovec biov{bounce.data, end - start};
+        ReadRange(&biov, 1, start);
+
+        auto src = bounce.data + (offset - start);
+        for (size_t i = 0; i < count; ++i) {
+            std::memcpy(iov[i].iov_base, src, iov[i].iov_len);
+            src += iov[i].iov_len;
+        }
+    }
+
+    void
+    Write(const iovec *iov, size_t count, uint64_t offset) override
+    {
+        if (not isDirect) {
+            WriteRange(iov, count, offset);
+            return;
+        }
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+            total += iov[i].iov_len;
+
+        auto start = AlignDown(offset);
+        auto end = AlignUp(offset + total);
+        constexpr auto kBlock = UringBackend::kDirectAlignment;
+        AlignedBuffer bounce(end - start);
+
+        // Lock the partial blocks at either edge, in order, and read them, so
+        // that the bytes that are already in them are written back unchanged.
+        UniqueLock headLk, tailLk;
+        auto head = start != offset ? &EdgeLock(start) : nullptr;
+        auto tail = end != offset+total ? &EdgeLock(end-kBlock) : nullptr;
+        if (head == tail)
+            tail = nullptr;
+        if (head and tail and tail < head)
+            std::swap(head, tail);
+        if (head)
+            headLk = UniqueLock(*head);
+        if (tail)
+            tailLk = UniqueLock(*tail);
+        if (start != offset) {
+            iovec biov{bounce.data, kBlock};
+            ReadRange(&biov, 1, start);
+        }
+        if (end != offset+total and (end-kBlock != start or start == offset)) {
+            iovec biov{bounce.data + (end-start-kBlock), kBlock};
+            ReadRange(&biov, 1, end-kBlock);
+        }
+
+        auto dst = bounce.data + (offset - start);
+        for (size_t i = 0; i < count; ++i) {
+            std::memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+
+        iovec biov{bounce.data, end - start};
+        WriteRange(&biov, 1, start);
+    }
+
+    void
+    Sync() override
+    {
+        if (fdatasync(fd))
+            throw SystemError(errno, "fdatasync " + fname);
+    }
+
+    void
+    Truncate(uint64_t size) override
+    {
+        if (ftruncate(fd, size))
+            throw SystemError(errno, "ftruncate " + fname);
+    }
+};
+
+// Define it here to avoid link errors
+constexpr size_t UringFile::kEdgeLocks;
+
+} // namespace
+
+/**
+ * Sets up the io_uring and starts the thread that reaps completions.
+ *
+ * @param entries The number of entries in the submission queue.
+ * @throw std::system_error if the ring cannot be set up.
+ */
+UringBackend::UringBackend(unsigned entries)
+    : ringFd(-1),
+      sqRing(MAP_FAILED),
+      sqRingSize(0),
+      sqTail(nullptr),
+      sqMask(nullptr),
+      sqArray(nullptr),
+      sqes(static_cast<io_uring_sqe*>(MAP_FAILED)),
+      sqesSize(0),
+      cqRing(MAP_FAILED),
+      cqRingSize(0),
+      cqHead(nullptr),
+      cqTail(nullptr),
+      cqMask(nullptr),
+      cqes(nullptr),
+      cqEntries(0),
+      sqMtx(),
+      sqCv(),
+      inFlight(0),
+      reaper()
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    ringFd = IoUringSetup(entries, &params);
+    if (ringFd < 0)
+        throw SystemError(errno, "io_uring_setup");
+
+    auto cleanup = [this] {
+        if (cqRing != MAP_FAILED and cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        close(ringFd);
+    };
+
+    sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        auto err = errno;
+        cleanup();
+        throw SystemError(err, "mmap sq ring");
+    }
+    cqRing = singleMmap
+        ? sqRing
+        : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    if (cqRing == MAP_FAILED) {
+        auto err = errno;
+        cleanup();
+        throw SystemError(err, "mmap cq ring");
+    }
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(
+        mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        auto err = errno;
+        cleanup();
+        throw SystemError(err, "mmap sqes");
+    }
+
+    sqTail = RingPtr<unsigned>(sqRing, params.sq_off.tail);
+    sqMask = RingPtr<unsigned>(sqRing, params.sq_off.ring_mask);
+    sqArray = RingPtr<unsigned>(sqRing, params.sq_off.array);
+    cqHead = RingPtr<unsigned>(cqRing, params.cq_off.head);
+    cqTail = RingPtr<unsigned>(cqRing, params.cq_off.tail);
+    cqMask = RingPtr<unsigned>(cqRing, params.cq_off.ring_mask);
+    cqes = RingPtr<io_uring_cqe>(cqRing, params.cq_off.cqes);
+    cqEntries = params.cq_entries;
+
+    reaper = std::thread(&UringBackend::Reap, this);
+}
+
+/**
+ * Dtor. Stops the reaper thread and tears down the ring. By the time the
+ * backend is destroyed, every file opened through it has been closed, so there
+ * are no requests in flight.
+ */
+UringBackend::~UringBackend()
+{
+    {
+        UniqueLock lk(sqMtx);
+        sqCv.wait(lk, [this] { return inFlight < cqEntries; });
+        // A no-op with no completion tells the reaper to stop.
+        Enqueue(IORING_OP_NOP, -1, nullptr, 0, 0, 0);
+    }
+    reaper.join();
+
+    if (cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    munmap(sqRing, sqRingSize);
+    munmap(sqes, sqesSize);
+    close(ringFd);
+}
+
+/**
+ * Opens a file for direct I/O through the ring.
+ *
+ * @param fname The name of the file.
+ * @param create If true, then the file is created or truncated.
+ * @return The file.
+ * @throw std::system_error if the file cannot be opened.
+ */
+std::unique_ptr<VolumeFile>
+UringBackend::Open(const std::string &fname, bool create)
+{
+    return std::unique_ptr<VolumeFile>(
+        new UringFile(shared_from_this(), fname, create));
+}
+
+/**
+ * Submits a request and waits for it to complete.
+ *
+ * @param opcode The operation, i.e., IORING_OP_READV or IORING_OP_WRITEV.
+ * @param fd The file descriptor.
+ * @param iov The buffers.
+ * @param count The number of buffers.
+ * @param offset The offset in the file.
+ * @return The number of bytes transferred, or a negated errno value.
+ */
+int
+UringBackend::Transfer(
+    uint8_t opcode, int fd, const iovec *iov, unsigned count, uint64_t offset)
+{
+    Completion completion;
+    {
+        UniqueLock lk(sqMtx);
+        sqCv.wait(lk, [this] { return inFlight < cqEntries; });
+        Enqueue(opcode, fd, iov, count, offset,
+                reinterpret_cast<uint64_t>(&completion));
+    }
+
+    UniqueLock lk(completion.mtx);
+    completion.cv.wait(lk, [&completion] { return completion.isDone; });
+    return completion.result;
+}
+
+/**
+ * Puts a request in the submission queue and submits it. The caller must hold
+ * the submission queue lock and make sure there is room for the completion.
+ *
+ * @throw std::system_error if the request cannot be submitted, in which case
+ *  it is taken back out of the queue.
+ */
+void
+UringBackend::Enqueue(
+    uint8_t opcode,
+    int fd,
+    const iovec *iov,
+    unsigned count,
+    uint64_t offset,
+    uint64_t userData)
+{
+    auto tail = *sqTail;
+    auto index = tail & *sqMask;
+    auto sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(iov);
+    sqe->len = count;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail+1, __ATOMIC_RELEASE);
+    ++inFlight;
+
+    for (;;) {
+        auto n = IoUringEnter(ringFd, 1, 0, 0);
+        if (n >= 0)
+            break;
+        if (errno != EINTR and errno != EAGAIN and errno != EBUSY) {
+            auto err = errno;
+            __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+            --inFlight;
+            sqCv.notify_all();
+            throw SystemError(err, "io_uring_enter");
+        }
+    }
+}
+
+/**
+ * Waits for completions and wakes up the threads waiting for them, until it
+ * finds the no-op submitted by the dtor.
+ */
+void
+UringBackend::Reap()
+{
+    for (bool isDone = false; not isDone;) {
+        IoUringEnter(ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+
+        auto head = *cqHead;
+        auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned reaped = 0;
+        for (; head != tail; ++head, ++reaped) {
+            auto &cqe = cqes[head & *cqMask];
+            if (not cqe.user_data) {
+                isDone = true;
+                continue;
+            }
+            auto completion = reinterpret_cast<Completion*>(cqe.user_data);
+            LockGuard lk(completion->mtx);
+            completion->result = cqe.res;
+            completion->isDone = true;
+            completion->cv.notify_one();
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        if (reaped) {
+            {
+                LockGuard lk(sqMtx);
+                inFlight -= reaped;
+            }
+            sqCv.notify_all();
+        }
+    }
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "iobackend.hh"
+
+/**
+ * An I/O backend built on a single io_uring.
+ *
+ * All the files opened through the backend submit their requests to the same
+ * submission queue, and a single thread reaps the completions and wakes up the
+ * threads waiting on them. Files are opened with O_DIRECT, so reads and writes
+ * bypass the page cache; requests that are not aligned to kDirectAlignment are
+ * transferred through an aligned bounce buffer, and unaligned writes read the
+ * partial blocks at their edges first, holding a lock per block. Files on
+ * filesystems that do not support O_DIRECT are opened for buffered I/O
+ * instead.
+ *
+ * The ring is set up with raw system calls, so liburing is not needed.
+ */
+class UringBackend : public IoBackend,
+                     public std::enable_shared_from_this<UringBackend>
+{
+public:
+    // The alignment of buffers, offsets, and sizes required for direct I/O.
+    static constexpr uint64_t kDirectAlignment = 4096;
+
+    // The default number of entries in the submission queue.
+    static constexpr unsigned kEntries = 256;
+
+private:
+    int ringFd;
+
+    // Submission queue ring.
+    void *sqRing;
+    size_t sqRingSize;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    // Completion queue ring, which may share the mapping with the submission
+    // queue ring.
+    void *cqRing;
+    size_t cqRingSize;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+    unsigned cqEntries;
+
+    // Protects the submission queue, and bounds the number of requests in
+    // flight so the completion queue never overflows.
+    std::mutex sqMtx;
+    std::condition_variable sqCv;
+    unsigned inFlight;
+
+    std::thread reaper;
+
+    void Enqueue(uint8_t opcode, int fd, const iovec *iov, unsigned count,
+                 uint64_t offset, uint64_t userData);
+    void Reap();
+
+public:
+    explicit UringBackend(unsigned entries = kEntries);
+    UringBackend(const UringBackend &backend) = delete;
+    UringBackend& operator=(const UringBackend &backend) = delete;
+    ~UringBackend() override;
+
+    std::unique_ptr<VolumeFile>
+    Open(const std::string &fname, bool create) override;
+
+    const char* Name() const noexcept override { return "uring"; }
+
+    // Submits a readv or writev request and waits for it to complete.
+    int Transfer(uint8_t opcode, int fd, const iovec *iov, unsigned count,
+                 uint64_t offset);
+};
@@ -0,0 +1,449 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bits.hh"
+#include "volumeindex.hh"
+
+// Define them here to avoid link errors
+constexpr unsigned VolumeIndex::kSizeBits;
+constexpr uint32_t VolumeIndex::kSizeMask;
+constexpr unsigned VolumeIndex::kCodecShift;
+constexpr uint32_t VolumeIndex::kCodecMask;
+constexpr uint32_t VolumeIndex::kUsedFlag;
+constexpr uint32_t VolumeIndex::kRemovedFlag;
+constexpr size_t VolumeIndex::kMinSlots;
+
+static_assert(sizeof(VolumeIndex::Entry) == 20, "entries must be packed");
+static_assert(sizeof(VolumeIndex::FrozenEntry) == 16,
+              "frozen entries must be packed");
+static_assert(sizeof(VolumeIndex::RawSize) == 12, "sizes must be packed");
+
+namespace {
+
+/**
+ * @return An estimate of the memory taken by a node based map: a node per
+ *  item, with the item, the link to the next node, and the cached hash, and
+ *  the array of buckets.
+ */
+template<typename Map>
+size_t
+MapMemory(const Map &map) noexcept
+{
+    return map.size() * (sizeof(typename Map::value_type) + 2*sizeof(void*))
+        + map.bucket_count() * sizeof(void*);
+}
+
+} // namespace
+
+/**
+ * Initializes an empty index.
+ *
+ * @param volumeId The ID of the volume, which all the needles are in.
+ * @param alignment The alignment of the offsets of the needles in the volume,
+ *  which is 1 for legacy volumes, whose offsets are not aligned.
+ */
+VolumeIndex::VolumeIndex(uint64_t volumeId, uint64_t alignment)
+    : mtx(),
+      volumeId(volumeId),
+      alignment(alignment ? alignment : 1),
+      table(),
+      tableUsed(0),
+      tableLive(0),
+      frozen(),
+      runs(),
+      frozenRemoved(0),
+      rawSizes(),
+      unpacked()
+{}
+
+/**
+ * Gets a needle from the index.
+ *
+ * @param needleId The ID of the needle.
+ * @param needle Set to the needle. Its checksum is 0, as it is not kept.
+ * @return True if the needle is found, false otherwise.
+ */
+bool
+VolumeIndex::Get(uint64_t needleId, Needle &needle) const
+{
+    LockGuard lk(mtx);
+    if (auto item = FindFrozen(needleId)) {
+        const auto idHigh = static_cast<uint32_t>(needleId >> 32);
+        needle = Unpack(Entry{
+            item->idLow, idHigh, item->offset, item->bits, item->cookie});
+        return true;
+    }
+    if (auto entry = FindSlot(needleId)) {
+        needle = Unpack(*entry);
+        return true;
+    }
+    auto item = unpacked.find(needleId);
+    if (item == unpacked.end())
+        return false;
+    needle = item->second;
+    return true;
+}
+
+/**
+ * Puts a needle into the index.
+ *
+ * @param needle The needle, which is found by its ID.
+ * @return True if the needle is inserted, false if the index already has a
+ *  needle with the same ID.
+ */
+bool
+VolumeIndex::Put(const Needle &needle)
+{
+    LockGuard lk(mtx);
+    const auto needleId = needle.flags.id;
+    if (Contains(needleId))
+        return false;
+
+    Entry entry;
+    if (not Pack(needle, entry)) {
+        unpacked.emplace(needleId, needle);
+        return true;
+    }
+    Insert(entry);
+    if (needle.flags.codec)
+        SetRawSize(needleId, needle.flags.rawSize);
+    return true;
+}
+
+/**
+ * Removes a needle from the index.
+ *
+ * @param needleId The ID of the needle.
+ * @return True if the needle is found and removed, false otherwise.
+ */
+bool
+VolumeIndex::Remove(uint64_t needleId)
+{
+    LockGuard lk(mtx);
+    if (auto item = FindFrozen(needleId)) {
+        item->bits |= kRemovedFlag;
+        if (++frozenRemoved * 4 > frozen.size()) {
+            std::vector<Entry> entries;
+            ThawFrozen(entries);
+            SetFrozen(entries);
+            PruneRawSizes();
+        }
+        return true;
+    }
+    if (auto entry = FindSlot(needleId)) {
+        entry->bits |= kRemovedFlag;
+        --tableLive;
+        return true;
+    }
+    return unpacked.erase(needleId) != 0;
+}
+
+/**
+ * Moves the needles in the table into the sorted array, once the volume is
+ * sealed and its needles stop changing. Needles put afterwards go to a new
+ * table, and they are moved by the next call.
+ */
+void
+VolumeIndex::Freeze()
+{
+    LockGuard lk(mtx);
+    if (table.empty() and not frozenRemoved)
+        return;
+
+    auto byId = [](const Entry &a, const Entry &b) { return Id(a) < Id(b); };
+    std::vector<Entry> merged;
+    merged.reserve(frozen.size() - frozenRemoved + tableLive);
+    ThawFrozen(merged);
+    auto middle = merged.size();
+    for (auto &entry : table) {
+        if (IsLive(entry.bits))
+            merged.push_back(entry);
+    }
+    std::sort(merged.begin() + middle, merged.end(), byId);
+    std::inplace_merge(
+        merged.begin(), merged.begin() + middle, merged.end(), byId);
+
+    SetFrozen(merged);
+    std::vector<Entry>().swap(table);
+    tableUsed = 0;
+    tableLive = 0;
+    PruneRawSizes();
+}
+
+/**
+ * @return The number of needles in the index.
+ */
+size_t
+VolumeIndex::Count() const noexcept
+{
+    LockGuard lk(mtx);
+    return frozen.size() - frozenRemoved + tableLive + unpacked.size();
+}
+
+/**
+ * @return An estimate of the bytes of memory taken by the index.
+ */
+size_t
+VolumeIndex::MemoryUsage() const noexcept
+{
+    LockGuard lk(mtx);
+    return sizeof(*this)
+        + table.capacity() * sizeof(Entry)
+        + frozen.capacity() * sizeof(FrozenEntry)
+        + runs.capacity() * sizeof(FrozenRun)
+        + rawSizes.capacity() * sizeof(RawSize)
+        + MapMemory(unpacked);
+}
+
+/**
+ * Packs a needle into an entry.
+ *
+ * @param needle The needle.
+ * @param entry Set to the entry.
+ * @return False if the needle cannot be packed, e.g., because its offset is
+ *  not aligned or its blob is too large, true otherwise.
+ */
+bool
+VolumeIndex::Pack(const Needle &needle, Entry &entry) const noexcept
+{
+    const auto units = needle.offset / alignment;
+    if (needle.haystackId != volumeId
+        or needle.offset % alignment or units > UINT32_MAX
+        or needle.flags.size > kSizeMask or needle.flags.codec > kCodecMask)
+        return false;
+
+    entry.idLow = static_cast<uint32_t>(needle.flags.id);
+    entry.idHigh = static_cast<uint32_t>(needle.flags.id >> 32);
+    entry.offset = static_cast<uint32_t>(units);
+    entry.bits = static_cast<uint32_t>(needle.flags.size)
+        | static_cast<uint32_t>(needle.flags.codec) << kCodecShift
+        | kUsedFlag;
+    entry.cookie = needle.flags.cookie;
+    return true;
+}
+
+/**
+ * @param entry A packed needle.
+ * @return The needle.
+ */
+Needle
+VolumeIndex::Unpack(const Entry &entry) const
+{
+    Needle needle(
+        volumeId, uint64_t(entry.offset) * alignment,
+        Id(entry), entry.bits & kSizeMask);
+    needle.flags.cookie = entry.cookie;
+    needle.flags.codec = (entry.bits >> kCodecShift) & kCodecMask;
+    if (needle.flags.codec) {
+        auto item = std::lower_bound(
+            rawSizes.begin(), rawSizes.end(), needle.flags.id,
+            [](const RawSize &size, uint64_t id) { return Id(size) < id; });
+        if (item != rawSizes.end() and Id(*item) == needle.flags.id)
+            needle.flags.rawSize = item->rawSize;
+    }
+    return needle;
+}
+
+/**
+ * @param needleId The ID of a needle.
+ * @return The slot of the table with the needle, or nullptr if it is not in
+ *  the table or it is removed.
+ */
+const VolumeIndex::Entry *
+VolumeIndex::FindSlot(uint64_t needleId) const noexcept
+{
+    if (table.empty())
+        return nullptr;
+    const auto mask = table.size() - 1;
+    for (auto i = Mix(needleId) & mask;; i = (i + 1) & mask) {
+        auto &entry = table[i];
+        if (not (entry.bits & kUsedFlag))
+            return nullptr;
+        if (IsLive(entry.bits) and Id(entry) == needleId)
+            return &entry;
+    }
+}
+
+VolumeIndex::Entry *
+VolumeIndex::FindSlot(uint64_t needleId) noexcept
+{
+    return const_cast<Entry*>(
+        static_cast<const VolumeIndex*>(this)->FindSlot(needleId));
+}
+
+/**
+ * @param needleId The ID of a needle.
+ * @return The entry of the sorted array with the needle, or nullptr if it is
+ *  not in the array or it is removed.
+ */
+const VolumeIndex::FrozenEntry *
+VolumeIndex::FindFrozen(uint64_t needleId) const noexcept
+{
+    const auto idHigh = static_cast<uint32_t>(needleId >> 32);
+    const auto idLow = static_cast<uint32_t>(needleId);
+    auto run = std::lower_bound(
+        runs.begin(), runs.end(), idHigh,
+        [](const FrozenRun &r, uint32_t high) { return r.idHigh < high; });
+    if (run == runs.end() or run->idHigh != idHigh)
+        return nullptr;
+
+    auto begin = frozen.begin() + run->begin;
+    auto end = run+1 == runs.end()
+        ? frozen.end() : frozen.begin() + (run+1)->begin;
+    auto it = std::lower_bound(
+        begin, end, idLow,
+        [](const FrozenEntry &e, uint32_t low) { return e.idLow < low; });
+    if (it == end or it->idLow != idLow or not IsLive(it->bits))
+        return nullptr;
+    return &*it;
+}
+
+VolumeIndex::FrozenEntry *
+VolumeIndex::FindFrozen(uint64_t needleId) noexcept
+{
+    return const_cast<FrozenEntry*>(
+        static_cast<const VolumeIndex*>(this)->FindFrozen(needleId));
+}
+
+/**
+ * @param needleId The ID of a needle.
+ * @return True if the index has the needle, false otherwise.
+ */
+bool
+VolumeIndex::Contains(uint64_t needleId) const noexcept
+{
+    return FindFrozen(needleId) or FindSlot(needleId)
+        or unpacked.count(needleId);
+}
+
+/**
+ * Inserts an entry into the table, which must not have it already. The table
+ * is rebuilt first if it is 3/4 full, counting the removed slots.
+ *
+ * @param entry The entry.
+ */
+void
+VolumeIndex::Insert(const Entry &entry)
+{
+    if ((tableUsed + 1) * 4 > table.size() * 3) {
+        size_t slots = kMinSlots;
+        while (slots < 2 * (tableLive + 1))
+            slots *= 2;
+        Rehash(slots);
+    }
+
+    const auto mask = table.size() - 1;
+    auto i = Mix(Id(entry)) & mask;
+    while (IsLive(table[i].bits))
+        i = (i + 1) & mask;
+    if (not (table[i].bits & kUsedFlag))
+        ++tableUsed;
+    table[i] = entry;
+    ++tableLive;
+}
+
+/**
+ * Rebuilds the table with a number of slots, and drops the removed entries
+ * and their uncompressed sizes.
+ *
+ * @param slots The number of slots, a power of two.
+ */
+void
+VolumeIndex::Rehash(size_t slots)
+{
+    std::vector<Entry> old(slots, Entry{0, 0, 0, 0, 0});
+    old.swap(table);
+    tableUsed = 0;
+    tableLive = 0;
+    for (auto &entry : old) {
+        if (IsLive(entry.bits))
+            Insert(entry);
+    }
+    PruneRawSizes();
+}
+
+/**
+ * Appends the needles of the sorted array that are not removed to a vector,
+ * in order.
+ *
+ * @param entries The vector.
+ */
+void
+VolumeIndex::ThawFrozen(std::vector<Entry> &entries) const
+{
+    for (size_t run = 0; run < runs.size(); ++run) {
+        auto end = run+1 < runs.size() ? runs[run+1].begin : frozen.size();
+        for (auto i = runs[run].begin; i < end; ++i) {
+            auto &item = frozen[i];
+            if (IsLive(item.bits)) {
+                entries.push_back(Entry{item.idLow, runs[run].idHigh,
+                                        item.offset, item.bits, item.cookie});
+            }
+        }
+    }
+}
+
+/**
+ * Replaces the sorted array and its runs.
+ *
+ * @param entries The needles of the new array, sorted by ID.
+ */
+void
+VolumeIndex::SetFrozen(const std::vector<Entry> &entries)
+{
+    std::vector<FrozenEntry> items;
+    std::vector<FrozenRun> newRuns;
+    items.reserve(entries.size());
+    for (auto &entry : entries) {
+        if (newRuns.empty() or newRuns.back().idHigh != entry.idHigh)
+            newRuns.push_back(FrozenRun{entry.idHigh, items.size()});
+        items.push_back(FrozenEntry{
+            entry.idLow, entry.offset, entry.bits, entry.cookie});
+    }
+    newRuns.shrink_to_fit();
+    frozen.swap(items);
+    runs.swap(newRuns);
+    frozenRemoved = 0;
+}
+
+/**
+ * Records the uncompressed size of a compressed needle. Needle IDs mostly grow
+ * as needles are written, so the size is usually appended.
+ *
+ * @param needleId The ID of the needle.
+ * @param rawSize The size of its contents.
+ */
+void
+VolumeIndex::SetRawSize(uint64_t needleId, uint32_t rawSize)
+{
+    auto item = std::lower_bound(
+        rawSizes.begin(), rawSizes.end(), needleId,
+        [](const RawSize &size, uint64_t id) { return Id(size) < id; });
+    if (item != rawSizes.end() and Id(*item) == needleId)
+        item->rawSize = rawSize;
+    else {
+        rawSizes.insert(item, RawSize{
+            static_cast<uint32_t>(needleId),
+            static_cast<uint32_t>(needleId >> 32), rawSize});
+    }
+}
+
+/**
+ * Drops the uncompressed sizes of the needles that were removed, which are
+ * kept until the table or the sorted array is rebuilt, so that removing a
+ * needle does not move the sizes of the others.
+ */
+void
+VolumeIndex::PruneRawSizes()
+{
+    rawSizes.erase(
+        std::remove_if(
+            rawSizes.begin(), rawSizes.end(),
+            [this](const RawSize &size) {
+                return not FindFrozen(Id(size)) and not FindSlot(Id(size));
+            }),
+        rawSizes.end());
+    rawSizes.shrink_to_fit();
+}
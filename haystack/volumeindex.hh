@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "needle.hh"
+
+/**
+ * The in-memory index of a volume, which maps needle IDs to needles in 16
+ * bytes per needle once the volume is sealed, and 27 to 54 bytes while it is
+ * writable, so that the index of a Store fits in memory.
+ *
+ * Every needle is packed into an Entry with its ID, its offset in units of
+ * the alignment of the volume, its size, codec and flags, and its cookie. The
+ * entries of a writable volume live in a flat table with open addressing and
+ * linear probing, which doubles when it is 3/4 full, so it is 3/8 to 3/4
+ * full. Once the volume is sealed, Freeze moves them into an array of
+ * FrozenEntry sorted by ID, which drops the high 32 bits of the ID, as they
+ * are kept once per run of needles that share them, and is searched with a
+ * binary search. Removed needles are marked in place, and the sorted array is
+ * compacted once a quarter of it is marked.
+ *
+ * The uncompressed sizes of the compressed needles are kept in a sorted side
+ * table, which takes 12 more bytes per compressed needle. Needles of legacy
+ * volumes, whose offsets are not aligned, are packed with their offset in
+ * bytes, and the few needles that cannot be packed at all, e.g., those past
+ * 4GB in a legacy volume, are kept as they are. Checksums are not kept, as
+ * reads take them from the needle headers. All the operations are thread
+ * safe.
+ */
+class VolumeIndex
+{
+public:
+    // A packed needle of a writable volume.
+    struct Entry
+    {
+        uint32_t idLow;
+        uint32_t idHigh;
+        uint32_t offset;  // In units of the alignment of the volume.
+        uint32_t bits;  // The size, the codec, and the flags below.
+        uint32_t cookie;
+    };
+
+    // A packed needle of a sealed volume, whose high 32 bits of the ID are
+    // those of its run.
+    struct FrozenEntry
+    {
+        uint32_t idLow;
+        uint32_t offset;
+        uint32_t bits;
+        uint32_t cookie;
+    };
+
+    // The entries of the sorted array that share the high 32 bits of the ID,
+    // from begin up to the begin of the next run.
+    struct FrozenRun
+    {
+        uint32_t idHigh;
+        size_t begin;
+    };
+
+    // The uncompressed size of a compressed needle.
+    struct RawSize
+    {
+        uint32_t idLow;
+        uint32_t idHigh;
+        uint32_t rawSize;
+    };
+
+    // The layout of Entry::bits.
+    static constexpr unsigned kSizeBits = 28;
+    static constexpr uint32_t kSizeMask = (1u << kSizeBits) - 1;
+    static constexpr unsigned kCodecShift = kSizeBits;
+    static constexpr uint32_t kCodecMask = 3;
+    static constexpr uint32_t kUsedFlag = 1u << 30;
+    static constexpr uint32_t kRemovedFlag = 1u << 31;
+
+    // The smallest table, in slots.
+    static constexpr size_t kMinSlots = 16;
+
+private:
+    using LockGuard = std::lock_guard<std::mutex>;
+
+    mutable std::mutex mtx;
+    uint64_t volumeId;
+    uint64_t alignment;  // Of the offsets of the needles, in bytes.
+    std::vector<Entry> table;  // Empty, or a power of two slots.
+    size_t tableUsed;  // The slots in use, including the removed ones.
+    size_t tableLive;  // The slots with needles that are not removed.
+    std::vector<FrozenEntry> frozen;  // Sorted by ID.
+    std::vector<FrozenRun> runs;  // Sorted by ID.
+    size_t frozenRemoved;  // The removed entries in the sorted array.
+    std::vector<RawSize> rawSizes;  // Sorted by ID.
+    std::unordered_map<uint64_t, Needle> unpacked;  // By needle ID.
+
+    bool Pack(const Needle &needle, Entry &entry) const noexcept;
+    Needle Unpack(const Entry &entry) const;
+    Entry *FindSlot(uint64_t needleId) noexcept;
+    const Entry *FindSlot(uint64_t needleId) const noexcept;
+    FrozenEntry *FindFrozen(uint64_t needleId) noexcept;
+    const FrozenEntry *FindFrozen(uint64_t needleId) const noexcept;
+    bool Contains(uint64_t needleId) const noexcept;
+    void Insert(const Entry &entry);
+    void Rehash(size_t slots);
+    void ThawFrozen(std::vector<Entry> &entries) const;
+    void SetFrozen(const std::vector<Entry> &entries);
+    void SetRawSize(uint64_t needleId, uint32_t rawSize);
+    void PruneRawSizes();
+
+    template<typename T>
+    static uint64_t Id(const T &item) noexcept
+    {
+        return uint64_t(item.idHigh) << 32 | item.idLow;
+    }
+
+    static bool IsLive(uint32_t bits) noexcept
+    {
+        return (bits & (kUsedFlag | kRemovedFlag)) == kUsedFlag;
+    }
+
+public:
+    explicit VolumeIndex(
+        uint64_t volumeId, uint64_t alignment = NeedleHeader::kAlignment);
+    VolumeIndex(const VolumeIndex &index) = delete;
+    VolumeIndex& operator=(const VolumeIndex &index) = delete;
+
+    bool Get(uint64_t needleId, Needle &needle) const;
+    bool Put(const Needle &needle);
+    bool Remove(uint64_t needleId);
+    void Freeze();
+    size_t Count() const noexcept;
+    size_t MemoryUsage() const noexcept;
+    template<typename Fn>
+    void ForEach(Fn fn) const;
+};
+
+/**
+ * Calls a function with every needle in the index, while holding the lock.
+ * The function must not call back into the index.
+ * @param fn The function, which takes the needle.
+ */
+template<typename Fn>
+void
+VolumeIndex::ForEach(Fn fn) const
+{
+    LockGuard lk(mtx);
+    for (size_t run = 0; run < runs.size(); ++run) {
+        auto end = run+1 < runs.size() ? runs[run+1].begin : frozen.size();
+        for (auto i = runs[run].begin; i < end; ++i) {
+            auto &item = frozen[i];
+            if (IsLive(item.bits)) {
+                fn(Unpack(Entry{item.idLow, runs[run].idHigh, item.offset,
+                                item.bits, item.cookie}));
+            }
+        }
+    }
+    for (auto &entry : table) {
+        if (IsLive(entry.bits))
+            fn(Unpack(entry));
+    }
+    for (auto &item : unpacked)
+        fn(item.second);
+}
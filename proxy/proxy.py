@@ -21,6 +21,14 @@ FILEMAX=1<<20
 # list from directory
 # get content from cache
 
+def trace():
+    '''Returns the trace token for the request, if it has an X-Trace-Id.'''
+    traceId = request.headers.get('X-Trace-Id', '')
+    try:
+        return ' trace={:x}'.format(int(traceId, 16)) if traceId else ''
+    except ValueError:
+        return ''
+
 # Create the Flask application
 app = Flask(__name__, static_url_path='')
 app.secret_key = 'key'
@@ -30,7 +38,7 @@ def index():
     '''Display list of needles.'''
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.connect(dirAddr)
-    s.send(b'list\n')
+    s.send(b'list{}\n'.format(trace()))
     buff = s.recv(FILEMAX).splitlines()
     if buff and 'ok' in buff[0]:
         return render_template('index.html', needles=buff[1:])
@@ -39,12 +47,12 @@ def index():
     else:
         return 'Unknown Error'
 
-@app.route('/show/<int:needleId>')
+@app.route('/show/<needleId>')
 def show(needleId):
     '''Displays the contents of a needle.'''
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.connect(cacheAddr)
-    s.send(b'get {}\n'.format(needleId))
+    s.send(b'get {}{}\n'.format(needleId, trace()))
     buff = s.recv(FILEMAX).splitlines()
     if buff and 'ok' in buff[0]:
         return render_template('data.html',
@@ -54,12 +62,12 @@ def show(needleId):
     else:
         return 'Unknown Error'
 
-@app.route('/delete/<int:needleId>')
+@app.route('/delete/<needleId>')
 def delete(needleId):
     '''Removes a needle.'''
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.connect(dirAddr)
-    s.send(b'delete {}\n'.format(needleId))
+    s.send(b'delete {}{}\n'.format(needleId, trace()))
     buff = s.recv(FILEMAX)
     if 'ok' in buff:
         return 'Needle {} has been deleted'.format(needleId)
@@ -75,7 +83,7 @@ def upload():
     blob = f.read()
     s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     s.connect(dirAddr)
-    s.send(b'upload {}\n{}'.format(len(blob), blob))
+    s.send(b'upload {}{}\n{}'.format(len(blob), trace(), blob))
     buff = s.recv(FILEMAX)
     if 'ok' in buff:
         return 'Needle {} has been created'.format(buff.split()[-1])
@@ -1,10 +1,9 @@
-#include <pthread.h>
-
 #include <chrono>
 #include <cstdlib>
 #include <functional>
 #include <random>
 #include <set>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -42,7 +41,7 @@ struct AppTest : public ::testing::Test
     std::string mongoUri{"mongodb://localhost:27017"};
 
     char buf[kBuffLimit];
-    std::vector<size_t> ids;
+    std::vector<std::string> ids;
     std::vector<std::vector<char>> fileData;
 
     Store store{storeIpAddr, storePort, PREFIX};
@@ -90,9 +89,9 @@ struct AppTest : public ::testing::Test
         std::system("kill $(ps | grep mongod | awk '{print $1}')");
         std::system("kill $(ps | grep redis-server | awk '{print $1}')");
         std::system("rm -fr /tmp/mongo");
-        pthread_cancel(thrStore.native_handle());
-        pthread_cancel(thrDir.native_handle());
-        pthread_cancel(thrCache.native_handle());
+        store.Stop();
+        directory.Stop();
+        cache.Stop();
         thrStore.join();
         thrDir.join();
         thrCache.join();
@@ -116,7 +115,7 @@ TEST_F(AppTest, TheDirectoryCacheAndStoreWorkCorrectlyTogether)
         std::string line, response;
         std::getline(conn, line);
         std::istringstream iss(line);
-        size_t id;
+        std::string id;
         iss >> response >> id;
         ASSERT_EQ("ok", response)
             << "line=" << line
@@ -143,6 +142,17 @@ TEST_F(AppTest, TheDirectoryCacheAndStoreWorkCorrectlyTogether)
         EXPECT_TRUE(std::equal(bytes.begin(), bytes.end(), buf));
     }
 
+    // The needles cannot be fetched from the store by their bare IDs.
+    for (auto &id : ids) {
+        NeedleHandle handle;
+        ASSERT_TRUE(NeedleHandle::Parse(id, handle)) << "id=" << id;
+        TcpStream conn(storeIpAddr, storePortStr);
+        conn << "get " << handle.needleId << '\n';
+        std::string response;
+        conn >> response;
+        ASSERT_EQ("err", response);
+    }
+
     // Now fetch the data directly from the cache.
     for (size_t i = 0; i < kTotalFiles; ++i) {
         TcpStream conn(cacheIpAddr, cachePortStr);
@@ -162,8 +172,8 @@ TEST_F(AppTest, TheDirectoryCacheAndStoreWorkCorrectlyTogether)
         EXPECT_TRUE(std::equal(bytes.begin(), bytes.end(), buf));
     }
 
-    // Now get the list of IDs, which should match the ones we received.
-    std::set<size_t> idSet;
+    // Now get the list of handles, which should match the ones we received.
+    std::set<std::string> idSet;
     {
         TcpStream conn(dirIpAddr, dirPortStr);
         conn << "list\n";
@@ -175,7 +185,7 @@ TEST_F(AppTest, TheDirectoryCacheAndStoreWorkCorrectlyTogether)
         ASSERT_EQ("ok", response)
             << "line=" << line
             << " size=" << size;
-        size_t needleId;
+        std::string needleId;
         while (conn >> needleId)
             idSet.insert(needleId);
         ASSERT_EQ(ids.size(), idSet.size());
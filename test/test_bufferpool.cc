@@ -0,0 +1,63 @@
+#include <stdexcept>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "bufferpool.hh"
+
+namespace {
+
+TEST(BufferPool, BuffersComeInSizeClasses)
+{
+    auto &pool = BufferPool::Instance();
+    EXPECT_EQ(BufferPool::kMinSize, pool.Get(0).Capacity());
+    EXPECT_EQ(BufferPool::kMinSize, pool.Get(100).Capacity());
+    EXPECT_EQ(8u << 10, pool.Get(BufferPool::kMinSize + 1).Capacity());
+    EXPECT_EQ(BufferPool::kMaxSize, pool.Get(BufferPool::kMaxSize).Capacity());
+    EXPECT_EQ(123u, pool.Get(123).Size());
+    EXPECT_THROW(pool.Get(BufferPool::kMaxSize + 1), std::length_error);
+}
+
+TEST(BufferPool, FreedBuffersAreReused)
+{
+    auto &pool = BufferPool::Instance();
+    char *data;
+    {
+        auto buf = pool.Get(5000);
+        data = buf.Data();
+        data[4999] = 'x';
+    }
+    // The buffer is in the cache of this thread.
+    auto buf = pool.Get(6000);
+    EXPECT_EQ(data, buf.Data());
+    EXPECT_NE(data, pool.Get(6000).Data());
+
+    // Moving a buffer transfers its ownership.
+    BufferPool::Buffer other(std::move(buf));
+    EXPECT_EQ(nullptr, buf.Data());
+    EXPECT_EQ(data, other.Data());
+}
+
+TEST(BufferPool, BuffersOfExitedThreadsAreShared)
+{
+    auto &pool = BufferPool::Instance();
+    auto before = pool.SharedBytes();
+    char *data = nullptr;
+    std::thread thr([&] {
+        auto buf = pool.Get(BufferPool::kMaxSize);
+        data = buf.Data();
+    });
+    thr.join();
+    EXPECT_EQ(before + BufferPool::kMaxSize, pool.SharedBytes());
+
+    // A new thread has an empty cache, so it takes the most recently shared
+    // buffer.
+    char *reused = nullptr;
+    std::thread other([&] {
+        reused = pool.Get(BufferPool::kMaxSize).Data();
+    });
+    other.join();
+    EXPECT_EQ(data, reused);
+}
+
+} // namespace
@@ -0,0 +1,75 @@
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "codec.hh"
+
+namespace {
+
+// Contents that compress well.
+std::string
+Text(size_t size)
+{
+    std::string text;
+    for (unsigned i = 0; text.size() < size; ++i)
+        text += "{\"id\":" + std::to_string(i) + ",\"tags\":[\"photo\"]}\n";
+    text.resize(size);
+    return text;
+}
+
+class CodecTest : public ::testing::TestWithParam<Codec>
+{};
+
+TEST_P(CodecTest, RoundTripsContents)
+{
+    auto codec = GetParam();
+    if (not IsCodecAvailable(codec))
+        GTEST_SKIP() << CodecName(codec) << " not available";
+
+    auto raw = Text(4096);
+    std::vector<char> packed(raw.size());
+    auto size = Compress(
+        codec, raw.data(), raw.size(), packed.data(), packed.size());
+    ASSERT_NE(0u, size);
+    EXPECT_LT(size, raw.size() / 2);
+
+    std::string result(raw.size(), '\0');
+    ASSERT_TRUE(Decompress(codec, packed.data(), size, &result[0], raw.size()));
+    EXPECT_EQ(raw, result);
+
+    // A wrong size, or corrupt data, is detected.
+    EXPECT_FALSE(
+        Decompress(codec, packed.data(), size, &result[0], raw.size() - 1));
+    packed[size / 2] ^= 0x5a;
+    packed[size - 1] ^= 0x5a;
+    if (Decompress(codec, packed.data(), size, &result[0], raw.size())) {
+        EXPECT_NE(raw, result);
+    }
+
+    // Contents that do not fit in the destination are not compressed.
+    EXPECT_EQ(0u, Compress(codec, raw.data(), raw.size(), packed.data(), 16));
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Codecs, CodecTest, ::testing::Values(Codec::Lz4, Codec::Zstd));
+
+TEST(Codec, ParsesNames)
+{
+    Codec codec = Codec::None;
+    EXPECT_TRUE(ParseCodec("zstd", codec));
+    EXPECT_EQ(Codec::Zstd, codec);
+    EXPECT_TRUE(ParseCodec("lz4", codec));
+    EXPECT_EQ(Codec::Lz4, codec);
+    EXPECT_TRUE(ParseCodec("none", codec));
+    EXPECT_EQ(Codec::None, codec);
+    EXPECT_FALSE(ParseCodec("gzip", codec));
+    EXPECT_EQ(Codec::None, codec);
+
+    EXPECT_STREQ("lz4", CodecName(Codec::Lz4));
+    EXPECT_TRUE(IsCodecAvailable(Codec::None));
+    EXPECT_EQ(0u, Compress(Codec::None, "abc", 3, nullptr, 0));
+}
+
+} // namespace
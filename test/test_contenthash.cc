@@ -0,0 +1,49 @@
+#include <cstddef>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "contenthash.hh"
+#include "crc32c.hh"
+
+namespace {
+
+TEST(ContentHash, MatchesTheXxh64ReferenceValues)
+{
+    EXPECT_EQ(0xef46db3751d8e999ull, Xxh64("", 0));
+    EXPECT_EQ(0x44bc2cf5ad770999ull, Xxh64("abc", 3));
+}
+
+TEST(ContentHash, IsTheSameWhenFedInPieces)
+{
+    std::string data;
+    for (unsigned i = 0; data.size() < 1000; ++i)
+        data += std::to_string(i * 2654435761u);
+
+    // Every split, including those within and across stripes, and every tail
+    // length.
+    for (size_t size : {0ul, 7ul, 31ul, 32ul, 33ul, 100ul, 1000ul}) {
+        auto expected = Xxh64(data.data(), size);
+        for (size_t cut = 0; cut <= size; ++cut) {
+            ContentHash hash;
+            hash.Update(data.data(), cut);
+            hash.Update(data.data() + cut, size - cut);
+            ASSERT_EQ(expected, hash.Xxh64()) << size << ' ' << cut;
+            ASSERT_EQ(Crc32c(data.data(), size), hash.Crc());
+            ASSERT_EQ(size, hash.Size());
+        }
+    }
+}
+
+TEST(ContentHash, FormatsTheContentAddress)
+{
+    ContentHash hash;
+    hash.Update("abc", 3);
+    EXPECT_EQ("3-44bc2cf5ad770999-364b3fb7", hash.ToString());
+
+    ContentHash other;
+    other.Update("abd", 3);
+    EXPECT_NE(hash.ToString(), other.ToString());
+}
+
+} // namespace
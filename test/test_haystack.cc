@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <random>
 #include <vector>
 #include <utility>
 
+#include <boost/filesystem.hpp>
 #include "gtest/gtest.h"
 
+#include "crc32c.hh"
 #include "haystack.hh"
 #include "needle.hh"
 
@@ -14,8 +19,6 @@
 
 namespace {
 
-constexpr uint64_t kPadding = sizeof(NeedleFlags);
-
 struct HaystackTest : public ::testing::Test
 {
     static constexpr int kSamples = 20;
@@ -42,12 +45,13 @@ struct HaystackTest : public ::testing::Test
         uint64_t offset = 0;
         for (int i = 0; i < kSamples; ++i) {
             auto size = genSize();
-            needles.emplace_back(0, offset, i, size);
             std::vector<char> buffer(size);
             for (auto &c : buffer)
                 c = genByte();
+            needles.emplace_back(
+                0, offset, i, size, Crc32c(buffer.data(), size));
             fileData.emplace_back(std::move(buffer));
-            offset += kPadding + size;
+            offset += NeedleDiskSize(size);
         }
         totalSize = offset;
     }
@@ -68,7 +72,7 @@ TEST_F(HaystackTest, CanWriteNeedleAndThenReadItAfterClosingFile)
     auto &bytes = fileData[0];
     EXPECT_LE(static_cast<size_t>(kBuffLimit >> 1), bytes.size());
     // Create a needle in the file and then close the file.
-    auto eFreeBytes = totalSize+1-bytes.size()-kPadding;
+    auto eFreeBytes = totalSize+1-NeedleDiskSize(bytes.size());
     {
         Haystack hs(0, PREFIX, totalSize+1);
         auto result = hs.Write(needle.flags.id, bytes.data(), bytes.size());
@@ -157,6 +161,121 @@ TEST_F(HaystackTest, NeedlesReturnsTheCorrectSetOfNeedles)
         EXPECT_EQ(needles[i], results[i]);
 }
 
+TEST_F(HaystackTest, ScanStreamsTheNeedlesInChunks)
+{
+    Haystack hs(0, PREFIX, totalSize+1);
+    for (int i = 0; i < kSamples; ++i) {
+        auto &bytes = fileData[i];
+        hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+    }
+    std::vector<Needle> deleted{needles[3]};
+    hs.DeleteGroup(deleted);
+    needles[3].flags.isDeleted = 1;
+
+    // Chunks smaller than a header, smaller than a needle, and larger than
+    // the file all find the same needles.
+    for (uint64_t chunkSize : {1ul, 7ul, 100ul, 1000ul, totalSize, 1ul << 20}) {
+        std::vector<Needle> results;
+        EXPECT_TRUE(hs.Scan([&](const Needle &needle) {
+            results.push_back(needle);
+            return true;
+        }, chunkSize));
+        EXPECT_TRUE(needles == results) << chunkSize;
+    }
+
+    // The function stops the scan.
+    size_t count = 0;
+    EXPECT_FALSE(hs.Scan([&](const Needle &) { return ++count < 5; }, 512));
+    EXPECT_EQ(5u, count);
+}
+
+TEST_F(HaystackTest, ScanSkipsHeadersThatCannotBeDecoded)
+{
+    Haystack hs(0, PREFIX, totalSize+1);
+    for (int i = 0; i < kSamples; ++i) {
+        auto &bytes = fileData[i];
+        hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+    }
+    hs.Sync();
+
+    // Wipe the magic of two headers in a row.
+    {
+        std::fstream file(PREFIX "/haystack_0",
+            std::ios::in | std::ios::out | std::ios::binary);
+        for (int i : {3, 4}) {
+            file.seekp(needles[i].offset);
+            file.write("XXXX", 4);
+        }
+    }
+
+    for (uint64_t chunkSize : {7ul, 1000ul, 1ul << 20}) {
+        std::vector<Needle> results;
+        std::vector<std::pair<uint64_t, uint64_t>> damage;
+        EXPECT_TRUE(hs.Scan(
+            [&](const Needle &needle) {
+                results.push_back(needle);
+                return true;
+            },
+            chunkSize,
+            [&](uint64_t offset, uint64_t next) {
+                damage.emplace_back(offset, next);
+            }));
+        auto expected = needles;
+        expected.erase(expected.begin() + 3, expected.begin() + 5);
+        EXPECT_TRUE(expected == results) << chunkSize;
+        ASSERT_EQ(1u, damage.size());
+        EXPECT_EQ(needles[3].offset, damage[0].first);
+        EXPECT_EQ(needles[5].offset, damage[0].second);
+    }
+}
+
+TEST_F(HaystackTest, StatsFollowWritesAndDeletes)
+{
+    EXPECT_EQ(0u, VolumeStats::Bucket(0));
+    EXPECT_EQ(0u, VolumeStats::Bucket(1023));
+    EXPECT_EQ(1u, VolumeStats::Bucket(1024));
+    EXPECT_EQ(VolumeStats::kSizeBuckets - 1, VolumeStats::Bucket(1ull << 40));
+
+    uint64_t liveBytes = 0;
+    {
+        Haystack hs(0, PREFIX, totalSize+1);
+        EXPECT_EQ(0u, hs.Stats().liveNeedles);
+        EXPECT_EQ(0, hs.Stats().lastWrite);
+        for (int i = 0; i < 4; ++i) {
+            auto &bytes = fileData[i];
+            hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+            liveBytes += NeedleDiskSize(bytes.size());
+        }
+        hs.Delete(needles[1]);
+        hs.Delete(needles[1]);
+        liveBytes -= NeedleDiskSize(needles[1].flags.size);
+
+        auto stats = hs.Stats();
+        EXPECT_EQ(3u, stats.liveNeedles);
+        EXPECT_EQ(1u, stats.deletedNeedles);
+        EXPECT_EQ(liveBytes, stats.liveBytes);
+        EXPECT_EQ(NeedleDiskSize(needles[1].flags.size), stats.garbageBytes);
+        EXPECT_EQ(3u, stats.sizeHistogram[0] + stats.sizeHistogram[1]);
+        EXPECT_LT(0, stats.lastWrite);
+    }
+
+    // A delete left in the journal by a crash is counted on open.
+    {
+        TombstoneJournal journal(PREFIX "/haystack_0.tomb", true);
+        journal.Append(
+            {{needles[2].offset, needles[2].flags.id,
+              NeedleHeader::kDeletedFlag}});
+    }
+    Haystack hs(0, PREFIX, totalSize+1, true);
+    auto stats = hs.Stats();
+    EXPECT_EQ(2u, stats.liveNeedles);
+    EXPECT_EQ(2u, stats.deletedNeedles);
+    EXPECT_EQ(liveBytes - NeedleDiskSize(needles[2].flags.size),
+              stats.liveBytes);
+    EXPECT_EQ(hs.Size(), stats.liveBytes + stats.garbageBytes);
+    EXPECT_LT(0, stats.lastWrite);
+}
+
 TEST_F(HaystackTest, DeleteMarksNeedlesAsDeletedCorrectly)
 {
     // Create a needle in the file and then close the file.
@@ -188,4 +307,443 @@ TEST_F(HaystackTest, DeleteMarksNeedlesAsDeletedCorrectly)
     }
 }
 
+TEST_F(HaystackTest, DeletesAreJournaledAndFoldedLater)
+{
+    Haystack hs(0, PREFIX, totalSize+1);
+    for (int i = 0; i < 4; ++i) {
+        auto &bytes = fileData[i];
+        hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+    }
+
+    // The deletes go to the journal, and the headers are not touched yet.
+    std::vector<Needle> deleted{needles[1], needles[2]};
+    hs.DeleteGroup(deleted);
+    EXPECT_TRUE(deleted[0].flags.isDeleted and deleted[1].flags.isDeleted);
+    EXPECT_EQ(2u, hs.TombstoneCount());
+    EXPECT_EQ(2u * TombstoneJournal::kRecordSize,
+              boost::filesystem::file_size(PREFIX "/haystack_0.tomb"));
+    EXPECT_THROW(hs.Read(needles[1], buff), HaystackErr);
+    auto results = hs.Needles();
+    EXPECT_FALSE(results[0].flags.isDeleted);
+    EXPECT_TRUE(results[1].flags.isDeleted and results[2].flags.isDeleted);
+
+    hs.FoldTombstones();
+    EXPECT_EQ(0u, hs.TombstoneCount());
+    EXPECT_EQ(0u, boost::filesystem::file_size(PREFIX "/haystack_0.tomb"));
+    EXPECT_TRUE(results == hs.Needles());
+    hs.Read(needles[3], buff);
+}
+
+TEST_F(HaystackTest, JournaledDeletesAreFoldedOnOpen)
+{
+    {
+        Haystack hs(0, PREFIX, totalSize+1);
+        for (int i = 0; i < 3; ++i) {
+            auto &bytes = fileData[i];
+            hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+        }
+    }
+
+    // A journal left behind by a crash, with one delete, and one that does
+    // not match the needle at its offset.
+    {
+        TombstoneJournal journal(PREFIX "/haystack_0.tomb", true);
+        journal.Append(
+            {{needles[1].offset, needles[1].flags.id,
+              NeedleHeader::kDeletedFlag},
+             {needles[2].offset, needles[0].flags.id,
+              NeedleHeader::kDeletedFlag}});
+    }
+
+    Haystack hs(0, PREFIX, totalSize+1, true);
+    EXPECT_EQ(0u, hs.TombstoneCount());
+    EXPECT_EQ(0u, boost::filesystem::file_size(PREFIX "/haystack_0.tomb"));
+    auto results = hs.Needles();
+    ASSERT_EQ(3u, results.size());
+    EXPECT_FALSE(results[0].flags.isDeleted);
+    EXPECT_TRUE(results[1].flags.isDeleted);
+    EXPECT_FALSE(results[2].flags.isDeleted);
+}
+
+TEST_F(HaystackTest, ReadDetectsCorruptNeedles)
+{
+    auto &needle = needles[1];
+    auto &bytes = fileData[1];
+    {
+        Haystack hs(0, PREFIX, totalSize+1);
+        for (int i = 0; i < 3; ++i) {
+            auto &bytes = fileData[i];
+            hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+        }
+    }
+
+    // Flip a byte in the middle of the second blob.
+    {
+        std::fstream file(PREFIX "/haystack_0",
+            std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(needle.offset + NeedleHeader::kSize + bytes.size()/2);
+        file.put(~bytes[bytes.size()/2]);
+    }
+
+    Haystack hs(0, PREFIX, totalSize+1, true);
+    EXPECT_TRUE(hs.Verify(needles[0]));
+    EXPECT_FALSE(hs.Verify(needle));
+    EXPECT_TRUE(hs.Verify(needles[2]));
+
+    try {
+        hs.Read(needle, buff);
+        FAIL() << "Read did not detect corrupt needle";
+    }
+    catch (HaystackErr &err) {
+        EXPECT_EQ(HsErr::BadChecksum, err.reason());
+    }
+
+    // Skipping verification returns the bytes as they are on disk.
+    hs.Read(needle, buff, false);
+    EXPECT_NE(bytes[bytes.size()/2], buff[bytes.size()/2]);
+}
+
+TEST_F(HaystackTest, ReopenTrimsOnlyTrailingZeros)
+{
+    {
+        Haystack hs(0, PREFIX, 2*totalSize);
+        for (int i = 0; i < 5; ++i) {
+            auto &bytes = fileData[i];
+            hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+        }
+    }
+    const auto size = needles[5].offset;
+    {
+        std::ofstream file(PREFIX "/haystack_0",
+            std::ios::binary | std::ios::app);
+        file << std::string(4096, '\0');
+    }
+    {
+        Haystack hs(0, PREFIX, 2*totalSize, true);
+        EXPECT_EQ(size, hs.Size());
+        EXPECT_FALSE(hs.IsReadOnly());
+    }
+    EXPECT_EQ(size, boost::filesystem::file_size(PREFIX "/haystack_0"));
+
+    // The remains of a torn write are kept.
+    {
+        std::ofstream file(PREFIX "/haystack_0",
+            std::ios::binary | std::ios::app);
+        file.write(fileData[5].data(), 100);
+    }
+    {
+        Haystack hs(0, PREFIX, 2*totalSize, true);
+        EXPECT_EQ(size + 100, hs.Size());
+        EXPECT_TRUE(hs.IsReadOnly());
+        EXPECT_EQ(5u, hs.Needles().size());
+    }
+    EXPECT_EQ(size + 100, boost::filesystem::file_size(PREFIX "/haystack_0"));
+}
+
+TEST_F(HaystackTest, ReopenKeepsTheNeedlesAfterABadHeader)
+{
+    {
+        Haystack hs(0, PREFIX, 2*totalSize);
+        for (int i = 0; i < 5; ++i) {
+            auto &bytes = fileData[i];
+            hs.Write(needles[i].flags.id, bytes.data(), bytes.size());
+        }
+    }
+    const auto size = needles[5].offset;
+    {
+        std::fstream file(PREFIX "/haystack_0",
+            std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(needles[2].offset);
+        file.write("XXXX", 4);
+    }
+
+    {
+        Haystack hs(0, PREFIX, 2*totalSize, true);
+        EXPECT_EQ(size, hs.Size());
+        EXPECT_TRUE(hs.IsReadOnly());
+        EXPECT_EQ(4u, hs.Stats().liveNeedles);
+        auto results = hs.Needles();
+        ASSERT_EQ(4u, results.size());
+        EXPECT_EQ(needles[4], results[3]);
+
+        auto &bytes = fileData[4];
+        hs.Read(needles[4], buff);
+        EXPECT_EQ(0, std::memcmp(bytes.data(), buff, bytes.size()));
+        EXPECT_THROW(
+            hs.Write(99, fileData[5].data(), fileData[5].size()),
+            HaystackErr);
+    }
+    EXPECT_EQ(size, boost::filesystem::file_size(PREFIX "/haystack_0"));
+}
+
+TEST(NeedleHeader, EncodesFieldsInLittleEndianOrder)
+{
+    NeedleFlags nf(0x0102030405060708, 0x0a0b0c0d, 0x11121314, 0x21222324);
+    nf.isDeleted = 1;
+    char buff[NeedleHeader::kSize];
+    NeedleHeader::Encode(nf, buff);
+
+    const unsigned char expected[NeedleHeader::kSize] = {
+        'H', 'S', 'N', 'D', 1, 1, 0, 0,
+        0x24, 0x23, 0x22, 0x21, 0x14, 0x13, 0x12, 0x11,
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+        0x0d, 0x0c, 0x0b, 0x0a, 0, 0, 0, 0};
+    EXPECT_TRUE(std::equal(expected, expected+NeedleHeader::kSize,
+        reinterpret_cast<unsigned char*>(buff)));
+
+    NeedleFlags result;
+    EXPECT_TRUE(NeedleHeader::Decode(buff, result));
+    EXPECT_EQ(nf, result);
+
+    buff[0] = 'X';
+    EXPECT_FALSE(NeedleHeader::Decode(buff, result));
+}
+
+TEST(NeedleHeader, EncodesTheCodecOfCompressedNeedles)
+{
+    NeedleFlags nf(1, 0x20, 0, 0);
+    nf.codec = static_cast<uint8_t>(Codec::Zstd);
+    nf.rawSize = 0x01020304;
+    char buff[NeedleHeader::kSize];
+    NeedleHeader::Encode(nf, buff);
+    EXPECT_EQ(NeedleHeader::kCompressedFlag, buff[NeedleHeader::kFlagsOffset]);
+    EXPECT_EQ(2, buff[6]);
+    EXPECT_EQ(0x04, buff[28]);
+    EXPECT_EQ(0x01, buff[31]);
+
+    NeedleFlags result;
+    EXPECT_TRUE(NeedleHeader::Decode(buff, result));
+    EXPECT_EQ(nf, result);
+    EXPECT_EQ(0x01020304u, result.DataSize());
+}
+
+TEST_F(HaystackTest, CompressedNeedlesReadBackTheirContents)
+{
+    for (auto codec : {Codec::Lz4, Codec::Zstd}) {
+        if (not IsCodecAvailable(codec))
+            continue;
+        SCOPED_TRACE(CodecName(codec));
+        std::string text;
+        while (text.size() < 900)
+            text += "the quick brown fox jumps over the lazy dog ";
+        Needle needle;
+        {
+            Haystack hs(0, PREFIX, 1 << 20);
+
+            // Random bytes do not compress, and are stored as they are.
+            auto &bytes = fileData[0];
+            auto plain = hs.Write(0, bytes.data(), bytes.size(), 0, codec);
+            EXPECT_EQ(0, plain.flags.codec);
+            needle = hs.Write(1, &text[0], text.size(), 7, codec);
+            EXPECT_EQ(static_cast<uint8_t>(codec), needle.flags.codec);
+            EXPECT_EQ(text.size(), needle.flags.DataSize());
+            EXPECT_LT(needle.flags.size, text.size() / 2);
+            EXPECT_TRUE(hs.Verify(needle));
+
+            hs.Read(needle, buff);
+            EXPECT_EQ(text, std::string(buff, text.size()));
+            hs.ReadRange(needle, ByteRange{4, 5}, buff);
+            EXPECT_EQ("quick", std::string(buff, 5));
+            std::vector<char> stored(needle.flags.size);
+            hs.ReadStored(needle, stored.data());
+            EXPECT_EQ(
+                needle.flags.checksum, Crc32c(stored.data(), stored.size()));
+        }
+
+        // The needles are found as they were written after reopening.
+        Haystack hs(0, PREFIX, 1 << 20, true);
+        auto needles = hs.Needles();
+        ASSERT_EQ(2u, needles.size());
+        EXPECT_EQ(needle.flags, needles[1].flags);
+        hs.Read(needles[1], buff);
+        EXPECT_EQ(text, std::string(buff, text.size()));
+    }
+}
+
+TEST_F(HaystackTest, WriteGroupAppendsAllTheNeedlesOrNone)
+{
+    std::vector<NeedleWrite> writes;
+    uint64_t groupSize = 0;
+    for (int i = 0; i < 5; ++i) {
+        auto &bytes = fileData[i];
+        writes.push_back({needles[i].flags.id, bytes.data(), bytes.size(),
+                          static_cast<uint32_t>(i + 1)});
+        groupSize += NeedleDiskSize(bytes.size());
+    }
+
+    {
+        Haystack hs(0, PREFIX, groupSize + 1);
+        auto written = hs.WriteGroup(writes);
+        ASSERT_EQ(writes.size(), written.size());
+        for (int i = 0; i < 5; ++i) {
+            EXPECT_EQ(needles[i].offset, written[i].offset);
+            EXPECT_EQ(static_cast<uint32_t>(i + 1), written[i].flags.cookie);
+            hs.Read(written[i], buff);
+            EXPECT_TRUE(std::equal(fileData[i].begin(), fileData[i].end(),
+                                   buff));
+        }
+        EXPECT_EQ(1u, hs.FreeCount());
+
+        // A group that does not fit is not written at all.
+        try {
+            hs.WriteGroup({writes[0]});
+            FAIL() << "WriteGroup did not check the size";
+        }
+        catch (HaystackErr &err) {
+            EXPECT_EQ(HsErr::NoFit, err.reason());
+        }
+        EXPECT_EQ(1u, hs.FreeCount());
+    }
+
+    Haystack hs(0, PREFIX, groupSize + 1, true);
+    EXPECT_EQ(5u, hs.Needles().size());
+}
+
+TEST_F(HaystackTest, ReadChecksTheCookie)
+{
+    auto &bytes = fileData[0];
+    Haystack hs(0, PREFIX, totalSize+1);
+    auto needle = hs.Write(0, bytes.data(), bytes.size(), 0x9f3a2b1c);
+    EXPECT_EQ(0x9f3a2b1cu, needle.flags.cookie);
+    hs.Read(needle, buff);
+    EXPECT_TRUE(std::equal(bytes.begin(), bytes.end(), buff));
+
+    needle.flags.cookie = 0;
+    try {
+        hs.Read(needle, buff);
+        FAIL() << "Read did not check the cookie";
+    }
+    catch (HaystackErr &err) {
+        EXPECT_EQ(HsErr::BadNeedle, err.reason());
+    }
+}
+
+TEST_F(HaystackTest, ReadRangeReadsPartOfANeedle)
+{
+    auto &bytes = fileData[0];
+    Haystack hs(0, PREFIX, totalSize+1);
+    auto needle = hs.Write(0, bytes.data(), bytes.size());
+
+    hs.ReadRange(needle, ByteRange{10, 20}, buff);
+    EXPECT_TRUE(std::equal(bytes.begin()+10, bytes.begin()+30, buff));
+    hs.ReadRange(needle, ByteRange{bytes.size(), 0}, buff);
+
+    try {
+        hs.ReadRange(needle, ByteRange{bytes.size()-1, 2}, buff);
+        FAIL() << "ReadRange did not check the range";
+    }
+    catch (HaystackErr &err) {
+        EXPECT_EQ(HsErr::BadRange, err.reason());
+    }
+}
+
+TEST_F(HaystackTest, ReadRangeSeesJournaledDeletes)
+{
+    auto &bytes = fileData[0];
+    Haystack hs(0, PREFIX, totalSize+1);
+    auto needle = hs.Write(0, bytes.data(), bytes.size());
+
+    // The copy of the needle, e.g., in an index, is not marked as deleted,
+    // and the delete is not in its header yet.
+    std::vector<Needle> deleted{needle};
+    hs.DeleteGroup(deleted);
+    ASSERT_EQ(1u, hs.TombstoneCount());
+    try {
+        hs.ReadRange(needle, ByteRange{10, 20}, buff);
+        FAIL() << "ReadRange read a deleted needle";
+    }
+    catch (HaystackErr &err) {
+        EXPECT_EQ(HsErr::BadNeedle, err.reason());
+    }
+}
+
+TEST(ByteRange, ReadsAndClampsRanges)
+{
+    ByteRange range;
+    std::istringstream withRange("10 20 trace=1f");
+    ASSERT_TRUE(ByteRange::Read(withRange, range));
+    EXPECT_EQ(10u, range.offset);
+    EXPECT_EQ(20u, range.length);
+    std::string token;
+    withRange >> token;
+    EXPECT_EQ("trace=1f", token);
+
+    std::istringstream withoutRange("trace=1f");
+    EXPECT_FALSE(ByteRange::Read(withoutRange, range));
+    withoutRange >> token;
+    EXPECT_EQ("trace=1f", token);
+
+    EXPECT_TRUE(range.Clamp(25));
+    EXPECT_EQ(15u, range.length);
+    EXPECT_TRUE(range.Clamp(10));
+    EXPECT_EQ(0u, range.length);
+    EXPECT_FALSE(range.Clamp(9));
+}
+
+TEST(NeedleHandle, ParsesAndFormatsHandles)
+{
+    NeedleHandle handle;
+    ASSERT_TRUE(NeedleHandle::Parse("3,1024,9f3a2b1c", handle));
+    EXPECT_EQ(3u, handle.volumeId);
+    EXPECT_EQ(1024u, handle.needleId);
+    EXPECT_EQ(0x9f3a2b1cu, handle.cookie);
+    EXPECT_EQ("3,1024,9f3a2b1c", handle.ToString());
+    EXPECT_EQ("0,7,0", (NeedleHandle{0, 7, 0}).ToString());
+
+    for (auto bad : {"", "1024", "3,1024", "3,1024,", ",1024,1",
+                     "3,1024,1,2", "3,x,1", "3,1024,9F", "3,1024,100000000",
+                     "18446744073709551616,1,1"})
+        EXPECT_FALSE(NeedleHandle::Parse(bad, handle)) << bad;
+}
+
+TEST(NeedleHeader, NeedlesAreAligned)
+{
+    EXPECT_EQ(NeedleHeader::kSize, NeedleDiskSize(0));
+    EXPECT_EQ(NeedleHeader::kSize+8, NeedleDiskSize(1));
+    EXPECT_EQ(NeedleHeader::kSize+8, NeedleDiskSize(8));
+    EXPECT_EQ(NeedleHeader::kSize+16, NeedleDiskSize(9));
+}
+
+TEST_F(HaystackTest, LegacyFilesCanBeReadAndDeletedFrom)
+{
+    // Write the file in the legacy format: a raw 24 byte header with the ID,
+    // the size, and the deleted flag, followed by the blob.
+    std::vector<Needle> legacy;
+    {
+        std::ofstream file(PREFIX "/haystack_0",
+            std::ios::out | std::ios::trunc | std::ios::binary);
+        uint64_t offset = 0;
+        for (int i = 0; i < 3; ++i) {
+            auto &bytes = fileData[i];
+            char header[NeedleHeader::kLegacySize] = {};
+            uint64_t needleId = i, size = bytes.size();
+            std::memcpy(header, &needleId, sizeof(needleId));
+            std::memcpy(header+8, &size, sizeof(size));
+            file.write(header, sizeof(header));
+            file.write(bytes.data(), bytes.size());
+            legacy.emplace_back(0, offset, needleId, size);
+            offset += sizeof(header) + size;
+        }
+    }
+
+    Haystack hs(0, PREFIX, totalSize+1, true);
+    EXPECT_EQ(0u, hs.Version());
+    EXPECT_TRUE(hs.IsReadOnly());
+    EXPECT_TRUE(legacy == hs.Needles());
+
+    for (int i : {2, 0, 1}) {
+        auto &bytes = fileData[i];
+        hs.Read(legacy[i], buff);
+        EXPECT_TRUE(std::equal(bytes.begin(), bytes.end(), buff));
+        EXPECT_TRUE(hs.Verify(legacy[i]));
+    }
+
+    auto &bytes = fileData[0];
+    EXPECT_THROW(hs.Write(5, bytes.data(), bytes.size()), HaystackErr);
+
+    hs.Delete(legacy[1]);
+    EXPECT_THROW(hs.Read(legacy[1], buff), HaystackErr);
+    EXPECT_TRUE(legacy == hs.Needles());
+}
+
 } // namespace
@@ -0,0 +1,70 @@
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "histogram.hh"
+
+namespace {
+
+TEST(Histogram, SmallValuesAreExact)
+{
+    Histogram hist;
+    for (uint64_t v = 0; v < Histogram::kSubBuckets; ++v)
+        hist.Record(v);
+    EXPECT_EQ(Histogram::kSubBuckets, hist.Count());
+    EXPECT_EQ(0u, hist.Min());
+    EXPECT_EQ(Histogram::kSubBuckets - 1, hist.Max());
+    EXPECT_EQ(63u, hist.Percentile(50));
+    EXPECT_EQ(Histogram::kSubBuckets - 1, hist.Percentile(100));
+}
+
+TEST(Histogram, PercentilesAreWithinThePrecision)
+{
+    Histogram hist;
+    for (uint64_t v = 1; v <= 1000000; ++v)
+        hist.Record(v * 1000);
+
+    for (double p : {50.0, 90.0, 99.0, 99.9}) {
+        double expected = p * 10000000;
+        double actual = hist.Percentile(p);
+        EXPECT_NEAR(expected, actual, expected / Histogram::kSubBuckets)
+            << "p" << p;
+    }
+    EXPECT_EQ(1000000000u, hist.Percentile(100));
+    EXPECT_DOUBLE_EQ(500000500.0, hist.Mean());
+}
+
+TEST(Histogram, MergeAddsTheCounts)
+{
+    Histogram a, b;
+    a.Record(10, 3);
+    b.Record(1u << 30);
+    a.Merge(b);
+    EXPECT_EQ(4u, a.Count());
+    EXPECT_EQ(10u, a.Min());
+    EXPECT_EQ(1u << 30, a.Max());
+    EXPECT_EQ(10u, a.Percentile(75));
+    EXPECT_EQ(1u << 30, a.Percentile(76));
+
+    a.Reset();
+    EXPECT_EQ(0u, a.Count());
+    EXPECT_EQ(0u, a.Percentile(50));
+}
+
+TEST(Histogram, PrintsAnHdrPercentileDistribution)
+{
+    Histogram hist;
+    for (uint64_t v = 1; v <= 1000; ++v)
+        hist.Record(v);
+    std::ostringstream oss;
+    hist.PrintPercentiles(oss);
+
+    auto text = oss.str();
+    EXPECT_EQ(0u, text.find("       Value     Percentile TotalCount"));
+    EXPECT_NE(std::string::npos, text.find("1000.000 1.000000000000"));
+    EXPECT_NE(std::string::npos, text.find("#[Total count    = 1000]"));
+}
+
+} // namespace
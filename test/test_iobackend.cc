@@ -0,0 +1,161 @@
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "haystack.hh"
+#include "iobackend.hh"
+#include "needle.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+// Runs every test with each of the backends.
+struct IoBackendTest : public ::testing::TestWithParam<std::string>
+{
+    std::shared_ptr<IoBackend> io;
+    std::string fname = PREFIX "/iobackend";
+
+    virtual void
+    SetUp() override
+    {
+        boost::filesystem::create_directories(PREFIX);
+        io = MakeIoBackend(GetParam());
+    }
+
+    std::vector<char>
+    Bytes(size_t size, char first)
+    {
+        std::vector<char> bytes(size);
+        for (auto &c : bytes)
+            c = first++;
+        return bytes;
+    }
+};
+
+TEST_P(IoBackendTest, UnalignedWritesPreserveTheBytesAroundThem)
+{
+    auto file = io->Open(fname, true);
+    auto a = Bytes(5000, 1);
+    auto b = Bytes(3, 7);
+    auto c = Bytes(100, 11);
+
+    file->Write(a.data(), a.size(), 0);
+    iovec iov[] = {{b.data(), b.size()}, {c.data(), c.size()}};
+    file->Write(iov, 2, 4097);
+
+    std::vector<char> expected(a);
+    std::copy(b.begin(), b.end(), expected.begin()+4097);
+    std::copy(c.begin(), c.end(), expected.begin()+4100);
+
+    std::vector<char> result(expected.size());
+    file->Read(result.data(), result.size(), 0);
+    EXPECT_EQ(expected, result);
+
+    // Scattered reads at unaligned offsets.
+    std::vector<char> head(10), tail(4000);
+    iovec riov[] = {{head.data(), head.size()}, {tail.data(), tail.size()}};
+    file->Read(riov, 2, 33);
+    EXPECT_TRUE(std::equal(head.begin(), head.end(), expected.begin()+33));
+    EXPECT_TRUE(std::equal(tail.begin(), tail.end(), expected.begin()+43));
+}
+
+TEST_P(IoBackendTest, ReadsPastTheEndOfTheFileAreZeros)
+{
+    auto file = io->Open(fname, true);
+    auto a = Bytes(10, 1);
+    file->Write(a.data(), a.size(), 0);
+    file->Truncate(a.size());
+
+    std::vector<char> result(20, 'x');
+    file->Read(result.data(), result.size(), 0);
+    EXPECT_TRUE(std::equal(a.begin(), a.end(), result.begin()));
+    EXPECT_EQ(std::vector<char>(10, 0),
+              std::vector<char>(result.begin()+10, result.end()));
+}
+
+TEST_P(IoBackendTest, ConcurrentReadsSeeTheSameData)
+{
+    auto file = io->Open(fname, true);
+    auto a = Bytes(1 << 16, 3);
+    file->Write(a.data(), a.size(), 0);
+
+    std::vector<std::thread> threads;
+    std::vector<int> mismatches(8);
+    for (size_t t = 0; t < mismatches.size(); ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<char> result(777);
+            for (size_t off = t; off + result.size() < a.size(); off += 4999) {
+                file->Read(result.data(), result.size(), off);
+                if (not std::equal(result.begin(), result.end(), a.begin()+off))
+                    ++mismatches[t];
+            }
+        });
+    }
+    for (auto &thr : threads)
+        thr.join();
+    EXPECT_EQ(std::vector<int>(mismatches.size(), 0), mismatches);
+}
+
+TEST_P(IoBackendTest, ConcurrentWritesCanShareABlock)
+{
+    // Every thread writes slices that share their edge blocks with the
+    // slices of the other threads.
+    constexpr size_t kThreads = 8;
+    constexpr size_t kSlice = 1000;
+    constexpr size_t kRounds = 50;
+    auto file = io->Open(fname, true);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&, t] {
+            std::vector<char> slice(kSlice, static_cast<char>('a' + t));
+            for (size_t r = 0; r < kRounds; ++r) {
+                auto offset = (r * kThreads + t) * kSlice;
+                file->Write(slice.data(), slice.size(), offset);
+            }
+        });
+    }
+    for (auto &thr : threads)
+        thr.join();
+
+    std::vector<char> expected, result(kThreads * kRounds * kSlice);
+    for (size_t r = 0; r < kRounds; ++r) {
+        for (size_t t = 0; t < kThreads; ++t)
+            expected.insert(expected.end(), kSlice, static_cast<char>('a' + t));
+    }
+    file->Read(result.data(), result.size(), 0);
+    EXPECT_TRUE(expected == result);
+}
+
+TEST_P(IoBackendTest, HaystacksCanBeReopened)
+{
+    auto bytes = Bytes(1234, 5);
+    Needle needle;
+    {
+        Haystack hs(0, PREFIX, 1 << 20, false, io);
+        hs.Write(0, bytes.data(), 10);
+        needle = hs.Write(1, bytes.data(), bytes.size());
+    }
+
+    Haystack hs(0, PREFIX, 1 << 20, true, io);
+    EXPECT_EQ(NeedleDiskSize(10) + NeedleDiskSize(bytes.size()), hs.Size());
+    std::vector<char> result(bytes.size());
+    hs.Read(needle, result.data());
+    EXPECT_EQ(bytes, result);
+    EXPECT_EQ(2u, hs.Needles().size());
+}
+
+INSTANTIATE_TEST_CASE_P(
+    Backends, IoBackendTest, ::testing::Values("fstream", "uring"));
+
+} // namespace
@@ -0,0 +1,72 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "ioqueue.hh"
+
+namespace {
+
+TEST(IoQueue, RunReturnsTheResultOfTheRequest)
+{
+    IoQueue queue("test", 2, 4);
+    EXPECT_EQ(42, queue.Run([] { return 42; }));
+    EXPECT_EQ(2u, queue.Workers());
+    EXPECT_EQ(1u, queue.GetStats().completed);
+}
+
+TEST(IoQueue, RunRethrowsExceptions)
+{
+    IoQueue queue("test", 1, 4);
+    EXPECT_THROW(
+        queue.Run([]() -> int { throw std::runtime_error("disk"); }),
+        std::runtime_error);
+    EXPECT_EQ(3, queue.Run([] { return 3; }));
+}
+
+TEST(IoQueue, DepthIsBoundedByTheWorkersAndTheCapacity)
+{
+    constexpr unsigned kWorkers = 2;
+    constexpr size_t kCapacity = 3;
+    constexpr int kRequests = 20;
+    IoQueue queue("test", kWorkers, kCapacity);
+
+    // Block the workers until every caller has had a chance to queue up.
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool isReleased = false;
+    std::atomic<int> sum(0);
+    std::vector<std::thread> callers;
+    for (int i = 0; i < kRequests; ++i) {
+        callers.emplace_back([&, i] {
+            sum += queue.Run([&, i] {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait(lk, [&] { return isReleased; });
+                return i;
+            });
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(kWorkers + kCapacity, queue.GetStats().depth);
+    {
+        std::lock_guard<std::mutex> lk(mtx);
+        isReleased = true;
+    }
+    cv.notify_all();
+    for (auto &thr : callers)
+        thr.join();
+
+    auto stats = queue.GetStats();
+    EXPECT_EQ(0u, stats.depth);
+    EXPECT_EQ(kWorkers + kCapacity, stats.maxDepth);
+    EXPECT_EQ(static_cast<uint64_t>(kRequests), stats.completed);
+    EXPECT_EQ(kRequests * (kRequests - 1) / 2, sum);
+}
+
+} // namespace
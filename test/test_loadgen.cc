@@ -0,0 +1,78 @@
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "loadgen.hh"
+#include "store.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+TEST(LoadGen, SizeDistributionsStayWithinTheirBounds)
+{
+    std::mt19937_64 rng;
+    SizeDistribution fixed("fixed:4K");
+    SizeDistribution uniform("uniform:100:200");
+    SizeDistribution lognormal("lognormal:64K:2");
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(4096u, fixed(rng));
+        auto size = uniform(rng);
+        EXPECT_TRUE(size >= 100 and size <= 200) << size;
+        size = lognormal(rng);
+        EXPECT_TRUE(size >= 1 and size <= SizeDistribution::kMaxSize) << size;
+    }
+    EXPECT_THROW(SizeDistribution("normal:1:2"), std::invalid_argument);
+    EXPECT_THROW(SizeDistribution("uniform:2:1"), std::invalid_argument);
+}
+
+TEST(LoadGen, ZipfFavorsTheFirstRanks)
+{
+    std::mt19937_64 rng;
+    ZipfDistribution zipf(1000, 0.99);
+    std::vector<int> hits(1000);
+    for (int i = 0; i < 100000; ++i)
+        ++hits.at(zipf(rng));
+    EXPECT_GT(hits[0], 10 * hits[99]);
+    EXPECT_GT(hits[0], hits[1]);
+}
+
+TEST(LoadGen, DrivesAStore)
+{
+    unsigned port = 5030;
+    boost::filesystem::remove_all(PREFIX "/loadgen");
+    Store store("127.0.0.1", port, PREFIX "/loadgen");
+    std::thread thr(&Store::Run, &store);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+    LoadGenConfig config;
+    config.storeIpAddr = "127.0.0.1";
+    config.storePort = std::to_string(port);
+    config.threads = 2;
+    config.duration = std::chrono::milliseconds(200);
+    config.sizes = "uniform:1K:8K";
+    config.readPct = 70;
+    config.writePct = 20;
+    config.deletePct = 10;
+    config.preload = 50;
+
+    LoadGen loadGen(config);
+    loadGen.Preload();
+    auto report = loadGen.Run();
+    for (int op = 0; op < LoadGen::kOps; ++op) {
+        EXPECT_GT(report.latency[op].Count(), 0u) << op;
+        EXPECT_EQ(0u, report.errors[op]) << op;
+    }
+
+    store.Stop();
+    thr.join();
+}
+
+} // namespace
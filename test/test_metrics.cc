@@ -0,0 +1,131 @@
+#include <chrono>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "metrics.hh"
+#include "store.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+std::string
+HttpGet(const std::string &port, const std::string &path)
+{
+    boost::asio::ip::tcp::iostream conn("127.0.0.1", port);
+    conn << "GET " << path << " HTTP/1.0\r\n\r\n";
+    conn.flush();
+    std::ostringstream oss;
+    oss << conn.rdbuf();
+    return oss.str();
+}
+
+TEST(Metrics, CountersAddUpAcrossThreads)
+{
+    Counter counter;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&] {
+            for (int i = 0; i < 10000; ++i)
+                counter.Inc();
+        });
+    }
+    for (auto &thr : threads)
+        thr.join();
+    EXPECT_EQ(80000u, counter.Value());
+}
+
+TEST(Metrics, HistogramBucketsAreCumulative)
+{
+    LatencyHistogram hist;
+    hist.Observe(std::chrono::microseconds(5));
+    hist.Observe(std::chrono::microseconds(10));
+    hist.Observe(std::chrono::microseconds(15));
+    hist.Observe(std::chrono::seconds(100));
+
+    auto snapshot = hist.Collect();
+    EXPECT_DOUBLE_EQ(10e-6, LatencyHistogram::UpperBound(0));
+    EXPECT_DOUBLE_EQ(20e-6, LatencyHistogram::UpperBound(1));
+    EXPECT_EQ(2u, snapshot.cumulative[0]);
+    EXPECT_EQ(3u, snapshot.cumulative[1]);
+    EXPECT_EQ(3u, snapshot.cumulative[LatencyHistogram::kBuckets - 1]);
+    EXPECT_EQ(4u, snapshot.cumulative[LatencyHistogram::kBuckets]);
+    EXPECT_EQ(4u, snapshot.count);
+    EXPECT_NEAR(100.00003, snapshot.sum, 1e-9);
+}
+
+TEST(Metrics, RegistryRendersTheExpositionFormat)
+{
+    MetricsRegistry registry;
+    auto &counter = registry.AddCounter("requests_total", "Requests.",
+                                        {{"command", "get"}});
+    counter.Inc(3);
+    EXPECT_EQ(&counter, &registry.AddCounter(
+        "requests_total", "Requests.", {{"command", "get"}}));
+    registry.AddHistogram("latency_seconds", "Latency.")
+        .Observe(std::chrono::microseconds(1));
+    registry.AddGauge("fill_ratio", "Fill.", [] {
+        return std::vector<MetricsRegistry::GaugeSample>{
+            {{{"volume", "0"}}, 0.5}};
+    });
+    EXPECT_THROW(registry.AddHistogram("requests_total", "Requests."),
+                 std::invalid_argument);
+
+    std::ostringstream oss;
+    registry.Render(oss);
+    auto text = oss.str();
+    EXPECT_NE(std::string::npos, text.find(
+        "# TYPE requests_total counter\nrequests_total{command=\"get\"} 3\n"));
+    EXPECT_NE(std::string::npos, text.find(
+        "latency_seconds_bucket{le=\"1e-05\"} 1\n"));
+    EXPECT_NE(std::string::npos, text.find(
+        "latency_seconds_bucket{le=\"+Inf\"} 1\n"));
+    EXPECT_NE(std::string::npos, text.find("latency_seconds_count 1\n"));
+    EXPECT_NE(std::string::npos, text.find(
+        "# TYPE fill_ratio gauge\nfill_ratio{volume=\"0\"} 0.5\n"));
+}
+
+TEST(Metrics, StoreServesItsMetricsOverHttp)
+{
+    std::string ipAddr = "127.0.0.1";
+    unsigned port = 5050, metricsPort = 5051;
+    boost::filesystem::remove_all(PREFIX "/metrics");
+    Store store(ipAddr, port, PREFIX "/metrics");
+    store.ServeMetrics(metricsPort);
+    std::thread thr(&Store::Run, &store);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    for (auto request : {"put 0 1 3\nabc", "get 1\n", "get 2\n"}) {
+        boost::asio::ip::tcp::iostream conn(ipAddr, std::to_string(port));
+        conn << request;
+        conn.flush();
+        std::string reply;
+        std::getline(conn, reply);
+    }
+
+    auto response = HttpGet(std::to_string(metricsPort), "/metrics");
+    EXPECT_EQ(0u, response.find("HTTP/1.0 200 OK\r\n"));
+    EXPECT_NE(std::string::npos, response.find(
+        "haystack_store_requests_total{command=\"get\",result=\"ok\"} 1\n"));
+    EXPECT_NE(std::string::npos, response.find(
+        "haystack_store_requests_total{command=\"get\",result=\"err\"} 1\n"));
+    EXPECT_NE(std::string::npos, response.find(
+        "haystack_store_request_duration_seconds_count{command=\"put\"} 1\n"));
+    EXPECT_NE(std::string::npos, response.find(
+        "haystack_store_volume_fill_ratio{volume=\"0\",mode=\"rw\"}"));
+    EXPECT_EQ(0u, HttpGet(std::to_string(metricsPort), "/other")
+                      .find("HTTP/1.0 404"));
+
+    store.Stop();
+    thr.join();
+}
+
+} // namespace
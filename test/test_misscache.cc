@@ -0,0 +1,50 @@
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "misscache.hh"
+
+namespace {
+
+TEST(MissCache, MissesExpire)
+{
+    MissCache misses(std::chrono::milliseconds(50), 16);
+    EXPECT_FALSE(misses.Contains("0,1,a"));
+    misses.Add("0,1,a");
+    misses.Add("0,2,b");
+    EXPECT_TRUE(misses.Contains("0,1,a"));
+    EXPECT_TRUE(misses.Contains("0,2,b"));
+    EXPECT_FALSE(misses.Contains("0,3,c"));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    misses.Add("0,2,b");
+    std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    EXPECT_FALSE(misses.Contains("0,1,a"));
+    EXPECT_TRUE(misses.Contains("0,2,b"));
+    EXPECT_EQ(1u, misses.Size());
+}
+
+TEST(MissCache, OldestMissesAreDroppedWhenFull)
+{
+    MissCache misses(std::chrono::seconds(10), 4);
+    for (int i = 0; i < 6; ++i)
+        misses.Add(std::to_string(i));
+    EXPECT_EQ(4u, misses.Size());
+    EXPECT_FALSE(misses.Contains("0"));
+    EXPECT_FALSE(misses.Contains("1"));
+    EXPECT_TRUE(misses.Contains("5"));
+
+    // Adding a key again does not take another entry.
+    for (int i = 0; i < 20; ++i)
+        misses.Add("5");
+    EXPECT_EQ(4u, misses.Size());
+    EXPECT_TRUE(misses.Contains("2"));
+
+    MissCache disabled(std::chrono::seconds(10), 0);
+    disabled.Add("0");
+    EXPECT_FALSE(disabled.Contains("0"));
+}
+
+} // namespace
@@ -0,0 +1,59 @@
+#include <cstdint>
+#include <sstream>
+#include <stdexcept>
+
+#include "gtest/gtest.h"
+
+#include "needlefilter.hh"
+
+namespace {
+
+TEST(NeedleFilter, AddedIdsAreAlwaysFound)
+{
+    constexpr uint64_t kNeedles = 10000;
+    NeedleFilter filter(NeedleFilter::BitsFor(kNeedles));
+    EXPECT_EQ(1u << 17, filter.Bits());
+    EXPECT_FALSE(filter.MayContain(1));
+    for (uint64_t i = 0; i < kNeedles; ++i)
+        filter.Add(i * 3);
+    for (uint64_t i = 0; i < kNeedles; ++i)
+        EXPECT_TRUE(filter.MayContain(i * 3));
+
+    // IDs that were never added are found rarely.
+    unsigned found = 0;
+    for (uint64_t i = 0; i < kNeedles; ++i)
+        found += filter.MayContain(i * 3 + 1);
+    EXPECT_LT(found, kNeedles / 50);
+}
+
+TEST(NeedleFilter, SizesAreRoundedToPowersOfTwo)
+{
+    EXPECT_EQ(NeedleFilter::kMinBits, NeedleFilter(0).Bits());
+    EXPECT_EQ(8192u, NeedleFilter(5000).Bits());
+    EXPECT_EQ(8192u, NeedleFilter(8192).Bits());
+    EXPECT_EQ(NeedleFilter::kMaxBits, NeedleFilter::BitsFor(uint64_t(1) << 40));
+}
+
+TEST(NeedleFilter, FiltersAreMergedAndSent)
+{
+    NeedleFilter first(4096), second(4096);
+    first.Add(7);
+    second.Add(1 << 20);
+    EXPECT_THROW(first.Merge(NeedleFilter(8192)), std::invalid_argument);
+    first.Merge(second);
+    EXPECT_TRUE(first.MayContain(7));
+    EXPECT_TRUE(first.MayContain(1 << 20));
+
+    std::stringstream ss;
+    first.Write(ss);
+    EXPECT_EQ(512u, ss.str().size());
+    NeedleFilter copy(4096);
+    ASSERT_TRUE(copy.Read(ss));
+    EXPECT_TRUE(copy.MayContain(7));
+    EXPECT_TRUE(copy.MayContain(1 << 20));
+
+    std::istringstream shortStream("abc");
+    EXPECT_FALSE(copy.Read(shortStream));
+}
+
+} // namespace
@@ -0,0 +1,109 @@
+#include <cstdint>
+#include <string>
+
+#include "gtest/gtest.h"
+
+#include "bufferpool.hh"
+#include "readcache.hh"
+
+namespace {
+
+// The handle of a needle in volume 0 with no cookie.
+NeedleHandle
+Handle(uint64_t needleId)
+{
+    return NeedleHandle{0, needleId, 0};
+}
+
+TEST(ReadCache, CachesSmallNeedles)
+{
+    ReadCache cache(ReadCache::kShards * 100, 50);
+    std::string small(50, 's'), large(51, 'l');
+    cache.Put(Handle(1), small.data(), small.size(), cache.Generation(1));
+    cache.Put(Handle(2), large.data(), large.size(), cache.Generation(2));
+
+    BufferPool::Buffer buf;
+    ASSERT_TRUE(cache.Get(Handle(1), buf));
+    EXPECT_EQ(small, std::string(buf.Data(), buf.Size()));
+    EXPECT_FALSE(cache.Get(Handle(2), buf));
+    EXPECT_EQ(50u, cache.Bytes());
+
+    ReadCache disabled(0, 50);
+    disabled.Put(
+        Handle(1), small.data(), small.size(), disabled.Generation(1));
+    EXPECT_FALSE(disabled.Get(Handle(1), buf));
+}
+
+TEST(ReadCache, EvictsTheLeastRecentlyUsed)
+{
+    // Each shard holds two needles of 40 bytes.
+    ReadCache cache(ReadCache::kShards * 100, 50);
+    std::string data(40, 'x');
+    const uint64_t a = 1, b = a + ReadCache::kShards, c = b + ReadCache::kShards;
+    cache.Put(Handle(a), data.data(), data.size(), cache.Generation(a));
+    cache.Put(Handle(b), data.data(), data.size(), cache.Generation(b));
+
+    BufferPool::Buffer buf;
+    ASSERT_TRUE(cache.Get(Handle(a), buf));
+    cache.Put(Handle(c), data.data(), data.size(), cache.Generation(c));
+    EXPECT_TRUE(cache.Get(Handle(a), buf));
+    EXPECT_FALSE(cache.Get(Handle(b), buf));
+    EXPECT_TRUE(cache.Get(Handle(c), buf));
+    EXPECT_EQ(80u, cache.Bytes());
+}
+
+TEST(ReadCache, RemovedNeedlesAreNotCachedAgain)
+{
+    ReadCache cache(ReadCache::kShards * 100, 50);
+    std::string data(10, 'x');
+    cache.Put(Handle(1), data.data(), data.size(), cache.Generation(1));
+    cache.Remove(1);
+
+    BufferPool::Buffer buf;
+    EXPECT_FALSE(cache.Get(Handle(1), buf));
+    EXPECT_EQ(0u, cache.Bytes());
+
+    // A read that started before the needle was removed does not cache it.
+    auto generation = cache.Generation(2);
+    cache.Remove(2);
+    cache.Put(Handle(2), data.data(), data.size(), generation);
+    EXPECT_FALSE(cache.Get(Handle(2), buf));
+}
+
+TEST(ReadCache, OnlyServesTheSameVolumeAndCookie)
+{
+    ReadCache cache(ReadCache::kShards * 100, 50);
+    std::string data(10, 'x'), other(20, 'y');
+    NeedleHandle handle{3, 1, 0xabc};
+    cache.Put(handle, data.data(), data.size(), cache.Generation(1));
+
+    BufferPool::Buffer buf;
+    EXPECT_TRUE(cache.Get(handle, buf));
+    EXPECT_FALSE(cache.Get(NeedleHandle{3, 1, 0xabd}, buf));
+    EXPECT_FALSE(cache.Get(NeedleHandle{4, 1, 0xabc}, buf));
+
+    // A needle with the same ID in another volume replaces it.
+    NeedleHandle moved{4, 1, 0xdef};
+    cache.Put(moved, other.data(), other.size(), cache.Generation(1));
+    EXPECT_FALSE(cache.Get(handle, buf));
+    ASSERT_TRUE(cache.Get(moved, buf));
+    EXPECT_EQ(other, std::string(buf.Data(), buf.Size()));
+    EXPECT_EQ(20u, cache.Bytes());
+}
+
+TEST(ReadCache, ServesRangesOfCachedNeedles)
+{
+    ReadCache cache(ReadCache::kShards * 100, 50);
+    std::string data("0123456789");
+    cache.Put(Handle(1), data.data(), data.size(), cache.Generation(1));
+
+    BufferPool::Buffer buf;
+    ASSERT_TRUE(cache.Get(Handle(1), ByteRange{2, 3}, buf));
+    EXPECT_EQ("234", std::string(buf.Data(), buf.Size()));
+    ASSERT_TRUE(cache.Get(Handle(1), ByteRange{8, 100}, buf));
+    EXPECT_EQ("89", std::string(buf.Data(), buf.Size()));
+    EXPECT_FALSE(cache.Get(Handle(1), ByteRange{11, 1}, buf));
+    EXPECT_FALSE(cache.Get(Handle(2), ByteRange{0, 1}, buf));
+}
+
+} // namespace
@@ -0,0 +1,318 @@
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "replicaset.hh"
+#include "store.hh"
+#include "storeconfig.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+TEST(ReplicaSet, ParsesStoreAddresses)
+{
+    auto stores = ParseStoreAddresses("10.0.0.1,10.0.0.2:5001", "5000");
+    ASSERT_EQ(2u, stores.size());
+    EXPECT_EQ("10.0.0.1:5000", stores[0].ToString());
+    EXPECT_EQ("10.0.0.2:5001", stores[1].ToString());
+    EXPECT_THROW(ParseStoreAddresses("", "5000"), std::invalid_argument);
+    EXPECT_THROW(ParseStoreAddresses("a,:5001", "5000"), std::invalid_argument);
+
+    EXPECT_EQ(2u, ReplicaSet(stores).Quorum());
+    EXPECT_EQ(1u, ReplicaSet(stores, 1).Quorum());
+}
+
+// Three local Store processes holding replicas of the same volumes.
+struct ReplicaSetTest : public ::testing::Test
+{
+    static constexpr unsigned kReplicas = 3;
+    static constexpr unsigned kFirstPort = 5100;
+    std::string ipAddr{"127.0.0.1"};
+    std::vector<std::unique_ptr<Store>> stores;
+    std::vector<std::thread> threads;
+    std::vector<StoreAddress> addresses;
+
+    virtual void
+    SetUp() override
+    {
+        stores.resize(kReplicas);
+        threads.resize(kReplicas);
+        for (unsigned i = 0; i < kReplicas; ++i) {
+            boost::filesystem::remove_all(Dir(i));
+            StartStore(i);
+            addresses.push_back({ipAddr, std::to_string(kFirstPort + i)});
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    virtual void
+    TearDown() override
+    {
+        for (unsigned i = 0; i < kReplicas; ++i)
+            StopStore(i);
+    }
+
+    static std::string
+    Dir(unsigned i)
+    {
+        return PREFIX "/replica" + std::to_string(i);
+    }
+
+    // Starts a replica, or restarts it with the volumes it had.
+    void
+    StartStore(unsigned i)
+    {
+        auto config = StoreConfig::Default(Dir(i));
+        config.writableVolumes = 2;
+        stores[i].reset(new Store(ipAddr, kFirstPort + i, config));
+        threads[i] = std::thread(&Store::Run, stores[i].get());
+    }
+
+    void
+    StopStore(unsigned i)
+    {
+        if (not threads[i].joinable())
+            return;
+        stores[i]->Stop();
+        threads[i].join();
+    }
+
+    // Sends a request about a needle to one of the replicas.
+    std::string
+    Ask(const StoreAddress &store, const std::string &command,
+        const NeedleHandle &handle)
+    {
+        boost::asio::ip::tcp::iostream conn(store.ipAddr, store.port);
+        conn << command << ' ' << handle.ToString() << '\n';
+        std::string line;
+        std::getline(conn, line);
+        return line;
+    }
+
+    // Reads a needle from one of the replicas.
+    std::string
+    Get(const StoreAddress &store, const NeedleHandle &handle)
+    {
+        return Ask(store, "get", handle);
+    }
+};
+
+TEST_F(ReplicaSetTest, WritesReachAQuorum)
+{
+    ReplicaSet replicas(addresses);
+    auto volumes = replicas.WritableVolumes();
+    ASSERT_EQ(2u, volumes.size());
+
+    std::vector<StoreAddress> acked;
+    NeedleHandle first{volumes[0], 1, 0x1234};
+    EXPECT_EQ("ok", replicas.Put(first, "abc", 3, 0, acked));
+    EXPECT_LE(replicas.Quorum(), acked.size());
+    EXPECT_EQ(
+        "err BadHaystackId",
+        replicas.Put(NeedleHandle{99, 2, 1}, "abc", 3, 0, acked));
+    EXPECT_TRUE(acked.empty());
+
+    // The writes to the slowest replicas complete in the background.
+    replicas.Wait();
+    for (auto &store : addresses)
+        EXPECT_EQ("ok 3", Get(store, first));
+
+    // One replica down still leaves a quorum.
+    StopStore(2);
+    EXPECT_EQ(volumes, replicas.WritableVolumes());
+    NeedleHandle second{volumes[1], 3, 0x5678};
+    EXPECT_EQ("ok", replicas.Put(second, "xyz", 3, 0, acked));
+    ASSERT_EQ(2u, acked.size());
+    EXPECT_EQ(addresses[0].ToString(), acked[0].ToString());
+    EXPECT_EQ(addresses[1].ToString(), acked[1].ToString());
+    EXPECT_EQ("ok", replicas.Delete(first, 0));
+    EXPECT_EQ("err BadNeedle", replicas.Delete(NeedleHandle{0, 4, 1}, 0));
+
+    // Two replicas down do not.
+    StopStore(1);
+    EXPECT_EQ(
+        "err NoQuorum",
+        replicas.Put(NeedleHandle{volumes[1], 5, 1}, "xyz", 3, 0, acked));
+    EXPECT_THROW(replicas.WritableVolumes(), std::runtime_error);
+}
+
+TEST_F(ReplicaSetTest, GroupsOfNeedlesAreWrittenTogether)
+{
+    ReplicaSet replicas(addresses);
+    auto volumes = replicas.WritableVolumes();
+    ASSERT_EQ(2u, volumes.size());
+
+    std::vector<NeedleUpload> uploads{
+        {NeedleHandle{volumes[0], 10, 0xa}, "abc", 3},
+        {NeedleHandle{volumes[1], 11, 0xb}, "hello", 5},
+        {NeedleHandle{volumes[0], 12, 0xc}, "", 0}};
+    std::vector<StoreAddress> acked;
+    EXPECT_EQ("ok", replicas.PutGroup(uploads, 0x1f, acked));
+    EXPECT_LE(replicas.Quorum(), acked.size());
+
+    replicas.Wait();
+    for (auto &store : addresses) {
+        EXPECT_EQ("ok 3", Get(store, uploads[0].handle));
+        EXPECT_EQ("ok 5", Get(store, uploads[1].handle));
+        EXPECT_EQ("ok 0", Get(store, uploads[2].handle));
+    }
+
+    // A volume that does not exist fails the group before anything is
+    // written.
+    uploads = {
+        {NeedleHandle{volumes[0], 13, 0xd}, "xyz", 3},
+        {NeedleHandle{99, 14, 0xe}, "x", 1}};
+    EXPECT_EQ("err BadHaystackId", replicas.PutGroup(uploads, 0, acked));
+    EXPECT_TRUE(acked.empty());
+    EXPECT_EQ("err BadNeedle", Get(addresses[0], uploads[0].handle));
+}
+
+TEST_F(ReplicaSetTest, GroupsOfNeedlesAreDeletedTogether)
+{
+    ReplicaSet replicas(addresses);
+    auto volumes = replicas.WritableVolumes();
+    ASSERT_EQ(2u, volumes.size());
+
+    std::vector<NeedleUpload> uploads{
+        {NeedleHandle{volumes[0], 20, 0xa}, "abc", 3},
+        {NeedleHandle{volumes[1], 21, 0xb}, "hello", 5},
+        {NeedleHandle{volumes[0], 22, 0xc}, "xyz", 3}};
+    std::vector<StoreAddress> acked;
+    ASSERT_EQ("ok", replicas.PutGroup(uploads, 0, acked));
+    replicas.Wait();
+
+    EXPECT_EQ("ok", replicas.DeleteGroup(
+        {uploads[0].handle, uploads[1].handle, NeedleHandle{99, 23, 1}},
+        0x1f));
+    replicas.Wait();
+    for (auto &store : addresses) {
+        EXPECT_EQ("err BadNeedle", Get(store, uploads[0].handle));
+        EXPECT_EQ("err BadNeedle", Get(store, uploads[1].handle));
+        EXPECT_EQ("ok 3", Get(store, uploads[2].handle));
+    }
+}
+
+TEST_F(ReplicaSetTest, ConcurrentWritesShareTheSenders)
+{
+    std::vector<NeedleHandle> handles;
+    {
+        ReplicaSet replicas(addresses, 1);
+        auto volumes = replicas.WritableVolumes();
+        ASSERT_EQ(2u, volumes.size());
+
+        // More writes than senders, some of which are sent by the callers.
+        for (uint64_t id = 0; id < 64; ++id)
+            handles.push_back(NeedleHandle{volumes[id % 2], id, 1});
+        std::vector<std::thread> writers;
+        for (uint64_t t = 0; t < 8; ++t) {
+            writers.emplace_back([&replicas, &handles, t] {
+                std::vector<StoreAddress> acked;
+                for (uint64_t i = 0; i < 8; ++i) {
+                    EXPECT_EQ("ok", replicas.Put(
+                        handles[t*8 + i], "abc", 3, 0, acked));
+                }
+            });
+        }
+        for (auto &thr : writers)
+            thr.join();
+    }
+
+    // The dtor waited for the writes to the slowest replicas.
+    for (auto &store : addresses) {
+        for (auto &handle : handles)
+            EXPECT_EQ("ok 3", Get(store, handle));
+    }
+}
+
+TEST_F(ReplicaSetTest, MissedDeletesAreSentAgain)
+{
+    ReplicaSet replicas(addresses);
+    auto volumes = replicas.WritableVolumes();
+    ASSERT_EQ(2u, volumes.size());
+    std::vector<StoreAddress> acked;
+    NeedleHandle handle{volumes[0], 30, 0x1234};
+    ASSERT_EQ("ok", replicas.Put(handle, "abc", 3, 0, acked));
+    replicas.Wait();
+
+    StopStore(2);
+    EXPECT_EQ("ok", replicas.Delete(handle, 0));
+    replicas.Wait();
+    EXPECT_EQ(1u, replicas.Missed());
+
+    // The replica still has the needle until it is repaired.
+    StartStore(2);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ("ok 3", Get(addresses[2], handle));
+    replicas.Repair();
+    EXPECT_EQ(0u, replicas.Missed());
+    EXPECT_EQ("err BadNeedle", Get(addresses[2], handle));
+}
+
+TEST_F(ReplicaSetTest, ReadsNeedAQuorumOfTheReplicas)
+{
+    ReplicaSet replicas(addresses);
+    auto volumes = replicas.WritableVolumes();
+    ASSERT_EQ(2u, volumes.size());
+    std::vector<StoreAddress> acked;
+    NeedleHandle handle{volumes[0], 40, 0x1234};
+    ASSERT_EQ("ok", replicas.Put(handle, "abc", 3, 0, acked));
+    replicas.Wait();
+    auto get = "get " + handle.ToString();
+    auto stat = "stat " + handle.ToString();
+
+    // A replica that missed the write does not hide the needle.
+    ASSERT_EQ("ok", Ask(addresses[0], "delete", handle));
+    for (unsigned i = 0; i < kReplicas; ++i) {
+        ReplicaSet::TcpStream conn;
+        bool isMissing = true;
+        ASSERT_EQ("ok 3", replicas.Read(get, stat, conn, isMissing));
+        EXPECT_FALSE(isMissing);
+        std::string data(3, '\0');
+        conn.read(&data[0], data.size());
+        EXPECT_EQ("abc", data);
+    }
+
+    // Nor does a replica that missed the delete bring it back.
+    ASSERT_EQ("ok", Ask(addresses[1], "delete", handle));
+    for (unsigned i = 0; i < kReplicas; ++i) {
+        ReplicaSet::TcpStream conn;
+        bool isMissing = false;
+        EXPECT_EQ("err BadNeedle", replicas.Read(get, stat, conn, isMissing));
+        EXPECT_TRUE(isMissing);
+    }
+
+    // Without a quorum, the replica that has the needle is trusted.
+    StopStore(1);
+    ReplicaSet::TcpStream conn;
+    bool isMissing = true;
+    std::string reply;
+    for (unsigned i = 0; i < kReplicas and reply != "ok 3"; ++i)
+        reply = replicas.Read(get, stat, conn, isMissing);
+    EXPECT_EQ("ok 3", reply);
+    EXPECT_FALSE(isMissing);
+}
+
+TEST_F(ReplicaSetTest, ReadsAreSpreadAcrossTheReplicas)
+{
+    ReplicaSet replicas(addresses);
+    std::vector<unsigned> first(kReplicas);
+    for (unsigned i = 0; i < 3 * kReplicas; ++i) {
+        auto order = replicas.ReadOrder();
+        ASSERT_EQ(addresses.size(), order.size());
+        ++first[std::stoul(order[0].port) - kFirstPort];
+    }
+    for (auto count : first)
+        EXPECT_EQ(3u, count);
+}
+
+} // namespace
@@ -0,0 +1,245 @@
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "crc32c.hh"
+#include "haystack.hh"
+#include "iobackend.hh"
+#include "needle.hh"
+#include "scrubber.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+TEST(Crc32c, MatchesKnownValues)
+{
+    std::string digits("123456789");
+    EXPECT_EQ(0xe3069283u, Crc32c(digits.data(), digits.size()));
+    EXPECT_EQ(0u, Crc32c(nullptr, 0));
+
+    std::string zeros(32, '\0');
+    EXPECT_EQ(0x8a9136aau, Crc32c(zeros.data(), zeros.size()));
+}
+
+TEST(Crc32c, CanBeComputedIncrementally)
+{
+    std::string data("The quick brown fox jumps over the lazy dog");
+    auto crc = Crc32c(data.data(), 10);
+    crc = Crc32c(data.data()+10, data.size()-10, crc);
+    EXPECT_EQ(Crc32c(data.data(), data.size()), crc);
+}
+
+// A backend whose reads fail with EIO at a given offset, or at any offset if
+// it is kAnyOffset, once it is armed.
+class FailingBackend : public IoBackend
+{
+public:
+    static constexpr uint64_t kAnyOffset = ~uint64_t(0);
+
+    std::atomic<bool> isArmed{false};
+    std::atomic<uint64_t> failAt{kAnyOffset};
+
+private:
+    class File : public VolumeFile
+    {
+        FailingBackend &backend;
+        std::unique_ptr<VolumeFile> file;
+
+    public:
+        File(FailingBackend &backend, std::unique_ptr<VolumeFile> file)
+            : backend(backend), file(std::move(file))
+        {}
+
+        void
+        Read(const iovec *iov, size_t count, uint64_t offset) override
+        {
+            if (backend.isArmed and (backend.failAt == kAnyOffset
+                                     or backend.failAt == offset))
+                throw std::system_error(EIO, std::generic_category(), "read");
+            file->Read(iov, count, offset);
+        }
+
+        void
+        Write(const iovec *iov, size_t count, uint64_t offset) override
+        {
+            file->Write(iov, count, offset);
+        }
+
+        void Sync() override { file->Sync(); }
+        void Truncate(uint64_t size) override { file->Truncate(size); }
+    };
+
+    std::shared_ptr<IoBackend> io = MakeFstreamBackend();
+
+public:
+    std::unique_ptr<VolumeFile>
+    Open(const std::string &fname, bool create) override
+    {
+        return std::unique_ptr<VolumeFile>(
+            new File(*this, io->Open(fname, create)));
+    }
+
+    const char* Name() const noexcept override { return "failing"; }
+};
+
+constexpr uint64_t FailingBackend::kAnyOffset;
+
+struct ScrubberTest : public ::testing::Test
+{
+    static constexpr int kSamples = 10;
+    static constexpr int kSize = 256;
+    uint64_t maxSize = kSamples * NeedleDiskSize(kSize);
+    std::vector<Needle> needles;
+    std::shared_ptr<Haystack> hs;
+
+    virtual void
+    SetUp() override
+    {
+        hs = std::make_shared<Haystack>(0, PREFIX, maxSize);
+        std::vector<char> bytes(kSize);
+        for (int i = 0; i < kSamples; ++i) {
+            for (auto &c : bytes)
+                c = static_cast<char>(i);
+            needles.push_back(hs->Write(i, bytes.data(), bytes.size()));
+        }
+    }
+
+    // Flips one byte in the blob of a needle.
+    void
+    Corrupt(const Needle &needle)
+    {
+        std::fstream file(PREFIX "/haystack_0",
+            std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(needle.offset + NeedleHeader::kSize + kSize/2);
+        file.put(static_cast<char>(0xff));
+    }
+
+    // Reopens the haystack with a backend that fails reads when armed.
+    std::shared_ptr<FailingBackend>
+    ReopenFailing()
+    {
+        auto io = std::make_shared<FailingBackend>();
+        hs.reset();
+        hs = std::make_shared<Haystack>(0, PREFIX, maxSize, true, io);
+        return io;
+    }
+
+    Scrubber::VolumeFn
+    Volumes()
+    {
+        auto hs = this->hs;
+        return [hs] { return Scrubber::HaystackList{hs}; };
+    }
+};
+
+TEST_F(ScrubberTest, ScrubOnceReportsCorruptNeedles)
+{
+    ASSERT_TRUE(hs->IsReadOnly());
+    Corrupt(needles[3]);
+    Corrupt(needles[7]);
+
+    std::vector<uint64_t> corrupt;
+    Scrubber scrubber(Volumes(), 1<<30, std::chrono::seconds(1),
+        [&corrupt](const Needle &needle) {
+            corrupt.push_back(needle.flags.id);
+        });
+    EXPECT_TRUE(scrubber.ScrubOnce());
+    EXPECT_EQ(static_cast<uint64_t>(kSamples), scrubber.Scrubbed());
+    EXPECT_EQ(2u, scrubber.Corrupted());
+    EXPECT_EQ((std::vector<uint64_t>{3, 7}), corrupt);
+}
+
+TEST_F(ScrubberTest, CorruptHeadersAreCountedAndSkipped)
+{
+    {
+        std::fstream file(PREFIX "/haystack_0",
+            std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(needles[4].offset);
+        file.write("XXXX", 4);
+    }
+
+    Scrubber scrubber(Volumes(), 1<<30, std::chrono::seconds(1),
+        [](const Needle&) {});
+    EXPECT_TRUE(scrubber.ScrubOnce());
+    EXPECT_EQ(static_cast<uint64_t>(kSamples-1), scrubber.Scrubbed());
+    EXPECT_EQ(1u, scrubber.Corrupted());
+}
+
+TEST_F(ScrubberTest, ScrubberSkipsDeletedNeedles)
+{
+    Corrupt(needles[3]);
+    hs->Delete(needles[3]);
+
+    Scrubber scrubber(Volumes(), 1<<30, std::chrono::seconds(1),
+        [](const Needle&) {});
+    EXPECT_TRUE(scrubber.ScrubOnce());
+    EXPECT_EQ(static_cast<uint64_t>(kSamples-1), scrubber.Scrubbed());
+    EXPECT_EQ(0u, scrubber.Corrupted());
+}
+
+TEST_F(ScrubberTest, ScrubberThreadCanBeStartedAndStopped)
+{
+    Corrupt(needles[0]);
+    Scrubber scrubber(Volumes(), 1<<30, std::chrono::seconds(60),
+        [](const Needle&) {});
+    scrubber.Start();
+    for (int i = 0; i < 100 and scrubber.Scrubbed() < kSamples; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    scrubber.Stop();
+    EXPECT_EQ(1u, scrubber.Corrupted());
+}
+
+TEST_F(ScrubberTest, UnreadableNeedlesAreReportedAsCorrupt)
+{
+    auto io = ReopenFailing();
+    io->failAt = needles[5].offset + NeedleHeader::kSize;
+    io->isArmed = true;
+
+    std::vector<uint64_t> corrupt;
+    Scrubber scrubber(Volumes(), 1<<30, std::chrono::seconds(1),
+        [&corrupt](const Needle &needle) {
+            corrupt.push_back(needle.flags.id);
+        });
+    EXPECT_TRUE(scrubber.ScrubOnce());
+    EXPECT_EQ(static_cast<uint64_t>(kSamples), scrubber.Scrubbed());
+    EXPECT_EQ(1u, scrubber.Corrupted());
+    EXPECT_EQ(1u, scrubber.Unreadable());
+    EXPECT_EQ((std::vector<uint64_t>{5}), corrupt);
+}
+
+TEST_F(ScrubberTest, UnreadableVolumesAreSkipped)
+{
+    auto io = ReopenFailing();
+    io->isArmed = true;
+    auto failing = hs;
+    auto healthy = std::make_shared<Haystack>(1, PREFIX, maxSize);
+    std::vector<char> bytes(kSize, 'x');
+    for (int i = 0; i < kSamples; ++i)
+        healthy->Write(i, bytes.data(), bytes.size());
+
+    Scrubber scrubber(
+        [failing, healthy] {
+            return Scrubber::HaystackList{failing, healthy};
+        },
+        1<<30, std::chrono::seconds(1), [](const Needle&) {});
+    EXPECT_TRUE(scrubber.ScrubOnce());
+    EXPECT_EQ(static_cast<uint64_t>(kSamples), scrubber.Scrubbed());
+    EXPECT_EQ(0u, scrubber.Corrupted());
+    EXPECT_EQ(1u, scrubber.Unreadable());
+}
+
+} // namespace
@@ -1,18 +1,23 @@
-#include <pthread.h>
-
 #include <chrono>
+#include <fstream>
 #include <functional>
 #include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
 #include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
 #include "gtest/gtest.h"
 
 #include "haystack.hh"
 #include "needle.hh"
+#include "needlefilter.hh"
 #include "store.hh"
+#include "storeconfig.hh"
 
 #ifndef PREFIX
  #error Need to define PREFIX with file path
@@ -20,6 +25,107 @@
 
 namespace {
 
+/**
+ * Runs a Store on its own thread for the duration of a test, and sends it
+ * requests, each on a connection of its own.
+ */
+class StoreServer
+{
+public:
+    const std::string ipAddr;
+    const std::string port;
+
+private:
+    Store store;
+    std::thread thr;
+
+public:
+    StoreServer(unsigned port, const StoreConfig &config,
+                const std::string &ipAddr = "127.0.0.1")
+        : ipAddr(ipAddr),
+          port(std::to_string(port)),
+          store(ipAddr, port, config),
+          thr(&Store::Run, &store)
+    {
+        // The Store listens once its volumes are open.
+        for (int i = 0; i < 5000; ++i) {
+            if (Request("volumes").compare(0, 3, "ok ") == 0)
+                return;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        ADD_FAILURE() << "the store does not listen on port " << port;
+    }
+
+    ~StoreServer() { Stop(); }
+
+    void
+    Stop()
+    {
+        if (not thr.joinable())
+            return;
+        store.Stop();
+        thr.join();
+    }
+
+    // Sends a request, and returns the first line of the reply. If data is
+    // given, then the bytes of an "ok <size>" reply are read into it.
+    std::string
+    Request(const std::string &line, const std::string &body = "",
+            std::string *data = nullptr)
+    {
+        boost::asio::ip::tcp::iostream conn(ipAddr, port);
+        conn << line << '\n' << body;
+        conn.flush();
+        std::string response, status;
+        size_t size = 0;
+        std::getline(conn, response);
+        std::istringstream(response) >> status >> size;
+        if (data and status == "ok") {
+            data->assign(size, '\0');
+            if (size)
+                conn.read(&(*data)[0], size);
+        }
+        return response;
+    }
+
+    // Sends a request, and returns the reply line followed by the bytes of an
+    // "ok <size>" reply.
+    std::string
+    Fetch(const std::string &line)
+    {
+        std::string data;
+        auto response = Request(line, "", &data);
+        return response.compare(0, 3, "ok ") == 0
+            ? response + ' ' + data : response;
+    }
+
+    // Sends a request, and returns all the lines of the reply.
+    std::vector<std::string>
+    Lines(const std::string &line, const std::string &body = "")
+    {
+        boost::asio::ip::tcp::iostream conn(ipAddr, port);
+        conn << line << '\n' << body;
+        conn.flush();
+        std::vector<std::string> lines;
+        std::string response;
+        while (std::getline(conn, response))
+            lines.push_back(response);
+        return lines;
+    }
+};
+
+/**
+ * @param name The directory of the volumes, under PREFIX, which is emptied.
+ * @return The default configuration with a single, empty directory.
+ */
+StoreConfig
+EmptyConfig(const std::string &name)
+{
+    auto hayDir = PREFIX "/" + name;
+    boost::filesystem::remove_all(hayDir);
+    return StoreConfig::Default(hayDir);
+}
+
 struct StoreTest : public ::testing::Test
 {
     static constexpr size_t kTotalFiles = 10;
@@ -31,11 +137,14 @@ struct StoreTest : public ::testing::Test
     // List of pairs of (needle ID, haystack ID)
     std::vector<std::pair<size_t, size_t>> ids;
     std::vector<std::vector<char>> fileData;
-    Store store{ipAddr, serverPort, PREFIX};
+    std::string hayDir = PREFIX "/store";
+    Store store{ipAddr, serverPort, hayDir};
 
     virtual void
     SetUp() override
     {
+        boost::filesystem::remove_all(hayDir);
+
         // Random generator for size of buffer. Since we don't vary the seed,
         // behavior is actually deterministic across different runs.
         auto genSize = std::bind(
@@ -119,8 +228,398 @@ TEST_F(StoreTest, PutGetAndDeleteWork)
         ASSERT_EQ("err BadNeedle", response);
     }
 
-    pthread_cancel(thr.native_handle());
+    store.Stop();
     thr.join();
 }
 
+TEST(StoreConfigTest, ReadsAConfigurationFile)
+{
+    auto fname = PREFIX "/store.conf";
+    boost::filesystem::create_directories(PREFIX);
+    {
+        std::ofstream file(fname);
+        file << "# Two disks\n"
+             << "directory /mnt/a 512M 10\n"
+             << "directory /mnt/b 2G 3  # bigger volumes\n"
+             << "writable 4\n"
+             << "io uring\n"
+             << "threads 8\n"
+             << "backlog 16\n"
+             << "readcache 256M 16K\n"
+             << "verify off\n"
+             << "compression none\n";
+    }
+
+    auto config = StoreConfig::FromFile(fname);
+    ASSERT_EQ(2u, config.dirs.size());
+    EXPECT_EQ("/mnt/a", config.dirs[0].path);
+    EXPECT_EQ(512ull << 20, config.dirs[0].volumeSize);
+    EXPECT_EQ(10u, config.dirs[0].maxVolumes);
+    EXPECT_EQ(2ull << 30, config.dirs[1].volumeSize);
+    EXPECT_EQ(3u, config.dirs[1].maxVolumes);
+    EXPECT_EQ(4u, config.writableVolumes);
+    EXPECT_EQ("uring", config.ioBackend);
+    EXPECT_FALSE(config.verifyReads);
+    EXPECT_EQ(8u, config.threads);
+    EXPECT_EQ(16u, config.backlog);
+    EXPECT_EQ(256ull << 20, config.readCacheSize);
+    EXPECT_EQ(16ull << 10, config.readCacheNeedleSize);
+
+    EXPECT_EQ(Codec::None, config.compression);
+
+    std::ofstream(fname) << "directory /mnt/a big 10\n";
+    EXPECT_THROW(StoreConfig::FromFile(fname), std::invalid_argument);
+    std::ofstream(fname) << "directory /mnt/a 1G 10\ncompression gzip\n";
+    EXPECT_THROW(StoreConfig::FromFile(fname), std::invalid_argument);
+}
+
+TEST(StoreVolumesTest, FullVolumesAreReplaced)
+{
+    boost::filesystem::remove_all(PREFIX "/vol0");
+    boost::filesystem::remove_all(PREFIX "/vol1");
+    StoreConfig config;
+    config.dirs.push_back({PREFIX "/vol0", 3 * NeedleDiskSize(1000), 2});
+    config.dirs.push_back({PREFIX "/vol1", 3 * NeedleDiskSize(1000), 2});
+    config.writableVolumes = 2;
+    StoreServer server(5010, config);
+
+    auto volumes = [&] {
+        std::vector<std::string> result;
+        auto lines = server.Lines("volumes");
+        EXPECT_EQ(0u, lines.at(0).find("ok "));
+        std::string mode;
+        size_t volumeId, freeBytes;
+        for (size_t i = 1; i < lines.size(); ++i) {
+            std::istringstream(lines[i]) >> volumeId >> freeBytes >> mode;
+            result.push_back(std::to_string(volumeId) + ' ' + mode);
+        }
+        return result;
+    };
+    auto put = [&](size_t volumeId, size_t needleId) {
+        return server.Request(
+            "put " + std::to_string(volumeId) + ' '
+            + std::to_string(needleId) + " 1000", std::string(1000, 'x'));
+    };
+
+    EXPECT_EQ((std::vector<std::string>{"0 rw", "1 rw"}), volumes());
+
+    // Filling up volume 0 seals it and creates a new one.
+    for (size_t needleId = 0; needleId < 3; ++needleId)
+        ASSERT_EQ("ok", put(0, needleId));
+    EXPECT_EQ((std::vector<std::string>{"0 ro", "1 rw", "2 rw"}), volumes());
+    EXPECT_EQ("err NoFit", put(0, 3));
+    EXPECT_EQ("err BadHaystackId", put(9, 3));
+
+    // Once the directories are full, no more volumes are created.
+    for (size_t needleId = 3; needleId < 9; ++needleId)
+        ASSERT_EQ("ok", put(1 + needleId / 6, needleId));
+    EXPECT_EQ((std::vector<std::string>{"0 ro", "1 ro", "2 ro", "3 rw"}),
+              volumes());
+
+    // Both directories are on the same device, so one queue served every put
+    // that reached a volume, including the one that did not fit.
+    auto lines = server.Lines("iostat");
+    ASSERT_EQ(2u, lines.size());
+    EXPECT_EQ("ok 1", lines[0]);
+    std::istringstream iss(lines[1]);
+    std::string device;
+    size_t workers, depth, maxDepth, completed;
+    iss >> device >> workers >> depth >> maxDepth >> completed;
+    EXPECT_EQ(StoreConfig::kIoWorkers, workers);
+    EXPECT_EQ(0u, depth);
+    EXPECT_EQ(10u, completed);
+}
+
+TEST(StoreBusyTest, ConnectionsBeyondTheBacklogAreRefused)
+{
+    auto config = EmptyConfig("busy");
+    config.writableVolumes = 1;
+    config.threads = 1;
+    config.backlog = 1;
+    StoreServer server(5070, config);
+
+    // The first connection keeps the only thread waiting for a request, and
+    // the second one fills the backlog.
+    boost::asio::ip::tcp::iostream served(server.ipAddr, server.port);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    boost::asio::ip::tcp::iostream queued(server.ipAddr, server.port);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    boost::asio::ip::tcp::iostream refused(server.ipAddr, server.port);
+    std::string response;
+    std::getline(refused, response);
+    EXPECT_EQ("err Busy", response);
+
+    // Once the thread is free, the queued connection is served.
+    served << "volumes\n";
+    served.flush();
+    std::getline(served, response);
+    EXPECT_EQ("ok 1", response);
+    queued << "volumes\n";
+    queued.flush();
+    std::getline(queued, response);
+    EXPECT_EQ("ok 1", response);
+}
+
+TEST(StoreRestartTest, NeedlesSurviveARestart)
+{
+    auto config = EmptyConfig("restart");
+    config.writableVolumes = 2;
+    {
+        StoreServer server(5080, config);
+        for (int needleId = 0; needleId < 4; ++needleId) {
+            auto line = "put " + std::to_string(needleId % 2) + ' '
+                + std::to_string(needleId) + " 3";
+            ASSERT_EQ("ok", server.Request(line, "abc"));
+        }
+        ASSERT_EQ("ok", server.Request("delete 1"));
+    }
+    ASSERT_TRUE(boost::filesystem::exists(config.IndexPath()));
+
+    // The index saved on shutdown is loaded, and then removed.
+    {
+        StoreServer server(5080, config);
+        EXPECT_FALSE(boost::filesystem::exists(config.IndexPath()));
+        EXPECT_EQ("ok 3", server.Request("get 0"));
+        EXPECT_EQ("err BadNeedle", server.Request("get 1"));
+        EXPECT_EQ("ok 3", server.Request("get 3"));
+        EXPECT_EQ("err NoFit", server.Request("put 0 2 3", "abc"));
+        EXPECT_EQ("ok", server.Request("put 0 4 3", "xyz"));
+        EXPECT_EQ("ok 2", server.Request("volumes"));
+    }
+
+    // Without an index, e.g., after a crash, the volumes are scanned.
+    boost::filesystem::remove(config.IndexPath());
+    StoreServer server(5080, config);
+    EXPECT_EQ("ok 3", server.Request("get 0"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 1"));
+    EXPECT_EQ("ok 3", server.Request("get 4"));
+}
+
+TEST(StoreReadCacheTest, DeletedNeedlesAreNotServedFromTheCache)
+{
+    auto config = EmptyConfig("readcache");
+    config.writableVolumes = 1;
+    config.readCacheSize = 1 << 20;
+    StoreServer server(5090, config);
+
+    EXPECT_EQ("ok", server.Request("put 0 1 3", "abc"));
+    // The first read goes to disk, and the second one to the cache.
+    EXPECT_EQ("ok 3 abc", server.Fetch("get 1"));
+    EXPECT_EQ("ok 3 abc", server.Fetch("get 1"));
+    EXPECT_EQ("ok", server.Request("delete 1"));
+    EXPECT_EQ("err BadNeedle", server.Fetch("get 1"));
+}
+
+TEST(StoreHandleTest, NeedlesAreServedOnlyWithTheirCookie)
+{
+    auto config = EmptyConfig("handle");
+    config.writableVolumes = 2;
+    config.readCacheSize = 1 << 20;
+    StoreServer server(5110, config);
+
+    EXPECT_EQ("ok", server.Request("put 1,5,c0ffee 3", "abc"));
+    EXPECT_EQ("ok 3", server.Request("get 1,5,c0ffee"));
+    // Served from the read cache, which checks the cookie and volume too.
+    EXPECT_EQ("ok 3", server.Request("get 1,5,c0ffee"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 1,5,c0ffef"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 0,5,c0ffee"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 5"));
+    EXPECT_EQ("err BadNeedle", server.Request("delete 1,5,0"));
+    EXPECT_EQ("err BadHaystackId", server.Request("put 9,6,1 3", "abc"));
+
+    // Needles written without a cookie can still be read by their IDs.
+    EXPECT_EQ("ok", server.Request("put 0 6 3", "xyz"));
+    EXPECT_EQ("ok 3", server.Request("get 6"));
+    EXPECT_EQ("ok 3", server.Request("get 0,6,0"));
+
+    EXPECT_EQ("ok", server.Request("delete 1,5,c0ffee"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 1,5,c0ffee"));
+}
+
+TEST(StoreRangeTest, RangesAndSizesAreServedWithoutTheWholeNeedle)
+{
+    auto config = EmptyConfig("range");
+    config.writableVolumes = 1;
+    config.readCacheNeedleSize = 16;
+    config.readCacheSize = 1 << 20;
+    StoreServer server(5120, config);
+
+    // A large needle is read from disk, and a small one from the read cache
+    // once it is in it.
+    std::string large = "abcdefghijklmnopqrstuvwxyz";
+    EXPECT_EQ("ok", server.Request("put 0,1,a 26", large));
+    EXPECT_EQ("ok", server.Request("put 0,2,b 10", "0123456789"));
+    EXPECT_EQ("ok 26", server.Request("stat 0,1,a"));
+    EXPECT_EQ("ok 10", server.Request("stat 0,2,b trace=1f"));
+    EXPECT_EQ("ok 3 xyz", server.Fetch("get 0,1,a 23 10"));
+    EXPECT_EQ("ok 4 cdef", server.Fetch("get 0,1,a 2 4 trace=1f"));
+    EXPECT_EQ("ok 0 ", server.Fetch("get 0,1,a 26 1"));
+    EXPECT_EQ("err BadRange", server.Fetch("get 0,1,a 27 1"));
+    EXPECT_EQ("ok 26 " + large, server.Fetch("get 0,1,a 0 26"));
+    EXPECT_EQ("ok 10 0123456789", server.Fetch("get 0,2,b"));
+    EXPECT_EQ("ok 2 45", server.Fetch("get 0,2,b 4 2"));
+    EXPECT_EQ("err BadNeedle", server.Request("stat 0,1,b"));
+
+    EXPECT_EQ("ok", server.Request("delete 0,1,a"));
+    EXPECT_EQ("err BadNeedle", server.Request("stat 0,1,a"));
+    EXPECT_EQ("err BadNeedle", server.Fetch("get 0,1,a 0 1"));
+}
+
+TEST(StoreMultiputTest, GroupsOfNeedlesAreWrittenWithOneRequest)
+{
+    auto config = EmptyConfig("multiput");
+    config.writableVolumes = 2;
+    StoreServer server(5140, config);
+
+    EXPECT_EQ("ok", server.Request(
+        "multiput 3 trace=1f",
+        "0,1,a 3\nabc1,2,b 5\nhello0,3,c 0\n"));
+    EXPECT_EQ("ok 3 abc", server.Fetch("get 0,1,a"));
+    EXPECT_EQ("ok 5 hello", server.Fetch("get 1,2,b"));
+    EXPECT_EQ("ok 0 ", server.Fetch("get 0,3,c"));
+
+    // Nothing is written if a frame or a volume is bad.
+    EXPECT_EQ("err BadHaystackId", server.Request(
+        "multiput 2", "0,4,d 1\nx9,5,e 1\ny"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 0,4,d"));
+    EXPECT_EQ("err BadFrame", server.Request(
+        "multiput 2", "0,6,f 1\nxoops\n"));
+    EXPECT_EQ("err BadNeedle", server.Request("get 0,6,f"));
+    EXPECT_EQ("err TooManyNeedles", server.Request("multiput 100000"));
+    EXPECT_EQ("err TooManyBytes", server.Request(
+        "multiput 1", "0,7,a 2000000\n"));
+}
+
+TEST(StoreMultideleteTest, GroupsOfNeedlesAreDeletedWithOneRequest)
+{
+    auto config = EmptyConfig("multidelete");
+    config.writableVolumes = 2;
+    {
+        StoreServer server(5150, config);
+        EXPECT_EQ("ok", server.Request(
+            "multiput 3", "0,1,a 3\nabc1,2,b 5\nhello0,3,c 1\nx"));
+
+        // Needles that are not found are skipped.
+        EXPECT_EQ("ok", server.Request(
+            "multidelete 3 trace=1f", "0,1,a\n1,2,b\n0,9,f\n"));
+        EXPECT_EQ("err BadNeedle", server.Request("get 0,1,a"));
+        EXPECT_EQ("err BadNeedle", server.Request("get 1,2,b"));
+        EXPECT_EQ("ok 1", server.Request("stat 0,3,c"));
+
+        // Nothing is deleted if a line is bad.
+        EXPECT_EQ("err BadFrame", server.Request(
+            "multidelete 2", "0,3,c\noops\n"));
+        EXPECT_EQ("ok 1", server.Request("stat 0,3,c"));
+        EXPECT_EQ("err TooManyNeedles", server.Request("multidelete 100000"));
+    }
+
+    // The deletes survive a restart, once folded into the volumes.
+    StoreServer server(5150, config);
+    EXPECT_EQ("err BadNeedle", server.Request("get 0,1,a"));
+    EXPECT_EQ("ok 1", server.Request("stat 0,3,c"));
+}
+
+TEST(StoreCompressionTest, NeedlesAreDecompressedUnlessTheClientAccepts)
+{
+    auto codec = IsCodecAvailable(Codec::Zstd) ? Codec::Zstd : Codec::Lz4;
+    if (not IsCodecAvailable(codec))
+        GTEST_SKIP() << "no codec available";
+
+    auto config = EmptyConfig("compress");
+    config.writableVolumes = 1;
+    config.compression = codec;
+    config.readCacheSize = 1 << 20;
+    StoreServer server(5130, config);
+
+    std::string text;
+    while (text.size() < 1000)
+        text += "the quick brown fox jumps over the lazy dog ";
+
+    std::string data;
+    auto put = "put 0,1,a " + std::to_string(text.size());
+    EXPECT_EQ("ok", server.Request(put, text));
+    auto size = std::to_string(text.size());
+    EXPECT_EQ("ok " + size, server.Request("stat 0,1,a"));
+    EXPECT_EQ("ok " + size, server.Request("get 0,1,a", "", &data));
+    EXPECT_EQ(text, data);
+    EXPECT_EQ("ok 5", server.Request("get 0,1,a 4 5", "", &data));
+    EXPECT_EQ("quick", data);
+    EXPECT_EQ("ok " + size, server.Request("get 0,1,a accept=gzip"));
+
+    // A client that decompresses the needle gets it as it is stored.
+    auto reply = server.Request(
+        "get 0,1,a accept=lz4,zstd trace=1f", "", &data);
+    std::istringstream iss(reply);
+    std::string status, name;
+    size_t storedSize, rawSize;
+    ASSERT_TRUE(iss >> status >> storedSize >> name >> rawSize) << reply;
+    EXPECT_EQ(CodecName(codec), name);
+    EXPECT_EQ(text.size(), rawSize);
+    EXPECT_LT(storedSize, text.size());
+    std::string raw(rawSize, '\0');
+    ASSERT_TRUE(Decompress(codec, data.data(), data.size(), &raw[0], rawSize));
+    EXPECT_EQ(text, raw);
+
+    // Ranges are always served decompressed.
+    EXPECT_EQ("ok 3", server.Request(
+        "get 0,1,a 0 3 accept=lz4,zstd", "", &data));
+    EXPECT_EQ("the", data);
+}
+
+TEST(StoreFilterTest, FiltersHaveTheIdsOfAllTheNeedles)
+{
+    auto config = EmptyConfig("idfilter");
+    config.writableVolumes = 2;
+    StoreServer server(5160, config);
+
+    EXPECT_EQ("ok", server.Request(
+        "multiput 3", "0,1,a 3\nabc1,2,b 5\nhello0,30,c 1\nx"));
+    EXPECT_EQ("ok", server.Request("delete 1,2,b"));
+
+    boost::asio::ip::tcp::iostream conn(server.ipAddr, server.port);
+    conn << "idfilter 5000\n";
+    conn.flush();
+    std::string line;
+    std::getline(conn, line);
+    EXPECT_EQ("ok 8192 2 30", line);
+    NeedleFilter filter(8192);
+    ASSERT_TRUE(filter.Read(conn));
+    EXPECT_TRUE(filter.MayContain(1));
+    EXPECT_TRUE(filter.MayContain(30));
+}
+
+TEST(StoreStatTest, VolumeStatsAreServedWithoutAHandle)
+{
+    auto config = EmptyConfig("stat");
+    config.writableVolumes = 2;
+    StoreServer server(5170, config);
+
+    server.Request("multiput 3", "0,1,a 3\nabc0,2,b 2000\n"
+                   + std::string(2000, 'x') + "1,3,c 1\nx");
+    server.Request("delete 0,1,a");
+
+    auto lines = server.Lines("stat");
+    ASSERT_EQ(3u, lines.size());
+    EXPECT_EQ("ok 2", lines[0]);
+    std::istringstream iss(lines[1]);
+    uint64_t volumeId, live, deleted, liveBytes, garbageBytes;
+    int64_t lastWrite;
+    std::string mode, histogram;
+    ASSERT_TRUE(iss >> volumeId >> mode >> live >> deleted >> liveBytes
+                >> garbageBytes >> lastWrite >> histogram);
+    EXPECT_EQ(0u, volumeId);
+    EXPECT_EQ("rw", mode);
+    EXPECT_EQ(1u, live);
+    EXPECT_EQ(1u, deleted);
+    EXPECT_EQ(NeedleDiskSize(2000), liveBytes);
+    EXPECT_EQ(NeedleDiskSize(3), garbageBytes);
+    EXPECT_LT(0, lastWrite);
+    EXPECT_EQ("0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0", histogram);
+    EXPECT_EQ(0u, lines[2].find("1 rw 1 0 "));
+
+    // A handle still gets the size of its needle.
+    EXPECT_EQ("ok 2000", server.Request("stat 0,2,b"));
+}
+
 } // namespace
@@ -0,0 +1,101 @@
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "storemap.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+constexpr uint64_t kNeedles = 10000;
+
+TEST(StoreMap, ReadsAStoreMapFile)
+{
+    auto fname = PREFIX "/storemap.conf";
+    boost::filesystem::create_directories(PREFIX);
+    {
+        std::ofstream file(fname);
+        file << "# Two shards of three replicas, and one of one\n"
+             << "shard a 10.0.0.1,10.0.0.2,10.0.0.3:5001\n"
+             << "shard b 10.0.1.1,10.0.1.2,10.0.1.3 3  # all must ack\n"
+             << "shard c 10.0.2.1\n";
+    }
+
+    auto storeMap = StoreMap::FromArgs(fname, "5000");
+    ASSERT_EQ(3u, storeMap.Shards().size());
+    auto a = storeMap.Find("a");
+    ASSERT_NE(nullptr, a);
+    ASSERT_EQ(3u, a->replicas->Stores().size());
+    EXPECT_EQ("10.0.0.3:5001", a->replicas->Stores()[2].ToString());
+    EXPECT_EQ(2u, a->replicas->Quorum());
+    EXPECT_EQ(3u, storeMap.Find("b")->replicas->Quorum());
+    EXPECT_EQ(nullptr, storeMap.Find("d"));
+
+    // A list of Stores is a single shard.
+    auto single = StoreMap::FromArgs("10.0.0.1,10.0.0.2:5001", "5000");
+    ASSERT_EQ(1u, single.Shards().size());
+    EXPECT_EQ(2u, single.Shards()[0].replicas->Stores().size());
+
+    std::ofstream(fname) << "shard a 10.0.0.1\nshard a 10.0.0.2\n";
+    EXPECT_THROW(StoreMap::FromFile(fname, "5000"), std::invalid_argument);
+    std::ofstream(fname) << "shard a 10.0.0.1 many\n";
+    EXPECT_THROW(StoreMap::FromFile(fname, "5000"), std::invalid_argument);
+    std::ofstream(fname) << "# empty\n";
+    EXPECT_THROW(StoreMap::FromFile(fname, "5000"), std::invalid_argument);
+}
+
+TEST(StoreMap, NeedlesAreSpreadAcrossTheShards)
+{
+    StoreMap storeMap;
+    storeMap.AddShard("a", {{"10.0.0.1", "5000"}});
+    storeMap.AddShard("b", {{"10.0.0.2", "5000"}});
+    storeMap.AddShard("c", {{"10.0.0.3", "5000"}});
+
+    std::map<std::string, uint64_t> counts;
+    for (uint64_t needleId = 0; needleId < kNeedles; ++needleId)
+        ++counts[storeMap.Owner(needleId).name];
+    ASSERT_EQ(3u, counts.size());
+    for (auto &item : counts) {
+        EXPECT_GT(item.second, kNeedles / 5) << item.first;
+        EXPECT_LT(item.second, kNeedles / 2) << item.first;
+    }
+
+    // The owner's Store is tried first, and then the others.
+    auto order = storeMap.ReadOrder(42);
+    ASSERT_EQ(3u, order.size());
+    EXPECT_EQ(
+        storeMap.Owner(42).replicas->Stores()[0].ToString(),
+        order[0].ToString());
+}
+
+TEST(StoreMap, AddingAShardMovesFewNeedles)
+{
+    StoreMap before, after;
+    for (auto name : {"a", "b", "c"}) {
+        before.AddShard(name, {{name, "5000"}});
+        after.AddShard(name, {{name, "5000"}});
+    }
+    after.AddShard("d", {{"d", "5000"}});
+
+    uint64_t moved = 0;
+    for (uint64_t needleId = 0; needleId < kNeedles; ++needleId) {
+        auto &owner = after.Owner(needleId).name;
+        if (owner == before.Owner(needleId).name)
+            continue;
+        // Needles only move to the new shard.
+        EXPECT_EQ("d", owner);
+        ++moved;
+    }
+    EXPECT_GT(moved, kNeedles / 8);
+    EXPECT_LT(moved, kNeedles * 3 / 8);
+}
+
+} // namespace
@@ -0,0 +1,65 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+#include "threadpool.hh"
+
+namespace {
+
+TEST(ThreadPool, RunsEveryTask)
+{
+    std::atomic<int> count(0);
+    {
+        ThreadPool pool(4, 1000);
+        EXPECT_EQ(4u, pool.Workers());
+        for (int i = 0; i < 1000; ++i)
+            EXPECT_TRUE(pool.TrySubmit([&] { ++count; }));
+    }
+    EXPECT_EQ(1000, count);
+}
+
+TEST(ThreadPool, RefusesTasksWhenTheBacklogIsFull)
+{
+    std::promise<void> started, release;
+    auto released = release.get_future().share();
+    ThreadPool pool(1, 2);
+    ASSERT_TRUE(pool.TrySubmit([&] {
+        started.set_value();
+        released.wait();
+    }));
+    started.get_future().wait();
+
+    EXPECT_TRUE(pool.TrySubmit([] {}));
+    EXPECT_TRUE(pool.TrySubmit([] {}));
+    EXPECT_EQ(2u, pool.Pending());
+    EXPECT_FALSE(pool.TrySubmit([] {}));
+    release.set_value();
+}
+
+TEST(ThreadPool, IdleWorkersStealQueuedTasks)
+{
+    std::promise<void> started, release, stolen;
+    auto released = release.get_future().share();
+    ThreadPool pool(2, 10);
+
+    // The tasks are queued in round robin order, so the third one waits
+    // behind the blocked first one unless the second worker steals it.
+    ASSERT_TRUE(pool.TrySubmit([&] {
+        started.set_value();
+        released.wait();
+    }));
+    started.get_future().wait();
+    ASSERT_TRUE(pool.TrySubmit([] {}));
+    ASSERT_TRUE(pool.TrySubmit([&] { stolen.set_value(); }));
+
+    auto status = stolen.get_future().wait_for(std::chrono::seconds(5));
+    EXPECT_EQ(std::future_status::ready, status);
+    release.set_value();
+}
+
+} // namespace
@@ -0,0 +1,70 @@
+#include <fstream>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "tombstone.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+constexpr char kJournal[] = PREFIX "/tombstones.tomb";
+
+TEST(TombstoneJournal, RecordsAreReadBack)
+{
+    boost::filesystem::create_directories(PREFIX);
+    {
+        TombstoneJournal journal(kJournal, true);
+        EXPECT_TRUE(journal.Load().empty());
+        journal.Append({{0, 7, 1}, {4096, 8, 3}});
+        journal.Append({{64, 9, 1}});
+        EXPECT_EQ(3u, journal.Count());
+    }
+
+    TombstoneJournal journal(kJournal, false);
+    auto tombstones = journal.Load();
+    ASSERT_EQ(3u, tombstones.size());
+    EXPECT_EQ(4096u, tombstones[1].offset);
+    EXPECT_EQ(8u, tombstones[1].needleId);
+    EXPECT_EQ(3, tombstones[1].flags);
+    EXPECT_EQ(9u, tombstones[2].needleId);
+
+    // Appends go after the records that were loaded.
+    journal.Append({{128, 10, 1}});
+    EXPECT_EQ(4u, journal.Load().size());
+    journal.Clear();
+    EXPECT_TRUE(journal.Load().empty());
+}
+
+TEST(TombstoneJournal, TornRecordsAreIgnored)
+{
+    boost::filesystem::create_directories(PREFIX);
+    {
+        TombstoneJournal journal(kJournal, true);
+        journal.Append({{0, 7, 1}, {64, 8, 1}});
+    }
+
+    // Cut the second record short, and then corrupt the first one.
+    boost::filesystem::resize_file(
+        kJournal, 2 * TombstoneJournal::kRecordSize - 1);
+    {
+        TombstoneJournal journal(kJournal, false);
+        auto tombstones = journal.Load();
+        ASSERT_EQ(1u, tombstones.size());
+        EXPECT_EQ(7u, tombstones[0].needleId);
+    }
+    {
+        std::fstream file(kJournal,
+            std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(8);
+        file.put(8);
+    }
+    TombstoneJournal journal(kJournal, false);
+    EXPECT_TRUE(journal.Load().empty());
+}
+
+} // namespace
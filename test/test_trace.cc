@@ -0,0 +1,125 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+#include "gtest/gtest.h"
+
+#include "store.hh"
+#include "storeconfig.hh"
+#include "trace.hh"
+
+#ifndef PREFIX
+ #error Need to define PREFIX with file path
+#endif
+
+namespace {
+
+std::vector<std::string>
+ReadLines(const std::string &fname)
+{
+    std::ifstream file(fname);
+    std::vector<std::string> lines;
+    for (std::string line; std::getline(file, line);)
+        lines.push_back(line);
+    return lines;
+}
+
+TEST(Trace, TraceIdsRoundTripThroughTokens)
+{
+    uint64_t traceId = 0;
+    EXPECT_TRUE(ParseTraceId("trace=1f2e3d", traceId));
+    EXPECT_EQ(0x1f2e3du, traceId);
+    EXPECT_EQ(" trace=1f2e3d", TraceToken(traceId));
+    EXPECT_EQ("", TraceToken(0));
+
+    EXPECT_FALSE(ParseTraceId("trace=", traceId));
+    EXPECT_FALSE(ParseTraceId("trace=xyz", traceId));
+    EXPECT_FALSE(ParseTraceId("1f2e3d", traceId));
+
+    std::istringstream iss(" trace=abc");
+    EXPECT_EQ(0xabcu, RequestTraceId(iss, nullptr));
+    std::istringstream none("");
+    EXPECT_EQ(0u, RequestTraceId(none, nullptr));
+}
+
+TEST(Trace, SpansAreWrittenAndDroppedWhenTheBufferIsFull)
+{
+    boost::filesystem::create_directories(PREFIX);
+    std::string fname = PREFIX "/trace_spans";
+    boost::filesystem::remove(fname);
+    uint64_t dropped = 0;
+    {
+        Tracer tracer("test", fname, 0, 3);
+        auto start = Tracer::Clock::now();
+        for (int i = 0; i < 6; ++i)
+            tracer.Record(1 + i, "span", start, start);
+        tracer.Flush();
+        dropped = tracer.Dropped();
+        EXPECT_EQ(0u, tracer.Sample());
+    }
+
+    // The capacity is rounded up to 4, and the writer thread may have emptied
+    // the buffer in the meantime.
+    auto lines = ReadLines(fname);
+    ASSERT_FALSE(lines.empty());
+    EXPECT_GE(2u, dropped);
+    EXPECT_EQ(6u, lines.size() + dropped);
+    std::istringstream iss(lines[0]);
+    std::string traceId, process, span;
+    uint64_t start, duration;
+    ASSERT_TRUE(iss >> traceId >> process >> span >> start >> duration);
+    EXPECT_EQ("1", traceId);
+    EXPECT_EQ("test", process);
+    EXPECT_EQ("span", span);
+    EXPECT_EQ(0u, duration);
+}
+
+TEST(Trace, StoreRecordsTheStagesOfTracedRequests)
+{
+    boost::filesystem::remove_all(PREFIX "/trace");
+    boost::filesystem::create_directories(PREFIX "/trace");
+    std::string fname = PREFIX "/trace/spans";
+    auto config = StoreConfig::Default(PREFIX "/trace");
+    config.tracePath = fname;
+
+    std::string ipAddr = "127.0.0.1";
+    unsigned port = 5060;
+    Store store(ipAddr, port, config);
+    std::thread thr(&Store::Run, &store);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    for (auto request : {"put 0 1 3 trace=abc\nabc", "get 1\n"}) {
+        boost::asio::ip::tcp::iostream conn(ipAddr, std::to_string(port));
+        conn << request;
+        conn.flush();
+        std::string reply;
+        std::getline(conn, reply);
+        EXPECT_EQ(0u, reply.find("ok"));
+    }
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(3 * Tracer::kFlushIntervalMs));
+
+    std::vector<std::string> spans;
+    for (auto &line : ReadLines(fname)) {
+        std::istringstream iss(line);
+        std::string traceId, process, span;
+        iss >> traceId >> process >> span;
+        EXPECT_EQ("abc", traceId);
+        EXPECT_EQ("store", process);
+        spans.push_back(span);
+    }
+    for (auto span : {"store.put", "store.recv", "store.queue_wait",
+                      "haystack.write"})
+        EXPECT_NE(spans.end(), std::find(spans.begin(), spans.end(), span));
+
+    store.Stop();
+    thr.join();
+}
+
+} // namespace
@@ -0,0 +1,196 @@
+#include <cstdint>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+#include "needle.hh"
+#include "volumeindex.hh"
+
+namespace {
+
+constexpr uint64_t kVolumeId = 3;
+
+Needle
+MakeNeedle(uint64_t needleId, uint64_t offset, uint64_t size)
+{
+    Needle needle(kVolumeId, offset, needleId, size, 0x1234);
+    needle.flags.cookie = static_cast<uint32_t>(needleId * 7 + 1);
+    return needle;
+}
+
+void
+ExpectNeedle(const VolumeIndex &index, const Needle &expected)
+{
+    Needle needle;
+    ASSERT_TRUE(index.Get(expected.flags.id, needle));
+    EXPECT_EQ(expected.haystackId, needle.haystackId);
+    EXPECT_EQ(expected.offset, needle.offset);
+    EXPECT_EQ(expected.flags.id, needle.flags.id);
+    EXPECT_EQ(expected.flags.size, needle.flags.size);
+    EXPECT_EQ(expected.flags.cookie, needle.flags.cookie);
+    EXPECT_EQ(expected.flags.codec, needle.flags.codec);
+    EXPECT_EQ(expected.flags.rawSize, needle.flags.rawSize);
+}
+
+TEST(VolumeIndex, NeedlesArePutAndRemoved)
+{
+    VolumeIndex index(kVolumeId);
+    Needle needle;
+    EXPECT_FALSE(index.Get(1, needle));
+
+    auto first = MakeNeedle(1, 0, 100);
+    auto second = MakeNeedle(uint64_t(1) << 40 | 2, 4096, 0);
+    EXPECT_TRUE(index.Put(first));
+    EXPECT_TRUE(index.Put(second));
+    EXPECT_FALSE(index.Put(MakeNeedle(1, 8192, 5)));
+    EXPECT_EQ(2u, index.Count());
+    ExpectNeedle(index, first);
+    ExpectNeedle(index, second);
+
+    EXPECT_TRUE(index.Remove(1));
+    EXPECT_FALSE(index.Remove(1));
+    EXPECT_FALSE(index.Get(1, needle));
+    EXPECT_EQ(1u, index.Count());
+
+    // The ID of a removed needle can be taken again.
+    auto third = MakeNeedle(1, 8192, 5);
+    EXPECT_TRUE(index.Put(third));
+    ExpectNeedle(index, third);
+}
+
+TEST(VolumeIndex, FrozenNeedlesAreFoundAndRemoved)
+{
+    VolumeIndex index(kVolumeId);
+    std::vector<Needle> needles;
+    for (uint64_t i = 0; i < 100; ++i) {
+        needles.push_back(MakeNeedle(1000 - i, i * 256, i));
+        ASSERT_TRUE(index.Put(needles.back()));
+    }
+    index.Freeze();
+    EXPECT_EQ(100u, index.Count());
+    for (auto &needle : needles)
+        ExpectNeedle(index, needle);
+    EXPECT_FALSE(index.Put(needles[10]));
+
+    // Needles put after the volume is frozen are merged by the next call.
+    auto late = MakeNeedle(5, 100 * 256, 1);
+    EXPECT_TRUE(index.Put(late));
+    index.Freeze();
+    ExpectNeedle(index, late);
+
+    // Removing enough needles compacts the sorted array.
+    for (uint64_t i = 0; i < 50; ++i)
+        EXPECT_TRUE(index.Remove(needles[i].flags.id));
+    EXPECT_EQ(51u, index.Count());
+    Needle needle;
+    EXPECT_FALSE(index.Get(needles[0].flags.id, needle));
+    ExpectNeedle(index, needles[50]);
+
+    size_t count = 0;
+    index.ForEach([&](const Needle &) { ++count; });
+    EXPECT_EQ(51u, count);
+}
+
+TEST(VolumeIndex, CompressedAndUnalignedNeedlesAreKept)
+{
+    VolumeIndex index(kVolumeId);
+    auto compressed = MakeNeedle(1, 0, 40);
+    compressed.flags.codec = 2;
+    compressed.flags.rawSize = 4000;
+    auto legacy = MakeNeedle(2, 13, 7);
+    auto huge = MakeNeedle(3, uint64_t(1) << 40, 7);
+    EXPECT_TRUE(index.Put(compressed));
+    EXPECT_TRUE(index.Put(legacy));
+    EXPECT_TRUE(index.Put(huge));
+    EXPECT_FALSE(index.Put(MakeNeedle(2, 64, 1)));
+    index.Freeze();
+
+    ExpectNeedle(index, compressed);
+    ExpectNeedle(index, legacy);
+    ExpectNeedle(index, huge);
+    EXPECT_EQ(3u, index.Count());
+    EXPECT_TRUE(index.Remove(2));
+    EXPECT_EQ(2u, index.Count());
+}
+
+TEST(VolumeIndex, RawSizesSurviveFreezeAndCompaction)
+{
+    VolumeIndex index(kVolumeId);
+    std::vector<Needle> needles;
+    for (uint64_t i = 0; i < 100; ++i) {
+        needles.push_back(MakeNeedle(1000 - i, i * 256, i));
+        if (i % 2) {
+            needles.back().flags.codec = 1;
+            needles.back().flags.rawSize = static_cast<uint32_t>(i * 100);
+        }
+        ASSERT_TRUE(index.Put(needles.back()));
+    }
+    index.Freeze();
+    for (auto &needle : needles)
+        ExpectNeedle(index, needle);
+
+    for (uint64_t i = 0; i < 50; ++i)
+        EXPECT_TRUE(index.Remove(needles[i].flags.id));
+    for (uint64_t i = 50; i < 100; ++i)
+        ExpectNeedle(index, needles[i]);
+
+    // The ID of a removed compressed needle can be taken by a plain one.
+    auto plain = MakeNeedle(needles[1].flags.id, 100 * 256, 3);
+    EXPECT_TRUE(index.Put(plain));
+    index.Freeze();
+    ExpectNeedle(index, plain);
+}
+
+TEST(VolumeIndex, NeedlesAreFoundAcrossHighIds)
+{
+    VolumeIndex index(kVolumeId);
+    std::vector<Needle> needles;
+    for (uint64_t high = 0; high < 4; ++high) {
+        for (uint64_t low = 0; low < 10; ++low) {
+            auto offset = (high * 10 + low) * 64;
+            needles.push_back(MakeNeedle(high << 32 | low * 3, offset, 9));
+            ASSERT_TRUE(index.Put(needles.back()));
+        }
+    }
+    index.Freeze();
+    EXPECT_EQ(40u, index.Count());
+    for (auto &needle : needles)
+        ExpectNeedle(index, needle);
+    Needle needle;
+    EXPECT_FALSE(index.Get(uint64_t(5) << 32 | 3, needle));
+    EXPECT_FALSE(index.Get(uint64_t(1) << 32 | 4, needle));
+}
+
+TEST(VolumeIndex, LegacyNeedlesArePackedWithByteOffsets)
+{
+    constexpr uint64_t kNeedles = 10000;
+    VolumeIndex index(kVolumeId, 1);
+    for (uint64_t i = 0; i < kNeedles; ++i)
+        ASSERT_TRUE(index.Put(MakeNeedle(i, i * 37 + 13, 20)));
+    auto huge = MakeNeedle(kNeedles, uint64_t(1) << 40, 7);
+    EXPECT_TRUE(index.Put(huge));
+    index.Freeze();
+
+    EXPECT_EQ(kNeedles + 1, index.Count());
+    EXPECT_LE(index.MemoryUsage(), 16 * kNeedles + 1024);
+    ExpectNeedle(index, MakeNeedle(777, 777 * 37 + 13, 20));
+    ExpectNeedle(index, huge);
+}
+
+TEST(VolumeIndex, FrozenNeedlesTakeSixteenBytes)
+{
+    constexpr uint64_t kNeedles = 100000;
+    VolumeIndex index(kVolumeId);
+    for (uint64_t i = 0; i < kNeedles; ++i)
+        ASSERT_TRUE(index.Put(MakeNeedle(i * 31, i * 64, 20)));
+    EXPECT_EQ(kNeedles, index.Count());
+    EXPECT_GT(index.MemoryUsage(), 26 * kNeedles);
+    EXPECT_LE(index.MemoryUsage(), 54 * kNeedles + 1024);
+    ExpectNeedle(index, MakeNeedle(31 * 777, 64 * 777, 20));
+
+    index.Freeze();
+    EXPECT_LE(index.MemoryUsage(), 16 * kNeedles + 1024);
+    ExpectNeedle(index, MakeNeedle(31 * 777, 64 * 777, 20));
+}
+
+} // namespace